@@ -35,6 +35,12 @@ const OptionInfoRec intel_options[] = {
 	{OPTION_VIRTUAL,	"VirtualHeads",	OPTV_INTEGER,	{0},	0},
 	{OPTION_TEAR_FREE,	"TearFree",	OPTV_BOOLEAN,	{0},	0},
 	{OPTION_CRTC_PIXMAPS,	"PerCrtcPixmaps", OPTV_BOOLEAN,	{0},	0},
+	{OPTION_THREADS,	"Threads",	OPTV_INTEGER,	{0},	0},
+	{OPTION_THREAD_AFFINITY, "ThreadAffinity", OPTV_BOOLEAN, {0},	0},
+	{OPTION_CACHE_SIZE,	"CacheSize",	OPTV_INTEGER,	{0},	0},
+	{OPTION_TRACE_BATCHES,	"TraceBatches",	OPTV_BOOLEAN,	{0},	0},
+	{OPTION_ASYNC_SUBMIT,	"AsyncSubmit",	OPTV_BOOLEAN,	{0},	0},
+	{OPTION_CAPTURE_BATCHES, "CaptureBatches", OPTV_BOOLEAN, {0},	0},
 #endif
 #ifdef USE_UXA
 	{OPTION_FALLBACKDEBUG,	"FallbackDebug",OPTV_BOOLEAN,	{0},	0},
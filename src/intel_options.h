@@ -39,6 +39,12 @@ enum intel_options {
 	OPTION_VIRTUAL,
 	OPTION_TEAR_FREE,
 	OPTION_CRTC_PIXMAPS,
+	OPTION_THREADS,
+	OPTION_THREAD_AFFINITY,
+	OPTION_CACHE_SIZE,
+	OPTION_TRACE_BATCHES,
+	OPTION_ASYNC_SUBMIT,
+	OPTION_CAPTURE_BATCHES,
 #endif
 #ifdef USE_UXA
 	OPTION_FALLBACKDEBUG,
@@ -61,7 +61,7 @@ typedef struct {
 # define atomic_add(x, v) ((void) AO_fetch_and_add_full(&(x)->atomic, (v)))
 # define atomic_dec(x, v) ((void) AO_fetch_and_add_full(&(x)->atomic, -(v)))
 # define atomic_dec_and_test(x) (AO_fetch_and_sub1_full(&(x)->atomic) == 1)
-# define atomic_cmpxchg(x, oldv, newv) AO_compare_and_swap_full(&(x)->atomic, oldv, newv)
+# define atomic_cmpxchg(x, oldv, newv) AO_fetch_compare_and_swap_full(&(x)->atomic, oldv, newv)
 
 #endif
 
@@ -631,7 +631,101 @@ memcpy_between_tiled_x__swizzle_0__sse2(const void *src, void *dst, int bpp,
 	}
 }
 
-#pragma GCC push_options
+/* dst = src | or, aligning the destination for the wide stores. When
+ * streaming, only whole cachelines are written with non-temporal stores,
+ * as mixing them with ordinary stores to the same line is very slow.
+ */
+static force_inline void
+__or_row__sse2(uint32_t *d, const uint32_t *s, int n, uint32_t or, bool stream)
+{
+	__m128i mask = xmm_create_mask_32(or);
+
+	while (n && (uintptr_t)d & (stream ? 63 : 15)) {
+		*d++ = *s++ | or;
+		n--;
+	}
+
+	while (n >= 16) {
+		__m128i xmm1, xmm2, xmm3, xmm4;
+
+		xmm1 = _mm_or_si128(xmm_load_128u((const __m128i*)s + 0), mask);
+		xmm2 = _mm_or_si128(xmm_load_128u((const __m128i*)s + 1), mask);
+		xmm3 = _mm_or_si128(xmm_load_128u((const __m128i*)s + 2), mask);
+		xmm4 = _mm_or_si128(xmm_load_128u((const __m128i*)s + 3), mask);
+
+		if (stream) {
+			_mm_stream_si128((__m128i*)d + 0, xmm1);
+			_mm_stream_si128((__m128i*)d + 1, xmm2);
+			_mm_stream_si128((__m128i*)d + 2, xmm3);
+			_mm_stream_si128((__m128i*)d + 3, xmm4);
+		} else {
+			xmm_save_128((__m128i*)d + 0, xmm1);
+			xmm_save_128((__m128i*)d + 1, xmm2);
+			xmm_save_128((__m128i*)d + 2, xmm3);
+			xmm_save_128((__m128i*)d + 3, xmm4);
+		}
+
+		d += 16;
+		s += 16;
+		n -= 16;
+	}
+
+	if (n & 8) {
+		__m128i xmm1, xmm2;
+
+		xmm1 = _mm_or_si128(xmm_load_128u((const __m128i*)s + 0), mask);
+		xmm2 = _mm_or_si128(xmm_load_128u((const __m128i*)s + 1), mask);
+
+		xmm_save_128((__m128i*)d + 0, xmm1);
+		xmm_save_128((__m128i*)d + 1, xmm2);
+		d += 8;
+		s += 8;
+		n -= 8;
+	}
+
+	if (n & 4) {
+		xmm_save_128((__m128i*)d,
+			     _mm_or_si128(xmm_load_128u((const __m128i*)s),
+					  mask));
+
+		d += 4;
+		s += 4;
+		n -= 4;
+	}
+
+	while (n) {
+		*d++ = *s++ | or;
+		n--;
+	}
+
+}
+
+static void
+or_box__sse2(uint8_t *dst, int32_t dst_stride,
+	     const uint8_t *src, int32_t src_stride,
+	     int width, int height, uint32_t or)
+{
+	do {
+		__or_row__sse2((uint32_t *)dst, (const uint32_t *)src, width, or, false);
+		src += src_stride;
+		dst += dst_stride;
+	} while (--height);
+}
+
+static void
+or_box__sse2__nt(uint8_t *dst, int32_t dst_stride,
+		 const uint8_t *src, int32_t src_stride,
+		 int width, int height, uint32_t or)
+{
+	do {
+		__or_row__sse2((uint32_t *)dst, (const uint32_t *)src, width, or, true);
+		src += src_stride;
+		dst += dst_stride;
+	} while (--height);
+	_mm_sfence();
+}
+
+#pragma GCC pop_options
 #endif
 
 fast void
@@ -897,13 +991,17 @@ memcpy_between_tiled_x__swizzle_0(const void *src, void *dst, int bpp,
 	}
 }
 
-#define memcpy_to_tiled_x(swizzle) \
-fast_memcpy static void \
-memcpy_to_tiled_x__##swizzle (const void *src, void *dst, int bpp, \
-			      int32_t src_stride, int32_t dst_stride, \
-			      int16_t src_x, int16_t src_y, \
-			      int16_t dst_x, int16_t dst_y, \
-			      uint16_t width, uint16_t height) \
+/* Bit 6 swizzling only ever exchanges whole 64 byte chunks within a tile
+ * row, so each variant moves one chunk at a time using the given helper and
+ * leaves the unaligned head and tail of each row to memcpy.
+ */
+#define memcpy_to_tiled_x(attr, func, swizzle, to64) \
+attr void \
+func (const void *src, void *dst, int bpp, \
+      int32_t src_stride, int32_t dst_stride, \
+      int16_t src_x, int16_t src_y, \
+      int16_t dst_x, int16_t dst_y, \
+      uint16_t width, uint16_t height) \
 { \
 	const unsigned tile_width = 512; \
 	const unsigned tile_height = 8; \
@@ -942,8 +1040,8 @@ memcpy_to_tiled_x__##swizzle (const void *src, void *dst, int bpp, \
 				tile_row + \
 				(dx >> tile_pixels) * tile_size + \
 				(dx & tile_mask) * cpp; \
-			memcpy(assume_aligned((char *)dst+swizzle(offset),64), \
-			       src_row, 64); \
+			to64(assume_aligned((uint8_t *)dst + swizzle(offset), 64), \
+			     src_row); \
 			src_row += 64; \
 			x -= 64; \
 			dx += swizzle_pixels; \
@@ -958,13 +1056,13 @@ memcpy_to_tiled_x__##swizzle (const void *src, void *dst, int bpp, \
 	} \
 }
 
-#define memcpy_from_tiled_x(swizzle) \
-fast_memcpy static void \
-memcpy_from_tiled_x__##swizzle (const void *src, void *dst, int bpp, \
-				int32_t src_stride, int32_t dst_stride, \
-				int16_t src_x, int16_t src_y, \
-				int16_t dst_x, int16_t dst_y, \
-				uint16_t width, uint16_t height) \
+#define memcpy_from_tiled_x(attr, func, swizzle, from64) \
+attr void \
+func (const void *src, void *dst, int bpp, \
+      int32_t src_stride, int32_t dst_stride, \
+      int16_t src_x, int16_t src_y, \
+      int16_t dst_x, int16_t dst_y, \
+      uint16_t width, uint16_t height) \
 { \
 	const unsigned tile_width = 512; \
 	const unsigned tile_height = 8; \
@@ -1003,7 +1101,8 @@ memcpy_from_tiled_x__##swizzle (const void *src, void *dst, int bpp, \
 				tile_row + \
 				(sx >> tile_pixels) * tile_size + \
 				(sx & tile_mask) * cpp; \
-			memcpy(dst_row, assume_aligned((const char *)src + swizzle(offset), 64), 64); \
+			from64(dst_row, \
+			       assume_aligned((const uint8_t *)src + swizzle(offset), 64)); \
 			dst_row += 64; \
 			x -= 64; \
 			sx += swizzle_pixels; \
@@ -1011,32 +1110,909 @@ memcpy_from_tiled_x__##swizzle (const void *src, void *dst, int bpp, \
 		if (x) { \
 			uint32_t offset = \
 				tile_row + \
-				(sx >> tile_pixels) * tile_size + \
-				(sx & tile_mask) * cpp; \
-			memcpy(dst_row, assume_aligned((const char *)src + swizzle(offset), 64), x); \
+				(sx >> tile_pixels) * tile_size + \
+				(sx & tile_mask) * cpp; \
+			memcpy(dst_row, assume_aligned((const char *)src + swizzle(offset), 64), x); \
+		} \
+	} \
+}
+
+#define swizzle_0(X) (X)
+#define swizzle_9(X) ((X) ^ (((X) >> 3) & 64))
+#define swizzle_9_10(X) ((X) ^ ((((X) ^ ((X) >> 1)) >> 3) & 64))
+#define swizzle_9_11(X) ((X) ^ ((((X) ^ ((X) >> 2)) >> 3) & 64))
+#define swizzle_9_10_11(X) ((X) ^ ((((X) ^ ((X) >> 1) ^ ((X) >> 2)) >> 3) & 64))
+
+static force_inline void
+to_x64(uint8_t *dst, const uint8_t *src)
+{
+	memcpy(dst, src, 64);
+}
+
+static force_inline void
+from_x64(uint8_t *dst, const uint8_t *src)
+{
+	memcpy(dst, src, 64);
+}
+
+memcpy_to_tiled_x(fast_memcpy static, memcpy_to_tiled_x__swizzle_9, swizzle_9, to_x64)
+memcpy_from_tiled_x(fast_memcpy static, memcpy_from_tiled_x__swizzle_9, swizzle_9, from_x64)
+
+memcpy_to_tiled_x(fast_memcpy static, memcpy_to_tiled_x__swizzle_9_10, swizzle_9_10, to_x64)
+memcpy_from_tiled_x(fast_memcpy static, memcpy_from_tiled_x__swizzle_9_10, swizzle_9_10, from_x64)
+
+memcpy_to_tiled_x(fast_memcpy static, memcpy_to_tiled_x__swizzle_9_11, swizzle_9_11, to_x64)
+memcpy_from_tiled_x(fast_memcpy static, memcpy_from_tiled_x__swizzle_9_11, swizzle_9_11, from_x64)
+
+memcpy_to_tiled_x(fast_memcpy static, memcpy_to_tiled_x__swizzle_9_10_11, swizzle_9_10_11, to_x64)
+memcpy_from_tiled_x(fast_memcpy static, memcpy_from_tiled_x__swizzle_9_10_11, swizzle_9_10_11, from_x64)
+
+/* A Y tile is 128 bytes by 32 rows, stored as eight columns of 16 bytes
+ * by 32 rows. Walking along a row therefore steps 512 bytes for every
+ * 16 bytes of pixels, across tile boundaries included, and only the
+ * 16 byte runs (two per 32 byte copy) are contiguous in the bo.
+ */
+#define memcpy_to_tiled_y(attr, func, swizzle, to16, to32) \
+attr void \
+func(const void *src, void *dst, int bpp, \
+     int32_t src_stride, int32_t dst_stride, \
+     int16_t src_x, int16_t src_y, \
+     int16_t dst_x, int16_t dst_y, \
+     uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_height = 32; \
+	const unsigned column_size = 512; \
+	const unsigned cpp = bpp / 8; \
+	unsigned y; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	assert((dst_stride & 127) == 0); \
+	src = (const uint8_t *)src + src_y * src_stride + src_x * cpp; \
+	for (y = 0; y < height; ++y) { \
+		const uint32_t dy = y + dst_y; \
+		const uint32_t tile_row = \
+			dy / tile_height * dst_stride * tile_height + \
+			(dy & (tile_height-1)) * 16; \
+		const uint8_t *src_row = (const uint8_t *)src + src_stride * y; \
+		uint32_t x = dst_x * cpp; \
+		uint32_t w = width * cpp; \
+		if (x & 15) { \
+			const uint32_t len = min(16 - (x & 15), w); \
+			memcpy((uint8_t *)dst + swizzle(tile_row + (x >> 4) * column_size + (x & 15)), \
+			       src_row, len); \
+			src_row += len; \
+			x += len; \
+			w -= len; \
+		} \
+		while (w >= 32) { \
+			to32(assume_aligned((uint8_t *)dst + swizzle(tile_row + (x >> 4) * column_size), 16), \
+			     assume_aligned((uint8_t *)dst + swizzle(tile_row + ((x >> 4) + 1) * column_size), 16), \
+			     src_row); \
+			src_row += 32; \
+			x += 32; \
+			w -= 32; \
+		} \
+		if (w & 16) { \
+			to16(assume_aligned((uint8_t *)dst + swizzle(tile_row + (x >> 4) * column_size), 16), \
+			     src_row); \
+			src_row += 16; \
+			x += 16; \
+		} \
+		if (w & 15) \
+			memcpy(assume_aligned((uint8_t *)dst + swizzle(tile_row + (x >> 4) * column_size), 16), \
+			       src_row, w & 15); \
+	} \
+}
+
+#define memcpy_from_tiled_y(attr, func, swizzle, from16, from32) \
+attr void \
+func(const void *src, void *dst, int bpp, \
+     int32_t src_stride, int32_t dst_stride, \
+     int16_t src_x, int16_t src_y, \
+     int16_t dst_x, int16_t dst_y, \
+     uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_height = 32; \
+	const unsigned column_size = 512; \
+	const unsigned cpp = bpp / 8; \
+	unsigned y; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	assert((src_stride & 127) == 0); \
+	dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp; \
+	for (y = 0; y < height; ++y) { \
+		const uint32_t sy = y + src_y; \
+		const uint32_t tile_row = \
+			sy / tile_height * src_stride * tile_height + \
+			(sy & (tile_height-1)) * 16; \
+		uint8_t *dst_row = (uint8_t *)dst + dst_stride * y; \
+		uint32_t x = src_x * cpp; \
+		uint32_t w = width * cpp; \
+		if (x & 15) { \
+			const uint32_t len = min(16 - (x & 15), w); \
+			memcpy(dst_row, \
+			       (const uint8_t *)src + swizzle(tile_row + (x >> 4) * column_size + (x & 15)), \
+			       len); \
+			dst_row += len; \
+			x += len; \
+			w -= len; \
+		} \
+		while (w >= 32) { \
+			from32(dst_row, \
+			       assume_aligned((const uint8_t *)src + swizzle(tile_row + (x >> 4) * column_size), 16), \
+			       assume_aligned((const uint8_t *)src + swizzle(tile_row + ((x >> 4) + 1) * column_size), 16)); \
+			dst_row += 32; \
+			x += 32; \
+			w -= 32; \
+		} \
+		if (w & 16) { \
+			from16(dst_row, \
+			       assume_aligned((const uint8_t *)src + swizzle(tile_row + (x >> 4) * column_size), 16)); \
+			dst_row += 16; \
+			x += 16; \
+		} \
+		if (w & 15) \
+			memcpy(dst_row, \
+			       assume_aligned((const uint8_t *)src + swizzle(tile_row + (x >> 4) * column_size), 16), \
+			       w & 15); \
+	} \
+}
+
+static force_inline void
+to_y16(uint8_t *dst, const uint8_t *src)
+{
+	memcpy(dst, src, 16);
+}
+
+static force_inline void
+to_y32(uint8_t *lo, uint8_t *hi, const uint8_t *src)
+{
+	memcpy(lo, src, 16);
+	memcpy(hi, src + 16, 16);
+}
+
+static force_inline void
+from_y16(uint8_t *dst, const uint8_t *src)
+{
+	memcpy(dst, src, 16);
+}
+
+static force_inline void
+from_y32(uint8_t *dst, const uint8_t *lo, const uint8_t *hi)
+{
+	memcpy(dst, lo, 16);
+	memcpy(dst + 16, hi, 16);
+}
+
+memcpy_to_tiled_y(fast_memcpy static, memcpy_to_tiled_y__swizzle_0, swizzle_0, to_y16, to_y32)
+memcpy_from_tiled_y(fast_memcpy static, memcpy_from_tiled_y__swizzle_0, swizzle_0, from_y16, from_y32)
+
+memcpy_to_tiled_y(fast_memcpy static, memcpy_to_tiled_y__swizzle_9, swizzle_9, to_y16, to_y32)
+memcpy_from_tiled_y(fast_memcpy static, memcpy_from_tiled_y__swizzle_9, swizzle_9, from_y16, from_y32)
+
+memcpy_to_tiled_y(fast_memcpy static, memcpy_to_tiled_y__swizzle_9_10, swizzle_9_10, to_y16, to_y32)
+memcpy_from_tiled_y(fast_memcpy static, memcpy_from_tiled_y__swizzle_9_10, swizzle_9_10, from_y16, from_y32)
+
+memcpy_to_tiled_y(fast_memcpy static, memcpy_to_tiled_y__swizzle_9_11, swizzle_9_11, to_y16, to_y32)
+memcpy_from_tiled_y(fast_memcpy static, memcpy_from_tiled_y__swizzle_9_11, swizzle_9_11, from_y16, from_y32)
+
+memcpy_to_tiled_y(fast_memcpy static, memcpy_to_tiled_y__swizzle_9_10_11, swizzle_9_10_11, to_y16, to_y32)
+memcpy_from_tiled_y(fast_memcpy static, memcpy_from_tiled_y__swizzle_9_10_11, swizzle_9_10_11, from_y16, from_y32)
+
+#if defined(sse2)
+#pragma GCC push_options
+#pragma GCC target("sse2,inline-all-stringops,fpmath=sse")
+#pragma GCC optimize("Ofast")
+
+memcpy_to_tiled_x(static, memcpy_to_tiled_x__swizzle_9__sse2, swizzle_9, to_sse64)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9__sse2, swizzle_9, from_sse64u)
+
+memcpy_to_tiled_x(static, memcpy_to_tiled_x__swizzle_9_10__sse2, swizzle_9_10, to_sse64)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9_10__sse2, swizzle_9_10, from_sse64u)
+
+memcpy_to_tiled_x(static, memcpy_to_tiled_x__swizzle_9_11__sse2, swizzle_9_11, to_sse64)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9_11__sse2, swizzle_9_11, from_sse64u)
+
+memcpy_to_tiled_x(static, memcpy_to_tiled_x__swizzle_9_10_11__sse2, swizzle_9_10_11, to_sse64)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9_10_11__sse2, swizzle_9_10_11, from_sse64u)
+
+static force_inline void
+to_sse_y32(uint8_t *lo, uint8_t *hi, const uint8_t *src)
+{
+	xmm_save_128((__m128i*)lo, xmm_load_128u((const __m128i*)src + 0));
+	xmm_save_128((__m128i*)hi, xmm_load_128u((const __m128i*)src + 1));
+}
+
+static force_inline void
+from_sse_y32u(uint8_t *dst, const uint8_t *lo, const uint8_t *hi)
+{
+	xmm_save_128u((__m128i*)dst + 0, xmm_load_128((const __m128i*)lo));
+	xmm_save_128u((__m128i*)dst + 1, xmm_load_128((const __m128i*)hi));
+}
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_0__sse2, swizzle_0, to_sse16, to_sse_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_0__sse2, swizzle_0, from_sse16u, from_sse_y32u)
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_9__sse2, swizzle_9, to_sse16, to_sse_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9__sse2, swizzle_9, from_sse16u, from_sse_y32u)
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_9_10__sse2, swizzle_9_10, to_sse16, to_sse_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9_10__sse2, swizzle_9_10, from_sse16u, from_sse_y32u)
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_9_11__sse2, swizzle_9_11, to_sse16, to_sse_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9_11__sse2, swizzle_9_11, from_sse16u, from_sse_y32u)
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_9_10_11__sse2, swizzle_9_10_11, to_sse16, to_sse_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9_10_11__sse2, swizzle_9_10_11, from_sse16u, from_sse_y32u)
+
+#pragma GCC pop_options
+#endif
+
+#if defined(sse4_1)
+#pragma GCC push_options
+#pragma GCC target("sse4.1,sse2,inline-all-stringops,fpmath=sse")
+#pragma GCC optimize("Ofast")
+#include <smmintrin.h>
+
+/* MOVNTDQA pulls a whole line out of a WC mapping at a time instead of
+ * issuing an uncached read per load; from cacheable memory it is just
+ * an aligned load. Only the detiling side reads from the bo.
+ */
+static force_inline void
+from_sse41_64u(uint8_t *dst, const uint8_t *src)
+{
+	__m128i xmm1, xmm2, xmm3, xmm4;
+
+	assert(((uintptr_t)src & 15) == 0);
+
+	xmm1 = _mm_stream_load_si128((__m128i *)src + 0);
+	xmm2 = _mm_stream_load_si128((__m128i *)src + 1);
+	xmm3 = _mm_stream_load_si128((__m128i *)src + 2);
+	xmm4 = _mm_stream_load_si128((__m128i *)src + 3);
+
+	xmm_save_128u((__m128i*)dst + 0, xmm1);
+	xmm_save_128u((__m128i*)dst + 1, xmm2);
+	xmm_save_128u((__m128i*)dst + 2, xmm3);
+	xmm_save_128u((__m128i*)dst + 3, xmm4);
+}
+
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_0__sse4_1, swizzle_0, from_sse41_64u)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9__sse4_1, swizzle_9, from_sse41_64u)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9_10__sse4_1, swizzle_9_10, from_sse41_64u)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9_11__sse4_1, swizzle_9_11, from_sse41_64u)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9_10_11__sse4_1, swizzle_9_10_11, from_sse41_64u)
+
+static force_inline void
+from_sse41_16u(uint8_t *dst, const uint8_t *src)
+{
+	assert(((uintptr_t)src & 15) == 0);
+
+	xmm_save_128u((__m128i*)dst, _mm_stream_load_si128((__m128i *)src));
+}
+
+static force_inline void
+from_sse41_y32u(uint8_t *dst, const uint8_t *lo, const uint8_t *hi)
+{
+	__m128i xmm1, xmm2;
+
+	xmm1 = _mm_stream_load_si128((__m128i *)lo);
+	xmm2 = _mm_stream_load_si128((__m128i *)hi);
+
+	xmm_save_128u((__m128i*)dst + 0, xmm1);
+	xmm_save_128u((__m128i*)dst + 1, xmm2);
+}
+
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_0__sse4_1, swizzle_0, from_sse41_16u, from_sse41_y32u)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9__sse4_1, swizzle_9, from_sse41_16u, from_sse41_y32u)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9_10__sse4_1, swizzle_9_10, from_sse41_16u, from_sse41_y32u)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9_11__sse4_1, swizzle_9_11, from_sse41_16u, from_sse41_y32u)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9_10_11__sse4_1, swizzle_9_10_11, from_sse41_16u, from_sse41_y32u)
+
+#pragma GCC pop_options
+#endif
+
+#if defined(avx2)
+#pragma GCC push_options
+#pragma GCC target("avx2,avx,sse4.2,sse4.1,sse2,inline-all-stringops,fpmath=sse")
+#pragma GCC optimize("Ofast")
+#include <immintrin.h>
+
+static force_inline __m256i
+ymm_load_256u(const __m256i *src)
+{
+	return _mm256_loadu_si256(src);
+}
+
+static force_inline __m256i
+ymm_stream_load_256(const __m256i *src)
+{
+	return _mm256_stream_load_si256((__m256i *)src);
+}
+
+static force_inline void
+ymm_save_256(__m256i *dst, __m256i data)
+{
+	_mm256_store_si256(dst, data);
+}
+
+static force_inline void
+ymm_save_256u(__m256i *dst, __m256i data)
+{
+	_mm256_storeu_si256(dst, data);
+}
+
+static force_inline void
+to_avx2_128xN(uint8_t *dst, const uint8_t *src, int bytes)
+{
+	int i;
+
+	assert(((uintptr_t)dst & 31) == 0);
+
+	for (i = 0; i < bytes / 128; i++) {
+		__m256i ymm0, ymm1, ymm2, ymm3;
+
+		ymm0 = ymm_load_256u((const __m256i*)src + 0);
+		ymm1 = ymm_load_256u((const __m256i*)src + 1);
+		ymm2 = ymm_load_256u((const __m256i*)src + 2);
+		ymm3 = ymm_load_256u((const __m256i*)src + 3);
+
+		ymm_save_256((__m256i*)dst + 0, ymm0);
+		ymm_save_256((__m256i*)dst + 1, ymm1);
+		ymm_save_256((__m256i*)dst + 2, ymm2);
+		ymm_save_256((__m256i*)dst + 3, ymm3);
+
+		dst += 128;
+		src += 128;
+	}
+}
+
+static force_inline void
+to_avx2_64(uint8_t *dst, const uint8_t *src)
+{
+	__m256i ymm0, ymm1;
+
+	assert(((uintptr_t)dst & 31) == 0);
+
+	ymm0 = ymm_load_256u((const __m256i*)src + 0);
+	ymm1 = ymm_load_256u((const __m256i*)src + 1);
+
+	ymm_save_256((__m256i*)dst + 0, ymm0);
+	ymm_save_256((__m256i*)dst + 1, ymm1);
+}
+
+static force_inline void
+from_avx2_128xNu(uint8_t *dst, const uint8_t *src, int bytes)
+{
+	int i;
+
+	assert(((uintptr_t)src & 31) == 0);
+
+	for (i = 0; i < bytes / 128; i++) {
+		__m256i ymm0, ymm1, ymm2, ymm3;
+
+		ymm0 = ymm_stream_load_256((const __m256i*)src + 0);
+		ymm1 = ymm_stream_load_256((const __m256i*)src + 1);
+		ymm2 = ymm_stream_load_256((const __m256i*)src + 2);
+		ymm3 = ymm_stream_load_256((const __m256i*)src + 3);
+
+		ymm_save_256u((__m256i*)dst + 0, ymm0);
+		ymm_save_256u((__m256i*)dst + 1, ymm1);
+		ymm_save_256u((__m256i*)dst + 2, ymm2);
+		ymm_save_256u((__m256i*)dst + 3, ymm3);
+
+		dst += 128;
+		src += 128;
+	}
+}
+
+static force_inline void
+from_avx2_64u(uint8_t *dst, const uint8_t *src)
+{
+	__m256i ymm0, ymm1;
+
+	assert(((uintptr_t)src & 31) == 0);
+
+	ymm0 = ymm_stream_load_256((const __m256i*)src + 0);
+	ymm1 = ymm_stream_load_256((const __m256i*)src + 1);
+
+	ymm_save_256u((__m256i*)dst + 0, ymm0);
+	ymm_save_256u((__m256i*)dst + 1, ymm1);
+}
+
+static force_inline void
+from_avx2_32u(uint8_t *dst, const uint8_t *src)
+{
+	assert(((uintptr_t)src & 31) == 0);
+
+	ymm_save_256u((__m256i*)dst, ymm_stream_load_256((const __m256i*)src));
+}
+
+static void
+memcpy_to_tiled_x__swizzle_0__avx2(const void *src, void *dst, int bpp,
+				   int32_t src_stride, int32_t dst_stride,
+				   int16_t src_x, int16_t src_y,
+				   int16_t dst_x, int16_t dst_y,
+				   uint16_t width, uint16_t height)
+{
+	const unsigned tile_width = 512;
+	const unsigned tile_height = 8;
+	const unsigned tile_size = 4096;
+
+	const unsigned cpp = bpp / 8;
+	const unsigned tile_pixels = tile_width / cpp;
+	const unsigned tile_shift = ffs(tile_pixels) - 1;
+	const unsigned tile_mask = tile_pixels - 1;
+
+	unsigned offset_x, length_x;
+
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+	assert(src != dst);
+
+	if (src_x | src_y)
+		src = (const uint8_t *)src + src_y * src_stride + src_x * cpp;
+	width *= cpp;
+	assert(src_stride >= width);
+
+	if (dst_x & tile_mask) {
+		offset_x = (dst_x & tile_mask) * cpp;
+		length_x = min(tile_width - offset_x, width);
+	} else
+		length_x = 0;
+	dst = (uint8_t *)dst + (dst_x >> tile_shift) * tile_size;
+
+	while (height--) {
+		unsigned w = width;
+		const uint8_t *src_row = src;
+		uint8_t *tile_row = dst;
+
+		src = (const uint8_t *)src + src_stride;
+
+		tile_row += dst_y / tile_height * dst_stride * tile_height;
+		tile_row += (dst_y & (tile_height-1)) * tile_width;
+		dst_y++;
+
+		if (length_x) {
+			to_memcpy(tile_row + offset_x, src_row, length_x);
+
+			tile_row += tile_size;
+			src_row = (const uint8_t *)src_row + length_x;
+			w -= length_x;
+		}
+		while (w >= tile_width) {
+			assert(((uintptr_t)tile_row & (tile_width - 1)) == 0);
+			to_avx2_128xN(assume_aligned(tile_row, tile_width),
+				      src_row, tile_width);
+			tile_row += tile_size;
+			src_row = (const uint8_t *)src_row + tile_width;
+			w -= tile_width;
+		}
+		if (w) {
+			assert(((uintptr_t)tile_row & (tile_width - 1)) == 0);
+			to_memcpy(assume_aligned(tile_row, tile_width),
+				  src_row, w);
+		}
+	}
+}
+
+static void
+memcpy_from_tiled_x__swizzle_0__avx2(const void *src, void *dst, int bpp,
+				     int32_t src_stride, int32_t dst_stride,
+				     int16_t src_x, int16_t src_y,
+				     int16_t dst_x, int16_t dst_y,
+				     uint16_t width, uint16_t height)
+{
+	const unsigned tile_width = 512;
+	const unsigned tile_height = 8;
+	const unsigned tile_size = 4096;
+
+	const unsigned cpp = bpp / 8;
+	const unsigned tile_pixels = tile_width / cpp;
+	const unsigned tile_shift = ffs(tile_pixels) - 1;
+	const unsigned tile_mask = tile_pixels - 1;
+
+	unsigned offset_x, length_x;
+
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+	assert(src != dst);
+
+	if (dst_x | dst_y)
+		dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp;
+	width *= cpp;
+	assert(dst_stride >= width);
+
+	if (src_x & tile_mask) {
+		offset_x = (src_x & tile_mask) * cpp;
+		length_x = min(tile_width - offset_x, width);
+	} else
+		length_x = 0;
+	src = (const uint8_t *)src + (src_x >> tile_shift) * tile_size;
+
+	while (height--) {
+		unsigned w = width;
+		const uint8_t *tile_row = src;
+		uint8_t *dst_row = dst;
+
+		dst = (uint8_t *)dst + dst_stride;
+
+		tile_row += src_y / tile_height * src_stride * tile_height;
+		tile_row += (src_y & (tile_height-1)) * tile_width;
+		src_y++;
+
+		if (length_x) {
+			memcpy(dst_row, tile_row + offset_x, length_x);
+
+			tile_row += tile_size;
+			dst_row += length_x;
+			w -= length_x;
+		}
+		while (w >= tile_width) {
+			assert(((uintptr_t)tile_row & (tile_width - 1)) == 0);
+			from_avx2_128xNu(dst_row,
+					 assume_aligned(tile_row, tile_width),
+					 tile_width);
+			tile_row += tile_size;
+			dst_row += tile_width;
+			w -= tile_width;
+		}
+		while (w >= 64) {
+			from_avx2_64u(dst_row, tile_row);
+			tile_row += 64;
+			dst_row += 64;
+			w -= 64;
+		}
+		if (w & 32) {
+			from_avx2_32u(dst_row, tile_row);
+			tile_row += 32;
+			dst_row += 32;
+		}
+		if (w & 16) {
+			from_sse16u(dst_row, tile_row);
+			tile_row += 16;
+			dst_row += 16;
+		}
+		memcpy(dst_row, assume_aligned(tile_row, 16), w & 15);
+	}
+}
+
+static void
+memcpy_between_tiled_x__swizzle_0__avx2(const void *src, void *dst, int bpp,
+					int32_t src_stride, int32_t dst_stride,
+					int16_t src_x, int16_t src_y,
+					int16_t dst_x, int16_t dst_y,
+					uint16_t width, uint16_t height)
+{
+	const unsigned tile_width = 512;
+	const unsigned tile_height = 8;
+	const unsigned tile_size = 4096;
+
+	const unsigned cpp = bpp / 8;
+	const unsigned tile_pixels = tile_width / cpp;
+	const unsigned tile_shift = ffs(tile_pixels) - 1;
+	const unsigned tile_mask = tile_pixels - 1;
+
+	unsigned ox, lx;
+
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+	assert(src != dst);
+
+	width *= cpp;
+	dst_stride *= tile_height;
+	src_stride *= tile_height;
+
+	assert((dst_x & tile_mask) == (src_x & tile_mask));
+	if (dst_x & tile_mask) {
+		ox = (dst_x & tile_mask) * cpp;
+		lx = min(tile_width - ox, width);
+		assert(lx != 0);
+	} else
+		lx = 0;
+
+	if (dst_x)
+		dst = (uint8_t *)dst + (dst_x >> tile_shift) * tile_size;
+	if (src_x)
+		src = (const uint8_t *)src + (src_x >> tile_shift) * tile_size;
+
+	while (height--) {
+		const uint8_t *src_row;
+		uint8_t *dst_row;
+		unsigned w = width;
+
+		dst_row = dst;
+		dst_row += dst_y / tile_height * dst_stride;
+		dst_row += (dst_y & (tile_height-1)) * tile_width;
+		dst_y++;
+
+		src_row = src;
+		src_row += src_y / tile_height * src_stride;
+		src_row += (src_y & (tile_height-1)) * tile_width;
+		src_y++;
+
+		if (lx) {
+			to_memcpy(dst_row + ox, src_row + ox, lx);
+			dst_row += tile_size;
+			src_row += tile_size;
+			w -= lx;
+		}
+		while (w >= tile_width) {
+			assert(((uintptr_t)dst_row & (tile_width - 1)) == 0);
+			assert(((uintptr_t)src_row & (tile_width - 1)) == 0);
+			from_avx2_128xNu(assume_aligned(dst_row, tile_width),
+					 assume_aligned(src_row, tile_width),
+					 tile_width);
+			dst_row += tile_size;
+			src_row += tile_size;
+			w -= tile_width;
+		}
+		if (w) {
+			assert(((uintptr_t)dst_row & (tile_width - 1)) == 0);
+			assert(((uintptr_t)src_row & (tile_width - 1)) == 0);
+			to_memcpy(assume_aligned(dst_row, tile_width),
+				  assume_aligned(src_row, tile_width),
+				  w);
+		}
+	}
+}
+
+memcpy_to_tiled_x(static, memcpy_to_tiled_x__swizzle_9__avx2, swizzle_9, to_avx2_64)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9__avx2, swizzle_9, from_avx2_64u)
+
+memcpy_to_tiled_x(static, memcpy_to_tiled_x__swizzle_9_10__avx2, swizzle_9_10, to_avx2_64)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9_10__avx2, swizzle_9_10, from_avx2_64u)
+
+memcpy_to_tiled_x(static, memcpy_to_tiled_x__swizzle_9_11__avx2, swizzle_9_11, to_avx2_64)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9_11__avx2, swizzle_9_11, from_avx2_64u)
+
+memcpy_to_tiled_x(static, memcpy_to_tiled_x__swizzle_9_10_11__avx2, swizzle_9_10_11, to_avx2_64)
+memcpy_from_tiled_x(static, memcpy_from_tiled_x__swizzle_9_10_11__avx2, swizzle_9_10_11, from_avx2_64u)
+
+/* A 32 byte span of a row straddles two Y tile columns; move it through
+ * one ymm register and split it into the two 16 byte column slots.
+ */
+static force_inline void
+to_avx2_y32(uint8_t *lo, uint8_t *hi, const uint8_t *src)
+{
+	__m256i ymm = ymm_load_256u((const __m256i*)src);
+
+	xmm_save_128((__m128i*)lo, _mm256_castsi256_si128(ymm));
+	xmm_save_128((__m128i*)hi, _mm256_extracti128_si256(ymm, 1));
+}
+
+static force_inline void
+from_avx2_y32u(uint8_t *dst, const uint8_t *lo, const uint8_t *hi)
+{
+	__m256i ymm;
+
+	ymm = _mm256_castsi128_si256(_mm_stream_load_si128((__m128i *)lo));
+	ymm = _mm256_inserti128_si256(ymm, _mm_stream_load_si128((__m128i *)hi), 1);
+
+	ymm_save_256u((__m256i*)dst, ymm);
+}
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_0__avx2, swizzle_0, to_sse16, to_avx2_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_0__avx2, swizzle_0, from_sse41_16u, from_avx2_y32u)
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_9__avx2, swizzle_9, to_sse16, to_avx2_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9__avx2, swizzle_9, from_sse41_16u, from_avx2_y32u)
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_9_10__avx2, swizzle_9_10, to_sse16, to_avx2_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9_10__avx2, swizzle_9_10, from_sse41_16u, from_avx2_y32u)
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_9_11__avx2, swizzle_9_11, to_sse16, to_avx2_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9_11__avx2, swizzle_9_11, from_sse41_16u, from_avx2_y32u)
+
+memcpy_to_tiled_y(static, memcpy_to_tiled_y__swizzle_9_10_11__avx2, swizzle_9_10_11, to_sse16, to_avx2_y32)
+memcpy_from_tiled_y(static, memcpy_from_tiled_y__swizzle_9_10_11__avx2, swizzle_9_10_11, from_sse41_16u, from_avx2_y32u)
+
+static force_inline void
+__or_row__avx2(uint32_t *d, const uint32_t *s, int n, uint32_t or, bool stream)
+{
+	const __m256i mask = _mm256_set1_epi32(or);
+
+	while (n && (uintptr_t)d & (stream ? 63 : 31)) {
+		*d++ = *s++ | or;
+		n--;
+	}
+
+	while (n >= 32) {
+		__m256i ymm1, ymm2, ymm3, ymm4;
+
+		ymm1 = _mm256_or_si256(ymm_load_256u((const __m256i*)s + 0), mask);
+		ymm2 = _mm256_or_si256(ymm_load_256u((const __m256i*)s + 1), mask);
+		ymm3 = _mm256_or_si256(ymm_load_256u((const __m256i*)s + 2), mask);
+		ymm4 = _mm256_or_si256(ymm_load_256u((const __m256i*)s + 3), mask);
+
+		if (stream) {
+			_mm256_stream_si256((__m256i*)d + 0, ymm1);
+			_mm256_stream_si256((__m256i*)d + 1, ymm2);
+			_mm256_stream_si256((__m256i*)d + 2, ymm3);
+			_mm256_stream_si256((__m256i*)d + 3, ymm4);
+		} else {
+			ymm_save_256((__m256i*)d + 0, ymm1);
+			ymm_save_256((__m256i*)d + 1, ymm2);
+			ymm_save_256((__m256i*)d + 2, ymm3);
+			ymm_save_256((__m256i*)d + 3, ymm4);
+		}
+
+		d += 32;
+		s += 32;
+		n -= 32;
+	}
+
+	if (n & 16) {
+		ymm_save_256((__m256i*)d + 0,
+			     _mm256_or_si256(ymm_load_256u((const __m256i*)s + 0), mask));
+		ymm_save_256((__m256i*)d + 1,
+			     _mm256_or_si256(ymm_load_256u((const __m256i*)s + 1), mask));
+		d += 16;
+		s += 16;
+	}
+
+	if (n & 8) {
+		ymm_save_256((__m256i*)d,
+			     _mm256_or_si256(ymm_load_256u((const __m256i*)s), mask));
+		d += 8;
+		s += 8;
+	}
+
+	n &= 7;
+	while (n) {
+		*d++ = *s++ | or;
+		n--;
+	}
+
+}
+
+static void
+or_box__avx2(uint8_t *dst, int32_t dst_stride,
+	     const uint8_t *src, int32_t src_stride,
+	     int width, int height, uint32_t or)
+{
+	do {
+		__or_row__avx2((uint32_t *)dst, (const uint32_t *)src, width, or, false);
+		src += src_stride;
+		dst += dst_stride;
+	} while (--height);
+}
+
+static void
+or_box__avx2__nt(uint8_t *dst, int32_t dst_stride,
+		 const uint8_t *src, int32_t src_stride,
+		 int width, int height, uint32_t or)
+{
+	do {
+		__or_row__avx2((uint32_t *)dst, (const uint32_t *)src, width, or, true);
+		src += src_stride;
+		dst += dst_stride;
+	} while (--height);
+	_mm_sfence();
+}
+
+#pragma GCC pop_options
+#endif
+
+static void
+or_box__generic(uint8_t *dst, int32_t dst_stride,
+		const uint8_t *src, int32_t src_stride,
+		int width, int height, uint32_t or)
+{
+	do {
+		const uint32_t *s = (const uint32_t *)src;
+		uint32_t *d = (uint32_t *)dst;
+		int i;
+
+		for (i = 0; i < width; i++)
+			d[i] = s[i] | or;
+
+		src += src_stride;
+		dst += dst_stride;
+	} while (--height);
+}
+
+typedef void (*or_box_func)(uint8_t *dst, int32_t dst_stride,
+			    const uint8_t *src, int32_t src_stride,
+			    int width, int height, uint32_t or);
+
+/* The 32bpp and==~0 case of memcpy_xor(), with non-temporal stores for
+ * destinations too large to remain in cache, which are then only read
+ * back by the GPU.
+ */
+#define XOR_STREAM_BYTES (1 << 20)
+static struct {
+	or_box_func box;
+	or_box_func stream;
+} xor_funcs = {
+#if defined(sse2) && __x86_64__
+	or_box__sse2,
+	or_box__sse2__nt,
+#else
+	or_box__generic,
+	or_box__generic,
+#endif
+};
+
+void choose_memcpy_xor(unsigned cpu)
+{
+#if defined(avx2)
+	if (cpu & AVX2) {
+		xor_funcs.box = or_box__avx2;
+		xor_funcs.stream = or_box__avx2__nt;
+	} else
+#endif
+#if defined(sse2)
+	if (cpu & SSE2) {
+		xor_funcs.box = or_box__sse2;
+		xor_funcs.stream = or_box__sse2__nt;
+	} else
+#endif
+	{
+		xor_funcs.box = or_box__generic;
+		xor_funcs.stream = or_box__generic;
+	}
+}
+
+/* As memcpy_to_tiled_x() but applying the and/or of memcpy_xor(), for
+ * 32bpp only. Each run of pixels between swizzle boundaries (every 64
+ * bytes, or the whole tile width without swizzling) is contiguous.
+ */
+#define memcpy_xor_to_tiled_x(swizzle, chunk) \
+fast_memcpy static void \
+memcpy_xor_to_tiled_x__##swizzle (const void *src, void *dst, int bpp, \
+				  int32_t src_stride, int32_t dst_stride, \
+				  int16_t src_x, int16_t src_y, \
+				  int16_t dst_x, int16_t dst_y, \
+				  uint16_t width, uint16_t height, \
+				  uint32_t and, uint32_t or) \
+{ \
+	const unsigned tile_width = 512; \
+	const unsigned tile_height = 8; \
+	const unsigned tile_size = 4096; \
+	const unsigned stride_tiles = dst_stride / tile_width; \
+	unsigned y; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d, and=%x, or=%x\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride, and, or)); \
+	assert(bpp == 32); \
+	src = (const uint8_t *)src + src_y * src_stride + src_x * 4; \
+	for (y = 0; y < height; ++y) { \
+		const uint32_t dy = y + dst_y; \
+		const uint32_t tile_row = \
+			(dy / tile_height * stride_tiles * tile_size + \
+			 (dy & (tile_height-1)) * tile_width); \
+		const uint32_t *s = (const uint32_t *)((const uint8_t *)src + src_stride * y); \
+		uint32_t dx = dst_x * 4; \
+		unsigned w = width; \
+		while (w) { \
+			const uint32_t offset = \
+				tile_row + \
+				dx / tile_width * tile_size + \
+				(dx & (tile_width - 1)); \
+			const unsigned len = min(w, (chunk - (dx & (chunk - 1))) / 4); \
+			uint32_t *d = (uint32_t *)((uint8_t *)dst + swizzle(offset)); \
+			if (and == 0xffffffff) { \
+				xor_funcs.box((uint8_t *)d, 0, \
+					      (const uint8_t *)s, 0, \
+					      len, 1, or); \
+			} else { \
+				unsigned i; \
+				for (i = 0; i < len; i++) \
+					d[i] = (s[i] & and) | or; \
+			} \
+			s += len; \
+			dx += len * 4; \
+			w -= len; \
 		} \
 	} \
 }
 
-#define swizzle_9(X) ((X) ^ (((X) >> 3) & 64))
-memcpy_to_tiled_x(swizzle_9)
-memcpy_from_tiled_x(swizzle_9)
-#undef swizzle_9
-
-#define swizzle_9_10(X) ((X) ^ ((((X) ^ ((X) >> 1)) >> 3) & 64))
-memcpy_to_tiled_x(swizzle_9_10)
-memcpy_from_tiled_x(swizzle_9_10)
-#undef swizzle_9_10
-
-#define swizzle_9_11(X) ((X) ^ ((((X) ^ ((X) >> 2)) >> 3) & 64))
-memcpy_to_tiled_x(swizzle_9_11)
-memcpy_from_tiled_x(swizzle_9_11)
-#undef swizzle_9_11
-
-#define swizzle_9_10_11(X) ((X) ^ ((((X) ^ ((X) >> 1) ^ ((X) >> 2)) >> 3) & 64))
-memcpy_to_tiled_x(swizzle_9_10_11)
-memcpy_from_tiled_x(swizzle_9_10_11)
-#undef swizzle_9_10_11
+memcpy_xor_to_tiled_x(swizzle_0, 512)
+memcpy_xor_to_tiled_x(swizzle_9, 64)
+memcpy_xor_to_tiled_x(swizzle_9_10, 64)
+memcpy_xor_to_tiled_x(swizzle_9_11, 64)
+memcpy_xor_to_tiled_x(swizzle_9_10_11, 64)
 
 static fast_memcpy void
 memcpy_to_tiled_x__gen2(const void *src, void *dst, int bpp,
@@ -1171,6 +2147,20 @@ void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu)
 		break;
 	case I915_BIT_6_SWIZZLE_NONE:
 		DBG(("%s: no swizzling\n", __FUNCTION__));
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_0__avx2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_0__avx2;
+			kgem->memcpy_between_tiled_x = memcpy_between_tiled_x__swizzle_0__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_0__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_0__sse4_1;
+			kgem->memcpy_between_tiled_x = memcpy_between_tiled_x__swizzle_0__sse2;
+		} else
+#endif
 #if defined(sse2)
 		if (cpu & SSE2) {
 			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_0__sse2;
@@ -1178,31 +2168,259 @@ void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu)
 			kgem->memcpy_between_tiled_x = memcpy_between_tiled_x__swizzle_0__sse2;
 		} else
 #endif
-	       	{
+		{
 			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_0;
 			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_0;
 			kgem->memcpy_between_tiled_x = memcpy_between_tiled_x__swizzle_0;
 		}
+		kgem->memcpy_xor_to_tiled_x = memcpy_xor_to_tiled_x__swizzle_0;
+		break;
+	case I915_BIT_6_SWIZZLE_9:
+		DBG(("%s: 6^9 swizzling\n", __FUNCTION__));
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9__avx2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9__sse4_1;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9;
+		}
+		kgem->memcpy_xor_to_tiled_x = memcpy_xor_to_tiled_x__swizzle_9;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10:
+		DBG(("%s: 6^9^10 swizzling\n", __FUNCTION__));
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10__avx2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10__sse4_1;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10;
+		}
+		kgem->memcpy_xor_to_tiled_x = memcpy_xor_to_tiled_x__swizzle_9_10;
+		break;
+	case I915_BIT_6_SWIZZLE_9_11:
+		DBG(("%s: 6^9^11 swizzling\n", __FUNCTION__));
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11__avx2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11__sse4_1;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11;
+		}
+		kgem->memcpy_xor_to_tiled_x = memcpy_xor_to_tiled_x__swizzle_9_11;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10_11:
+		DBG(("%s: 6^9^10^11 swizzling\n", __FUNCTION__));
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11__avx2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11__sse4_1;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11__sse2;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11;
+			kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11;
+		}
+		kgem->memcpy_xor_to_tiled_x = memcpy_xor_to_tiled_x__swizzle_9_10_11;
+		break;
+	}
+}
+
+void choose_memcpy_tiled_y(struct kgem *kgem, int swizzling, unsigned cpu)
+{
+	/* gen2 and the 915G/GM use different Y tile layouts. kgem->gen
+	 * does not tell the 915 apart from the 945/G33, so all of gen3 is
+	 * left on the GTT path and we only detile from gen4 onwards.
+	 */
+	if (kgem->gen < 040) {
+		DBG(("%s: no Y detiling for gen%d\n", __FUNCTION__, kgem->gen >> 3));
+		return;
+	}
+
+	switch (swizzling) {
+	default:
+		DBG(("%s: unknown swizzling, %d\n", __FUNCTION__, swizzling));
+		break;
+	case I915_BIT_6_SWIZZLE_NONE:
+		DBG(("%s: no swizzling\n", __FUNCTION__));
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_0__avx2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_0__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_0__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_0__sse4_1;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_0__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_0__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_0;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_0;
+		}
 		break;
 	case I915_BIT_6_SWIZZLE_9:
 		DBG(("%s: 6^9 swizzling\n", __FUNCTION__));
-		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9;
-		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9;
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9__avx2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9__sse4_1;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9;
+		}
 		break;
 	case I915_BIT_6_SWIZZLE_9_10:
 		DBG(("%s: 6^9^10 swizzling\n", __FUNCTION__));
-		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10;
-		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10;
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10__avx2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10__sse4_1;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10;
+		}
 		break;
 	case I915_BIT_6_SWIZZLE_9_11:
 		DBG(("%s: 6^9^11 swizzling\n", __FUNCTION__));
-		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11;
-		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11;
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_11__avx2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_11__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_11__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_11__sse4_1;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_11__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_11__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_11;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_11;
+		}
 		break;
 	case I915_BIT_6_SWIZZLE_9_10_11:
 		DBG(("%s: 6^9^10^11 swizzling\n", __FUNCTION__));
-		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11;
-		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11;
+#if defined(avx2)
+		if (cpu & AVX2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10_11__avx2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10_11__avx2;
+		} else
+#endif
+#if defined(sse4_1)
+		if (cpu & SSE4_1) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10_11__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10_11__sse4_1;
+		} else
+#endif
+#if defined(sse2)
+		if (cpu & SSE2) {
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10_11__sse2;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10_11__sse2;
+		} else
+#endif
+		{
+			kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10_11;
+			kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10_11;
+		}
 		break;
 	}
 }
@@ -1428,87 +2646,14 @@ memcpy_xor(const void *src, void *dst, int bpp,
 				height = 1;
 			}
 
-#if defined(sse2) && __x86_64__
-			if (have_sse2()) {
-				do {
-					uint32_t *d = (uint32_t *)dst_bytes;
-					const uint32_t *s = (const uint32_t *)src_bytes;
-					__m128i mask = xmm_create_mask_32(or);
-
-					i = w;
-					while (i && (uintptr_t)d & 15) {
-						*d++ = *s++ | or;
-						i--;
-					}
-
-					while (i >= 16) {
-						__m128i xmm1, xmm2, xmm3, xmm4;
-
-						xmm1 = xmm_load_128u((const __m128i*)s + 0);
-						xmm2 = xmm_load_128u((const __m128i*)s + 1);
-						xmm3 = xmm_load_128u((const __m128i*)s + 2);
-						xmm4 = xmm_load_128u((const __m128i*)s + 3);
-
-						xmm_save_128((__m128i*)d + 0,
-							     _mm_or_si128(xmm1, mask));
-						xmm_save_128((__m128i*)d + 1,
-							     _mm_or_si128(xmm2, mask));
-						xmm_save_128((__m128i*)d + 2,
-							     _mm_or_si128(xmm3, mask));
-						xmm_save_128((__m128i*)d + 3,
-							     _mm_or_si128(xmm4, mask));
-
-						d += 16;
-						s += 16;
-						i -= 16;
-					}
-
-					if (i & 8) {
-						__m128i xmm1, xmm2;
-
-						xmm1 = xmm_load_128u((const __m128i*)s + 0);
-						xmm2 = xmm_load_128u((const __m128i*)s + 1);
-
-						xmm_save_128((__m128i*)d + 0,
-							     _mm_or_si128(xmm1, mask));
-						xmm_save_128((__m128i*)d + 1,
-							     _mm_or_si128(xmm2, mask));
-						d += 8;
-						s += 8;
-						i -= 8;
-					}
-
-					if (i & 4) {
-						xmm_save_128((__m128i*)d,
-							     _mm_or_si128(xmm_load_128u((const __m128i*)s),
-									  mask));
-
-						d += 4;
-						s += 4;
-						i -= 4;
-					}
-
-					while (i) {
-						*d++ = *s++ | or;
-						i--;
-					}
-
-					src_bytes += src_stride;
-					dst_bytes += dst_stride;
-				} while (--height);
-			} else
-#else
-				do {
-					uint32_t *d = (uint32_t *)dst_bytes;
-					uint32_t *s = (uint32_t *)src_bytes;
-
-					for (i = 0; i < w; i++)
-						d[i] = s[i] | or;
-
-					src_bytes += src_stride;
-					dst_bytes += dst_stride;
-				} while (--height);
-#endif
+			if ((uint64_t)w * height * 4 >= XOR_STREAM_BYTES)
+				xor_funcs.stream(dst_bytes, dst_stride,
+						 src_bytes, src_stride,
+						 w, height, or);
+			else
+				xor_funcs.box(dst_bytes, dst_stride,
+					      src_bytes, src_stride,
+					      w, height, or);
 			break;
 		}
 	} else {
@@ -1553,7 +2698,7 @@ memcpy_xor(const void *src, void *dst, int bpp,
 }
 
 #define BILINEAR_INTERPOLATION_BITS 4
-static inline int
+static force_inline int
 bilinear_weight(pixman_fixed_t x)
 {
 	return (x >> (16 - BILINEAR_INTERPOLATION_BITS)) &
@@ -1562,7 +2707,7 @@ bilinear_weight(pixman_fixed_t x)
 
 #if BILINEAR_INTERPOLATION_BITS <= 4
 /* Inspired by Filter_32_opaque from Skia */
-static inline uint32_t
+static force_inline uint32_t
 bilinear_interpolation(uint32_t tl, uint32_t tr,
 		       uint32_t bl, uint32_t br,
 		       int distx, int disty)
@@ -1595,7 +2740,7 @@ bilinear_interpolation(uint32_t tl, uint32_t tr,
 	return ((lo >> 8) & 0xff00ff) | (hi & ~0xff00ff);
 }
 #elif SIZEOF_LONG > 4
-static inline uint32_t
+static force_inline uint32_t
 bilinear_interpolation(uint32_t tl, uint32_t tr,
 		       uint32_t bl, uint32_t br,
 		       int distx, int disty)
@@ -1640,7 +2785,7 @@ bilinear_interpolation(uint32_t tl, uint32_t tr,
 	return (uint32_t)(r >> 16);
 }
 #else
-static inline uint32_t
+static force_inline uint32_t
 bilinear_interpolation(uint32_t tl, uint32_t tr,
 		       uint32_t bl, uint32_t br,
 		       int distx, int disty)
@@ -1687,11 +2832,348 @@ bilinear_interpolation(uint32_t tl, uint32_t tr,
 }
 #endif
 
-static inline uint32_t convert_pixel(const uint8_t *p, int x)
+static force_inline uint32_t convert_pixel(const uint8_t *p, int x)
 {
 	return ((uint32_t *)p)[x];
 }
 
+/* Sample the source at the pixel centre (x, y), treating everything
+ * outside of the source as transparent. Forced inline so that the AVX2
+ * kernels do not call back into SSE code for their edges.
+ */
+static force_inline uint32_t
+affine_sample(const uint8_t *src, int32_t src_stride,
+	      int src_width, int src_height,
+	      pixman_fixed_t x, pixman_fixed_t y)
+{
+	static const uint8_t zero[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	const uint8_t *row1;
+	const uint8_t *row2;
+	int x1, y1, x2, y2;
+	uint32_t tl, tr, bl, br;
+	int32_t fx, fy;
+
+	x1 = x - pixman_fixed_1/2;
+	y1 = y - pixman_fixed_1/2;
+
+	fx = bilinear_weight(x1);
+	fy = bilinear_weight(y1);
+
+	x1 = pixman_fixed_to_int(x1);
+	x2 = x1 + 1;
+	y1 = pixman_fixed_to_int(y1);
+	y2 = y1 + 1;
+
+	if (x1 >= src_width  || x2 < 0 ||
+	    y1 >= src_height || y2 < 0)
+		return 0;
+
+	if (y2 == 0) {
+		row1 = zero;
+	} else {
+		row1 = src + src_stride * y1;
+		row1 += 4 * x1;
+	}
+
+	if (y1 == src_height - 1) {
+		row2 = zero;
+	} else {
+		row2 = src + src_stride * y2;
+		row2 += 4 * x1;
+	}
+
+	if (x2 == 0) {
+		tl = 0;
+		bl = 0;
+	} else {
+		tl = convert_pixel(row1, 0);
+		bl = convert_pixel(row2, 0);
+	}
+
+	if (x1 == src_width - 1) {
+		tr = 0;
+		br = 0;
+	} else {
+		tr = convert_pixel(row1, 1);
+		br = convert_pixel(row2, 1);
+	}
+
+	return bilinear_interpolation(tl, tr, bl, br, fx, fy);
+}
+
+/* A row of an arbitrary affine transform, starting from the pixel centre
+ * (x, y) and stepping by (ux, uy).
+ */
+typedef void (*affine_row_func)(const uint8_t *src, int32_t src_stride,
+				int src_width, int src_height,
+				pixman_fixed_t x, pixman_fixed_t y,
+				pixman_fixed_t ux, pixman_fixed_t uy,
+				uint32_t *dst, int width);
+
+/* A row of a pure scale where every sample lies wholly inside the source,
+ * between row1 and row2. x is the left edge of the first sample, i.e. the
+ * pixel centre less one half.
+ */
+typedef void (*scale_row_func)(const uint32_t *row1, const uint32_t *row2,
+			       int fy, pixman_fixed_t x, pixman_fixed_t ux,
+			       uint32_t *dst, int width);
+
+static void
+affine_row__generic(const uint8_t *src, int32_t src_stride,
+		    int src_width, int src_height,
+		    pixman_fixed_t x, pixman_fixed_t y,
+		    pixman_fixed_t ux, pixman_fixed_t uy,
+		    uint32_t *dst, int width)
+{
+	while (width--) {
+		*dst++ = affine_sample(src, src_stride,
+				       src_width, src_height,
+				       x, y);
+		x += ux;
+		y += uy;
+	}
+}
+
+static void
+scale_row__generic(const uint32_t *row1, const uint32_t *row2,
+		   int fy, pixman_fixed_t x, pixman_fixed_t ux,
+		   uint32_t *dst, int width)
+{
+	while (width--) {
+		int x1 = pixman_fixed_to_int(x);
+
+		*dst++ = bilinear_interpolation(row1[x1], row1[x1 + 1],
+						row2[x1], row2[x1 + 1],
+						bilinear_weight(x), fy);
+		x += ux;
+	}
+}
+
+#if defined(avx2)
+#pragma GCC push_options
+#pragma GCC target("avx2,avx,sse4.2,sse4.1,sse2,inline-all-stringops,fpmath=sse")
+#pragma GCC optimize("Ofast")
+#include <immintrin.h>
+
+/* Eight copies of bilinear_interpolation(), bit for bit. The weights are
+ * at most 256 and sum to 256, so every channel fits in 16 bits.
+ */
+static force_inline __m256i
+bilinear_interpolation_x8(__m256i tl, __m256i tr, __m256i bl, __m256i br,
+			  __m256i distx, __m256i disty)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i distxy, distxiy, distixy, distixiy;
+	__m256i lo, hi;
+
+	distxy = _mm256_mullo_epi32(distx, disty);
+	distxiy = _mm256_sub_epi32(_mm256_slli_epi32(distx, 4), distxy);
+	distixy = _mm256_sub_epi32(_mm256_slli_epi32(disty, 4), distxy);
+	distixiy = _mm256_add_epi32(_mm256_sub_epi32(_mm256_set1_epi32(256),
+						     _mm256_slli_epi32(_mm256_add_epi32(distx, disty), 4)),
+				    distxy);
+
+	/* replicate each weight across the 4 channels of its pixel */
+	distxy = _mm256_or_si256(distxy, _mm256_slli_epi32(distxy, 16));
+	distxiy = _mm256_or_si256(distxiy, _mm256_slli_epi32(distxiy, 16));
+	distixy = _mm256_or_si256(distixy, _mm256_slli_epi32(distixy, 16));
+	distixiy = _mm256_or_si256(distixiy, _mm256_slli_epi32(distixiy, 16));
+
+	lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(tl, zero),
+				_mm256_unpacklo_epi32(distixiy, distixiy));
+	lo = _mm256_add_epi16(lo,
+			      _mm256_mullo_epi16(_mm256_unpacklo_epi8(tr, zero),
+						 _mm256_unpacklo_epi32(distxiy, distxiy)));
+	lo = _mm256_add_epi16(lo,
+			      _mm256_mullo_epi16(_mm256_unpacklo_epi8(bl, zero),
+						 _mm256_unpacklo_epi32(distixy, distixy)));
+	lo = _mm256_add_epi16(lo,
+			      _mm256_mullo_epi16(_mm256_unpacklo_epi8(br, zero),
+						 _mm256_unpacklo_epi32(distxy, distxy)));
+
+	hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(tl, zero),
+				_mm256_unpackhi_epi32(distixiy, distixiy));
+	hi = _mm256_add_epi16(hi,
+			      _mm256_mullo_epi16(_mm256_unpackhi_epi8(tr, zero),
+						 _mm256_unpackhi_epi32(distxiy, distxiy)));
+	hi = _mm256_add_epi16(hi,
+			      _mm256_mullo_epi16(_mm256_unpackhi_epi8(bl, zero),
+						 _mm256_unpackhi_epi32(distixy, distixy)));
+	hi = _mm256_add_epi16(hi,
+			      _mm256_mullo_epi16(_mm256_unpackhi_epi8(br, zero),
+						 _mm256_unpackhi_epi32(distxy, distxy)));
+
+	return _mm256_packus_epi16(_mm256_srli_epi16(lo, 8),
+				   _mm256_srli_epi16(hi, 8));
+}
+
+static force_inline __m256i
+bilinear_weight_x8(__m256i x)
+{
+	return _mm256_and_si256(_mm256_srai_epi32(x, 16 - BILINEAR_INTERPOLATION_BITS),
+				_mm256_set1_epi32((1 << BILINEAR_INTERPOLATION_BITS) - 1));
+}
+
+static void
+affine_row__avx2(const uint8_t *src, int32_t src_stride,
+		 int src_width, int src_height,
+		 pixman_fixed_t x, pixman_fixed_t y,
+		 pixman_fixed_t ux, pixman_fixed_t uy,
+		 uint32_t *dst, int width)
+{
+	const __m256i ramp = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i stepx = _mm256_mullo_epi32(ramp, _mm256_set1_epi32(ux));
+	const __m256i stepy = _mm256_mullo_epi32(ramp, _mm256_set1_epi32(uy));
+	const __m256i minus_one = _mm256_set1_epi32(-1);
+	const __m256i minus_two = _mm256_set1_epi32(-2);
+	const __m256i max_x = _mm256_set1_epi32(src_width - 1);
+	const __m256i max_y = _mm256_set1_epi32(src_height - 1);
+	const __m256i stride = _mm256_set1_epi32(src_stride);
+	int i;
+
+	while (width >= 8) {
+		__m256i vx, vy, ix, iy, inside, outside;
+
+		vx = _mm256_add_epi32(_mm256_set1_epi32(x - pixman_fixed_1/2), stepx);
+		vy = _mm256_add_epi32(_mm256_set1_epi32(y - pixman_fixed_1/2), stepy);
+		ix = _mm256_srai_epi32(vx, 16);
+		iy = _mm256_srai_epi32(vy, 16);
+
+		/* all four neighbours inside the source? */
+		inside = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(ix, minus_one),
+							   _mm256_cmpgt_epi32(max_x, ix)),
+					  _mm256_and_si256(_mm256_cmpgt_epi32(iy, minus_one),
+							   _mm256_cmpgt_epi32(max_y, iy)));
+		if (_mm256_movemask_epi8(inside) == -1) {
+			const int *row1 = (const int *)src;
+			const int *row2 = (const int *)(src + src_stride);
+			__m256i offset;
+
+			offset = _mm256_add_epi32(_mm256_mullo_epi32(iy, stride),
+						  _mm256_slli_epi32(ix, 2));
+			_mm256_storeu_si256((__m256i *)dst,
+					    bilinear_interpolation_x8(_mm256_i32gather_epi32(row1, offset, 1),
+								      _mm256_i32gather_epi32(row1 + 1, offset, 1),
+								      _mm256_i32gather_epi32(row2, offset, 1),
+								      _mm256_i32gather_epi32(row2 + 1, offset, 1),
+								      bilinear_weight_x8(vx),
+								      bilinear_weight_x8(vy)));
+		} else {
+			/* or with no neighbours inside at all? */
+			outside = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi32(minus_two, ix),
+								  _mm256_cmpgt_epi32(ix, max_x)),
+						  _mm256_or_si256(_mm256_cmpgt_epi32(minus_two, iy),
+								  _mm256_cmpgt_epi32(iy, max_y)));
+			if (_mm256_movemask_epi8(outside) == -1)
+				_mm256_storeu_si256((__m256i *)dst,
+						    _mm256_setzero_si256());
+			else for (i = 0; i < 8; i++)
+				dst[i] = affine_sample(src, src_stride,
+						       src_width, src_height,
+						       x + i * ux, y + i * uy);
+		}
+
+		x += 8 * ux;
+		y += 8 * uy;
+		dst += 8;
+		width -= 8;
+	}
+
+	for (i = 0; i < width; i++)
+		dst[i] = affine_sample(src, src_stride,
+				       src_width, src_height,
+				       x + i * ux, y + i * uy);
+}
+
+static void
+scale_row__avx2(const uint32_t *row1, const uint32_t *row2,
+		int fy, pixman_fixed_t x, pixman_fixed_t ux,
+		uint32_t *dst, int width)
+{
+	const __m256i stepx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+						 _mm256_set1_epi32(ux));
+	const __m256i disty = _mm256_set1_epi32(fy);
+
+	while (width >= 8) {
+		__m256i vx, ix;
+
+		vx = _mm256_add_epi32(_mm256_set1_epi32(x), stepx);
+		ix = _mm256_srai_epi32(vx, 16);
+
+		_mm256_storeu_si256((__m256i *)dst,
+				    bilinear_interpolation_x8(_mm256_i32gather_epi32((const int *)row1, ix, 4),
+							      _mm256_i32gather_epi32((const int *)row1 + 1, ix, 4),
+							      _mm256_i32gather_epi32((const int *)row2, ix, 4),
+							      _mm256_i32gather_epi32((const int *)row2 + 1, ix, 4),
+							      bilinear_weight_x8(vx),
+							      disty));
+
+		x += 8 * ux;
+		dst += 8;
+		width -= 8;
+	}
+
+	while (width--) {
+		int x1 = pixman_fixed_to_int(x);
+
+		*dst++ = bilinear_interpolation(row1[x1], row1[x1 + 1],
+						row2[x1], row2[x1 + 1],
+						bilinear_weight(x), fy);
+		x += ux;
+	}
+}
+
+#pragma GCC pop_options
+#endif
+
+static struct {
+	affine_row_func affine;
+	scale_row_func scale;
+} affine_funcs = {
+	affine_row__generic,
+	scale_row__generic,
+};
+
+void choose_affine_blt(unsigned cpu)
+{
+#if defined(avx2)
+	if (cpu & AVX2) {
+		affine_funcs.affine = affine_row__avx2;
+		affine_funcs.scale = scale_row__avx2;
+	} else
+#endif
+	{
+		affine_funcs.affine = affine_row__generic;
+		affine_funcs.scale = scale_row__generic;
+	}
+}
+
+/* Find the run of columns [*lo, *hi) whose samples, and their right hand
+ * neighbours, all lie inside the source. Columns step monotonically, so
+ * the run is contiguous; anything unexpected just leaves it empty.
+ */
+static void
+scale_columns(pixman_fixed_t x, pixman_fixed_t ux,
+	      int src_width, int width,
+	      int *lo, int *hi)
+{
+	int i, n = 0;
+
+	*lo = *hi = 0;
+	for (i = 0; i < width; i++) {
+		int x1 = pixman_fixed_to_int(x - pixman_fixed_1/2);
+		if (x1 >= 0 && x1 < src_width - 1) {
+			if (n++ == 0)
+				*lo = i;
+			*hi = i + 1;
+		}
+		x += ux;
+	}
+
+	if (*hi - *lo != n)
+		*lo = *hi = 0;
+}
+
 fast void
 affine_blt(const void *src, void *dst, int bpp,
 	   int16_t src_x, int16_t src_y,
@@ -1702,10 +3184,12 @@ affine_blt(const void *src, void *dst, int bpp,
 	   int32_t dst_stride,
 	   const struct pixman_f_transform *t)
 {
-	static const uint8_t zero[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 	const pixman_fixed_t ux = pixman_double_to_fixed(t->m[0][0]);
 	const pixman_fixed_t uy = pixman_double_to_fixed(t->m[1][0]);
-	int i, j;
+	/* Without shear or rotation every row samples the same columns */
+	const bool scale = t->m[0][1] == 0 && uy == 0;
+	int lo = 0, hi = 0;
+	int j;
 
 	assert(bpp == 32);
 
@@ -1713,6 +3197,7 @@ affine_blt(const void *src, void *dst, int bpp,
 		pixman_fixed_t x, y;
 		struct pixman_f_vector v;
 		uint32_t *b;
+		int y1;
 
 		/* reference point is the center of the pixel */
 		v.v[0] = dst_x + 0.5;
@@ -1727,65 +3212,31 @@ affine_blt(const void *src, void *dst, int bpp,
 		y +=  pixman_int_to_fixed(src_y - dst_y);
 
 		b = (uint32_t*)((uint8_t *)dst + (dst_y + j) * dst_stride + dst_x * bpp / 8);
-		for (i = 0; i < dst_width; i++) {
-			const uint8_t *row1;
-			const uint8_t *row2;
-			int x1, y1, x2, y2;
-			uint32_t tl, tr, bl, br;
-			int32_t fx, fy;
-
-			x1 = x - pixman_fixed_1/2;
-			y1 = y - pixman_fixed_1/2;
-
-			fx = bilinear_weight(x1);
-			fy = bilinear_weight(y1);
-
-			x1 = pixman_fixed_to_int(x1);
-			x2 = x1 + 1;
-			y1 = pixman_fixed_to_int(y1);
-			y2 = y1 + 1;
-
-			if (x1 >= src_width  || x2 < 0 ||
-			    y1 >= src_height || y2 < 0) {
-				b[i] = 0;
-				goto next;
-			}
-
-			if (y2 == 0) {
-				row1 = zero;
-			} else {
-				row1 = (uint8_t *)src + src_stride * y1;
-				row1 += bpp / 8 * x1;
-			}
-
-			if (y1 == src_height - 1) {
-				row2 = zero;
-			} else {
-				row2 = (uint8_t *)src + src_stride * y2;
-				row2 += bpp / 8 * x1;
-			}
-
-			if (x2 == 0) {
-				tl = 0;
-				bl = 0;
-			} else {
-				tl = convert_pixel(row1, 0);
-				bl = convert_pixel(row2, 0);
-			}
-
-			if (x1 == src_width - 1) {
-				tr = 0;
-				br = 0;
-			} else {
-				tr = convert_pixel(row1, 1);
-				br = convert_pixel(row2, 1);
-			}
-
-			b[i] = bilinear_interpolation(tl, tr, bl, br, fx, fy);
 
-next:
-			x += ux;
-			y += uy;
-		}
+		if (scale && j == 0)
+			scale_columns(x, ux, src_width, dst_width, &lo, &hi);
+
+		y1 = pixman_fixed_to_int(y - pixman_fixed_1/2);
+		if (hi > lo && y1 >= 0 && y1 < src_height - 1) {
+			const uint8_t *row = (const uint8_t *)src + y1 * src_stride;
+
+			affine_funcs.affine(src, src_stride,
+					    src_width, src_height,
+					    x, y, ux, uy,
+					    b, lo);
+			affine_funcs.scale((const uint32_t *)row,
+					   (const uint32_t *)(row + src_stride),
+					   bilinear_weight(y - pixman_fixed_1/2),
+					   x + lo * ux - pixman_fixed_1/2, ux,
+					   b + lo, hi - lo);
+			affine_funcs.affine(src, src_stride,
+					    src_width, src_height,
+					    x + hi * ux, y, ux, uy,
+					    b + hi, dst_width - hi);
+		} else
+			affine_funcs.affine(src, src_stride,
+					    src_width, src_height,
+					    x, y, ux, uy,
+					    b, dst_width);
 	}
 }
@@ -60,6 +60,7 @@
 
 #if HAS_GCC(4, 5)
 #define sse2 fast __attribute__((target("sse2,fpmath=sse")))
+#define sse4_1 fast __attribute__((target("sse4.1,sse2,fpmath=sse")))
 #define sse4_2 fast __attribute__((target("sse4.2,sse2,fpmath=sse")))
 #endif
 
@@ -940,22 +940,16 @@ gen4_emit_drawing_rectangle(struct sna *sna, const struct sna_composite_op *op)
 {
 	uint32_t limit = (op->dst.height - 1) << 16 | (op->dst.width - 1);
 	uint32_t offset = (uint16_t)op->dst.y << 16 | (uint16_t)op->dst.x;
+	uint32_t packet[4];
 
 	assert(!too_large(abs(op->dst.x), abs(op->dst.y)));
 	assert(!too_large(op->dst.width, op->dst.height));
 
-	if (sna->render_state.gen4.drawrect_limit == limit &&
-	    sna->render_state.gen4.drawrect_offset == offset)
-		return true;
-
-	sna->render_state.gen4.drawrect_offset = offset;
-	sna->render_state.gen4.drawrect_limit = limit;
-
-	OUT_BATCH(GEN4_3DSTATE_DRAWING_RECTANGLE | (4 - 2));
-	OUT_BATCH(0);
-	OUT_BATCH(limit);
-	OUT_BATCH(offset);
-	return false;
+	packet[0] = GEN4_3DSTATE_DRAWING_RECTANGLE | (4 - 2);
+	packet[1] = 0;
+	packet[2] = limit;
+	packet[3] = offset;
+	return !sna_state_emit(sna, SNA_STATE_DRAWRECT, packet, 4);
 }
 
 static void
@@ -2960,14 +2954,14 @@ gen4_render_fill_one(struct sna *sna, PixmapPtr dst, struct kgem_bo *bo,
 
 static void gen4_render_reset(struct sna *sna)
 {
+	sna_state_reset(sna);
+
 	sna->render_state.gen4.needs_invariant = true;
 	sna->render_state.gen4.needs_urb = true;
 	sna->render_state.gen4.ve_id = -1;
 	sna->render_state.gen4.last_primitive = -1;
 	sna->render_state.gen4.last_pipelined_pointers = -1;
 
-	sna->render_state.gen4.drawrect_offset = -1;
-	sna->render_state.gen4.drawrect_limit = -1;
 	sna->render_state.gen4.surface_table = 0;
 
 	if (sna->render.vbo && !kgem_bo_can_map(&sna->kgem, sna->render.vbo)) {
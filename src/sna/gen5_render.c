@@ -876,23 +876,19 @@ gen5_emit_drawing_rectangle(struct sna *sna, const struct sna_composite_op *op)
 {
 	uint32_t limit = (op->dst.height - 1) << 16 | (op->dst.width - 1);
 	uint32_t offset = (uint16_t)op->dst.y << 16 | (uint16_t)op->dst.x;
+	uint32_t packet[4];
 
 	assert(!too_large(abs(op->dst.x), abs(op->dst.y)));
 	assert(!too_large(op->dst.width, op->dst.height));
 
-	if (!DBG_NO_STATE_CACHE &&
-	    sna->render_state.gen5.drawrect_limit == limit &&
-	    sna->render_state.gen5.drawrect_offset == offset)
-		return false;
-
-	sna->render_state.gen5.drawrect_offset = offset;
-	sna->render_state.gen5.drawrect_limit = limit;
+	packet[0] = GEN5_3DSTATE_DRAWING_RECTANGLE | (4 - 2);
+	packet[1] = 0x00000000;
+	packet[2] = limit;
+	packet[3] = offset;
 
-	OUT_BATCH(GEN5_3DSTATE_DRAWING_RECTANGLE | (4 - 2));
-	OUT_BATCH(0x00000000);
-	OUT_BATCH(limit);
-	OUT_BATCH(offset);
-	return true;
+	if (DBG_NO_STATE_CACHE)
+		sna_state_invalidate(sna, SNA_STATE_DRAWRECT);
+	return sna_state_emit(sna, SNA_STATE_DRAWRECT, packet, 4);
 }
 
 static void
@@ -3057,7 +3053,7 @@ gen5_render_context_switch(struct kgem *kgem,
 		struct sna *sna = to_sna_from_kgem(kgem);
 		DBG(("%s: forcing drawrect on next state emission\n",
 		     __FUNCTION__));
-		sna->render_state.gen5.drawrect_limit = -1;
+		sna_state_invalidate(sna, SNA_STATE_DRAWRECT);
 	}
 
 	if (kgem_ring_is_idle(kgem, kgem->ring)) {
@@ -3068,13 +3064,13 @@ gen5_render_context_switch(struct kgem *kgem,
 
 static void gen5_render_reset(struct sna *sna)
 {
+	sna_state_reset(sna);
+
 	sna->render_state.gen5.needs_invariant = true;
 	sna->render_state.gen5.ve_id = -1;
 	sna->render_state.gen5.last_primitive = -1;
 	sna->render_state.gen5.last_pipelined_pointers = 0;
 
-	sna->render_state.gen5.drawrect_offset = -1;
-	sna->render_state.gen5.drawrect_limit = -1;
 	sna->render_state.gen5.surface_table = -1;
 
 	if (sna->render.vbo && !kgem_bo_can_map(&sna->kgem, sna->render.vbo)) {
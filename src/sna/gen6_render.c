@@ -613,19 +613,17 @@ gen6_emit_cc(struct sna *sna, int blend)
 static void
 gen6_emit_sampler(struct sna *sna, uint32_t state)
 {
-	if (sna->render_state.gen6.samplers == state)
-		return;
-
-	sna->render_state.gen6.samplers = state;
+	uint32_t packet[4];
 
-	DBG(("%s: sampler = %x\n", __FUNCTION__, state));
+	packet[0] = GEN6_3DSTATE_SAMPLER_STATE_POINTERS |
+		GEN6_3DSTATE_SAMPLER_STATE_MODIFY_PS |
+		(4 - 2);
+	packet[1] = 0; /* VS */
+	packet[2] = 0; /* GS */
+	packet[3] = sna->render_state.gen6.wm_state + state;
 
-	OUT_BATCH(GEN6_3DSTATE_SAMPLER_STATE_POINTERS |
-		  GEN6_3DSTATE_SAMPLER_STATE_MODIFY_PS |
-		  (4 - 2));
-	OUT_BATCH(0); /* VS */
-	OUT_BATCH(0); /* GS */
-	OUT_BATCH(sna->render_state.gen6.wm_state + state);
+	if (sna_state_emit(sna, SNA_STATE_SAMPLER, packet, 4))
+		DBG(("%s: sampler = %x\n", __FUNCTION__, state));
 }
 
 static void
@@ -725,12 +723,16 @@ gen6_emit_drawing_rectangle(struct sna *sna,
 {
 	uint32_t limit = (op->dst.height - 1) << 16 | (op->dst.width - 1);
 	uint32_t offset = (uint16_t)op->dst.y << 16 | (uint16_t)op->dst.x;
+	uint32_t packet[4];
 
 	assert(!too_large(abs(op->dst.x), abs(op->dst.y)));
 	assert(!too_large(op->dst.width, op->dst.height));
 
-	if (sna->render_state.gen6.drawrect_limit  == limit &&
-	    sna->render_state.gen6.drawrect_offset == offset)
+	packet[0] = GEN6_3DSTATE_DRAWING_RECTANGLE | (4 - 2);
+	packet[1] = 0;
+	packet[2] = limit;
+	packet[3] = offset;
+	if (!sna_state_changed(sna, SNA_STATE_DRAWRECT, packet, 4))
 		return true;
 
 	/* [DevSNB-C+{W/A}] Before any depth stall flush (including those
@@ -756,13 +758,7 @@ gen6_emit_drawing_rectangle(struct sna *sna,
 
 	DBG(("%s: offset=(%d, %d), limit=(%d, %d)\n",
 	     __FUNCTION__, op->dst.x, op->dst.y, op->dst.width, op->dst.height));
-	OUT_BATCH(GEN6_3DSTATE_DRAWING_RECTANGLE | (4 - 2));
-	OUT_BATCH(0);
-	OUT_BATCH(limit);
-	OUT_BATCH(offset);
-
-	sna->render_state.gen6.drawrect_offset = offset;
-	sna->render_state.gen6.drawrect_limit = limit;
+	sna_state_out(sna, packet, 4);
 	return false;
 }
 
@@ -3574,17 +3570,16 @@ gen6_render_clear(struct sna *sna, PixmapPtr dst, struct kgem_bo *bo)
 
 static void gen6_render_reset(struct sna *sna)
 {
+	sna_state_reset(sna);
+
 	sna->render_state.gen6.needs_invariant = true;
 	sna->render_state.gen6.first_state_packet = true;
 	sna->render_state.gen6.ve_id = 3 << 2;
 	sna->render_state.gen6.last_primitive = -1;
 
 	sna->render_state.gen6.num_sf_outputs = 0;
-	sna->render_state.gen6.samplers = -1;
 	sna->render_state.gen6.blend = -1;
 	sna->render_state.gen6.kernel = -1;
-	sna->render_state.gen6.drawrect_offset = -1;
-	sna->render_state.gen6.drawrect_limit = -1;
 	sna->render_state.gen6.surface_table = -1;
 
 	if (sna->render.vbo && !kgem_bo_can_map(&sna->kgem, sna->render.vbo)) {
@@ -809,36 +809,31 @@ static void
 gen7_emit_cc(struct sna *sna, uint32_t blend_offset)
 {
 	struct gen7_render_state *render = &sna->render_state.gen7;
-
-	if (render->blend == blend_offset)
-		return;
-
-	DBG(("%s: blend = %x\n", __FUNCTION__, blend_offset));
+	uint32_t packet[2];
 
 	/* XXX can have up to 8 blend states preload, selectable via
 	 * Render Target Index. What other side-effects of Render Target Index?
 	 */
 
 	assert (is_aligned(render->cc_blend + blend_offset, 64));
-	OUT_BATCH(GEN7_3DSTATE_BLEND_STATE_POINTERS | (2 - 2));
-	OUT_BATCH((render->cc_blend + blend_offset) | 1);
+	packet[0] = GEN7_3DSTATE_BLEND_STATE_POINTERS | (2 - 2);
+	packet[1] = (render->cc_blend + blend_offset) | 1;
 
-	render->blend = blend_offset;
+	if (sna_state_emit(sna, SNA_STATE_BLEND, packet, 2))
+		DBG(("%s: blend = %x\n", __FUNCTION__, blend_offset));
 }
 
 static void
 gen7_emit_sampler(struct sna *sna, uint32_t state)
 {
-	if (sna->render_state.gen7.samplers == state)
-		return;
-
-	sna->render_state.gen7.samplers = state;
-
-	DBG(("%s: sampler = %x\n", __FUNCTION__, state));
+	uint32_t packet[2];
 
 	assert (is_aligned(sna->render_state.gen7.wm_state + state, 32));
-	OUT_BATCH(GEN7_3DSTATE_SAMPLER_STATE_POINTERS_PS | (2 - 2));
-	OUT_BATCH(sna->render_state.gen7.wm_state + state);
+	packet[0] = GEN7_3DSTATE_SAMPLER_STATE_POINTERS_PS | (2 - 2);
+	packet[1] = sna->render_state.gen7.wm_state + state;
+
+	if (sna_state_emit(sna, SNA_STATE_SAMPLER, packet, 2))
+		DBG(("%s: sampler = %x\n", __FUNCTION__, state));
 }
 
 static void
@@ -927,22 +922,16 @@ gen7_emit_drawing_rectangle(struct sna *sna,
 {
 	uint32_t limit = (op->dst.height - 1) << 16 | (op->dst.width - 1);
 	uint32_t offset = (uint16_t)op->dst.y << 16 | (uint16_t)op->dst.x;
+	uint32_t packet[4];
 
 	assert(!too_large(abs(op->dst.x), abs(op->dst.y)));
 	assert(!too_large(op->dst.width, op->dst.height));
 
-	if (sna->render_state.gen7.drawrect_limit == limit &&
-	    sna->render_state.gen7.drawrect_offset == offset)
-		return true;
-
-	sna->render_state.gen7.drawrect_offset = offset;
-	sna->render_state.gen7.drawrect_limit = limit;
-
-	OUT_BATCH(GEN7_3DSTATE_DRAWING_RECTANGLE | (4 - 2));
-	OUT_BATCH(0);
-	OUT_BATCH(limit);
-	OUT_BATCH(offset);
-	return false;
+	packet[0] = GEN7_3DSTATE_DRAWING_RECTANGLE | (4 - 2);
+	packet[1] = 0;
+	packet[2] = limit;
+	packet[3] = offset;
+	return !sna_state_emit(sna, SNA_STATE_DRAWRECT, packet, 4);
 }
 
 static void
@@ -3799,6 +3788,8 @@ gen7_render_clear(struct sna *sna, PixmapPtr dst, struct kgem_bo *bo)
 }
 static void gen7_render_reset(struct sna *sna)
 {
+	sna_state_reset(sna);
+
 	sna->render_state.gen7.pipe_controls_since_stall = 0;
 	sna->render_state.gen7.emit_flush = false;
 	sna->render_state.gen7.needs_invariant = true;
@@ -3806,11 +3797,7 @@ static void gen7_render_reset(struct sna *sna)
 	sna->render_state.gen7.last_primitive = -1;
 
 	sna->render_state.gen7.num_sf_outputs = 0;
-	sna->render_state.gen7.samplers = -1;
-	sna->render_state.gen7.blend = -1;
 	sna->render_state.gen7.kernel = -1;
-	sna->render_state.gen7.drawrect_offset = -1;
-	sna->render_state.gen7.drawrect_limit = -1;
 	sna->render_state.gen7.surface_table = 0;
 
 	if (sna->render.vbo && !kgem_bo_can_map(&sna->kgem, sna->render.vbo)) {
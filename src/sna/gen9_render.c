@@ -922,14 +922,7 @@ static void
 gen9_emit_cc(struct sna *sna, uint32_t blend)
 {
 	struct gen9_render_state *render = &sna->render_state.gen9;
-
-	if (render->blend == blend)
-		return;
-
-	DBG(("%s: blend=%x (current=%x), src=%d, dst=%d\n",
-	     __FUNCTION__, blend, render->blend,
-	     blend / GEN9_BLENDFACTOR_COUNT,
-	     blend % GEN9_BLENDFACTOR_COUNT));
+	uint32_t packet[6];
 
 	assert(blend < GEN9_BLENDFACTOR_COUNT * GEN9_BLENDFACTOR_COUNT);
 	assert(blend / GEN9_BLENDFACTOR_COUNT > 0);
@@ -939,43 +932,45 @@ gen9_emit_cc(struct sna *sna, uint32_t blend)
 	 * Render Target Index. What other side-effects of Render Target Index?
 	 */
 
-	OUT_BATCH(GEN9_3DSTATE_PS_BLEND | (2 - 2));
+	packet[0] = GEN9_3DSTATE_PS_BLEND | (2 - 2);
 	if (blend != GEN9_BLEND(NO_BLEND)) {
 		uint32_t src = blend / GEN9_BLENDFACTOR_COUNT;
 		uint32_t dst = blend % GEN9_BLENDFACTOR_COUNT;
-		OUT_BATCH(PS_BLEND_HAS_WRITEABLE_RT |
-			  PS_BLEND_COLOR_BLEND_ENABLE |
-			  src << PS_BLEND_SRC_ALPHA_SHIFT |
-			  dst << PS_BLEND_DST_ALPHA_SHIFT |
-			  src << PS_BLEND_SRC_SHIFT |
-			  dst << PS_BLEND_DST_SHIFT);
+		packet[1] = PS_BLEND_HAS_WRITEABLE_RT |
+			PS_BLEND_COLOR_BLEND_ENABLE |
+			src << PS_BLEND_SRC_ALPHA_SHIFT |
+			dst << PS_BLEND_DST_ALPHA_SHIFT |
+			src << PS_BLEND_SRC_SHIFT |
+			dst << PS_BLEND_DST_SHIFT;
 	} else
-		OUT_BATCH(PS_BLEND_HAS_WRITEABLE_RT);
+		packet[1] = PS_BLEND_HAS_WRITEABLE_RT;
 
 	assert(is_aligned(render->cc_blend + blend * GEN9_BLEND_STATE_PADDED_SIZE, 64));
-	OUT_BATCH(GEN9_3DSTATE_BLEND_STATE_POINTERS | (2 - 2));
-	OUT_BATCH((render->cc_blend + blend * GEN9_BLEND_STATE_PADDED_SIZE) | 1);
+	packet[2] = GEN9_3DSTATE_BLEND_STATE_POINTERS | (2 - 2);
+	packet[3] = (render->cc_blend + blend * GEN9_BLEND_STATE_PADDED_SIZE) | 1;
 
 	/* Force a CC_STATE pointer change to improve blend performance */
-	OUT_BATCH(GEN9_3DSTATE_CC_STATE_POINTERS | (2 - 2));
-	OUT_BATCH(0);
-
-	render->blend = blend;
+	packet[4] = GEN9_3DSTATE_CC_STATE_POINTERS | (2 - 2);
+	packet[5] = 0;
+
+	if (sna_state_emit(sna, SNA_STATE_BLEND, packet, 6))
+		DBG(("%s: blend=%x, src=%d, dst=%d\n",
+		     __FUNCTION__, blend,
+		     blend / GEN9_BLENDFACTOR_COUNT,
+		     blend % GEN9_BLENDFACTOR_COUNT));
 }
 
 static void
 gen9_emit_sampler(struct sna *sna, uint32_t state)
 {
-	if (sna->render_state.gen9.samplers == state)
-		return;
-
-	sna->render_state.gen9.samplers = state;
-
-	DBG(("%s: sampler = %x\n", __FUNCTION__, state));
+	uint32_t packet[2];
 
 	assert(2 * sizeof(struct gen9_sampler_state) == 32);
-	OUT_BATCH(GEN9_3DSTATE_SAMPLER_STATE_POINTERS_PS | (2 - 2));
-	OUT_BATCH(sna->render_state.gen9.wm_state + state * 2 * sizeof(struct gen9_sampler_state));
+	packet[0] = GEN9_3DSTATE_SAMPLER_STATE_POINTERS_PS | (2 - 2);
+	packet[1] = sna->render_state.gen9.wm_state + state * 2 * sizeof(struct gen9_sampler_state);
+
+	if (sna_state_emit(sna, SNA_STATE_SAMPLER, packet, 2))
+		DBG(("%s: sampler = %x\n", __FUNCTION__, state));
 }
 
 static void
@@ -1062,22 +1057,16 @@ gen9_emit_drawing_rectangle(struct sna *sna,
 {
 	uint32_t limit = (op->dst.height - 1) << 16 | (op->dst.width - 1);
 	uint32_t offset = (uint16_t)op->dst.y << 16 | (uint16_t)op->dst.x;
+	uint32_t packet[4];
 
 	assert(!too_large(abs(op->dst.x), abs(op->dst.y)));
 	assert(!too_large(op->dst.width, op->dst.height));
 
-	if (sna->render_state.gen9.drawrect_limit == limit &&
-	    sna->render_state.gen9.drawrect_offset == offset)
-		return true;
-
-	sna->render_state.gen9.drawrect_offset = offset;
-	sna->render_state.gen9.drawrect_limit = limit;
-
-	OUT_BATCH(GEN9_3DSTATE_DRAWING_RECTANGLE | (4 - 2));
-	OUT_BATCH(0);
-	OUT_BATCH(limit);
-	OUT_BATCH(offset);
-	return false;
+	packet[0] = GEN9_3DSTATE_DRAWING_RECTANGLE | (4 - 2);
+	packet[1] = 0;
+	packet[2] = limit;
+	packet[3] = offset;
+	return !sna_state_emit(sna, SNA_STATE_DRAWRECT, packet, 4);
 }
 
 static void
@@ -3964,17 +3953,15 @@ static void gen9_render_flush(struct sna *sna)
 
 static void gen9_render_reset(struct sna *sna)
 {
+	sna_state_reset(sna);
+
 	sna->render_state.gen9.emit_flush = false;
 	sna->render_state.gen9.needs_invariant = true;
 	sna->render_state.gen9.ve_id = 3 << 2;
 	sna->render_state.gen9.last_primitive = -1;
 
 	sna->render_state.gen9.num_sf_outputs = 0;
-	sna->render_state.gen9.samplers = -1;
-	sna->render_state.gen9.blend = -1;
 	sna->render_state.gen9.kernel = -1;
-	sna->render_state.gen9.drawrect_offset = -1;
-	sna->render_state.gen9.drawrect_limit = -1;
 	sna->render_state.gen9.surface_table = 0;
 
 	if (sna->render.vbo && !kgem_bo_can_map(&sna->kgem, sna->render.vbo)) {
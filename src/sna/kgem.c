@@ -40,6 +40,8 @@
 #include <sched.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include <xf86drm.h>
 
@@ -80,8 +82,10 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 #define DBG_NO_SECURE_BATCHES 0
 #define DBG_NO_PINNED_BATCHES 0
 #define DBG_NO_SHRINK_BATCHES 0
+#define DBG_NO_BATCH_RING 0
 #define DBG_NO_FAST_RELOC 0
 #define DBG_NO_HANDLE_LUT 0
+#define DBG_NO_SOFTPIN 0
 #define DBG_NO_WT 0
 #define DBG_NO_WC_MMAP 0
 #define DBG_NO_BLT_Y 0
@@ -133,6 +137,7 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 #define LOCAL_I915_PARAM_HAS_RELAXED_FENCING	12
 #define LOCAL_I915_PARAM_HAS_RELAXED_DELTA	15
 #define LOCAL_I915_PARAM_HAS_LLC		17
+#define LOCAL_I915_PARAM_HAS_ALIASING_PPGTT	18
 #define LOCAL_I915_PARAM_HAS_SEMAPHORES		20
 #define LOCAL_I915_PARAM_HAS_SECURE_BATCHES	23
 #define LOCAL_I915_PARAM_HAS_PINNED_BATCHES	24
@@ -140,11 +145,14 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 #define LOCAL_I915_PARAM_HAS_HANDLE_LUT		26
 #define LOCAL_I915_PARAM_HAS_WT			27
 #define LOCAL_I915_PARAM_MMAP_VERSION		30
+#define LOCAL_I915_PARAM_HAS_EXEC_SOFTPIN	37
 
 #define LOCAL_I915_EXEC_IS_PINNED		(1<<10)
 #define LOCAL_I915_EXEC_NO_RELOC		(1<<11)
 #define LOCAL_I915_EXEC_HANDLE_LUT		(1<<12)
 
+#define LOCAL_EXEC_OBJECT_PINNED		(1<<4)
+
 #define LOCAL_I915_GEM_CREATE2       0x34
 #define LOCAL_IOCTL_I915_GEM_CREATE2 DRM_IOWR (DRM_COMMAND_BASE + LOCAL_I915_GEM_CREATE2, struct local_i915_gem_create2)
 struct local_i915_gem_create2 {
@@ -238,6 +246,23 @@ static inline int bytes(struct kgem_bo *bo)
 #define bucket(B) (B)->size.pages.bucket
 #define num_pages(B) (B)->size.pages.count
 
+static int sys_ioctl(int fd, unsigned long req, void *arg)
+{
+	return ioctl(fd, req, arg);
+}
+
+static const struct kgem_backend kgem_backend_drm = {
+	"drm",
+	sys_ioctl,
+};
+
+static const struct kgem_backend *backend = &kgem_backend_drm;
+
+void kgem_set_backend(const struct kgem_backend *b)
+{
+	backend = b ? b : &kgem_backend_drm;
+}
+
 static int __do_ioctl(int fd, unsigned long req, void *arg)
 {
 	do {
@@ -252,14 +277,21 @@ static int __do_ioctl(int fd, unsigned long req, void *arg)
 			return -err;
 		}
 
-		if (likely(ioctl(fd, req, arg) == 0))
+		if (likely(backend->ioctl(fd, req, arg) == 0))
 			return 0;
 	} while (1);
 }
 
+static struct kgem_async *async_submit;
+static void kgem_async_sync(int fd, unsigned long req, void *arg);
+static void kgem_async_recover(struct kgem *kgem);
+
 inline static int do_ioctl(int fd, unsigned long req, void *arg)
 {
-	if (likely(ioctl(fd, req, arg) == 0))
+	if (unlikely(async_submit))
+		kgem_async_sync(fd, req, arg);
+
+	if (likely(backend->ioctl(fd, req, arg) == 0))
 		return 0;
 
 	return __do_ioctl(fd, req, arg);
@@ -480,7 +512,8 @@ restart:
 	set_tiling.tiling_mode = tiling;
 	set_tiling.stride = tiling ? stride : 0;
 
-	if (ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling) == 0) {
+	err = do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling);
+	if (err == 0) {
 		bo->tiling = set_tiling.tiling_mode;
 		bo->pitch = set_tiling.tiling_mode ? set_tiling.stride : stride;
 		DBG(("%s: handle=%d, tiling=%d [%d], pitch=%d [%d]: %d\n",
@@ -491,20 +524,11 @@ restart:
 		return set_tiling.tiling_mode == tiling;
 	}
 
-	err = errno;
-	if (err == EINTR)
-		goto restart;
-
-	if (err == EAGAIN) {
-		sched_yield();
-		goto restart;
-	}
-
-	if (err == EBUSY && kgem_bo_rmfb(kgem, bo))
+	if (err == -EBUSY && kgem_bo_rmfb(kgem, bo))
 		goto restart;
 
 	ERR(("%s: failed to set-tiling(tiling=%d, pitch=%d) for handle=%d: %d\n",
-	     __FUNCTION__, tiling, stride, bo->handle, err));
+	     __FUNCTION__, tiling, stride, bo->handle, -err));
 	return false;
 }
 
@@ -549,7 +573,7 @@ static bool __kgem_throttle(struct kgem *kgem, bool harder)
 	 * and so catch up or detect the hang.
 	 */
 	do {
-		if (ioctl(kgem->fd, DRM_IOCTL_I915_GEM_THROTTLE) == 0) {
+		if (backend->ioctl(kgem->fd, DRM_IOCTL_I915_GEM_THROTTLE, NULL) == 0) {
 			kgem->need_throttle = 0;
 			return false;
 		}
@@ -977,7 +1001,25 @@ constant inline static unsigned long __fls(unsigned long word)
 
 constant inline static int cache_bucket(int num_pages)
 {
-	return __fls(num_pages);
+	int order = __fls(num_pages);
+	int sub;
+
+	/* Split each power-of-two by the next most significant bits, so
+	 * that every bo in a later bucket is larger than num_pages.
+	 */
+	if (order >= CACHE_BUCKET_SPLIT)
+		sub = num_pages >> (order - CACHE_BUCKET_SPLIT);
+	else
+		sub = num_pages << (CACHE_BUCKET_SPLIT - order);
+
+	return order << CACHE_BUCKET_SPLIT | (sub & ((1 << CACHE_BUCKET_SPLIT) - 1));
+}
+
+/* The buckets searched for num_pages: those holding up to twice the size */
+constant inline static int cache_bucket_end(int bucket)
+{
+	bucket += 1 << CACHE_BUCKET_SPLIT;
+	return bucket < NUM_CACHE_BUCKETS ? bucket : NUM_CACHE_BUCKETS;
 }
 
 static struct kgem_bo *__kgem_bo_init(struct kgem_bo *bo,
@@ -1018,6 +1060,115 @@ static struct kgem_bo *__kgem_bo_alloc(int handle, int num_pages)
 	return __kgem_bo_init(bo, handle, num_pages);
 }
 
+/* The largest bo, in pages, that cache_bucket() maps to the bucket */
+constant inline static int va_bucket_pages(int bucket)
+{
+	int order = bucket >> CACHE_BUCKET_SPLIT;
+	int sub = bucket & ((1 << CACHE_BUCKET_SPLIT) - 1);
+
+	if (order >= CACHE_BUCKET_SPLIT)
+		return (((1 << CACHE_BUCKET_SPLIT) + sub + 1) << (order - CACHE_BUCKET_SPLIT)) - 1;
+	else
+		return ((1 << CACHE_BUCKET_SPLIT) + sub) >> (CACHE_BUCKET_SPLIT - order);
+}
+
+static bool kgem_bo_alloc_va(struct kgem *kgem, struct kgem_bo *bo)
+{
+	int b = bucket(bo);
+	uint64_t offset;
+
+	assert(kgem->has_softpin);
+	assert(bo->proxy == NULL);
+	assert(!bo->softpin);
+
+	/* Only cacheable sizes, so that every range can be reused */
+	if (b >= NUM_CACHE_BUCKETS)
+		return false;
+	assert(num_pages(bo) <= va_bucket_pages(b));
+
+	if (kgem->va.bucket[b].count) {
+		/* Take the oldest, the most likely to have been unbound */
+		offset = kgem->va.bucket[b].offset[kgem->va.bucket[b].head];
+		kgem->va.bucket[b].head =
+			(kgem->va.bucket[b].head + 1) & (kgem->va.bucket[b].size - 1);
+		kgem->va.bucket[b].count--;
+	} else {
+		/* Reserve room for the largest bo in the bucket plus a
+		 * guard page, so that prefetch past the end of a bo never
+		 * runs into the next.
+		 */
+		uint64_t size = (uint64_t)(va_bucket_pages(b) + 1) * PAGE_SIZE;
+
+		if (kgem->va.next + size > kgem->va.end) {
+			DBG(("%s: address space exhausted, handle=%d will be relocated\n",
+			     __FUNCTION__, bo->handle));
+			return false;
+		}
+
+		offset = kgem->va.next;
+		kgem->va.next += size;
+	}
+
+	DBG(("%s: handle=%d, bucket=%d -> offset=%llx\n",
+	     __FUNCTION__, bo->handle, b, (long long)offset));
+	assert(offset && (offset & (PAGE_SIZE - 1)) == 0);
+	bo->presumed_offset = offset;
+	bo->softpin = true;
+	return true;
+}
+
+static void kgem_bo_release_va(struct kgem *kgem, struct kgem_bo *bo)
+{
+	int b = bucket(bo);
+	uint32_t size;
+
+	if (!bo->softpin)
+		return;
+
+	DBG(("%s: handle=%d, bucket=%d, offset=%llx\n",
+	     __FUNCTION__, bo->handle, b, (long long)bo->presumed_offset));
+	assert(b < NUM_CACHE_BUCKETS);
+	bo->softpin = false;
+
+	size = kgem->va.bucket[b].size;
+	if (kgem->va.bucket[b].count == size) {
+		uint32_t head = kgem->va.bucket[b].head;
+		uint32_t grow = size ? 2 * size : 16;
+		uint64_t *offset;
+
+		offset = malloc(grow * sizeof(uint64_t));
+		if (offset == NULL)
+			return; /* leak the range rather than fail */
+
+		/* unwrap the fifo into the new array */
+		memcpy(offset, kgem->va.bucket[b].offset + head,
+		       (size - head) * sizeof(uint64_t));
+		memcpy(offset + size - head, kgem->va.bucket[b].offset,
+		       head * sizeof(uint64_t));
+		free(kgem->va.bucket[b].offset);
+
+		kgem->va.bucket[b].offset = offset;
+		kgem->va.bucket[b].head = 0;
+		kgem->va.bucket[b].size = size = grow;
+	}
+
+	kgem->va.bucket[b].offset[(kgem->va.bucket[b].head + kgem->va.bucket[b].count++) & (size - 1)] = bo->presumed_offset;
+}
+
+/* Point the execobject at the bo's own address if it has (or can be
+ * given) one, so that the kernel keeps it there and we need not emit
+ * relocations for it.
+ */
+static void kgem_exec_set_offset(struct kgem *kgem,
+				 struct drm_i915_gem_exec_object2 *exec,
+				 struct kgem_bo *bo)
+{
+	exec->flags &= ~LOCAL_EXEC_OBJECT_PINNED;
+	if (kgem->has_softpin && (bo->softpin || kgem_bo_alloc_va(kgem, bo)))
+		exec->flags |= LOCAL_EXEC_OBJECT_PINNED;
+	exec->offset = bo->presumed_offset;
+}
+
 static struct kgem_request *__kgem_request_alloc(struct kgem *kgem)
 {
 	struct kgem_request *rq;
@@ -1038,6 +1189,7 @@ static struct kgem_request *__kgem_request_alloc(struct kgem *kgem)
 	list_init(&rq->buffers);
 	rq->bo = NULL;
 	rq->ring = 0;
+	rq->trace = 0;
 
 	return rq;
 }
@@ -1067,6 +1219,90 @@ static struct list *active(struct kgem *kgem, int num_pages, int tiling)
 	return &kgem->active[cache_bucket(num_pages)][tiling];
 }
 
+static bool cache_is_empty(struct list *cache, int num_pages)
+{
+	int bucket = cache_bucket(num_pages);
+	int end = cache_bucket_end(bucket);
+
+	assert(bucket < NUM_CACHE_BUCKETS);
+	do {
+		if (!list_is_empty(&cache[bucket]))
+			return false;
+	} while (++bucket < end);
+
+	return true;
+}
+
+static bool inactive_is_empty(struct kgem *kgem, int num_pages)
+{
+	return cache_is_empty(kgem->inactive, num_pages);
+}
+
+static bool active_is_empty(struct kgem *kgem, int num_pages, int tiling)
+{
+	int bucket = cache_bucket(num_pages);
+	int end = cache_bucket_end(bucket);
+
+	assert(bucket < NUM_CACHE_BUCKETS);
+	do {
+		if (!list_is_empty(&kgem->active[bucket][tiling]))
+			return false;
+	} while (++bucket < end);
+
+	return true;
+}
+
+/* The large caches are kept ordered by size, so the first fit is the best */
+static void large_cache_add(struct list *cache, struct kgem_bo *bo)
+{
+	struct kgem_bo *pos;
+
+	list_del(&bo->list);
+	list_for_each_entry(pos, cache, list)
+		if (num_pages(pos) >= num_pages(bo))
+			break;
+	list_add_tail(&bo->list, &pos->list);
+}
+
+static inline int cache_order(int num_pages)
+{
+	int order = __fls(num_pages);
+	return order < NUM_CACHE_ORDERS ? order : NUM_CACHE_ORDERS;
+}
+
+static inline void cache_hit(struct kgem *kgem, struct kgem_bo *bo, int num_pages)
+{
+	kgem->cache_stats.hits++;
+	if (num_pages(bo) > num_pages)
+		kgem->cache_stats.wasted += (uint64_t)(num_pages(bo) - num_pages) * PAGE_SIZE;
+	kgem->cache_budget.order[cache_order(num_pages(bo))].demand += bytes(bo);
+}
+
+static inline void cache_miss(struct kgem *kgem, int num_pages)
+{
+	kgem->cache_stats.misses++;
+	kgem->cache_budget.order[cache_order(num_pages)].demand += (uint64_t)num_pages * PAGE_SIZE;
+}
+
+static inline void cache_budget_add(struct kgem *kgem, struct kgem_bo *bo)
+{
+	assert(!bo->cached);
+	bo->cached = true;
+	kgem->cache_budget.size += bytes(bo);
+	kgem->cache_budget.order[cache_order(num_pages(bo))].bytes += bytes(bo);
+}
+
+static inline void cache_budget_remove(struct kgem *kgem, struct kgem_bo *bo)
+{
+	if (!bo->cached)
+		return;
+
+	bo->cached = false;
+	assert(kgem->cache_budget.size >= bytes(bo));
+	kgem->cache_budget.size -= bytes(bo);
+	kgem->cache_budget.order[cache_order(num_pages(bo))].bytes -= bytes(bo);
+}
+
 static size_t
 agp_aperture_size(struct pci_device *dev, unsigned gen)
 {
@@ -1092,6 +1328,49 @@ total_ram_size(void)
 	return 0;
 }
 
+static int kgem_open_memory_pressure(void)
+{
+	/* Notify us of 150ms of stalls within any 2s window */
+	static const char trigger[] = "some 150000 2000000";
+	char path[1024], buf[1024];
+	int flags = O_RDWR | O_NONBLOCK;
+	FILE *file;
+	int fd = -1;
+
+#ifdef O_CLOEXEC
+	flags |= O_CLOEXEC;
+#endif
+
+	/* Prefer the pressure on our own (v2) cgroup over the system's */
+	file = fopen("/proc/self/cgroup", "r");
+	if (file) {
+		while (fgets(buf, sizeof(buf), file)) {
+			if (strncmp(buf, "0::", 3))
+				continue;
+
+			buf[strcspn(buf, "\n")] = '\0';
+			snprintf(path, sizeof(path),
+				 "/sys/fs/cgroup%s/memory.pressure", buf + 3);
+			fd = open(path, flags);
+			break;
+		}
+		fclose(file);
+	}
+	if (fd < 0)
+		fd = open("/proc/pressure/memory", flags);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, trigger, sizeof(trigger)) < 0) {
+		DBG(("%s: unable to install trigger, errno=%d\n",
+		     __FUNCTION__, errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
 static unsigned
 cpu_cache_size__cpuid4(void)
 {
@@ -1212,6 +1491,22 @@ static bool test_has_handle_lut(struct kgem *kgem)
 	return gem_param(kgem, LOCAL_I915_PARAM_HAS_HANDLE_LUT) > 0;
 }
 
+static bool test_has_softpin(struct kgem *kgem)
+{
+	if (DBG_NO_SOFTPIN)
+		return false;
+
+	/* Only the 64-bit relocations of gen8+ are elided */
+	if (kgem->gen < 0100)
+		return false;
+
+	/* and the addresses must be private to us, i.e. full-ppgtt */
+	if (gem_param(kgem, LOCAL_I915_PARAM_HAS_ALIASING_PPGTT) < 2)
+		return false;
+
+	return gem_param(kgem, LOCAL_I915_PARAM_HAS_EXEC_SOFTPIN) > 0;
+}
+
 static bool test_has_wt(struct kgem *kgem)
 {
 	if (DBG_NO_WT)
@@ -1460,7 +1755,7 @@ static bool gem_set_tiling(int fd, uint32_t handle, int tiling, int stride)
 	set_tiling.tiling_mode = tiling;
 	set_tiling.stride = stride;
 
-	if (ioctl(fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling) == 0)
+	if (do_ioctl(fd, DRM_IOCTL_I915_GEM_SET_TILING, &set_tiling) == 0)
 		return set_tiling.tiling_mode == tiling;
 
 	return false;
@@ -1505,7 +1800,7 @@ static bool test_can_scanout_y(struct kgem *kgem)
 		f.modifiers[0] = (uint64_t)1 << 56 | 2; /* MOD_Y_TILED */
 		f.pixel_format = 'X' | 'R' << 8 | '2' << 16 | '4' << 24; /* XRGB8888 */
 		f.flags = 1 << 1; /* + modifier */
-		if (drmIoctl(kgem->fd, LOCAL_IOCTL_MODE_ADDFB2, &f) == 0) {
+		if (do_ioctl(kgem->fd, LOCAL_IOCTL_MODE_ADDFB2, &f) == 0) {
 			ret = true;
 			arg.fb_id = f.fb_id;
 		}
@@ -1534,12 +1829,12 @@ static bool test_has_dirtyfb(struct kgem *kgem)
 	if (create.handle == 0)
 		return false;
 
-	if (drmIoctl(kgem->fd, DRM_IOCTL_MODE_ADDFB, &create) == 0) {
+	if (do_ioctl(kgem->fd, DRM_IOCTL_MODE_ADDFB, &create) == 0) {
 		struct drm_mode_fb_dirty_cmd dirty;
 
 		memset(&dirty, 0, sizeof(dirty));
 		dirty.fb_id = create.fb_id;
-		ret = drmIoctl(kgem->fd,
+		ret = do_ioctl(kgem->fd,
 			       DRM_IOCTL_MODE_DIRTYFB,
 			       &dirty) == 0;
 
@@ -1548,7 +1843,7 @@ static bool test_has_dirtyfb(struct kgem *kgem)
 		 * beneficial vs flagging the whole fb as dirty.
 		 */
 
-		drmIoctl(kgem->fd,
+		do_ioctl(kgem->fd,
 			 DRM_IOCTL_MODE_RMFB,
 			 &create.fb_id);
 	}
@@ -1693,6 +1988,24 @@ static void kgem_init_swizzling(struct kgem *kgem)
 		choose_memcpy_tiled_x(kgem,
 				      tiling.swizzle_mode,
 				      __to_sna(kgem)->cpu_features);
+
+	/* Y tiles use their own swizzle mode (e.g. 9_10 for X becomes 9) */
+	if (!gem_set_tiling(kgem->fd, tiling.handle, I915_TILING_Y, 128))
+		goto out;
+
+	if (do_ioctl(kgem->fd, LOCAL_IOCTL_I915_GEM_GET_TILING, &tiling))
+		goto out;
+
+	DBG(("%s: Y swizzle_mode=%d, phys_swizzle_mode=%d\n",
+	     __FUNCTION__, tiling.swizzle_mode, tiling.phys_swizzle_mode));
+
+	if (kgem->gen < 050 && tiling.phys_swizzle_mode != tiling.swizzle_mode)
+		goto out;
+
+	if (!DBG_NO_DETILING)
+		choose_memcpy_tiled_y(kgem,
+				      tiling.swizzle_mode,
+				      __to_sna(kgem)->cpu_features);
 out:
 	gem_close(kgem->fd, tiling.handle);
 	DBG(("%s: can fence?=%d\n", __FUNCTION__, kgem->can_fence));
@@ -1703,6 +2016,8 @@ static void kgem_fixup_relocs(struct kgem *kgem, struct kgem_bo *bo, int shrink)
 	int n;
 
 	bo->target_handle = kgem->has_handle_lut ? kgem->nexec : bo->handle;
+	if (kgem->has_softpin && !bo->softpin)
+		kgem_bo_alloc_va(kgem, bo);
 
 	assert(kgem->nreloc__self <= 256);
 	if (kgem->nreloc__self == 0)
@@ -1877,6 +2192,123 @@ restart:
 	return last;
 }
 
+static bool kgem_batch_ring_add(struct kgem *kgem)
+{
+	struct kgem_bo *bo;
+	uint32_t *map;
+	int n;
+
+	n = kgem->batch_ring.count;
+	assert(n < KGEM_BATCH_RING_MAX);
+
+	bo = kgem_create_linear(kgem, sizeof(uint32_t)*kgem->batch_size,
+				CREATE_INACTIVE | CREATE_NO_THROTTLE);
+	if (bo == NULL)
+		return false;
+
+	/* With LLC the CPU writes are coherent with the GPU, otherwise
+	 * write-combine straight into memory; either way the bo can be
+	 * rewritten without moving it between domains.
+	 */
+	if (kgem->has_llc) {
+		map = kgem_bo_map__cpu(kgem, bo);
+		if (map)
+			kgem_bo_sync__cpu(kgem, bo);
+	} else {
+		map = kgem_bo_map__wc(kgem, bo);
+		if (map)
+			kgem_bo_sync__gtt(kgem, bo);
+	}
+	if (map == NULL) {
+		kgem_bo_destroy(kgem, bo);
+		return false;
+	}
+
+	DBG(("%s: ring[%d] handle=%d [size=%d]\n",
+	     __FUNCTION__, n, bo->handle, bytes(bo)));
+	kgem->batch_ring.bo[n] = bo;
+	kgem->batch_ring.map[n] = map;
+	kgem->batch_ring.count++;
+	return true;
+}
+
+static bool kgem_init_batch_ring(struct kgem *kgem)
+{
+	if (DBG_NO_BATCH_RING)
+		return false;
+
+	if (kgem->wedged)
+		return false;
+
+	/* 830gm/845g must use the pinned batches, and 865g cannot span pages */
+	if (kgem->gen < 030)
+		return false;
+
+	if (!kgem->has_llc && !kgem->has_wc_mmap)
+		return false;
+
+	while (kgem->batch_ring.count < KGEM_BATCH_RING_MIN) {
+		if (!kgem_batch_ring_add(kgem)) {
+			while (kgem->batch_ring.count)
+				kgem_bo_destroy(kgem, kgem->batch_ring.bo[--kgem->batch_ring.count]);
+			return false;
+		}
+	}
+
+	kgem->batch_ring.current = 0;
+	kgem->batch = kgem->batch_ring.map[0];
+	return true;
+}
+
+/* Move on to the next bo in the ring for the following batch. If it is
+ * still busy, insert a new bo ahead of it until the ring is full, and
+ * only then wait.
+ */
+static void kgem_batch_ring_next(struct kgem *kgem)
+{
+	struct kgem_bo *bo;
+	int n;
+
+	n = kgem->batch_ring.current + 1;
+	if (n == kgem->batch_ring.count)
+		n = 0;
+
+	bo = kgem->batch_ring.bo[n];
+	if (bo->rq && __kgem_busy(kgem, bo->handle)) {
+		if (kgem->batch_ring.count < KGEM_BATCH_RING_MAX &&
+		    kgem_batch_ring_add(kgem)) {
+			int last = kgem->batch_ring.count - 1;
+			uint32_t *map = kgem->batch_ring.map[last];
+
+			bo = kgem->batch_ring.bo[last];
+			memmove(&kgem->batch_ring.bo[n + 1],
+				&kgem->batch_ring.bo[n],
+				(last - n) * sizeof(bo));
+			memmove(&kgem->batch_ring.map[n + 1],
+				&kgem->batch_ring.map[n],
+				(last - n) * sizeof(map));
+			kgem->batch_ring.bo[n] = bo;
+			kgem->batch_ring.map[n] = map;
+		} else {
+			DBG(("%s: waiting for ring[%d] handle=%d\n",
+			     __FUNCTION__, n, bo->handle));
+			kgem->batch_ring.waits++;
+			if (kgem_bo_wait(kgem, bo))
+				/* Only a dead GPU leaves it busy, forget it */
+				__kgem_set_wedged(kgem);
+		}
+	}
+	if (bo->rq)
+		__kgem_retire_requests_upto(kgem, bo);
+	assert(bo->rq == NULL);
+	assert(bo->refcnt == 1);
+
+	DBG(("%s: ring[%d] handle=%d, %d in ring\n",
+	     __FUNCTION__, n, bo->handle, kgem->batch_ring.count));
+	kgem->batch_ring.current = n;
+	kgem->batch = kgem->batch_ring.map[n];
+}
+
 static void
 no_retire(struct kgem *kgem)
 {
@@ -1915,10 +2347,10 @@ static uint64_t get_gtt_size(int fd)
 
 	memset(&p, 0, sizeof(p));
 	p.param = LOCAL_CONTEXT_PARAM_GTT_SIZE;
-	if (drmIoctl(fd, LOCAL_IOCTL_I915_GEM_CONTEXT_GETPARAM, &p) == 0)
+	if (do_ioctl(fd, LOCAL_IOCTL_I915_GEM_CONTEXT_GETPARAM, &p) == 0)
 		aperture.aper_size = p.value;
 	if (aperture.aper_size == 0)
-		(void)drmIoctl(fd, DRM_IOCTL_I915_GEM_GET_APERTURE, &aperture);
+		(void)do_ioctl(fd, DRM_IOCTL_I915_GEM_GET_APERTURE, &aperture);
 	if (aperture.aper_size == 0)
 		aperture.aper_size = 64*1024*1024;
 
@@ -1950,6 +2382,12 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	kgem->expire = no_expire;
 	kgem->context_switch = no_context_switch;
 
+	kgem->exec = kgem->exec__inline;
+	kgem->max_exec = ARRAY_SIZE(kgem->exec__inline);
+	kgem->reloc = kgem->reloc__inline;
+	kgem->max_reloc = ARRAY_SIZE(kgem->reloc__inline);
+	kgem->exec_serial = 1;
+
 	list_init(&kgem->requests[0]);
 	list_init(&kgem->requests[1]);
 	list_init(&kgem->batch_buffers);
@@ -2019,6 +2457,10 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	DBG(("%s: has handle-lut? %d\n", __FUNCTION__,
 	     kgem->has_handle_lut));
 
+	kgem->has_softpin = test_has_softpin(kgem);
+	DBG(("%s: has softpin? %d\n", __FUNCTION__,
+	     kgem->has_softpin));
+
 	kgem->has_semaphores = false;
 	if (kgem->has_blt && test_has_semaphores_enabled(kgem))
 		kgem->has_semaphores = true;
@@ -2082,7 +2524,8 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 
 	DBG(("%s: maximum batch size? %d\n", __FUNCTION__,
 	     kgem->batch_size));
-	kgem_new_batch(kgem);
+	if (!kgem_init_batch_ring(kgem))
+		kgem_new_batch(kgem);
 
 	kgem->half_cpu_cache_pages = cpu_cache_size() >> 13;
 	DBG(("%s: last-level cache size: %d bytes, threshold in pages: %d\n",
@@ -2156,6 +2599,11 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 
 	kgem->max_cpu_size = kgem->max_object_size;
 
+	kgem->cache_budget.limit = totalram / 16;
+	kgem->cache_budget.pressure_fd = kgem_open_memory_pressure();
+	DBG(("%s: inactive cache limit=%lld, memory pressure fd=%d\n", __FUNCTION__,
+	     (long long)kgem->cache_budget.limit, kgem->cache_budget.pressure_fd));
+
 	half_gpu_max = kgem->max_gpu_size / 2;
 	kgem->max_copy_tile_size = (MAX_CACHE_SIZE + 1)/2;
 	if (kgem->max_copy_tile_size > half_gpu_max)
@@ -2208,6 +2656,12 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	kgem->aperture_high /= PAGE_SIZE;
 	kgem->aperture_total /= PAGE_SIZE;
 
+	if (kgem->has_softpin) {
+		/* keep 0 as the unknown presumed_offset */
+		kgem->va.next = PAGE_SIZE;
+		kgem->va.end = (uint64_t)kgem->aperture_total * PAGE_SIZE;
+	}
+
 	kgem->fence_max = gem_param(kgem, I915_PARAM_NUM_FENCES_AVAIL) - 2;
 	if ((int)kgem->fence_max < 0)
 		kgem->fence_max = 5; /* minimum safe value for all hw */
@@ -2451,25 +2905,82 @@ static uint32_t kgem_aligned_height(struct kgem *kgem,
 	return ALIGN(height, tile_height);
 }
 
+static struct kgem_exec_hash *
+kgem_exec_hash_lookup(struct kgem *kgem, uint32_t handle)
+{
+	const unsigned mask = ARRAY_SIZE(kgem->exec_hash) - 1;
+	unsigned i = (handle * 0x9e3779b1) >> (32 - KGEM_EXEC_HASH_BITS);
+
+	/* Returns either the entry for handle, or the free slot to use */
+	for (;;) {
+		struct kgem_exec_hash *h = &kgem->exec_hash[i];
+		if (h->serial != kgem->exec_serial || h->handle == handle)
+			return h;
+		i = (i + 1) & mask;
+	}
+}
+
 static struct drm_i915_gem_exec_object2 *
 kgem_add_handle(struct kgem *kgem, struct kgem_bo *bo)
 {
 	struct drm_i915_gem_exec_object2 *exec;
+	struct kgem_exec_hash *h;
 
 	DBG(("%s: handle=%d, index=%d\n",
 	     __FUNCTION__, bo->handle, kgem->nexec));
 
-	assert(kgem->nexec < ARRAY_SIZE(kgem->exec));
+	/* Objects imported by name or prime share the handle of an
+	 * existing bo, and the kernel rejects an execbuffer that lists a
+	 * handle twice.
+	 */
+	h = kgem_exec_hash_lookup(kgem, bo->handle);
+	if (h->serial == kgem->exec_serial) {
+		DBG(("%s: handle=%d already in batch, index=%d\n",
+		     __FUNCTION__, bo->handle, h->index));
+		assert(h->index < kgem->nexec);
+		exec = &kgem->exec[h->index];
+		assert(exec->handle == bo->handle);
+
+		/* The object is wherever the first bo placed (or pinned) it,
+		 * so give up our own address to agree with it.
+		 */
+		if (bo->softpin && bo->presumed_offset != exec->offset)
+			kgem_bo_release_va(kgem, bo);
+		bo->presumed_offset = exec->offset;
+		assert(!bo->softpin || exec->flags & LOCAL_EXEC_OBJECT_PINNED);
+
+		bo->target_handle = kgem->has_handle_lut ? h->index : bo->handle;
+		return exec;
+	}
+
+	assert(kgem->nexec < kgem->max_exec);
+	h->handle = bo->handle;
+	h->index = kgem->nexec;
+	h->serial = kgem->exec_serial;
+
 	bo->target_handle = kgem->has_handle_lut ? kgem->nexec : bo->handle;
 	exec = memset(&kgem->exec[kgem->nexec++], 0, sizeof(*exec));
 	exec->handle = bo->handle;
-	exec->offset = bo->presumed_offset;
+	kgem_exec_set_offset(kgem, exec, bo);
 
 	kgem->aperture += num_pages(bo);
 
 	return exec;
 }
 
+#ifndef NDEBUG
+static bool kgem_exec_is_shared(struct kgem *kgem, struct kgem_bo *bo)
+{
+	struct kgem_bo *other;
+
+	list_for_each_entry(other, &kgem->next_request->buffers, request)
+		if (other != bo && other->exec == bo->exec)
+			return true;
+
+	return false;
+}
+#endif
+
 static void kgem_add_bo(struct kgem *kgem, struct kgem_bo *bo)
 {
 	assert(bo->refcnt);
@@ -2486,6 +2997,73 @@ static void kgem_add_bo(struct kgem *kgem, struct kgem_bo *bo)
 	kgem->flush |= bo->flush;
 }
 
+static unsigned grow_capacity(unsigned max, unsigned needed)
+{
+	while (max < needed)
+		max *= 2;
+	return max;
+}
+
+bool __kgem_grow_exec(struct kgem *kgem, int n)
+{
+	struct drm_i915_gem_exec_object2 *exec;
+	struct kgem_bo *bo;
+	unsigned max;
+
+	max = grow_capacity(kgem->max_exec,
+			    kgem->nexec + n + KGEM_EXEC_RESERVED);
+	DBG(("%s: nexec=%d + %d, growing from %d to %d\n",
+	     __FUNCTION__, kgem->nexec, n, kgem->max_exec, max));
+	if (max > KGEM_MAX_EXEC)
+		return __kgem_flush_for(kgem, KGEM_FLUSH_EXEC);
+
+	if (kgem->exec == kgem->exec__inline) {
+		exec = malloc(max * sizeof(*exec));
+		if (exec)
+			memcpy(exec, kgem->exec, kgem->nexec * sizeof(*exec));
+	} else
+		exec = realloc(kgem->exec, max * sizeof(*exec));
+	if (exec == NULL)
+		return __kgem_flush_for(kgem, KGEM_FLUSH_EXEC);
+
+	/* Every bo in the batch points into the old array */
+	list_for_each_entry(bo, &kgem->next_request->buffers, request) {
+		if (bo->exec >= kgem->exec &&
+		    bo->exec < kgem->exec + kgem->nexec)
+			bo->exec = exec + (bo->exec - kgem->exec);
+	}
+
+	kgem->exec = exec;
+	kgem->max_exec = max;
+	return true;
+}
+
+bool __kgem_grow_reloc(struct kgem *kgem, int n)
+{
+	struct drm_i915_gem_relocation_entry *reloc;
+	unsigned max;
+
+	max = grow_capacity(kgem->max_reloc,
+			    kgem->nreloc + n + KGEM_RELOC_RESERVED);
+	DBG(("%s: nreloc=%d + %d, growing from %d to %d\n",
+	     __FUNCTION__, kgem->nreloc, n, kgem->max_reloc, max));
+	if (max > KGEM_MAX_RELOC)
+		return __kgem_flush_for(kgem, KGEM_FLUSH_RELOC);
+
+	if (kgem->reloc == kgem->reloc__inline) {
+		reloc = malloc(max * sizeof(*reloc));
+		if (reloc)
+			memcpy(reloc, kgem->reloc, kgem->nreloc * sizeof(*reloc));
+	} else
+		reloc = realloc(kgem->reloc, max * sizeof(*reloc));
+	if (reloc == NULL)
+		return __kgem_flush_for(kgem, KGEM_FLUSH_RELOC);
+
+	kgem->reloc = reloc;
+	kgem->max_reloc = max;
+	return true;
+}
+
 static void kgem_clear_swctrl(struct kgem *kgem)
 {
 	uint32_t *b;
@@ -2546,6 +3124,7 @@ static void kgem_bo_free(struct kgem *kgem, struct kgem_bo *bo)
 	kgem->debug_memory.bo_bytes -= bytes(bo);
 #endif
 
+	cache_budget_remove(kgem, bo);
 	kgem_bo_binding_free(kgem, bo);
 	kgem_bo_rmfb(kgem, bo);
 
@@ -2584,6 +3163,7 @@ static void kgem_bo_free(struct kgem *kgem, struct kgem_bo *bo)
 	_list_del(&bo->list);
 	_list_del(&bo->request);
 	gem_close(kgem->fd, bo->handle);
+	kgem_bo_release_va(kgem, bo);
 
 	if (!bo->io && !DBG_NO_MALLOC_CACHE) {
 		*(struct kgem_bo **)bo = __kgem_freed_bo;
@@ -2614,6 +3194,7 @@ inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
 	assert_caching(kgem, bo);
 	ASSERT_IDLE(kgem, bo->handle);
 
+	cache_budget_add(kgem, bo);
 	if (bucket(bo) >= NUM_CACHE_BUCKETS) {
 		if (bo->map__gtt) {
 			DBG(("%s: relinquishing large GTT mapping for handle=%d\n",
@@ -2622,7 +3203,7 @@ inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
 			bo->map__gtt = NULL;
 		}
 
-		list_move(&bo->list, &kgem->large_inactive);
+		large_cache_add(&kgem->large_inactive, bo);
 	} else {
 		assert(bo->flush == false);
 		assert(list_is_empty(&bo->vma));
@@ -2685,6 +3266,7 @@ inline static void kgem_bo_remove_from_inactive(struct kgem *kgem,
 {
 	DBG(("%s: removing handle=%d from inactive\n", __FUNCTION__, bo->handle));
 
+	cache_budget_remove(kgem, bo);
 	list_del(&bo->list);
 	assert(bo->rq == NULL);
 	assert(bo->exec == NULL);
@@ -3020,11 +3602,11 @@ static void __kgem_bo_destroy(struct kgem *kgem, struct kgem_bo *bo)
 		struct list *cache;
 
 		DBG(("%s: handle=%d -> active\n", __FUNCTION__, bo->handle));
-		if (bucket(bo) < NUM_CACHE_BUCKETS)
+		if (bucket(bo) < NUM_CACHE_BUCKETS) {
 			cache = &kgem->active[bucket(bo)][bo->tiling];
-		else
-			cache = &kgem->large;
-		list_add(&bo->list, cache);
+			list_add(&bo->list, cache);
+		} else
+			large_cache_add(&kgem->large, bo);
 		return;
 	}
 
@@ -3157,16 +3739,315 @@ static bool __kgem_bo_flush(struct kgem *kgem, struct kgem_bo *bo)
 	return true;
 }
 
-static bool __kgem_retire_rq(struct kgem *kgem, struct kgem_request *rq)
+static uint64_t trace_clock(void)
 {
-	bool retired = false;
+	struct timespec ts;
 
-	DBG(("%s: request %d complete\n",
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Never follow, nor reuse, whatever may already be waiting at the path */
+static int open_private(const char *path, int flags)
+{
+	flags |= O_CREAT | O_EXCL;
+#ifdef O_NOFOLLOW
+	flags |= O_NOFOLLOW;
+#endif
+#ifdef O_CLOEXEC
+	flags |= O_CLOEXEC;
+#endif
+
+	return open(path, flags, 0600);
+}
+
+bool kgem_trace_open(struct kgem *kgem, const char *path)
+{
+	struct kgem_trace *trace;
+	size_t size;
+	int fd;
+
+	size = sizeof(*trace) + KGEM_TRACE_SIZE * sizeof(trace->batch[0]);
+
+	fd = open_private(path, O_RDWR);
+	if (fd < 0)
+		return false;
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		unlink(path);
+		return false;
+	}
+
+	trace = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		unlink(path);
+		return false;
+	}
+
+	kgem->trace_path = strdup(path);
+	if (kgem->trace_path == NULL) {
+		munmap(trace, size);
+		unlink(path);
+		return false;
+	}
+
+	trace->size = KGEM_TRACE_SIZE;
+	trace->pid = getpid();
+	trace->version = KGEM_TRACE_VERSION;
+	__sync_synchronize();
+	trace->magic = KGEM_TRACE_MAGIC;
+
+	kgem->trace = trace;
+	return true;
+}
+
+void kgem_trace_close(struct kgem *kgem)
+{
+	if (kgem->trace == NULL)
+		return;
+
+	munmap(kgem->trace,
+	       sizeof(*kgem->trace) +
+	       kgem->trace->size * sizeof(kgem->trace->batch[0]));
+	kgem->trace = NULL;
+
+	unlink(kgem->trace_path);
+	free(kgem->trace_path);
+	kgem->trace_path = NULL;
+}
+
+static void kgem_trace_submit(struct kgem *kgem,
+			      struct kgem_request *rq,
+			      const struct kgem_trace_batch *batch)
+{
+	struct kgem_trace *trace = kgem->trace;
+	struct kgem_trace_batch *b;
+	uint64_t n = trace->count;
+
+	b = &trace->batch[n & (trace->size - 1)];
+	b->seqno = 0;
+	__sync_synchronize();
+	*b = *batch;
+	__sync_synchronize();
+	b->seqno = n + 1;
+	trace->count = n + 1;
+
+	rq->trace = n + 1;
+}
+
+static void kgem_trace_retire(struct kgem *kgem, struct kgem_request *rq)
+{
+	struct kgem_trace_batch *b;
+
+	b = &kgem->trace->batch[(rq->trace - 1) & (kgem->trace->size - 1)];
+	if (b->seqno == rq->trace)
+		b->retire = trace_clock() - b->submit;
+}
+
+struct kgem_capture_file {
+	int fd;
+	uint32_t count;
+	char *buf;
+	size_t used, size;
+};
+
+bool kgem_capture_open(struct kgem *kgem, const char *path)
+{
+	struct kgem_capture_file *capture;
+	struct kgem_capture header;
+	int fd;
+
+	fd = open_private(path, O_WRONLY);
+	if (fd < 0)
+		return false;
+
+	header.magic = KGEM_CAPTURE_MAGIC;
+	header.version = KGEM_CAPTURE_VERSION;
+	header.gen = kgem->gen;
+	header.pid = getpid();
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		unlink(path);
+		return false;
+	}
+
+	capture = calloc(1, sizeof(*capture));
+	if (capture == NULL) {
+		close(fd);
+		unlink(path);
+		return false;
+	}
+
+	capture->fd = fd;
+	kgem->capture = capture;
+	return true;
+}
+
+void kgem_capture_close(struct kgem *kgem)
+{
+	struct kgem_capture_file *capture = kgem->capture;
+
+	if (capture == NULL)
+		return;
+
+	xf86DrvMsg(kgem_get_screen_index(kgem), X_INFO,
+		   "Captured %d batches\n", capture->count);
+
+	close(capture->fd);
+	free(capture->buf);
+	free(capture);
+	kgem->capture = NULL;
+}
+
+static void *kgem_capture_reserve(struct kgem_capture_file *capture,
+				  size_t len)
+{
+	void *ptr;
+
+	if (capture->used + len > capture->size) {
+		size_t size = ALIGN(capture->used + len, 64 << 10);
+		char *buf;
+
+		buf = realloc(capture->buf, size);
+		if (buf == NULL)
+			return NULL;
+
+		capture->buf = buf;
+		capture->size = size;
+	}
+
+	ptr = capture->buf + capture->used;
+	capture->used += len;
+	return ptr;
+}
+
+/* Record relocations against the index of their target in the exec list,
+ * without which the handles are meaningless outside of this process.
+ */
+static uint32_t kgem_capture_target(struct kgem *kgem, uint32_t target)
+{
+	int i;
+
+	if (kgem->has_handle_lut)
+		return target;
+
+	/* The exec hash is stale for the upload buffers that were shrunk */
+	for (i = 0; i < kgem->nexec; i++)
+		if (kgem->exec[i].handle == target)
+			return i;
+
+	assert(0);
+	return kgem->nexec - 1;
+}
+
+static void kgem_capture_submit(struct kgem *kgem,
+				struct kgem_request *rq,
+				uint32_t batch_end, uint32_t flags)
+{
+	struct kgem_capture_file *capture = kgem->capture;
+	struct kgem_capture_batch batch;
+	struct kgem_capture_exec *exec;
+	struct kgem_capture_reloc *reloc;
+	struct kgem_bo *bo;
+	size_t offset;
+	int i;
+
+	capture->used = 0;
+	if (kgem_capture_reserve(capture, sizeof(batch)) == NULL)
+		goto err;
+
+	exec = kgem_capture_reserve(capture, kgem->nexec * sizeof(*exec));
+	if (exec == NULL)
+		goto err;
+	for (i = 0; i < kgem->nexec; i++) {
+		exec[i].handle = kgem->exec[i].handle;
+		exec[i].size = 0;
+		exec[i].flags = kgem->exec[i].flags;
+		exec[i].tiling = 0;
+		exec[i].offset = kgem->exec[i].offset;
+	}
+
+	reloc = kgem_capture_reserve(capture, kgem->nreloc * sizeof(*reloc));
+	if (reloc == NULL)
+		goto err;
+	for (i = 0; i < kgem->nreloc; i++) {
+		reloc[i].offset = kgem->reloc[i].offset;
+		reloc[i].target = kgem_capture_target(kgem, kgem->reloc[i].target_handle);
+		reloc[i].delta = kgem->reloc[i].delta;
+		reloc[i].read_domains = kgem->reloc[i].read_domains;
+		reloc[i].write_domain = kgem->reloc[i].write_domain;
+	}
+
+	batch.nbo = 0;
+	list_for_each_entry(bo, &rq->buffers, request) {
+		struct kgem_capture_bo *data;
+		int size = kgem_bo_size(bo);
+
+		/* Handles shared through flink or prime appear only once */
+		i = bo->exec - kgem->exec;
+		assert(i >= 0 && i < kgem->nexec);
+		exec = (struct kgem_capture_exec *)(capture->buf + sizeof(batch));
+		if (exec[i].size)
+			continue;
+
+		exec[i].size = size;
+		exec[i].tiling = bo->tiling;
+
+		if (bo != rq->bo && size > KGEM_CAPTURE_MAX_BO)
+			continue;
+
+		offset = capture->used;
+		data = kgem_capture_reserve(capture, sizeof(*data) + ALIGN(size, 8));
+		if (data == NULL)
+			goto err;
+
+		data->index = i;
+		data->size = size;
+		if (gem_read(kgem->fd, bo->handle, data + 1, 0, size)) {
+			capture->used = offset;
+			continue;
+		}
+
+		batch.nbo++;
+	}
+
+	batch.length = capture->used;
+	batch.seqno = capture->count + 1;
+	batch.flags = flags;
+	batch.nbatch = batch_end;
+	batch.nexec = kgem->nexec;
+	batch.nreloc = kgem->nreloc;
+	batch.pad = 0;
+	memcpy(capture->buf, &batch, sizeof(batch));
+
+	/* A single write keeps the file parseable should the server die */
+	if (write(capture->fd, capture->buf, capture->used) != (ssize_t)capture->used)
+		goto err;
+
+	capture->count++;
+	return;
+
+err:
+	xf86DrvMsg(kgem_get_screen_index(kgem), X_WARNING,
+		   "Failed to record batch, stopping capture\n");
+	kgem_capture_close(kgem);
+}
+
+static bool __kgem_retire_rq(struct kgem *kgem, struct kgem_request *rq)
+{
+	bool retired = false;
+
+	DBG(("%s: request %d complete\n",
 	     __FUNCTION__, rq->bo->handle));
 	assert(RQ(rq->bo->rq) == rq);
 	assert(rq != (struct kgem_request *)kgem);
 	assert(rq != &kgem->static_request);
 
+	if (unlikely(rq->trace))
+		kgem_trace_retire(kgem, rq);
+
 	if (rq == kgem->fence[rq->ring])
 		kgem->fence[rq->ring] = NULL;
 
@@ -3275,6 +4156,7 @@ bool kgem_retire(struct kgem *kgem)
 
 	DBG(("%s, need_retire?=%d\n", __FUNCTION__, kgem->need_retire));
 
+	kgem_async_recover(kgem);
 	kgem->need_retire = false;
 
 	retired |= kgem_retire__flushing(kgem);
@@ -3482,10 +4364,16 @@ static void kgem_commit(struct kgem *kgem)
 		kgem_retire(kgem);
 		assert(list_is_empty(&rq->buffers));
 
-		assert(rq->bo->map__gtt == NULL);
-		assert(rq->bo->map__wc == NULL);
-		assert(rq->bo->map__cpu == NULL);
-		gem_close(kgem->fd, rq->bo->handle);
+		if (rq->bo->refcnt > 1) {
+			/* still held by the batch ring */
+			rq->bo->refcnt--;
+		} else {
+			assert(rq->bo->map__gtt == NULL);
+			assert(rq->bo->map__wc == NULL);
+			assert(rq->bo->map__cpu == NULL);
+			gem_close(kgem->fd, rq->bo->handle);
+			kgem_bo_release_va(kgem, rq->bo);
+		}
 		kgem_cleanup_cache(kgem);
 	} else {
 		assert(rq != (struct kgem_request *)kgem);
@@ -3605,6 +4493,7 @@ static void kgem_finish_buffers(struct kgem *kgem)
 
 					shrink->target_handle =
 						kgem->has_handle_lut ? bo->base.target_handle : shrink->handle;
+					kgem_exec_set_offset(kgem, bo->base.exec, shrink);
 					for (n = 0; n < kgem->nreloc; n++) {
 						if (kgem->reloc[n].target_handle == bo->base.target_handle) {
 							uint64_t addr = (int)kgem->reloc[n].delta + shrink->presumed_offset;
@@ -3618,7 +4507,6 @@ static void kgem_finish_buffers(struct kgem *kgem)
 					}
 
 					bo->base.exec->handle = shrink->handle;
-					bo->base.exec->offset = shrink->presumed_offset;
 					shrink->exec = bo->base.exec;
 					shrink->rq = bo->base.rq;
 					list_replace(&bo->base.request,
@@ -3653,6 +4541,7 @@ static void kgem_finish_buffers(struct kgem *kgem)
 							    0, bo->used, bo->mem) == 0) {
 					shrink->target_handle =
 						kgem->has_handle_lut ? bo->base.target_handle : shrink->handle;
+					kgem_exec_set_offset(kgem, bo->base.exec, shrink);
 					for (n = 0; n < kgem->nreloc; n++) {
 						if (kgem->reloc[n].target_handle == bo->base.target_handle) {
 							uint64_t addr = (int)kgem->reloc[n].delta + shrink->presumed_offset;
@@ -3666,7 +4555,6 @@ static void kgem_finish_buffers(struct kgem *kgem)
 					}
 
 					bo->base.exec->handle = shrink->handle;
-					bo->base.exec->offset = shrink->presumed_offset;
 					shrink->exec = bo->base.exec;
 					shrink->rq = bo->base.rq;
 					list_replace(&bo->base.request,
@@ -3707,6 +4595,8 @@ static void kgem_cleanup(struct kgem *kgem)
 {
 	int n;
 
+	kgem_async_drain(kgem);
+
 	for (n = 0; n < ARRAY_SIZE(kgem->requests); n++) {
 		while (!list_is_empty(&kgem->requests[n])) {
 			struct kgem_request *rq;
@@ -3876,6 +4766,10 @@ void kgem_reset(struct kgem *kgem)
 	kgem->nfence = 0;
 	kgem->nexec = 0;
 	kgem->nreloc = 0;
+	if (++kgem->exec_serial == 0) {
+		memset(kgem->exec_hash, 0, sizeof(kgem->exec_hash));
+		kgem->exec_serial = 1;
+	}
 	kgem->nreloc__self = 0;
 	kgem->aperture = 0;
 	kgem->aperture_fenced = 0;
@@ -3910,6 +4804,28 @@ static int compact_batch_surface(struct kgem *kgem, int *shrink)
 	return size * sizeof(uint32_t);
 }
 
+/* With the batch softpinned, kgem_fixup_relocs() has already written the
+ * final address of every self-relocation, so only those targeting other
+ * objects that could not be pinned need be passed to the kernel.
+ */
+static int kgem_discard_self_relocs(struct kgem *kgem, struct kgem_bo *batch)
+{
+	int n, count = 0;
+
+	for (n = 0; n < kgem->nreloc; n++) {
+		if (kgem->reloc[n].target_handle == batch->target_handle)
+			continue;
+
+		if (count != n)
+			kgem->reloc[count] = kgem->reloc[n];
+		count++;
+	}
+
+	DBG(("%s: %d of %d relocations remain\n",
+	     __FUNCTION__, count, kgem->nreloc));
+	return kgem->nreloc = count;
+}
+
 static struct kgem_bo *first_available(struct kgem *kgem, struct list *list)
 {
 	struct kgem_bo *bo;
@@ -3942,6 +4858,20 @@ kgem_create_batch(struct kgem *kgem)
 	struct kgem_bo *bo;
 	int size, shrink = 0;
 
+	if (kgem->batch_ring.count) {
+		/* The batch was written in place, so submit it as it is */
+		bo = kgem->batch_ring.bo[kgem->batch_ring.current];
+		assert(kgem->batch == kgem->batch_ring.map[kgem->batch_ring.current]);
+		kgem_fixup_relocs(kgem, bo, 0);
+		if (!kgem->has_llc)
+			__sync_synchronize(); /* drain the WC buffers */
+
+		/* kgem->batch is left in place for the debug dumps, and
+		 * only moves on after submission, see _kgem_submit().
+		 */
+		return kgem_bo_reference(bo);
+	}
+
 #if !DBG_NO_SHRINK_BATCHES
 	if (kgem->surface != kgem->batch_size)
 		size = compact_batch_surface(kgem, &shrink);
@@ -4102,8 +5032,504 @@ retry:
 	return ret;
 }
 
+/* Asynchronous submission: the execbuffer ioctl is handed over to a
+ * thread, along with copies of the exec and relocation arrays, so that
+ * the main thread can return to the clients whilst the kernel relocates
+ * and queues the batch.
+ *
+ * To the kernel, a batch still in the queue has not happened, so every
+ * ioctl that may observe or depend upon the state of an object first
+ * waits for the batches using that object (kgem_async_sync()), as does
+ * kgem_bo_submit(); ioctls that are not about a single object wait for
+ * the whole queue. Batches that are shared with other processes are
+ * still submitted synchronously.
+ *
+ * Those waits may be made from anywhere, including from the middle of a
+ * walk over the bo caches, and so may only retry a batch that failed.
+ * Making room by discarding the caches is left to kgem_async_recover(),
+ * called from kgem_retire() and _kgem_submit().
+ */
+#define KGEM_ASYNC_DEPTH 8
+
+struct kgem_async_job {
+	struct drm_i915_gem_execbuffer2 execbuf;
+	struct drm_i915_gem_exec_object2 *exec;
+	struct drm_i915_gem_relocation_entry *reloc;
+	unsigned max_exec, max_reloc;
+	struct kgem_request *rq;
+	uint32_t trace;
+	uint32_t elapsed;
+	int ret;
+};
+
+struct kgem_async {
+	struct kgem *kgem;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t work, idle;
+
+	/* queued and reaped are only written by the main thread, done and
+	 * stalled by the submission thread, all under the mutex.
+	 */
+	unsigned queued, done, reaped;
+	bool stalled;
+	bool draining;
+	bool quit;
+
+	struct kgem_async_job job[KGEM_ASYNC_DEPTH];
+};
+
+static void *kgem_async_thread(void *arg)
+{
+	struct kgem_async *async = arg;
+	int fd = async->kgem->fd;
+
+	pthread_mutex_lock(&async->mutex);
+	for (;;) {
+		struct kgem_async_job *job;
+		uint64_t start;
+
+		while ((async->done == async->queued || async->stalled) &&
+		       !async->quit)
+			pthread_cond_wait(&async->work, &async->mutex);
+		if (async->quit)
+			break;
+
+		job = &async->job[async->done % KGEM_ASYNC_DEPTH];
+		pthread_mutex_unlock(&async->mutex);
+
+		start = trace_clock();
+		job->ret = 0;
+		if (backend->ioctl(fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, &job->execbuf))
+			job->ret = __do_ioctl(fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, &job->execbuf);
+		job->elapsed = trace_clock() - start;
+
+		pthread_mutex_lock(&async->mutex);
+		async->done++;
+		/* keep the order of submission, leave the error to the caller */
+		async->stalled = job->ret < 0;
+		pthread_cond_signal(&async->idle);
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	return NULL;
+}
+
+/* As do_execbuf(), but the batches queued behind this one have not yet
+ * been submitted and so none of the requests may be retired; just free
+ * the idle buffers held in the caches and try again.
+ */
+static bool kgem_async_evict(struct kgem *kgem)
+{
+	bool freed = false;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
+		while (!list_is_empty(&kgem->inactive[i])) {
+			kgem_bo_free(kgem,
+				     list_last_entry(&kgem->inactive[i],
+						     struct kgem_bo, list));
+			freed = true;
+		}
+	}
+
+	while (!list_is_empty(&kgem->large_inactive)) {
+		kgem_bo_free(kgem,
+			     list_first_entry(&kgem->large_inactive,
+					      struct kgem_bo, list));
+		freed = true;
+	}
+
+	while (!list_is_empty(&kgem->snoop)) {
+		kgem_bo_free(kgem,
+			     list_last_entry(&kgem->snoop,
+					     struct kgem_bo, list));
+		freed = true;
+	}
+
+	return freed;
+}
+
+static int kgem_async_resubmit(struct kgem *kgem, struct kgem_async_job *job,
+			       bool evict)
+{
+	int ret = job->ret;
+
+	DBG(("%s: handle=%d failed ret=%d, evict? %d\n",
+	     __FUNCTION__, job->rq->bo->handle, ret, evict));
+
+	if (ret != -ENOSPC && ret != -EBUSY)
+		return ret;
+
+	/* The batches before this one may have since freed enough space */
+	ret = do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, &job->execbuf);
+	while (evict && (ret == -ENOSPC || ret == -EBUSY)) {
+		if (!kgem_async_evict(kgem))
+			break;
+
+		ret = do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2,
+			       &job->execbuf);
+	}
+
+	return ret;
+}
+
+static void kgem_async_complete(struct kgem *kgem, struct kgem_async_job *job,
+				bool evict)
+{
+	struct kgem_bo *bo;
+
+	DBG(("%s: handle=%d, ret=%d, elapsed=%dns\n",
+	     __FUNCTION__, job->rq->bo->handle, job->ret, job->elapsed));
+
+	if (job->trace) {
+		struct kgem_trace_batch *b;
+
+		b = &kgem->trace->batch[(job->trace - 1) & (kgem->trace->size - 1)];
+		if (b->seqno == job->trace)
+			b->execbuf = job->elapsed;
+	}
+
+	if (job->ret < 0 && !kgem->wedged)
+		job->ret = kgem_async_resubmit(kgem, job, evict);
+
+	if (job->ret < 0) {
+		if (!kgem->wedged) {
+			xf86DrvMsg(kgem_get_screen_index(kgem), X_ERROR,
+				   "Failed to submit rendering commands (%s), disabling acceleration.\n",
+				   strerror(-job->ret));
+			__kgem_set_wedged(kgem);
+		}
+		return;
+	}
+
+	/* Pick up where the kernel placed the objects, as kgem_commit()
+	 * could only use the offsets we presumed. Objects since added to
+	 * another batch have left rq->buffers, and so the target_handle of
+	 * those remaining is still their index into this execbuffer.
+	 */
+	list_for_each_entry(bo, &job->rq->buffers, request) {
+		unsigned idx = bo->target_handle;
+
+		if (bo->proxy == NULL &&
+		    idx < job->execbuf.buffer_count &&
+		    job->exec[idx].handle == bo->handle)
+			bo->presumed_offset = job->exec[idx].offset;
+	}
+}
+
+/* Wait for the batches before upto. Only when called from a point where
+ * we know that no one is walking the bo caches may evict be set, to
+ * free those caches to make room for a batch that failed.
+ */
+static void kgem_async_reap(struct kgem_async *async, unsigned upto,
+			    bool evict)
+{
+	struct kgem *kgem = async->kgem;
+
+	async->draining = true;
+	do {
+		bool stalled;
+		unsigned done;
+
+		pthread_mutex_lock(&async->mutex);
+		while ((int)(async->done - upto) < 0 && !async->stalled)
+			pthread_cond_wait(&async->idle, &async->mutex);
+		done = async->done;
+		stalled = async->stalled;
+		pthread_mutex_unlock(&async->mutex);
+
+		while (async->reaped != done)
+			kgem_async_complete(kgem,
+					    &async->job[async->reaped++ % KGEM_ASYNC_DEPTH],
+					    evict);
+
+		if (stalled) {
+			pthread_mutex_lock(&async->mutex);
+			if (kgem->wedged) {
+				/* discard the rest of the queue */
+				async->done = async->reaped = async->queued;
+			} else {
+				/* resubmitted, so carry on with the rest */
+				pthread_cond_signal(&async->work);
+			}
+			async->stalled = false;
+			pthread_mutex_unlock(&async->mutex);
+		}
+	} while ((int)(async->reaped - upto) < 0);
+	async->draining = false;
+}
+
+static void __kgem_async_drain(struct kgem_async *async, bool evict)
+{
+	if (async->reaped != async->queued && !async->draining) {
+		DBG(("%s: waiting for %d batches\n", __FUNCTION__,
+		     async->queued - async->reaped));
+		kgem_async_reap(async, async->queued, evict);
+	}
+}
+
+void kgem_async_drain(struct kgem *kgem)
+{
+	if (kgem->async)
+		__kgem_async_drain(kgem->async, false);
+}
+
+/* Returns the end of the last batch in the queue to use the handle */
+static unsigned kgem_async_pending(struct kgem_async *async, uint32_t handle)
+{
+	unsigned n, i, upto = async->reaped;
+
+	for (n = async->reaped; n != async->queued; n++) {
+		const struct kgem_async_job *job = &async->job[n % KGEM_ASYNC_DEPTH];
+		for (i = 0; i < job->execbuf.buffer_count; i++) {
+			if (job->exec[i].handle == handle) {
+				upto = n + 1;
+				break;
+			}
+		}
+	}
+
+	return upto;
+}
+
+static void kgem_async_wait_handle(struct kgem_async *async, uint32_t handle)
+{
+	unsigned upto;
+
+	if (async->draining)
+		return;
+
+	upto = kgem_async_pending(async, handle);
+	if (upto != async->reaped) {
+		DBG(("%s: handle=%d, waiting for %d batches\n", __FUNCTION__,
+		     handle, upto - async->reaped));
+		kgem_async_reap(async, upto, false);
+	}
+}
+
+void kgem_async_wait(struct kgem *kgem, struct kgem_bo *bo)
+{
+	if (kgem->async == NULL)
+		return;
+
+	while (bo->proxy)
+		bo = bo->proxy;
+
+	kgem_async_wait_handle(kgem->async, bo->handle);
+}
+
+/* Free the caches and resubmit should a batch have failed, and reap
+ * any others that have completed. Only called where no one can be
+ * walking the bo caches.
+ */
+static void kgem_async_recover(struct kgem *kgem)
+{
+	struct kgem_async *async = kgem->async;
+	unsigned done;
+
+	if (async == NULL || async->reaped == async->queued || async->draining)
+		return;
+
+	pthread_mutex_lock(&async->mutex);
+	done = async->done;
+	pthread_mutex_unlock(&async->mutex);
+
+	if (done != async->reaped)
+		kgem_async_reap(async, done, true);
+}
+
+static void kgem_async_sync(int fd, unsigned long req, void *arg)
+{
+	struct kgem_async *async = async_submit;
+
+	if (async->kgem->fd != fd || async->reaped == async->queued)
+		return;
+
+	switch (req) {
+	/* These neither touch the contents of an existing object, nor
+	 * report on its busyness, so need not wait for the queue.
+	 */
+	case DRM_IOCTL_I915_GEM_CREATE:
+	case DRM_IOCTL_I915_GEM_MMAP:
+	case DRM_IOCTL_I915_GEM_MMAP_GTT:
+	case DRM_IOCTL_I915_GEM_MADVISE:
+	case DRM_IOCTL_I915_GETPARAM:
+	case DRM_IOCTL_I915_GEM_GET_APERTURE:
+		return;
+
+	/* These only concern the one object, and so need only wait for
+	 * the batches using it, e.g. the next batch is uploaded into an
+	 * idle bo and freeing the caches never waits at all.
+	 */
+	case DRM_IOCTL_GEM_CLOSE:
+		kgem_async_wait_handle(async, ((struct drm_gem_close *)arg)->handle);
+		return;
+	case DRM_IOCTL_I915_GEM_BUSY:
+		kgem_async_wait_handle(async, ((struct drm_i915_gem_busy *)arg)->handle);
+		return;
+	case DRM_IOCTL_I915_GEM_SET_TILING:
+		kgem_async_wait_handle(async, ((struct drm_i915_gem_set_tiling *)arg)->handle);
+		return;
+	case DRM_IOCTL_I915_GEM_GET_TILING:
+		kgem_async_wait_handle(async, ((struct drm_i915_gem_get_tiling *)arg)->handle);
+		return;
+	case DRM_IOCTL_I915_GEM_SET_DOMAIN:
+		kgem_async_wait_handle(async, ((struct drm_i915_gem_set_domain *)arg)->handle);
+		return;
+	case DRM_IOCTL_I915_GEM_SW_FINISH:
+		kgem_async_wait_handle(async, ((struct drm_i915_gem_sw_finish *)arg)->handle);
+		return;
+	case DRM_IOCTL_I915_GEM_PREAD:
+		kgem_async_wait_handle(async, ((struct drm_i915_gem_pread *)arg)->handle);
+		return;
+	case DRM_IOCTL_I915_GEM_PWRITE:
+		kgem_async_wait_handle(async, ((struct drm_i915_gem_pwrite *)arg)->handle);
+		return;
+	}
+
+	__kgem_async_drain(async, false);
+}
+
+static bool kgem_async_queue(struct kgem *kgem,
+			     struct drm_i915_gem_execbuffer2 *execbuf)
+{
+	struct kgem_async *async = kgem->async;
+	struct kgem_async_job *job;
+
+	kgem_async_recover(kgem);
+	if (async->queued - async->reaped == KGEM_ASYNC_DEPTH)
+		kgem_async_reap(async, async->reaped + 1, true);
+
+	job = &async->job[async->queued % KGEM_ASYNC_DEPTH];
+	if (kgem->nexec > job->max_exec) {
+		void *ptr = realloc(job->exec, kgem->max_exec * sizeof(*job->exec));
+		if (ptr == NULL)
+			return false;
+		job->exec = ptr;
+		job->max_exec = kgem->max_exec;
+	}
+	if (kgem->nreloc > job->max_reloc) {
+		void *ptr = realloc(job->reloc, kgem->max_reloc * sizeof(*job->reloc));
+		if (ptr == NULL)
+			return false;
+		job->reloc = ptr;
+		job->max_reloc = kgem->max_reloc;
+	}
+
+	memcpy(job->exec, kgem->exec, kgem->nexec * sizeof(*job->exec));
+	memcpy(job->reloc, kgem->reloc, kgem->nreloc * sizeof(*job->reloc));
+	job->exec[kgem->nexec - 1].relocs_ptr = (uintptr_t)job->reloc;
+
+	job->execbuf = *execbuf;
+	job->execbuf.buffers_ptr = (uintptr_t)job->exec;
+	job->rq = kgem->next_request;
+	job->trace = kgem->trace ? kgem->trace->count + 1 : 0;
+
+	pthread_mutex_lock(&async->mutex);
+	async->queued++;
+	pthread_cond_signal(&async->work);
+	pthread_mutex_unlock(&async->mutex);
+
+	DBG(("%s: queued batch handle=%d, %d in flight\n", __FUNCTION__,
+	     job->rq->bo->handle, async->queued - async->reaped));
+	return true;
+}
+
+static bool kgem_can_submit_async(struct kgem *kgem)
+{
+	if (kgem->async == NULL || DEBUG_SYNC || SHOW_BATCH_AFTER)
+		return false;
+
+	/* Shared with the clients or another device */
+	if (kgem->flush)
+		return false;
+
+	/* Leave the batches that may exhaust the aperture to the
+	 * synchronous path, which knows how to make room and retry.
+	 */
+	if (kgem->aperture > kgem->aperture_high / 2)
+		return false;
+
+	return true;
+}
+
+bool kgem_enable_async_submit(struct kgem *kgem)
+{
+	struct kgem_async *async;
+	sigset_t signals, old;
+	int err;
+
+	if (async_submit || kgem->wedged)
+		return false;
+
+	/* Refreshing the presumed offsets afterwards relies on target_handle
+	 * being the execbuffer index.
+	 */
+	if (!kgem->has_handle_lut)
+		return false;
+
+	async = calloc(1, sizeof(*async));
+	if (async == NULL)
+		return false;
+
+	async->kgem = kgem;
+	pthread_mutex_init(&async->mutex, NULL);
+	pthread_cond_init(&async->work, NULL);
+	pthread_cond_init(&async->idle, NULL);
+
+	/* Leave the signals X uses for IO to the main thread */
+	sigfillset(&signals);
+	pthread_sigmask(SIG_SETMASK, &signals, &old);
+	err = pthread_create(&async->thread, NULL, kgem_async_thread, async);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		pthread_cond_destroy(&async->idle);
+		pthread_cond_destroy(&async->work);
+		pthread_mutex_destroy(&async->mutex);
+		free(async);
+		return false;
+	}
+
+	kgem->async = async;
+	async_submit = async;
+	return true;
+}
+
+void kgem_disable_async_submit(struct kgem *kgem)
+{
+	struct kgem_async *async = kgem->async;
+	int n;
+
+	if (async == NULL)
+		return;
+
+	__kgem_async_drain(async, true);
+
+	pthread_mutex_lock(&async->mutex);
+	async->quit = true;
+	pthread_cond_signal(&async->work);
+	pthread_mutex_unlock(&async->mutex);
+	pthread_join(async->thread, NULL);
+
+	pthread_cond_destroy(&async->idle);
+	pthread_cond_destroy(&async->work);
+	pthread_mutex_destroy(&async->mutex);
+
+	for (n = 0; n < KGEM_ASYNC_DEPTH; n++) {
+		free(async->job[n].exec);
+		free(async->job[n].reloc);
+	}
+	free(async);
+
+	kgem->async = NULL;
+	if (async_submit == async)
+		async_submit = NULL;
+}
+
 void _kgem_submit(struct kgem *kgem)
 {
+	struct kgem_trace_batch trace;
 	struct kgem_request *rq;
 	uint32_t batch_end;
 	int i, ret;
@@ -4125,10 +5551,24 @@ void _kgem_submit(struct kgem *kgem)
 
 	assert(kgem->nbatch <= kgem->batch_size);
 	assert(kgem->nbatch <= kgem->surface);
-	assert(kgem->nreloc <= ARRAY_SIZE(kgem->reloc));
-	assert(kgem->nexec < ARRAY_SIZE(kgem->exec));
+	assert(kgem->nreloc <= kgem->max_reloc);
+	assert(kgem->nexec < kgem->max_exec);
 	assert(kgem->nfence <= kgem->fence_max);
 
+	if (unlikely(kgem->trace)) {
+		trace.aperture = kgem->aperture;
+		trace.nbatch = kgem->nbatch;
+		trace.nreloc = kgem->nreloc;
+		trace.nexec = kgem->nexec;
+		trace.ring = kgem->ring;
+		trace.reason = kgem->flush_reason;
+		trace.retire = 0;
+		trace.seqno = 0;
+	}
+
+	kgem->flush_stats[kgem->flush_reason]++;
+	kgem->flush_reason = KGEM_FLUSH_OTHER;
+
 	kgem_finish_buffers(kgem);
 
 #if SHOW_BATCH_BEFORE
@@ -4149,9 +5589,14 @@ void _kgem_submit(struct kgem *kgem)
 		kgem->exec[i].relocation_count = kgem->nreloc;
 		kgem->exec[i].relocs_ptr = (uintptr_t)kgem->reloc;
 		kgem->exec[i].alignment = 0;
-		kgem->exec[i].offset = rq->bo->presumed_offset;
 		/* Make sure the kernel releases any fence, ignored if gen4+ */
 		kgem->exec[i].flags = EXEC_OBJECT_NEEDS_FENCE;
+		kgem_exec_set_offset(kgem, &kgem->exec[i], rq->bo);
+		if (rq->bo->softpin && !kgem->capture) {
+			assert(kgem->exec[i].flags & LOCAL_EXEC_OBJECT_PINNED);
+			kgem->exec[i].relocation_count =
+				kgem_discard_self_relocs(kgem, rq->bo);
+		}
 		kgem->exec[i].rsvd1 = 0;
 		kgem->exec[i].rsvd2 = 0;
 
@@ -4167,6 +5612,9 @@ void _kgem_submit(struct kgem *kgem)
 			execbuf.batch_len = batch_end*sizeof(uint32_t);
 		execbuf.flags = kgem->ring | kgem->batch_flags;
 
+		if (unlikely(kgem->capture))
+			kgem_capture_submit(kgem, rq, batch_end, execbuf.flags);
+
 		if (DBG_DUMP) {
 			int fd = open("/tmp/i915-batchbuffers.dump",
 				      O_WRONLY | O_CREAT | O_APPEND,
@@ -4177,7 +5625,22 @@ void _kgem_submit(struct kgem *kgem)
 			}
 		}
 
-		ret = do_execbuf(kgem, &execbuf);
+		if (unlikely(kgem->trace))
+			trace.submit = trace_clock();
+
+		/* The time in the ioctl is filled in upon completion */
+		if (kgem_can_submit_async(kgem) &&
+		    kgem_async_queue(kgem, &execbuf)) {
+			trace.execbuf = 0;
+			ret = 0;
+		} else {
+			ret = do_execbuf(kgem, &execbuf);
+			if (unlikely(kgem->trace))
+				trace.execbuf = trace_clock() - trace.submit;
+		}
+
+		if (unlikely(kgem->trace) && ret == 0)
+			kgem_trace_submit(kgem, rq, &trace);
 	} else
 		ret = -ENOMEM;
 
@@ -4269,6 +5732,9 @@ void _kgem_submit(struct kgem *kgem)
 		kgem_commit(kgem);
 	}
 
+	if (kgem->batch_ring.count)
+		kgem_batch_ring_next(kgem);
+
 	if (unlikely(kgem->wedged))
 		kgem_cleanup(kgem);
 
@@ -4300,60 +5766,231 @@ static void kgem_purge_cache(struct kgem *kgem)
 	struct kgem_bo *bo, *next;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
-		list_for_each_entry_safe(bo, next, &kgem->inactive[i], list) {
-			if (!kgem_bo_is_retained(kgem, bo)) {
-				DBG(("%s: purging %d\n",
-				     __FUNCTION__, bo->handle));
-				kgem_bo_free(kgem, bo);
-			}
-		}
+	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
+		list_for_each_entry_safe(bo, next, &kgem->inactive[i], list) {
+			if (!kgem_bo_is_retained(kgem, bo)) {
+				DBG(("%s: purging %d\n",
+				     __FUNCTION__, bo->handle));
+				kgem_bo_free(kgem, bo);
+			}
+		}
+	}
+
+	kgem->need_purge = false;
+}
+
+void kgem_clean_scanout_cache(struct kgem *kgem)
+{
+	while (!list_is_empty(&kgem->scanout)) {
+		struct kgem_bo *bo;
+
+		bo = list_first_entry(&kgem->scanout, struct kgem_bo, list);
+
+		assert(bo->scanout);
+		assert(!bo->refcnt);
+		assert(!bo->prime);
+		assert(bo->proxy == NULL);
+
+		if (bo->exec || __kgem_busy(kgem, bo->handle))
+			break;
+
+		DBG(("%s: handle=%d, fb=%d (reusable=%d)\n",
+		     __FUNCTION__, bo->handle, bo->delta, bo->reusable));
+		list_del(&bo->list);
+
+		kgem_bo_rmfb(kgem, bo);
+		bo->scanout = false;
+
+		if (!bo->purged) {
+			bo->reusable = true;
+			if (kgem->has_llc &&
+			    !gem_set_caching(kgem->fd, bo->handle, SNOOPED))
+				bo->reusable = false;
+
+		}
+
+		__kgem_bo_destroy(kgem, bo);
+	}
+}
+
+void kgem_clean_large_cache(struct kgem *kgem)
+{
+	while (!list_is_empty(&kgem->large_inactive)) {
+		kgem_bo_free(kgem,
+			     list_first_entry(&kgem->large_inactive,
+					      struct kgem_bo, list));
+
+	}
+}
+
+#define CACHE_TRIM_BATCH 64
+
+static bool over_budget(struct kgem *kgem, uint64_t limit)
+{
+	return limit && kgem->cache_budget.size > limit;
+}
+
+static struct kgem_bo *oldest_inactive(struct kgem *kgem)
+{
+	struct kgem_bo *bo, *oldest = NULL;
+	unsigned int i;
+
+	/* delta is the time the bo was first seen idle by expire, 0 if
+	 * it has not been seen yet, and so is newer than any other.
+	 */
+	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
+		if (list_is_empty(&kgem->inactive[i]))
+			continue;
+
+		bo = list_last_entry(&kgem->inactive[i], struct kgem_bo, list);
+		if (oldest == NULL ||
+		    (bo->delta && (oldest->delta == 0 || bo->delta < oldest->delta)) ||
+		    (bo->delta == oldest->delta && bytes(bo) > bytes(oldest)))
+			oldest = bo;
+	}
+
+	return oldest;
+}
+
+/* The PSI trigger is only sampled from the expire timer rather than
+ * registered with the server: the trigger reports POLLPRI, which the
+ * server's notify fds do not listen for, and the timer is already armed
+ * for as long as there is anything in the cache for us to release.
+ */
+static bool kgem_memory_pressure(struct kgem *kgem, time_t now)
+{
+	struct pollfd pfd;
+
+	pfd.fd = kgem->cache_budget.pressure_fd;
+	pfd.events = POLLPRI;
+	if (pfd.fd >= 0 && poll(&pfd, 1, 0) > 0) {
+		if (pfd.revents & (POLLERR | POLLNVAL)) {
+			/* our cgroup has gone away */
+			close(pfd.fd);
+			kgem->cache_budget.pressure_fd = -1;
+		} else if (pfd.revents & POLLPRI) {
+			DBG(("%s: memory pressure event\n", __FUNCTION__));
+			kgem->cache_budget.pressure = now;
+		}
+	}
+
+	return kgem->cache_budget.pressure &&
+		now - kgem->cache_budget.pressure < 2*MAX_INACTIVE_TIME;
+}
+
+static void kgem_update_working_set(struct kgem *kgem, time_t now)
+{
+	int n;
+
+	if (now - kgem->cache_budget.sampled < MAX_INACTIVE_TIME)
+		return;
+
+	/* The working set of each order is the largest recent demand,
+	 * decaying by a quarter for every period without it.
+	 */
+	for (n = 0; n < ARRAY_SIZE(kgem->cache_budget.order); n++) {
+		uint64_t ws = kgem->cache_budget.order[n].working_set;
+
+		ws -= ws / 4;
+		if (ws < kgem->cache_budget.order[n].demand)
+			ws = kgem->cache_budget.order[n].demand;
+
+		kgem->cache_budget.order[n].working_set = ws;
+		kgem->cache_budget.order[n].demand = 0;
 	}
 
-	kgem->need_purge = false;
+	kgem->cache_budget.sampled = now;
 }
 
-void kgem_clean_scanout_cache(struct kgem *kgem)
+void kgem_set_cache_limit(struct kgem *kgem, uint64_t limit)
 {
-	while (!list_is_empty(&kgem->scanout)) {
-		struct kgem_bo *bo;
+	DBG(("%s: %lld bytes\n", __FUNCTION__, (long long)limit));
+	kgem->cache_budget.limit = limit;
+}
 
-		bo = list_first_entry(&kgem->scanout, struct kgem_bo, list);
+void kgem_pressure_close(struct kgem *kgem)
+{
+	if (kgem->cache_budget.pressure_fd < 0)
+		return;
 
-		assert(bo->scanout);
-		assert(!bo->refcnt);
-		assert(!bo->prime);
-		assert(bo->proxy == NULL);
+	close(kgem->cache_budget.pressure_fd);
+	kgem->cache_budget.pressure_fd = -1;
+}
 
-		if (bo->exec || __kgem_busy(kgem, bo->handle))
-			break;
+void kgem_flush_dump(struct kgem *kgem)
+{
+	static const char * const reason[KGEM_FLUSH_REASONS] = {
+		[KGEM_FLUSH_OTHER] = "other",
+		[KGEM_FLUSH_BATCH] = "batch full",
+		[KGEM_FLUSH_RELOC] = "relocations",
+		[KGEM_FLUSH_EXEC] = "exec objects",
+		[KGEM_FLUSH_APERTURE] = "aperture",
+		[KGEM_FLUSH_FENCE] = "fences",
+	};
+	unsigned long total = 0;
+	int i;
 
-		DBG(("%s: handle=%d, fb=%d (reusable=%d)\n",
-		     __FUNCTION__, bo->handle, bo->delta, bo->reusable));
-		list_del(&bo->list);
+	for (i = 0; i < KGEM_FLUSH_REASONS; i++)
+		total += kgem->flush_stats[i];
 
-		kgem_bo_rmfb(kgem, bo);
-		bo->scanout = false;
+	ErrorF("batches: %lu submitted, capacity %d exec objects, %d relocations\n",
+	       total, kgem->max_exec, kgem->max_reloc);
+	if (kgem->batch_ring.count)
+		ErrorF("  written in place to a ring of %d bos, %lu stalls waiting for one\n",
+		       kgem->batch_ring.count, kgem->batch_ring.waits);
+	for (i = 0; i < KGEM_FLUSH_REASONS; i++) {
+		if (kgem->flush_stats[i])
+			ErrorF("  %s: %lu (%d%%)\n", reason[i], kgem->flush_stats[i],
+			       (int)(100 * kgem->flush_stats[i] / total));
+	}
+}
 
-		if (!bo->purged) {
-			bo->reusable = true;
-			if (kgem->has_llc &&
-			    !gem_set_caching(kgem->fd, bo->handle, SNOOPED))
-				bo->reusable = false;
+void kgem_cache_dump(struct kgem *kgem)
+{
+	unsigned long lookups = kgem->cache_stats.hits + kgem->cache_stats.misses;
+	struct kgem_bo *bo;
+	int i, j, order;
 
+	ErrorF("bo cache: %lu lookups, %lu hits (%d%%), %llu bytes wasted (%llu per hit)\n",
+	       lookups, kgem->cache_stats.hits,
+	       lookups ? (int)(100 * kgem->cache_stats.hits / lookups) : 0,
+	       (unsigned long long)kgem->cache_stats.wasted,
+	       kgem->cache_stats.hits ? (unsigned long long)(kgem->cache_stats.wasted / kgem->cache_stats.hits) : 0);
+
+	for (order = 0; order < NUM_CACHE_ORDERS; order++) {
+		int active = 0, inactive = 0;
+
+		for (i = order << CACHE_BUCKET_SPLIT;
+		     i < (order + 1) << CACHE_BUCKET_SPLIT;
+		     i++) {
+			list_for_each_entry(bo, &kgem->inactive[i], list)
+				inactive++;
+			for (j = 0; j < ARRAY_SIZE(kgem->active[i]); j++)
+				list_for_each_entry(bo, &kgem->active[i][j], list)
+					active++;
 		}
 
-		__kgem_bo_destroy(kgem, bo);
+		if (active | inactive)
+			ErrorF("  %6d pages: %d active, %d inactive (%llu bytes, working set %llu)\n",
+			       1 << order, active, inactive,
+			       (unsigned long long)kgem->cache_budget.order[order].bytes,
+			       (unsigned long long)kgem->cache_budget.order[order].working_set);
 	}
-}
 
-void kgem_clean_large_cache(struct kgem *kgem)
-{
-	while (!list_is_empty(&kgem->large_inactive)) {
-		kgem_bo_free(kgem,
-			     list_first_entry(&kgem->large_inactive,
-					      struct kgem_bo, list));
+	ErrorF("  inactive total %llu bytes, limit %llu%s\n",
+	       (unsigned long long)kgem->cache_budget.size,
+	       (unsigned long long)kgem->cache_budget.limit,
+	       kgem->cache_budget.pressure_fd < 0 ? "" : ", monitoring memory pressure");
+
+	if (kgem->has_softpin) {
+		unsigned long spare = 0;
 
+		for (i = 0; i < NUM_CACHE_BUCKETS; i++)
+			spare += kgem->va.bucket[i].count;
+		ErrorF("  softpin: %lluMiB of %lluMiB address space reserved, %lu ranges free for reuse\n",
+		       (unsigned long long)(kgem->va.next >> 20),
+		       (unsigned long long)(kgem->va.end >> 20),
+		       spare);
 	}
 }
 
@@ -4361,13 +5998,16 @@ bool kgem_expire_cache(struct kgem *kgem)
 {
 	time_t now, expire;
 	struct kgem_bo *bo;
-	unsigned int size = 0, count = 0;
-	bool idle;
+	unsigned int size = 0, count = 0, trimmed = 0;
+	uint64_t limit;
+	bool idle, pressure;
 	unsigned int i;
 
 	if (!time(&now))
 		return false;
 
+	kgem->need_trim = false;
+
 	while (__kgem_freed_bo) {
 		bo = __kgem_freed_bo;
 		__kgem_freed_bo = *(struct kgem_bo **)bo;
@@ -4427,6 +6067,17 @@ bool kgem_expire_cache(struct kgem *kgem)
 	if (kgem->need_retire)
 		kgem_retire(kgem);
 
+	pressure = kgem_memory_pressure(kgem, now);
+	kgem_update_working_set(kgem, now);
+
+	limit = kgem->cache_budget.limit;
+	if (pressure) {
+		/* Give back most of what we hold, a quarter at a time */
+		if (limit == 0 || limit > kgem->cache_budget.size)
+			limit = kgem->cache_budget.size;
+		limit /= 4;
+	}
+
 	expire = 0;
 	idle = true;
 	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
@@ -4442,14 +6093,19 @@ bool kgem_expire_cache(struct kgem *kgem)
 			bo->delta = now;
 		}
 	}
-	if (expire == 0) {
+	if (expire == 0 && !over_budget(kgem, limit)) {
 		DBG(("%s: idle? %d\n", __FUNCTION__, idle));
 		kgem->need_expire = !idle;
 		return false;
 	}
 
+	/* Free at most CACHE_TRIM_BATCH objects per call, so that a large
+	 * cache is released over several timer ticks rather than in one
+	 * long pause.
+	 */
 	idle = true;
-	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
+	for (i = 0; expire && i < ARRAY_SIZE(kgem->inactive); i++) {
+		const int order = i >> CACHE_BUCKET_SPLIT;
 		struct list preserve;
 
 		list_init(&preserve);
@@ -4462,11 +6118,25 @@ bool kgem_expire_cache(struct kgem *kgem)
 				break;
 			}
 
+			/* Keep what we expect to reuse, unless asked to shrink */
+			if (!pressure &&
+			    kgem->cache_budget.order[order].bytes <= kgem->cache_budget.order[order].working_set) {
+				idle = false;
+				break;
+			}
+
 			if (bo->map__cpu && bo->delta + MAP_PRESERVE_TIME > expire) {
 				idle = false;
 				list_move_tail(&bo->list, &preserve);
 			} else {
+				if (trimmed == CACHE_TRIM_BATCH) {
+					kgem->need_trim = true;
+					idle = false;
+					break;
+				}
+
 				count++;
+				trimmed++;
 				size += bytes(bo);
 				kgem_bo_free(kgem, bo);
 				DBG(("%s: expiring handle=%d\n",
@@ -4476,6 +6146,28 @@ bool kgem_expire_cache(struct kgem *kgem)
 		list_splice_tail(&preserve, &kgem->inactive[i]);
 	}
 
+	while (over_budget(kgem, limit)) {
+		bo = oldest_inactive(kgem);
+		if (bo == NULL)
+			break;
+
+		if (trimmed == CACHE_TRIM_BATCH) {
+			kgem->need_trim = true;
+			break;
+		}
+
+		DBG(("%s: over budget (%lld > %lld), trimming handle=%d\n",
+		     __FUNCTION__,
+		     (long long)kgem->cache_budget.size, (long long)limit,
+		     bo->handle));
+		count++;
+		trimmed++;
+		size += bytes(bo);
+		kgem_bo_free(kgem, bo);
+	}
+	for (i = 0; idle && i < ARRAY_SIZE(kgem->inactive); i++)
+		idle = list_is_empty(&kgem->inactive[i]);
+
 #ifdef DEBUG_MEMORY
 	{
 		long inactive_size = 0;
@@ -4563,6 +6255,7 @@ search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 	struct kgem_bo *bo, *first = NULL;
 	bool use_active = (flags & CREATE_INACTIVE) == 0;
 	struct list *cache;
+	int bucket, end;
 
 	DBG(("%s: num_pages=%d, flags=%x, use_active? %d, use_large=%d [max=%d]\n",
 	     __FUNCTION__, num_pages, flags, use_active,
@@ -4597,6 +6290,7 @@ retry_large:
 			if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo))
 				goto discard;
 
+			cache_budget_remove(kgem, bo);
 			list_del(&bo->list);
 			if (RQ(bo->rq) == (void *)kgem) {
 				assert(bo->exec == NULL);
@@ -4623,7 +6317,10 @@ discard:
 		return NULL;
 	}
 
-	if (!use_active && list_is_empty(inactive(kgem, num_pages))) {
+	bucket = cache_bucket(num_pages);
+	end = cache_bucket_end(bucket);
+
+	if (!use_active && inactive_is_empty(kgem, num_pages)) {
 		DBG(("%s: inactive and cache bucket empty\n",
 		     __FUNCTION__));
 
@@ -4632,7 +6329,7 @@ discard:
 			return NULL;
 		}
 
-		if (list_is_empty(active(kgem, num_pages, I915_TILING_NONE))) {
+		if (active_is_empty(kgem, num_pages, I915_TILING_NONE)) {
 			DBG(("%s: active cache bucket empty\n", __FUNCTION__));
 			return NULL;
 		}
@@ -4642,7 +6339,7 @@ discard:
 			return NULL;
 		}
 
-		if (list_is_empty(inactive(kgem, num_pages))) {
+		if (inactive_is_empty(kgem, num_pages)) {
 			DBG(("%s: active cache bucket still empty after retire\n",
 			     __FUNCTION__));
 			return NULL;
@@ -4653,46 +6350,49 @@ discard:
 		int for_cpu = !!(flags & CREATE_CPU_MAP);
 		DBG(("%s: searching for inactive %s map\n",
 		     __FUNCTION__, for_cpu ? "cpu" : "gtt"));
-		cache = &kgem->vma[for_cpu].inactive[cache_bucket(num_pages)];
-		list_for_each_entry(bo, cache, vma) {
-			assert(for_cpu ? !!bo->map__cpu : (bo->map__gtt || bo->map__wc));
-			assert(bucket(bo) == cache_bucket(num_pages));
-			assert(bo->proxy == NULL);
-			assert(bo->rq == NULL);
-			assert(bo->exec == NULL);
-			assert(!bo->scanout);
+		for (; bucket < end; bucket++) {
+			cache = &kgem->vma[for_cpu].inactive[bucket];
+			list_for_each_entry(bo, cache, vma) {
+				assert(for_cpu ? !!bo->map__cpu : (bo->map__gtt || bo->map__wc));
+				assert(bucket(bo) == bucket);
+				assert(bo->proxy == NULL);
+				assert(bo->rq == NULL);
+				assert(bo->exec == NULL);
+				assert(!bo->scanout);
 
-			if (num_pages > num_pages(bo)) {
-				DBG(("inactive too small: %d < %d\n",
-				     num_pages(bo), num_pages));
-				continue;
-			}
+				if (num_pages > num_pages(bo)) {
+					DBG(("inactive too small: %d < %d\n",
+					     num_pages(bo), num_pages));
+					continue;
+				}
 
-			if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
-				kgem_bo_free(kgem, bo);
-				break;
-			}
+				if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
+					kgem_bo_free(kgem, bo);
+					break;
+				}
 
-			if (!kgem_set_tiling(kgem, bo, I915_TILING_NONE, 0)) {
-				kgem_bo_free(kgem, bo);
-				break;
-			}
+				if (!kgem_set_tiling(kgem, bo, I915_TILING_NONE, 0)) {
+					kgem_bo_free(kgem, bo);
+					break;
+				}
 
-			kgem_bo_remove_from_inactive(kgem, bo);
-			assert(list_is_empty(&bo->vma));
-			assert(list_is_empty(&bo->list));
+				kgem_bo_remove_from_inactive(kgem, bo);
+				assert(list_is_empty(&bo->vma));
+				assert(list_is_empty(&bo->list));
 
-			assert(bo->tiling == I915_TILING_NONE);
-			assert(bo->pitch == 0);
-			bo->delta = 0;
-			DBG(("  %s: found handle=%d (num_pages=%d) in linear vma cache\n",
-			     __FUNCTION__, bo->handle, num_pages(bo)));
-			assert(use_active || bo->domain != DOMAIN_GPU);
-			assert(!bo->needs_flush);
-			assert_tiling(kgem, bo);
-			ASSERT_MAYBE_IDLE(kgem, bo->handle, !use_active);
-			return bo;
+				assert(bo->tiling == I915_TILING_NONE);
+				assert(bo->pitch == 0);
+				bo->delta = 0;
+				DBG(("  %s: found handle=%d (num_pages=%d) in linear vma cache\n",
+				     __FUNCTION__, bo->handle, num_pages(bo)));
+				assert(use_active || bo->domain != DOMAIN_GPU);
+				assert(!bo->needs_flush);
+				assert_tiling(kgem, bo);
+				ASSERT_MAYBE_IDLE(kgem, bo->handle, !use_active);
+				return bo;
+			}
 		}
+		bucket = cache_bucket(num_pages);
 
 		if (flags & CREATE_EXACT)
 			return NULL;
@@ -4701,92 +6401,95 @@ discard:
 			return NULL;
 	}
 
-	cache = use_active ? active(kgem, num_pages, I915_TILING_NONE) : inactive(kgem, num_pages);
-	list_for_each_entry(bo, cache, list) {
-		assert(bo->refcnt == 0);
-		assert(bo->reusable);
-		assert(!!bo->rq == !!use_active);
-		assert(bo->proxy == NULL);
-		assert(!bo->scanout);
-
-		if (num_pages > num_pages(bo))
-			continue;
-
-		if (use_active &&
-		    kgem->gen <= 040 &&
-		    bo->tiling != I915_TILING_NONE)
-			continue;
-
-		if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
-			kgem_bo_free(kgem, bo);
-			break;
-		}
+	for (; bucket < end; bucket++) {
+		cache = use_active ? &kgem->active[bucket][I915_TILING_NONE] : &kgem->inactive[bucket];
+		list_for_each_entry(bo, cache, list) {
+			assert(bo->refcnt == 0);
+			assert(bo->reusable);
+			assert(!!bo->rq == !!use_active);
+			assert(bo->proxy == NULL);
+			assert(!bo->scanout);
 
-		if (I915_TILING_NONE != bo->tiling) {
-			if (flags & (CREATE_CPU_MAP | CREATE_GTT_MAP))
+			if (num_pages > num_pages(bo))
 				continue;
 
-			if (first)
+			if (use_active &&
+			    kgem->gen <= 040 &&
+			    bo->tiling != I915_TILING_NONE)
 				continue;
 
-			if (!kgem_set_tiling(kgem, bo, I915_TILING_NONE, 0)) {
+			if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
 				kgem_bo_free(kgem, bo);
 				break;
 			}
-		}
-		assert(bo->tiling == I915_TILING_NONE);
-		bo->pitch = 0;
 
-		if (bo->map__gtt || bo->map__wc || bo->map__cpu) {
-			if (flags & (CREATE_CPU_MAP | CREATE_GTT_MAP)) {
-				int for_cpu = !!(flags & CREATE_CPU_MAP);
-				if (for_cpu ? !!bo->map__cpu : (bo->map__gtt || bo->map__wc)){
+			if (I915_TILING_NONE != bo->tiling) {
+				if (flags & (CREATE_CPU_MAP | CREATE_GTT_MAP))
+					continue;
+
+				if (first)
+					continue;
+
+				if (!kgem_set_tiling(kgem, bo, I915_TILING_NONE, 0)) {
+					kgem_bo_free(kgem, bo);
+					break;
+				}
+			}
+			assert(bo->tiling == I915_TILING_NONE);
+			bo->pitch = 0;
+
+			if (bo->map__gtt || bo->map__wc || bo->map__cpu) {
+				if (flags & (CREATE_CPU_MAP | CREATE_GTT_MAP)) {
+					int for_cpu = !!(flags & CREATE_CPU_MAP);
+					if (for_cpu ? !!bo->map__cpu : (bo->map__gtt || bo->map__wc)){
+						if (first != NULL)
+							goto use_first;
+
+						first = bo;
+						continue;
+					}
+				} else {
 					if (first != NULL)
-						break;
+						goto use_first;
 
 					first = bo;
 					continue;
 				}
 			} else {
-				if (first != NULL)
-					break;
-
-				first = bo;
-				continue;
-			}
-		} else {
-			if (flags & CREATE_GTT_MAP && !kgem_bo_can_map(kgem, bo))
-				continue;
+				if (flags & CREATE_GTT_MAP && !kgem_bo_can_map(kgem, bo))
+					continue;
 
-			if (flags & (CREATE_CPU_MAP | CREATE_GTT_MAP)) {
-				if (first != NULL)
-					break;
+				if (flags & (CREATE_CPU_MAP | CREATE_GTT_MAP)) {
+					if (first != NULL)
+						goto use_first;
 
-				first = bo;
-				continue;
+					first = bo;
+					continue;
+				}
 			}
-		}
 
-		if (use_active)
-			kgem_bo_remove_from_active(kgem, bo);
-		else
-			kgem_bo_remove_from_inactive(kgem, bo);
+			if (use_active)
+				kgem_bo_remove_from_active(kgem, bo);
+			else
+				kgem_bo_remove_from_inactive(kgem, bo);
 
-		assert(bo->tiling == I915_TILING_NONE);
-		assert(bo->pitch == 0);
-		bo->delta = 0;
-		DBG(("  %s: found handle=%d (num_pages=%d) in linear %s cache\n",
-		     __FUNCTION__, bo->handle, num_pages(bo),
-		     use_active ? "active" : "inactive"));
-		assert(list_is_empty(&bo->list));
-		assert(list_is_empty(&bo->vma));
-		assert(use_active || bo->domain != DOMAIN_GPU);
-		assert(!bo->needs_flush || use_active);
-		assert_tiling(kgem, bo);
-		ASSERT_MAYBE_IDLE(kgem, bo->handle, !use_active);
-		return bo;
+			assert(bo->tiling == I915_TILING_NONE);
+			assert(bo->pitch == 0);
+			bo->delta = 0;
+			DBG(("  %s: found handle=%d (num_pages=%d) in linear %s cache\n",
+			     __FUNCTION__, bo->handle, num_pages(bo),
+			     use_active ? "active" : "inactive"));
+			assert(list_is_empty(&bo->list));
+			assert(list_is_empty(&bo->vma));
+			assert(use_active || bo->domain != DOMAIN_GPU);
+			assert(!bo->needs_flush || use_active);
+			assert_tiling(kgem, bo);
+			ASSERT_MAYBE_IDLE(kgem, bo->handle, !use_active);
+			return bo;
+		}
 	}
 
+use_first:
 	if (first) {
 		assert(first->tiling == I915_TILING_NONE);
 
@@ -4911,7 +6614,7 @@ struct kgem_bo *kgem_create_for_prime(struct kgem *kgem, int name, uint32_t size
 	VG_CLEAR(caching);
 	caching.handle = args.handle;
 	caching.caching = kgem->has_llc;
-	(void)drmIoctl(kgem->fd, LOCAL_IOCTL_I915_GEM_GET_CACHING, &caching);
+	(void)do_ioctl(kgem->fd, LOCAL_IOCTL_I915_GEM_GET_CACHING, &caching);
 	DBG(("%s: imported handle=%d has caching %d\n", __FUNCTION__, args.handle, caching.caching));
 	switch (caching.caching) {
 	case 0:
@@ -4990,11 +6693,14 @@ struct kgem_bo *kgem_create_linear(struct kgem *kgem, int size, unsigned flags)
 			assert(bo->domain != DOMAIN_GPU);
 			ASSERT_IDLE(kgem, bo->handle);
 			bo->refcnt = 1;
+			cache_hit(kgem, bo, size);
 			return bo;
 		}
 
 		if (flags & CREATE_CACHED)
 			return NULL;
+
+		cache_miss(kgem, size);
 	}
 
 	handle = gem_create(kgem->fd, size);
@@ -5550,6 +7256,7 @@ struct kgem_bo *kgem_create_2d(struct kgem *kgem,
 			assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
 			assert_tiling(kgem, bo);
 			bo->refcnt = 1;
+			cache_hit(kgem, bo, size);
 			return bo;
 		}
 
@@ -5576,6 +7283,7 @@ large_inactive:
 				break;
 			}
 
+			cache_budget_remove(kgem, bo);
 			list_del(&bo->list);
 
 			assert(bo->domain != DOMAIN_GPU);
@@ -5586,6 +7294,7 @@ large_inactive:
 			assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
 			assert_tiling(kgem, bo);
 			bo->refcnt = 1;
+			cache_hit(kgem, bo, size);
 
 			if (flags & CREATE_SCANOUT)
 				__kgem_bo_make_scanout(kgem, bo, width, height);
@@ -5603,73 +7312,76 @@ large_inactive:
 		/* We presume that we will need to upload to this bo,
 		 * and so would prefer to have an active VMA.
 		 */
-		cache = &kgem->vma[for_cpu].inactive[bucket];
 		do {
-			list_for_each_entry(bo, cache, vma) {
-				assert(bucket(bo) == bucket);
-				assert(bo->refcnt == 0);
-				assert(!bo->scanout);
-				assert(for_cpu ? !!bo->map__cpu : (bo->map__gtt || bo->map__wc));
-				assert(bo->rq == NULL);
-				assert(bo->exec == NULL);
-				assert(list_is_empty(&bo->request));
-				assert(bo->flush == false);
-				assert_tiling(kgem, bo);
+			for (i = bucket; i < cache_bucket_end(bucket); i++) {
+				cache = &kgem->vma[for_cpu].inactive[i];
+				list_for_each_entry(bo, cache, vma) {
+					assert(bucket(bo) == i);
+					assert(bo->refcnt == 0);
+					assert(!bo->scanout);
+					assert(for_cpu ? !!bo->map__cpu : (bo->map__gtt || bo->map__wc));
+					assert(bo->rq == NULL);
+					assert(bo->exec == NULL);
+					assert(list_is_empty(&bo->request));
+					assert(bo->flush == false);
+					assert_tiling(kgem, bo);
+
+					if (size > num_pages(bo)) {
+						DBG(("inactive too small: %d < %d\n",
+						     num_pages(bo), size));
+						continue;
+					}
 
-				if (size > num_pages(bo)) {
-					DBG(("inactive too small: %d < %d\n",
-					     num_pages(bo), size));
-					continue;
-				}
+					if (flags & UNCACHED && !kgem->has_llc && bo->domain != DOMAIN_CPU)
+						continue;
 
-				if (flags & UNCACHED && !kgem->has_llc && bo->domain != DOMAIN_CPU)
-					continue;
+					if (bo->tiling != tiling ||
+					    (tiling != I915_TILING_NONE && bo->pitch != pitch)) {
+						if (bo->map__gtt ||
+						    !kgem_set_tiling(kgem, bo,
+								     tiling, pitch)) {
+							DBG(("inactive GTT vma with wrong tiling: %d < %d\n",
+							     bo->tiling, tiling));
+							kgem_bo_free(kgem, bo);
+							break;
+						}
+					}
 
-				if (bo->tiling != tiling ||
-				    (tiling != I915_TILING_NONE && bo->pitch != pitch)) {
-					if (bo->map__gtt ||
-					    !kgem_set_tiling(kgem, bo,
-							     tiling, pitch)) {
-						DBG(("inactive GTT vma with wrong tiling: %d < %d\n",
-						     bo->tiling, tiling));
+					if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
 						kgem_bo_free(kgem, bo);
 						break;
 					}
-				}
 
-				if (bo->purged && !kgem_bo_clear_purgeable(kgem, bo)) {
-					kgem_bo_free(kgem, bo);
-					break;
+					if (tiling == I915_TILING_NONE)
+						bo->pitch = pitch;
+
+					assert(bo->tiling == tiling);
+					assert(bo->pitch >= pitch);
+					bo->delta = 0;
+					bo->unique_id = kgem_get_unique_id(kgem);
+
+					kgem_bo_remove_from_inactive(kgem, bo);
+					assert(list_is_empty(&bo->list));
+					assert(list_is_empty(&bo->vma));
+
+					DBG(("  from inactive vma: pitch=%d, tiling=%d: handle=%d, id=%d\n",
+					     bo->pitch, bo->tiling, bo->handle, bo->unique_id));
+					assert(bo->reusable);
+					assert(bo->domain != DOMAIN_GPU);
+					ASSERT_IDLE(kgem, bo->handle);
+					assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
+					assert_tiling(kgem, bo);
+					bo->refcnt = 1;
+					cache_hit(kgem, bo, size);
+					return bo;
 				}
-
-				if (tiling == I915_TILING_NONE)
-					bo->pitch = pitch;
-
-				assert(bo->tiling == tiling);
-				assert(bo->pitch >= pitch);
-				bo->delta = 0;
-				bo->unique_id = kgem_get_unique_id(kgem);
-
-				kgem_bo_remove_from_inactive(kgem, bo);
-				assert(list_is_empty(&bo->list));
-				assert(list_is_empty(&bo->vma));
-
-				DBG(("  from inactive vma: pitch=%d, tiling=%d: handle=%d, id=%d\n",
-				     bo->pitch, bo->tiling, bo->handle, bo->unique_id));
-				assert(bo->reusable);
-				assert(bo->domain != DOMAIN_GPU);
-				ASSERT_IDLE(kgem, bo->handle);
-				assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
-				assert_tiling(kgem, bo);
-				bo->refcnt = 1;
-				return bo;
 			}
-		} while (!list_is_empty(cache) &&
+		} while (!cache_is_empty(kgem->vma[for_cpu].inactive, size) &&
 			 __kgem_throttle_retire(kgem, flags));
 
 		if (flags & CREATE_CPU_MAP && !kgem->has_llc) {
-			if (list_is_empty(&kgem->active[bucket][tiling]) &&
-			    list_is_empty(&kgem->inactive[bucket]))
+			if (active_is_empty(kgem, size, tiling) &&
+			    inactive_is_empty(kgem, size))
 				flags &= ~CREATE_CACHED;
 
 			goto create;
@@ -5681,8 +7393,8 @@ large_inactive:
 
 	/* Best active match */
 	retry = NUM_CACHE_BUCKETS - bucket;
-	if (retry > 3 && (flags & CREATE_TEMPORARY) == 0)
-		retry = 3;
+	if (retry > 3 << CACHE_BUCKET_SPLIT && (flags & CREATE_TEMPORARY) == 0)
+		retry = 3 << CACHE_BUCKET_SPLIT;
 search_active:
 	assert(bucket < NUM_CACHE_BUCKETS);
 	cache = &kgem->active[bucket][tiling];
@@ -5728,6 +7440,7 @@ search_active:
 			assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
 			assert_tiling(kgem, bo);
 			bo->refcnt = 1;
+			cache_hit(kgem, bo, size);
 			return bo;
 		}
 	} else {
@@ -5754,6 +7467,7 @@ search_active:
 			assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
 			assert_tiling(kgem, bo);
 			bo->refcnt = 1;
+			cache_hit(kgem, bo, size);
 			return bo;
 		}
 	}
@@ -5793,6 +7507,7 @@ search_active:
 				assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
 				assert_tiling(kgem, bo);
 				bo->refcnt = 1;
+				cache_hit(kgem, bo, size);
 				return bo;
 			}
 		}
@@ -5832,6 +7547,7 @@ search_active:
 				assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
 				assert_tiling(kgem, bo);
 				bo->refcnt = 1;
+				cache_hit(kgem, bo, size);
 				return bo;
 			}
 		}
@@ -5845,8 +7561,8 @@ search_active:
 skip_active_search:
 	bucket = cache_bucket(size);
 	retry = NUM_CACHE_BUCKETS - bucket;
-	if (retry > 3)
-		retry = 3;
+	if (retry > 3 << CACHE_BUCKET_SPLIT)
+		retry = 3 << CACHE_BUCKET_SPLIT;
 search_inactive:
 	/* Now just look for a close match and prefer any currently active */
 	assert(bucket < NUM_CACHE_BUCKETS);
@@ -5896,6 +7612,7 @@ search_inactive:
 		assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
 		assert_tiling(kgem, bo);
 		bo->refcnt = 1;
+		cache_hit(kgem, bo, size);
 
 		if (flags & CREATE_SCANOUT)
 			__kgem_bo_make_scanout(kgem, bo, width, height);
@@ -5948,6 +7665,7 @@ search_inactive:
 			assert(bo->pitch*kgem_aligned_height(kgem, height, bo->tiling) <= kgem_bo_size(bo));
 			assert_tiling(kgem, bo);
 			bo->refcnt = 1;
+			cache_hit(kgem, bo, size);
 
 			if (flags & CREATE_SCANOUT)
 				__kgem_bo_make_scanout(kgem, bo, width, height);
@@ -5969,6 +7687,8 @@ create:
 		return NULL;
 	}
 
+	cache_miss(kgem, size);
+
 	if (bucket >= NUM_CACHE_BUCKETS)
 		size = ALIGN(size, 1024);
 	handle = gem_create(kgem->fd, size);
@@ -6173,7 +7893,7 @@ void kgem_scanout_flush(struct kgem *kgem, struct kgem_bo *bo)
 		struct drm_mode_fb_dirty_cmd cmd;
 		memset(&cmd, 0, sizeof(cmd));
 		cmd.fb_id = bo->delta;
-		(void)drmIoctl(kgem->fd, DRM_IOCTL_MODE_DIRTYFB, &cmd);
+		(void)do_ioctl(kgem->fd, DRM_IOCTL_MODE_DIRTYFB, &cmd);
 	}
 
 	/* Whatever actually happens, we can regard the GTT write domain
@@ -6240,7 +7960,7 @@ static bool aperture_check(struct kgem *kgem, unsigned num_pages)
 	int reserve;
 
 	if (kgem->aperture)
-		return false;
+		return __kgem_flush_for(kgem, KGEM_FLUSH_APERTURE);
 
 	/* Leave some space in case of alignment issues */
 	reserve = kgem->aperture_mappable / 2;
@@ -6263,7 +7983,10 @@ static bool aperture_check(struct kgem *kgem, unsigned num_pages)
 	     (long)num_pages * PAGE_SIZE,
 	     (long)aperture.aper_available_size));
 
-	return num_pages <= aperture.aper_available_size / PAGE_SIZE;
+	if (num_pages > aperture.aper_available_size / PAGE_SIZE)
+		return __kgem_flush_for(kgem, KGEM_FLUSH_APERTURE);
+
+	return true;
 }
 
 static inline bool kgem_flush(struct kgem *kgem, bool flush)
@@ -6320,7 +8043,7 @@ bool kgem_check_bo(struct kgem *kgem, ...)
 	if (!num_pages)
 		return true;
 
-	if (kgem->nexec + num_exec >= KGEM_EXEC_SIZE(kgem)) {
+	if (!kgem_check_exec(kgem, num_exec + 1)) {
 		DBG(("%s: out of exec slots (%d + %d / %d)\n", __FUNCTION__,
 		     kgem->nexec, num_exec, KGEM_EXEC_SIZE(kgem)));
 		return false;
@@ -6354,7 +8077,7 @@ bool kgem_check_bo_fenced(struct kgem *kgem, struct kgem_bo *bo)
 			assert(bo->tiling == I915_TILING_X);
 
 			if (kgem->nfence >= kgem->fence_max)
-				return false;
+				return __kgem_flush_for(kgem, KGEM_FLUSH_FENCE);
 
 			if (kgem->aperture_fenced) {
 				size = 3*kgem->aperture_fenced;
@@ -6363,7 +8086,7 @@ bool kgem_check_bo_fenced(struct kgem *kgem, struct kgem_bo *bo)
 				if (size > kgem->aperture_fenceable &&
 				    kgem_ring_is_idle(kgem, kgem->ring)) {
 					DBG(("%s: opportunistic fence flush\n", __FUNCTION__));
-					return false;
+					return __kgem_flush_for(kgem, KGEM_FLUSH_FENCE);
 				}
 			}
 
@@ -6378,14 +8101,14 @@ bool kgem_check_bo_fenced(struct kgem *kgem, struct kgem_bo *bo)
 			if (size > kgem->aperture_fenceable) {
 				DBG(("%s: estimated fence space required %d (fenced=%d, max_fence=%d, aperture=%d) exceeds fenceable aperture %d\n",
 				     __FUNCTION__, size, kgem->aperture_fenced, kgem->aperture_max_fence, kgem->aperture, kgem->aperture_fenceable));
-				return false;
+				return __kgem_flush_for(kgem, KGEM_FLUSH_FENCE);
 			}
 		}
 
 		return true;
 	}
 
-	if (kgem->nexec >= KGEM_EXEC_SIZE(kgem) - 1)
+	if (!kgem_check_exec(kgem, 2))
 		return false;
 
 	if (needs_batch_flush(kgem, bo))
@@ -6398,7 +8121,7 @@ bool kgem_check_bo_fenced(struct kgem *kgem, struct kgem_bo *bo)
 		assert(bo->tiling == I915_TILING_X);
 
 		if (kgem->nfence >= kgem->fence_max)
-			return false;
+			return __kgem_flush_for(kgem, KGEM_FLUSH_FENCE);
 
 		if (kgem->aperture_fenced) {
 			size = 3*kgem->aperture_fenced;
@@ -6407,7 +8130,7 @@ bool kgem_check_bo_fenced(struct kgem *kgem, struct kgem_bo *bo)
 			if (size > kgem->aperture_fenceable &&
 			    kgem_ring_is_idle(kgem, kgem->ring)) {
 				DBG(("%s: opportunistic fence flush\n", __FUNCTION__));
-				return false;
+				return __kgem_flush_for(kgem, KGEM_FLUSH_FENCE);
 			}
 		}
 
@@ -6422,7 +8145,7 @@ bool kgem_check_bo_fenced(struct kgem *kgem, struct kgem_bo *bo)
 		if (size > kgem->aperture_fenceable) {
 			DBG(("%s: estimated fence space required %d (fenced=%d, max_fence=%d, aperture=%d) exceeds fenceable aperture %d\n",
 			     __FUNCTION__, size, kgem->aperture_fenced, kgem->aperture_max_fence, kgem->aperture, kgem->aperture_fenceable));
-			return false;
+			return __kgem_flush_for(kgem, KGEM_FLUSH_FENCE);
 		}
 	}
 
@@ -6492,7 +8215,7 @@ bool kgem_check_many_bo_fenced(struct kgem *kgem, ...)
 		uint32_t size;
 
 		if (kgem->nfence + num_fence > kgem->fence_max)
-			return false;
+			return __kgem_flush_for(kgem, KGEM_FLUSH_FENCE);
 
 		if (kgem->aperture_fenced) {
 			size = 3*kgem->aperture_fenced;
@@ -6501,7 +8224,7 @@ bool kgem_check_many_bo_fenced(struct kgem *kgem, ...)
 			if (size > kgem->aperture_fenceable &&
 			    kgem_ring_is_idle(kgem, kgem->ring)) {
 				DBG(("%s: opportunistic fence flush\n", __FUNCTION__));
-				return false;
+				return __kgem_flush_for(kgem, KGEM_FLUSH_FENCE);
 			}
 		}
 
@@ -6514,14 +8237,14 @@ bool kgem_check_many_bo_fenced(struct kgem *kgem, ...)
 		if (size > kgem->aperture_fenceable) {
 			DBG(("%s: estimated fence space required %d (fenced=%d, max_fence=%d, aperture=%d) exceeds fenceable aperture %d\n",
 			     __FUNCTION__, size, kgem->aperture_fenced, kgem->aperture_max_fence, kgem->aperture, kgem->aperture_fenceable));
-			return false;
+			return __kgem_flush_for(kgem, KGEM_FLUSH_FENCE);
 		}
 	}
 
 	if (num_pages == 0)
 		return true;
 
-	if (kgem->nexec + num_exec >= KGEM_EXEC_SIZE(kgem))
+	if (!kgem_check_exec(kgem, num_exec + 1))
 		return false;
 
 	if (num_pages + kgem->aperture > kgem->aperture_high - kgem->aperture_fenced) {
@@ -6600,7 +8323,7 @@ uint32_t kgem_add_reloc(struct kgem *kgem,
 	assert((read_write_domain & 0x7fff) == 0 || bo != NULL);
 
 	index = kgem->nreloc++;
-	assert(index < ARRAY_SIZE(kgem->reloc));
+	assert(index < kgem->max_reloc);
 	kgem->reloc[index].offset = pos * sizeof(kgem->batch[0]);
 	if (bo) {
 		assert(kgem->mode != KGEM_NONE);
@@ -6683,7 +8406,7 @@ uint64_t kgem_add_reloc64(struct kgem *kgem,
 	assert((read_write_domain & 0x7fff) == 0 || bo != NULL);
 
 	index = kgem->nreloc++;
-	assert(index < ARRAY_SIZE(kgem->reloc));
+	assert(index < kgem->max_reloc);
 	kgem->reloc[index].offset = pos * sizeof(kgem->batch[0]);
 	if (bo) {
 		assert(kgem->mode != KGEM_NONE);
@@ -6716,6 +8439,28 @@ uint64_t kgem_add_reloc64(struct kgem *kgem,
 		assert(bo->rq == MAKE_REQUEST(kgem->next_request, kgem->ring));
 		assert(RQ_RING(bo->rq) == kgem->ring);
 
+		/* The kernel will not move a softpinned bo, so write its
+		 * final address and leave it out of the relocations. Upload
+		 * buffers may yet be replaced by kgem_finish_buffers() and
+		 * so keep theirs, as does a batch being captured so that it
+		 * can be decoded later.
+		 */
+		if (bo->exec->flags & LOCAL_EXEC_OBJECT_PINNED && !bo->io &&
+		    !kgem->capture) {
+			DBG(("%s: handle=%d softpinned at %llx\n",
+			     __FUNCTION__, bo->handle, (long long)bo->presumed_offset));
+			assert(bo->softpin || kgem_exec_is_shared(kgem, bo));
+			assert(bo->exec->offset == bo->presumed_offset);
+			kgem->nreloc--;
+
+			if (read_write_domain & 0x7fff && !bo->gpu_dirty) {
+				assert(!bo->snoop || kgem->can_blt_cpu);
+				__kgem_bo_mark_dirty(bo);
+			}
+
+			return delta + bo->presumed_offset;
+		}
+
 		DBG(("%s[%d] = (delta=%d, target handle=%d, presumed=%llx)\n",
 					__FUNCTION__, index, delta, bo->target_handle, (long long)bo->presumed_offset));
 		kgem->reloc[index].delta = delta;
@@ -36,6 +36,9 @@
 
 #include "compiler.h"
 #include "debug.h"
+#include "kgem_backend.h"
+#include "kgem_trace.h"
+#include "kgem_capture.h"
 
 struct kgem_bo {
 	struct kgem_request *rq;
@@ -73,11 +76,14 @@ struct kgem_bo {
 	uint32_t active_scanout;
 	union {
 		struct {
-			uint32_t count:27;
+			uint32_t count:25;
 #define PAGE_SIZE 4096
-			uint32_t bucket:5;
-#define NUM_CACHE_BUCKETS 16
-#define MAX_CACHE_SIZE (1 << (NUM_CACHE_BUCKETS+12))
+			uint32_t bucket:7;
+/* Each power-of-two is split into 1 << CACHE_BUCKET_SPLIT buckets */
+#define CACHE_BUCKET_SPLIT 2
+#define NUM_CACHE_ORDERS 16
+#define NUM_CACHE_BUCKETS (NUM_CACHE_ORDERS << CACHE_BUCKET_SPLIT)
+#define MAX_CACHE_SIZE (1 << (NUM_CACHE_ORDERS+12))
 		} pages;
 		uint32_t bytes;
 	} size;
@@ -94,6 +100,8 @@ struct kgem_bo {
 	uint32_t scanout : 1;
 	uint32_t prime : 1;
 	uint32_t purged : 1;
+	uint32_t cached : 1; /* counted in kgem->cache_budget */
+	uint32_t softpin : 1; /* presumed_offset is assigned from kgem->va */
 };
 #define DOMAIN_NONE 0
 #define DOMAIN_CPU 1
@@ -105,6 +113,7 @@ struct kgem_request {
 	struct kgem_bo *bo;
 	struct list buffers;
 	unsigned ring;
+	uint32_t trace; /* seqno in kgem->trace, or 0 */
 };
 
 enum {
@@ -118,6 +127,28 @@ typedef void (*memcpy_box_func)(const void *src, void *dst, int bpp,
 				int16_t src_x, int16_t src_y,
 				int16_t dst_x, int16_t dst_y,
 				uint16_t width, uint16_t height);
+typedef void (*memcpy_xor_box_func)(const void *src, void *dst, int bpp,
+				    int32_t src_stride, int32_t dst_stride,
+				    int16_t src_x, int16_t src_y,
+				    int16_t dst_x, int16_t dst_y,
+				    uint16_t width, uint16_t height,
+				    uint32_t and, uint32_t or);
+
+/* Open-addressed map from handle to its slot in kgem->exec[], entries
+ * being valid only whilst their serial matches the current batch.
+ */
+struct kgem_exec_hash {
+	uint32_t handle;
+	uint16_t index;
+	uint16_t serial;
+};
+
+#define KGEM_MAX_EXEC 4096
+#define KGEM_MAX_RELOC 32768
+#define KGEM_EXEC_HASH_BITS 13 /* 2*KGEM_MAX_EXEC slots */
+
+#define KGEM_BATCH_RING_MIN 4
+#define KGEM_BATCH_RING_MAX 32
 
 struct kgem {
 	unsigned wedged;
@@ -133,6 +164,8 @@ struct kgem {
 	uint16_t nreloc__self;
 	uint16_t nfence;
 	uint16_t batch_size;
+	uint16_t max_exec;
+	uint16_t max_reloc;
 
 	uint32_t *batch;
 
@@ -173,6 +206,7 @@ struct kgem {
 
 	uint32_t flush:1;
 	uint32_t need_expire:1;
+	uint32_t need_trim:1;
 	uint32_t need_purge:1;
 	uint32_t need_retire:1;
 	uint32_t need_throttle:1;
@@ -194,6 +228,7 @@ struct kgem {
 	uint32_t has_wt :1;
 	uint32_t has_no_reloc :1;
 	uint32_t has_handle_lut :1;
+	uint32_t has_softpin :1;
 	uint32_t has_wc_mmap :1;
 	uint32_t has_dirtyfb :1;
 
@@ -221,12 +256,71 @@ struct kgem {
 	memcpy_box_func memcpy_to_tiled_x;
 	memcpy_box_func memcpy_from_tiled_x;
 	memcpy_box_func memcpy_between_tiled_x;
+	memcpy_box_func memcpy_to_tiled_y;
+	memcpy_box_func memcpy_from_tiled_y;
+	memcpy_xor_box_func memcpy_xor_to_tiled_x;
 
 	struct kgem_bo *batch_bo;
 
+	/* Batches are written directly into a ring of persistently mapped
+	 * bos, each submitted in turn and reused once its request retires.
+	 */
+	struct {
+		struct kgem_bo *bo[KGEM_BATCH_RING_MAX];
+		uint32_t *map[KGEM_BATCH_RING_MAX];
+		int count, current;
+		unsigned long waits; /* stalls for the next bo to become idle */
+	} batch_ring;
+
+	struct {
+		unsigned long hits, misses;
+		uint64_t wasted; /* bytes over the request, summed over hits */
+	} cache_stats;
+
+	struct {
+		uint64_t size; /* bytes held in the inactive caches */
+		uint64_t limit;
+		uint32_t pressure; /* time() of the last memory pressure event */
+		uint32_t sampled; /* time() the working set was last updated */
+		int pressure_fd;
+		struct {
+			uint64_t bytes;
+			uint64_t demand; /* bytes requested since the last sample */
+			uint64_t working_set;
+		} order[NUM_CACHE_ORDERS + 1]; /* the last holds the large objects */
+	} cache_budget;
+
+	/* With softpin, every cacheable bo is placed at an address of our
+	 * choosing in our private GTT. The ranges are sized by cache bucket,
+	 * and returned to the bucket for reuse when the bo is closed.
+	 */
+	struct {
+		uint64_t next, end;
+		struct {
+			uint64_t *offset; /* a fifo, oldest first */
+			uint32_t head, count, size;
+		} bucket[NUM_CACHE_BUCKETS];
+	} va;
+
+	enum kgem_flush_reason flush_reason; /* the last failed kgem_check */
+	unsigned long flush_stats[KGEM_FLUSH_REASONS];
+
+	struct kgem_trace *trace;
+	char *trace_path;
+	struct kgem_async *async;
+	struct kgem_capture_file *capture;
+
+	/* Start with the inline arrays, and move onto the heap when a
+	 * batch needs more exec objects or relocations than they hold.
+	 */
+	struct drm_i915_gem_exec_object2 *exec;
+	struct drm_i915_gem_relocation_entry *reloc;
+	uint16_t exec_serial;
+
 	uint16_t reloc__self[256];
-	struct drm_i915_gem_exec_object2 exec[384] page_aligned;
-	struct drm_i915_gem_relocation_entry reloc[8192] page_aligned;
+	struct kgem_exec_hash exec_hash[1 << KGEM_EXEC_HASH_BITS];
+	struct drm_i915_gem_exec_object2 exec__inline[384] page_aligned;
+	struct drm_i915_gem_relocation_entry reloc__inline[8192] page_aligned;
 
 #ifdef DEBUG_MEMORY
 	struct {
@@ -247,8 +341,8 @@ struct kgem {
 #endif
 
 #define KGEM_BATCH_SIZE(K) ((K)->batch_size-KGEM_BATCH_RESERVED)
-#define KGEM_EXEC_SIZE(K) (int)(ARRAY_SIZE((K)->exec)-KGEM_EXEC_RESERVED)
-#define KGEM_RELOC_SIZE(K) (int)(ARRAY_SIZE((K)->reloc)-KGEM_RELOC_RESERVED)
+#define KGEM_EXEC_SIZE(K) (int)((K)->max_exec-KGEM_EXEC_RESERVED)
+#define KGEM_RELOC_SIZE(K) (int)((K)->max_reloc-KGEM_RELOC_RESERVED)
 
 void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen);
 void kgem_reset(struct kgem *kgem);
@@ -382,13 +476,21 @@ static inline void kgem_submit(struct kgem *kgem)
 		_kgem_submit(kgem);
 }
 
+void kgem_async_drain(struct kgem *kgem);
+void kgem_async_wait(struct kgem *kgem, struct kgem_bo *bo);
+bool kgem_enable_async_submit(struct kgem *kgem);
+void kgem_disable_async_submit(struct kgem *kgem);
+
 static inline void kgem_bo_submit(struct kgem *kgem, struct kgem_bo *bo)
 {
-	if (bo->exec == NULL)
-		return;
+	if (bo->exec) {
+		assert(bo->refcnt);
+		_kgem_submit(kgem);
+	}
 
-	assert(bo->refcnt);
-	_kgem_submit(kgem);
+	/* Make sure the kernel has seen the batch before anyone else */
+	if (unlikely(kgem->async) && bo->rq)
+		kgem_async_wait(kgem, bo);
 }
 
 void kgem_scanout_flush(struct kgem *kgem, struct kgem_bo *bo);
@@ -449,24 +551,43 @@ static inline int kgem_batch_space(struct kgem *kgem)
 	return rem - KGEM_BATCH_RESERVED;
 }
 
+static inline bool __kgem_flush_for(struct kgem *kgem,
+				    enum kgem_flush_reason reason)
+{
+	kgem->flush_reason = reason;
+	return false;
+}
+
 static inline bool kgem_check_batch(struct kgem *kgem, int num_dwords)
 {
 	assert(num_dwords > 0);
 	assert(kgem->nbatch < kgem->surface);
 	assert(kgem->surface <= kgem->batch_size);
-	return likely(kgem->nbatch + num_dwords + KGEM_BATCH_RESERVED <= kgem->surface);
+	if (likely(kgem->nbatch + num_dwords + KGEM_BATCH_RESERVED <= kgem->surface))
+		return true;
+
+	return __kgem_flush_for(kgem, KGEM_FLUSH_BATCH);
 }
 
+bool __kgem_grow_reloc(struct kgem *kgem, int n);
+bool __kgem_grow_exec(struct kgem *kgem, int n);
+
 static inline bool kgem_check_reloc(struct kgem *kgem, int n)
 {
 	assert(kgem->nreloc <= KGEM_RELOC_SIZE(kgem));
-	return likely(kgem->nreloc + n <= KGEM_RELOC_SIZE(kgem));
+	if (likely(kgem->nreloc + n <= KGEM_RELOC_SIZE(kgem)))
+		return true;
+
+	return __kgem_grow_reloc(kgem, n);
 }
 
 static inline bool kgem_check_exec(struct kgem *kgem, int n)
 {
 	assert(kgem->nexec <= KGEM_EXEC_SIZE(kgem));
-	return likely(kgem->nexec + n <= KGEM_EXEC_SIZE(kgem));
+	if (likely(kgem->nexec + n <= KGEM_EXEC_SIZE(kgem)))
+		return true;
+
+	return __kgem_grow_exec(kgem, n);
 }
 
 static inline bool kgem_check_reloc_and_exec(struct kgem *kgem, int n)
@@ -478,8 +599,10 @@ static inline bool kgem_check_batch_with_surfaces(struct kgem *kgem,
 						  int num_dwords,
 						  int num_surfaces)
 {
-	return (int)(kgem->nbatch + num_dwords + KGEM_BATCH_RESERVED) <= (int)(kgem->surface - num_surfaces*8) &&
-		kgem_check_reloc(kgem, num_surfaces) &&
+	if ((int)(kgem->nbatch + num_dwords + KGEM_BATCH_RESERVED) > (int)(kgem->surface - num_surfaces*8))
+		return __kgem_flush_for(kgem, KGEM_FLUSH_BATCH);
+
+	return kgem_check_reloc(kgem, num_surfaces) &&
 		kgem_check_exec(kgem, num_surfaces);
 }
 
@@ -846,6 +969,14 @@ bool kgem_cleanup_cache(struct kgem *kgem);
 
 void kgem_clean_scanout_cache(struct kgem *kgem);
 void kgem_clean_large_cache(struct kgem *kgem);
+void kgem_cache_dump(struct kgem *kgem);
+void kgem_flush_dump(struct kgem *kgem);
+bool kgem_trace_open(struct kgem *kgem, const char *path);
+void kgem_trace_close(struct kgem *kgem);
+bool kgem_capture_open(struct kgem *kgem, const char *path);
+void kgem_capture_close(struct kgem *kgem);
+void kgem_set_cache_limit(struct kgem *kgem, uint64_t limit);
+void kgem_pressure_close(struct kgem *kgem);
 
 #if HAS_DEBUG_FULL
 void __kgem_batch_debug(struct kgem *kgem, uint32_t nbatch);
@@ -897,6 +1028,47 @@ memcpy_from_tiled_x(struct kgem *kgem,
 					 width, height);
 }
 
+static inline void
+memcpy_to_tiled_y(struct kgem *kgem,
+		  const void *src, void *dst, int bpp,
+		  int32_t src_stride, int32_t dst_stride,
+		  int16_t src_x, int16_t src_y,
+		  int16_t dst_x, int16_t dst_y,
+		  uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_to_tiled_y);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_to_tiled_y(src, dst, bpp,
+				       src_stride, dst_stride,
+				       src_x, src_y,
+				       dst_x, dst_y,
+				       width, height);
+}
+
+static inline void
+memcpy_from_tiled_y(struct kgem *kgem,
+		    const void *src, void *dst, int bpp,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_from_tiled_y);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_from_tiled_y(src, dst, bpp,
+					 src_stride, dst_stride,
+					 src_x, src_y,
+					 dst_x, dst_y,
+					 width, height);
+}
+
 void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu);
+void choose_memcpy_tiled_y(struct kgem *kgem, int swizzling, unsigned cpu);
 
 #endif /* KGEM_H */
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef KGEM_BACKEND_H
+#define KGEM_BACKEND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* All of kgem's requests to the kernel go through a single ioctl entry
+ * point, which may be replaced (before kgem_init()) to run kgem without
+ * a GPU. The backend must behave as ioctl(2), returning 0 or -1 and
+ * setting errno, and mmap(2) of the fd at the offset returned by
+ * MMAP_GTT must map the object.
+ */
+struct kgem_backend {
+	const char *name;
+	int (*ioctl)(int fd, unsigned long request, void *arg);
+};
+
+void kgem_set_backend(const struct kgem_backend *backend);
+
+#endif /* KGEM_BACKEND_H */
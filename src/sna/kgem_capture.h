@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#ifndef KGEM_CAPTURE_H
+#define KGEM_CAPTURE_H
+
+#include <stdint.h>
+
+/* With Option "CaptureBatches", every batch submitted is appended to a
+ * file along with its execobject list, its relocations and the contents
+ * of the smaller buffers it references (typically the vertices and the
+ * indirect state), so that tools/sna-batch-decode can decode it later on
+ * another machine.
+ *
+ * The file is a struct kgem_capture followed by one record per batch:
+ *
+ *	struct kgem_capture_batch
+ *	struct kgem_capture_exec	[nexec], the batch last
+ *	struct kgem_capture_reloc	[nreloc]
+ *	struct kgem_capture_bo + data	[nbo], each padded to 8 bytes
+ *
+ * Relocations refer to their target by its index in the exec list, not by
+ * its handle, and are all recorded even when the kernel was not told about
+ * them because the target was softpinned.
+ */
+
+#define KGEM_CAPTURE_MAGIC 0x4b474350 /* "KGCP" */
+#define KGEM_CAPTURE_VERSION 1
+#define KGEM_CAPTURE_MAX_BO (64 << 10) /* bytes, the batch is always kept */
+
+struct kgem_capture {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t gen;		/* as kgem->gen, i.e. 070 for Ivybridge */
+	uint32_t pid;
+};
+
+struct kgem_capture_batch {
+	uint32_t length;	/* bytes in this record, including this header */
+	uint32_t seqno;		/* low 32 bits of the batch count, from 1 */
+	uint32_t flags;		/* execbuffer flags, including the ring */
+	uint32_t nbatch;	/* dwords of commands before the surface state */
+	uint32_t nexec;
+	uint32_t nreloc;
+	uint32_t nbo;
+	uint32_t pad;
+};
+
+struct kgem_capture_exec {
+	uint32_t handle;
+	uint32_t size;		/* bytes */
+	uint32_t flags;		/* EXEC_OBJECT_* */
+	uint32_t tiling;
+	uint64_t offset;	/* presumed or pinned address */
+};
+
+struct kgem_capture_reloc {
+	uint32_t offset;	/* bytes into the batch */
+	uint32_t target;	/* index into the exec list */
+	uint32_t delta;
+	uint16_t read_domains;
+	uint16_t write_domain;
+};
+
+struct kgem_capture_bo {
+	uint32_t index;		/* into the exec list */
+	uint32_t size;		/* bytes of data that follow */
+};
+
+#endif /* KGEM_CAPTURE_H */
@@ -548,20 +548,10 @@ static int (*decode_2d(int gen))(struct kgem*, uint32_t)
 		return __decode_2d;
 }
 
-static int kgem_nop_decode_3d(struct kgem *kgem, uint32_t offset)
-{
-    uint32_t *data = kgem->batch + offset;
-    return (data[0] & 0xf) + 2;
-}
-
-static void kgem_nop_finish_state(struct kgem *kgem)
-{
-}
-
 static int (*decode_3d(int gen))(struct kgem*, uint32_t)
 {
 	if (gen >= 0100) {
-		return kgem_nop_decode_3d;
+		return kgem_gen8_decode_3d;
 	} else if (gen >= 070) {
 		return kgem_gen7_decode_3d;
 	} else if (gen >= 060) {
@@ -581,7 +571,7 @@ static int (*decode_3d(int gen))(struct kgem*, uint32_t)
 static void (*finish_state(int gen))(struct kgem*)
 {
 	if (gen >= 0100) {
-		return kgem_nop_finish_state;
+		return kgem_gen8_finish_state;
 	} else if (gen >= 070) {
 		return kgem_gen7_finish_state;
 	} else if (gen >= 060) {
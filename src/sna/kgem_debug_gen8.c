@@ -0,0 +1,488 @@
+/*
+ * Copyright © 2007-2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "sna.h"
+#include "sna_reg.h"
+#include "gen8_render.h"
+
+#include "kgem_debug.h"
+
+/* Also used for gen9, whose 3D pipeline only differs from gen8 in the
+ * commands that SNA does not emit.
+ */
+
+static struct state {
+	struct vertex_buffer {
+		const char *ptr;
+		int pitch;
+	} vb[33];
+	struct vertex_elements {
+		int buffer;
+		int offset;
+		bool valid;
+		uint32_t type;
+		uint8_t swizzle[4];
+	} ve[33];
+	int num_ve;
+	uint32_t topology;
+} state;
+
+static void *get_reloc_target(struct kgem *kgem, uint32_t offset, uint32_t *delta)
+{
+	uint32_t reloc = sizeof(uint32_t) * offset;
+	struct kgem_bo *bo;
+	int i;
+
+	for (i = 0; i < kgem->nreloc; i++)
+		if (kgem->reloc[i].offset == reloc)
+			break;
+	if (i == kgem->nreloc)
+		return NULL;
+
+	*delta = kgem->reloc[i].delta;
+	reloc = kgem->reloc[i].target_handle;
+	if (reloc == 0)
+		return kgem->batch;
+
+	list_for_each_entry(bo, &kgem->next_request->buffers, request)
+		if (bo->handle == reloc)
+			return kgem_bo_map__debug(kgem, bo);
+
+	return NULL;
+}
+
+static void gen8_update_vertex_buffer(struct kgem *kgem, uint32_t offset)
+{
+	const uint32_t *data = kgem->batch + offset;
+	uint32_t delta = 0;
+	char *base;
+	int i;
+
+	i = data[0] >> 26;
+	base = get_reloc_target(kgem, offset + 1, &delta);
+
+	state.vb[i].ptr = base ? base + delta : NULL;
+	state.vb[i].pitch = data[0] & 0xfff;
+}
+
+static uint32_t
+get_ve_component(uint32_t data, int component)
+{
+	return (data >> (16 + (3 - component) * 4)) & 0x7;
+}
+
+static void gen8_update_vertex_elements(struct kgem *kgem, int id, const uint32_t *data)
+{
+	state.ve[id].buffer = data[0] >> 26;
+	state.ve[id].valid = !!(data[0] & (1 << 25));
+	state.ve[id].type = (data[0] >> 16) & 0x1ff;
+	state.ve[id].offset = data[0] & 0x7ff;
+	state.ve[id].swizzle[0] = get_ve_component(data[1], 0);
+	state.ve[id].swizzle[1] = get_ve_component(data[1], 1);
+	state.ve[id].swizzle[2] = get_ve_component(data[1], 2);
+	state.ve[id].swizzle[3] = get_ve_component(data[1], 3);
+}
+
+static void component_out(uint8_t swizzle, const char *value)
+{
+	switch (swizzle) {
+	case 0: ErrorF("#"); break;
+	case 1: ErrorF("%s", value); break;
+	case 2: ErrorF("0.0"); break;
+	case 3: ErrorF("1.0"); break;
+	case 4: ErrorF("0x1"); break;
+	case 5: ErrorF("VID"); break;
+	default: ErrorF("?");
+	}
+}
+
+static void ve_out(const struct vertex_elements *ve, const void *ptr)
+{
+	const float *f = ptr;
+	const int16_t *v = ptr;
+	char buf[32];
+	int c, max;
+	bool is_float;
+
+	switch (ve->type) {
+	case SURFACEFORMAT_R32_FLOAT: max = 1; is_float = true; break;
+	case SURFACEFORMAT_R32G32_FLOAT: max = 2; is_float = true; break;
+	case SURFACEFORMAT_R32G32B32_FLOAT: max = 3; is_float = true; break;
+	case SURFACEFORMAT_R32G32B32A32_FLOAT: max = 4; is_float = true; break;
+	case SURFACEFORMAT_R16_SINT:
+	case SURFACEFORMAT_R16_SSCALED: max = 1; is_float = false; break;
+	case SURFACEFORMAT_R16G16_SINT:
+	case SURFACEFORMAT_R16G16_SSCALED: max = 2; is_float = false; break;
+	case SURFACEFORMAT_R16G16B16A16_SINT:
+	case SURFACEFORMAT_R16G16B16A16_SSCALED: max = 4; is_float = false; break;
+	default: ErrorF("(format 0x%03x)", ve->type); return;
+	}
+
+	ErrorF("(");
+	for (c = 0; c < 4; c++) {
+		if (c >= max)
+			strcpy(buf, "1.0");
+		else if (is_float)
+			snprintf(buf, sizeof(buf), "%f", f[c]);
+		else
+			snprintf(buf, sizeof(buf), "%d", v[c]);
+		component_out(ve->swizzle[c], buf);
+		if (c < 3)
+			ErrorF(", ");
+	}
+	ErrorF(")");
+}
+
+static void primitive_out(struct kgem *kgem, uint32_t *data)
+{
+	int n, i;
+
+	assert((data[1] & (1<<8)) == 0); /* XXX index buffers */
+
+	for (n = 0; n < data[2]; n++) {
+		int v = data[3] + n;
+		const char *sep = "";
+
+		ErrorF("	[%d:%d] = ", n, v);
+		for (i = 0; i < state.num_ve; i++) {
+			const struct vertex_elements *ve = &state.ve[i];
+			const struct vertex_buffer *vb = &state.vb[ve->buffer];
+
+			if (!ve->valid)
+				continue;
+
+			ErrorF("%s", sep);
+			if (vb->ptr)
+				ve_out(ve, vb->ptr + v * vb->pitch + ve->offset);
+			else
+				ErrorF("(not captured)");
+			sep = ", ";
+		}
+		ErrorF("\n");
+	}
+}
+
+static void
+state_base_out(uint32_t *data, uint32_t offset, unsigned int index,
+	       const char *name)
+{
+	if (data[index] & 1)
+		kgem_debug_print(data, offset, index,
+				 "%s state base address 0x%08x%08x\n",
+				 name, data[index+1], data[index] & ~1);
+	else
+		kgem_debug_print(data, offset, index,
+				 "%s state base not updated\n",
+				 name);
+}
+
+static void
+state_size_out(uint32_t *data, uint32_t offset, unsigned int index,
+	       const char *name)
+{
+	if (data[index] & 1)
+		kgem_debug_print(data, offset, index,
+				 "%s state size %d pages\n",
+				 name, data[index] >> 12);
+	else
+		kgem_debug_print(data, offset, index,
+				 "%s state size not updated\n",
+				 name);
+}
+
+static const char *
+get_element_component(uint32_t data, int component)
+{
+	uint32_t component_control = (data >> (16 + (3 - component) * 4)) & 0x7;
+
+	switch (component_control) {
+	case 0:
+		return "nostore";
+	case 1:
+		switch (component) {
+		case 0: return "X";
+		case 1: return "Y";
+		case 2: return "Z";
+		case 3: return "W";
+		default: return "fail";
+		}
+	case 2:
+		return "0.0";
+	case 3:
+		return "1.0";
+	case 4:
+		return "0x1";
+	case 5:
+		return "VID";
+	case 6:
+		return "IID";
+	case 7:
+		return "PID";
+	default:
+		return "fail";
+	}
+}
+
+static const char *
+get_prim_type(uint32_t data)
+{
+	switch (data & 0x3f) {
+	case 0x01: return "point list";
+	case 0x02: return "line list";
+	case 0x03: return "line strip";
+	case 0x04: return "tri list";
+	case 0x05: return "tri strip";
+	case 0x06: return "tri fan";
+	case 0x07: return "quad list";
+	case 0x08: return "quad strip";
+	case 0x0e: return "polygon";
+	case 0x0f: return "rect list";
+	case 0x10: return "line loop";
+	default: return "fail";
+	}
+}
+
+int kgem_gen8_decode_3d(struct kgem *kgem, uint32_t offset)
+{
+	static const struct {
+		uint32_t opcode;
+		int min_len;
+		int max_len;
+		const char *name;
+	} opcodes[] = {
+		{ 0x6102, 3, 3, "STATE_SIP" },
+		{ 0x6904, 1, 1, "PIPELINE_SELECT" },
+		{ 0x680b, 1, 1, "3DSTATE_VF_STATISTICS" },
+		{ 0x7804, 3, 3, "3DSTATE_CLEAR_PARAMS" },
+		{ 0x7805, 8, 8, "3DSTATE_DEPTH_BUFFER" },
+		{ 0x7806, 5, 5, "3DSTATE_STENCIL_BUFFER" },
+		{ 0x7807, 5, 5, "3DSTATE_HIER_DEPTH_BUFFER" },
+		{ 0x780a, 5, 5, "3DSTATE_INDEX_BUFFER" },
+		{ 0x780c, 2, 2, "3DSTATE_VF" },
+		{ 0x780d, 2, 2, "3DSTATE_MULTISAMPLE" },
+		{ 0x780e, 2, 2, "3DSTATE_CC_STATE_POINTERS" },
+		{ 0x780f, 2, 2, "3DSTATE_SCISSOR_STATE_POINTERS" },
+		{ 0x7810, 9, 9, "3DSTATE_VS" },
+		{ 0x7811, 10, 10, "3DSTATE_GS" },
+		{ 0x7812, 4, 4, "3DSTATE_CLIP" },
+		{ 0x7813, 4, 4, "3DSTATE_SF" },
+		{ 0x7814, 2, 2, "3DSTATE_WM" },
+		{ 0x7815, 11, 11, "3DSTATE_CONSTANT_VS" },
+		{ 0x7816, 11, 11, "3DSTATE_CONSTANT_GS" },
+		{ 0x7817, 11, 11, "3DSTATE_CONSTANT_PS" },
+		{ 0x7818, 2, 2, "3DSTATE_SAMPLE_MASK" },
+		{ 0x7819, 11, 11, "3DSTATE_CONSTANT_HS" },
+		{ 0x781a, 11, 11, "3DSTATE_CONSTANT_DS" },
+		{ 0x781b, 9, 9, "3DSTATE_HS" },
+		{ 0x781c, 4, 4, "3DSTATE_TE" },
+		{ 0x781d, 9, 11, "3DSTATE_DS" },
+		{ 0x781e, 5, 5, "3DSTATE_STREAMOUT" },
+		{ 0x781f, 4, 6, "3DSTATE_SBE" },
+		{ 0x7820, 12, 12, "3DSTATE_PS" },
+		{ 0x7821, 2, 2, "3DSTATE_VIEWPORT_STATE_POINTERS_SF_CLIP" },
+		{ 0x7823, 2, 2, "3DSTATE_VIEWPORT_STATE_POINTERS_CC" },
+		{ 0x7824, 2, 2, "3DSTATE_BLEND_STATE_POINTERS" },
+		{ 0x7826, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_VS" },
+		{ 0x7827, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_HS" },
+		{ 0x7828, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_DS" },
+		{ 0x7829, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_GS" },
+		{ 0x782a, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_PS" },
+		{ 0x782b, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_VS" },
+		{ 0x782c, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_HS" },
+		{ 0x782d, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_DS" },
+		{ 0x782e, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_GS" },
+		{ 0x782f, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_PS" },
+		{ 0x7830, 2, 2, "3DSTATE_URB_VS" },
+		{ 0x7831, 2, 2, "3DSTATE_URB_HS" },
+		{ 0x7832, 2, 2, "3DSTATE_URB_DS" },
+		{ 0x7833, 2, 2, "3DSTATE_URB_GS" },
+		{ 0x7849, 3, 3, "3DSTATE_VF_INSTANCING" },
+		{ 0x784a, 2, 2, "3DSTATE_VF_SGVS" },
+		{ 0x784c, 4, 4, "3DSTATE_WM_CHROMAKEY" },
+		{ 0x784d, 2, 2, "3DSTATE_PS_BLEND" },
+		{ 0x784e, 3, 4, "3DSTATE_WM_DEPTH_STENCIL" },
+		{ 0x784f, 2, 2, "3DSTATE_PS_EXTRA" },
+		{ 0x7850, 5, 5, "3DSTATE_RASTER" },
+		{ 0x7851, 11, 11, "3DSTATE_SBE_SWIZ" },
+		{ 0x7852, 5, 5, "3DSTATE_WM_HZ_OP" },
+		{ 0x7900, 4, 4, "3DSTATE_DRAWING_RECTANGLE" },
+		{ 0x7912, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_VS" },
+		{ 0x7913, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_HS" },
+		{ 0x7914, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_DS" },
+		{ 0x7915, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_GS" },
+		{ 0x7916, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_PS" },
+		{ 0x7917, 2, 0xff, "3DSTATE_SO_DECL_LIST" },
+		{ 0x7918, 8, 8, "3DSTATE_SO_BUFFER" },
+		{ 0x7919, 4, 4, "3DSTATE_BINDING_TABLE_POOL_ALLOC" },
+		{ 0x791a, 4, 4, "3DSTATE_GATHER_BUFFER_POOL_ALLOC" },
+	};
+	uint32_t *data = kgem->batch + offset;
+	uint32_t op;
+	unsigned int len;
+	int i;
+	const char *name;
+
+	len = (data[0] & 0xff) + 2;
+	op = (data[0] & 0xffff0000) >> 16;
+	if (op == 0x6904 || op == 0x680b)
+		len = 1;
+	switch (op) {
+	case 0x6101:
+		i = 0;
+		kgem_debug_print(data, offset, i++, "STATE_BASE_ADDRESS\n");
+		assert(len == 16 || len == 19);
+
+		state_base_out(data, offset, i, "general"); i += 2;
+		kgem_debug_print(data, offset, i++, "stateless dataport\n");
+		state_base_out(data, offset, i, "surface"); i += 2;
+		state_base_out(data, offset, i, "dynamic"); i += 2;
+		state_base_out(data, offset, i, "indirect"); i += 2;
+		state_base_out(data, offset, i, "instruction"); i += 2;
+
+		state_size_out(data, offset, i++, "general");
+		state_size_out(data, offset, i++, "dynamic");
+		state_size_out(data, offset, i++, "indirect");
+		state_size_out(data, offset, i++, "instruction");
+
+		if (len == 19) {
+			state_base_out(data, offset, i, "bindless surface"); i += 2;
+			state_size_out(data, offset, i++, "bindless surface");
+		}
+		return len;
+
+	case 0x7808:
+		assert((len - 1) % 4 == 0);
+		kgem_debug_print(data, offset, 0, "3DSTATE_VERTEX_BUFFERS\n");
+
+		for (i = 1; i < len;) {
+			gen8_update_vertex_buffer(kgem, offset + i);
+
+			kgem_debug_print(data, offset, i, "buffer %d: pitch %db%s\n",
+					 data[i] >> 26,
+					 data[i] & 0x0fff,
+					 data[i] & (1 << 14) ? "" : ", not modified");
+			i++;
+			kgem_debug_print(data, offset, i++, "buffer address\n");
+			kgem_debug_print(data, offset, i++, "buffer address, upper\n");
+			kgem_debug_print(data, offset, i, "buffer size %d\n", data[i]);
+			i++;
+		}
+		return len;
+
+	case 0x7809:
+		assert((len + 1) % 2 == 0);
+		kgem_debug_print(data, offset, 0, "3DSTATE_VERTEX_ELEMENTS\n");
+
+		state.num_ve = (len - 1) / 2;
+		for (i = 1; i < len;) {
+			gen8_update_vertex_elements(kgem, (i - 1)/2, data + i);
+
+			kgem_debug_print(data, offset, i, "buffer %d: %svalid, type 0x%04x, "
+					 "src offset 0x%04x bytes\n",
+					 data[i] >> 26,
+					 data[i] & (1 << 25) ? "" : "in",
+					 (data[i] >> 16) & 0x1ff,
+					 data[i] & 0x07ff);
+			i++;
+			kgem_debug_print(data, offset, i, "(%s, %s, %s, %s)\n",
+					 get_element_component(data[i], 0),
+					 get_element_component(data[i], 1),
+					 get_element_component(data[i], 2),
+					 get_element_component(data[i], 3));
+			i++;
+		}
+		return len;
+
+	case 0x784b:
+		assert(len == 2);
+		state.topology = data[1];
+		kgem_debug_print(data, offset, 0, "3DSTATE_VF_TOPOLOGY\n");
+		kgem_debug_print(data, offset, 1, "type %s\n",
+				 get_prim_type(data[1]));
+		return len;
+
+	case 0x7a00:
+		assert(len == 6);
+		kgem_debug_print(data, offset, 0, "PIPE_CONTROL\n");
+		kgem_debug_print(data, offset, 1, "flags 0x%08x%s%s%s%s\n",
+				 data[1],
+				 data[1] & (1 << 20) ? ", cs stall" : "",
+				 data[1] & (1 << 12) ? ", render flush" : "",
+				 data[1] & (1 << 11) ? ", texture invalidate" : "",
+				 data[1] & (1 << 14) ? ", post-sync" : "");
+		kgem_debug_print(data, offset, 2, "address\n");
+		kgem_debug_print(data, offset, 3, "address, upper\n");
+		kgem_debug_print(data, offset, 4, "immediate\n");
+		kgem_debug_print(data, offset, 5, "immediate, upper\n");
+		return len;
+
+	case 0x7b00:
+		assert(len == 7);
+		kgem_debug_print(data, offset, 0, "3DPRIMITIVE\n");
+		kgem_debug_print(data, offset, 1, "type %s, %s\n",
+				 get_prim_type(state.topology),
+				 (data[1] & (1 << 8)) ? "random" : "sequential");
+		kgem_debug_print(data, offset, 2, "vertex count\n");
+		kgem_debug_print(data, offset, 3, "start vertex\n");
+		kgem_debug_print(data, offset, 4, "instance count\n");
+		kgem_debug_print(data, offset, 5, "start instance\n");
+		kgem_debug_print(data, offset, 6, "index bias\n");
+		primitive_out(kgem, data);
+		return len;
+	}
+
+	/* For the rest, just dump the bytes */
+	name = NULL;
+	for (i = 0; i < ARRAY_SIZE(opcodes); i++)
+		if (op == opcodes[i].opcode) {
+			name = opcodes[i].name;
+			break;
+		}
+
+	if (name == NULL) {
+		kgem_debug_print(data, offset, 0, "unknown\n");
+	} else {
+		kgem_debug_print(data, offset, 0, "%s\n", opcodes[i].name);
+		if (opcodes[i].max_len > 1) {
+			assert(len >= opcodes[i].min_len &&
+					len <= opcodes[i].max_len);
+		}
+	}
+	for (i = 1; i < len; i++)
+		kgem_debug_print(data, offset, i, "dword %d\n", i);
+
+	return len;
+}
+
+void kgem_gen8_finish_state(struct kgem *kgem)
+{
+	memset(&state, 0, sizeof(state));
+}
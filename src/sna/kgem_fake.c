@@ -0,0 +1,1015 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* A userspace stand-in for the i915 GEM ioctls, so that kgem and the
+ * render backends can be run and profiled without a GPU.
+ *
+ * Every object is a page-aligned range of a single memory file, which is
+ * also the fd handed back to kgem: a GTT mmap is then just mmap(2) of the
+ * fd at the object's offset in the file, and the CPU and WC mmap ioctls
+ * map the same range. All views share the same linear backing store, so
+ * tiled objects read back through the GTT in their tiled layout.
+ *
+ * Execbuffers are validated and relocated as the kernel would: objects
+ * are bound into a fake GTT (rebinding everything once it is full), stale
+ * relocations are rewritten, and the objects are busy until the
+ * configured latency has elapsed. Nothing in the batch is executed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <xf86drm.h>
+#include <i915_drm.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "kgem_fake.h"
+
+#define PAGE_SIZE 4096
+#define ARENA_CHUNK (1ull << 32)
+
+#define LOCAL_I915_PARAM_CHIPSET_ID		4
+#define LOCAL_I915_PARAM_HAS_GEM		5
+#define LOCAL_I915_PARAM_NUM_FENCES_AVAIL	6
+#define LOCAL_I915_PARAM_HAS_EXECBUF2		9
+#define LOCAL_I915_PARAM_HAS_BLT		11
+#define LOCAL_I915_PARAM_HAS_RELAXED_FENCING	12
+#define LOCAL_I915_PARAM_HAS_RELAXED_DELTA	15
+#define LOCAL_I915_PARAM_HAS_LLC		17
+#define LOCAL_I915_PARAM_HAS_ALIASING_PPGTT	18
+#define LOCAL_I915_PARAM_HAS_WAIT_TIMEOUT	19
+#define LOCAL_I915_PARAM_HAS_SEMAPHORES		20
+#define LOCAL_I915_PARAM_HAS_NO_RELOC		25
+#define LOCAL_I915_PARAM_HAS_HANDLE_LUT		26
+#define LOCAL_I915_PARAM_HAS_WT			27
+#define LOCAL_I915_PARAM_MMAP_VERSION		30
+#define LOCAL_I915_PARAM_HAS_EXEC_SOFTPIN	37
+
+#define LOCAL_I915_EXEC_NO_RELOC		(1<<11)
+#define LOCAL_I915_EXEC_HANDLE_LUT		(1<<12)
+#define LOCAL_I915_EXEC_BATCH_FIRST		(1<<18)
+
+#define LOCAL_EXEC_OBJECT_NEEDS_FENCE		(1<<0)
+#define LOCAL_EXEC_OBJECT_WRITE			(1<<2)
+#define LOCAL_EXEC_OBJECT_SUPPORTS_48B		(1<<3)
+#define LOCAL_EXEC_OBJECT_PINNED		(1<<4)
+
+#define LOCAL_I915_GEM_SET_CACHING		0x2f
+#define LOCAL_I915_GEM_GET_CACHING		0x30
+#define LOCAL_I915_GEM_WAIT			0x2c
+#define LOCAL_I915_GEM_USERPTR			0x33
+#define LOCAL_I915_GEM_CONTEXT_GETPARAM		0x34
+#define LOCAL_I915_MMAP_WC			0x1
+#define LOCAL_CONTEXT_PARAM_GTT_SIZE		0x3
+
+struct local_i915_gem_mmap2 {
+	uint32_t handle;
+	uint32_t pad;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t addr_ptr;
+	uint64_t flags;
+};
+
+struct local_i915_gem_get_tiling_v2 {
+	uint32_t handle;
+	uint32_t tiling_mode;
+	uint32_t swizzle_mode;
+	uint32_t phys_swizzle_mode;
+};
+
+struct local_i915_gem_caching {
+	uint32_t handle;
+	uint32_t caching;
+};
+
+struct local_i915_gem_wait {
+	uint32_t handle;
+	uint32_t flags;
+	int64_t timeout;
+};
+
+struct local_i915_gem_userptr {
+	uint64_t user_ptr;
+	uint64_t user_size;
+	uint32_t flags;
+	uint32_t handle;
+};
+
+struct local_i915_gem_context_param {
+	uint32_t context;
+	uint32_t size;
+	uint64_t param;
+	uint64_t value;
+};
+
+struct fake_object {
+	uint64_t size;
+	uint64_t file_offset;	/* in the arena, unless userptr */
+	void *ptr;		/* our own mapping, for relocations */
+	void *userptr;
+
+	uint64_t offset;	/* in the fake GTT, 0 if unbound */
+	uint64_t busy_until;
+	uint32_t busy;		/* as reported by GEM_BUSY */
+
+	uint32_t tiling, stride;
+	uint32_t caching;
+	uint32_t madv;
+};
+
+static struct fake_device {
+	pthread_mutex_t lock;
+	int fd;
+	struct kgem_fake_config config;
+	struct kgem_fake_stats stats;
+
+	struct fake_object **objects;
+	uint32_t num_objects;	/* size of the handle table */
+	uint32_t *free_handles;
+	uint32_t num_free;
+
+	uint64_t arena_size, arena_end;
+	uint64_t gtt_next;
+
+	unsigned fail_execbuffers;	/* see kgem_fake_fail_execbuffers() */
+} fake = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t target)
+{
+	uint64_t now = now_ns();
+
+	if (target > now) {
+		struct timespec ts;
+
+		ts.tv_sec = (target - now) / 1000000000;
+		ts.tv_nsec = (target - now) % 1000000000;
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+	}
+}
+
+static struct fake_object *lookup(uint32_t handle)
+{
+	if (handle == 0 || handle >= fake.num_objects)
+		return NULL;
+
+	return fake.objects[handle];
+}
+
+static int object_busy(struct fake_object *obj)
+{
+	if (obj->busy && now_ns() >= obj->busy_until)
+		obj->busy = 0;
+
+	return obj->busy != 0;
+}
+
+static void object_wait(struct fake_object *obj)
+{
+	if (object_busy(obj)) {
+		fake.stats.waits++;
+		sleep_until(obj->busy_until);
+		obj->busy = 0;
+	}
+}
+
+static uint32_t new_handle(struct fake_object *obj)
+{
+	uint32_t handle;
+
+	if (fake.num_free) {
+		handle = fake.free_handles[--fake.num_free];
+	} else {
+		if (fake.num_objects == 0)
+			fake.num_objects = 1; /* handle 0 is invalid */
+
+		if ((fake.num_objects & (fake.num_objects - 1)) == 0 ||
+		    fake.num_objects == 1) {
+			struct fake_object **objects;
+			uint32_t *free_handles;
+			uint32_t size = 2 * fake.num_objects;
+
+			objects = realloc(fake.objects, size * sizeof(*objects));
+			if (objects == NULL)
+				return 0;
+			fake.objects = objects;
+
+			free_handles = realloc(fake.free_handles,
+					       size * sizeof(*free_handles));
+			if (free_handles == NULL)
+				return 0;
+			fake.free_handles = free_handles;
+		}
+
+		handle = fake.num_objects++;
+	}
+
+	fake.objects[handle] = obj;
+	fake.stats.objects++;
+	fake.stats.bytes += obj->size;
+	return handle;
+}
+
+static int fake_create(struct drm_i915_gem_create *arg)
+{
+	struct fake_object *obj;
+	uint64_t size;
+
+	if (arg->size == 0)
+		return -EINVAL;
+
+	size = (arg->size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+	if (fake.arena_end + size > fake.arena_size) {
+		uint64_t arena_size = fake.arena_size + ARENA_CHUNK;
+
+		while (fake.arena_end + size > arena_size)
+			arena_size += ARENA_CHUNK;
+
+		/* sparse, only the pages we touch are allocated */
+		if (ftruncate(fake.fd, arena_size))
+			return -ENOMEM;
+		fake.arena_size = arena_size;
+	}
+
+	obj = calloc(1, sizeof(*obj));
+	if (obj == NULL)
+		return -ENOMEM;
+
+	obj->size = size;
+	obj->file_offset = fake.arena_end;
+	obj->caching = fake.config.has_llc;
+
+	arg->handle = new_handle(obj);
+	if (arg->handle == 0) {
+		free(obj);
+		return -ENOMEM;
+	}
+
+	fake.arena_end += size;
+	return 0;
+}
+
+static int fake_userptr(struct local_i915_gem_userptr *arg)
+{
+	struct fake_object *obj;
+
+	if (arg->user_ptr & (PAGE_SIZE - 1) ||
+	    arg->user_size & (PAGE_SIZE - 1) ||
+	    arg->user_size == 0)
+		return -EINVAL;
+
+	obj = calloc(1, sizeof(*obj));
+	if (obj == NULL)
+		return -ENOMEM;
+
+	obj->size = arg->user_size;
+	obj->userptr = (void *)(uintptr_t)arg->user_ptr;
+	obj->caching = 1;
+
+	arg->handle = new_handle(obj);
+	if (arg->handle == 0) {
+		free(obj);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int fake_close(struct drm_gem_close *arg)
+{
+	struct fake_object *obj = lookup(arg->handle);
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	if (obj->ptr)
+		munmap(obj->ptr, obj->size);
+
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	/* return the pages, the range of the arena is never reused */
+	if (obj->userptr == NULL)
+		(void)fallocate(fake.fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				obj->file_offset, obj->size);
+#endif
+
+	fake.stats.objects--;
+	fake.stats.bytes -= obj->size;
+
+	fake.objects[arg->handle] = NULL;
+	fake.free_handles[fake.num_free++] = arg->handle;
+	free(obj);
+	return 0;
+}
+
+static void *object_ptr(struct fake_object *obj)
+{
+	if (obj->userptr)
+		return obj->userptr;
+
+	if (obj->ptr == NULL) {
+		void *ptr = mmap(0, obj->size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fake.fd, obj->file_offset);
+		if (ptr == MAP_FAILED)
+			return NULL;
+
+		obj->ptr = ptr;
+	}
+
+	return obj->ptr;
+}
+
+static int fake_pwrite(struct drm_i915_gem_pwrite *arg)
+{
+	struct fake_object *obj = lookup(arg->handle);
+	const void *src = (const void *)(uintptr_t)arg->data_ptr;
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	if (arg->offset > obj->size || arg->size > obj->size - arg->offset)
+		return -EINVAL;
+
+	object_wait(obj);
+
+	if (obj->userptr) {
+		memcpy((char *)obj->userptr + arg->offset, src, arg->size);
+		return 0;
+	}
+
+	if (pwrite(fake.fd, src, arg->size,
+		   obj->file_offset + arg->offset) != (ssize_t)arg->size)
+		return -EFAULT;
+
+	return 0;
+}
+
+static int fake_pread(struct drm_i915_gem_pread *arg)
+{
+	struct fake_object *obj = lookup(arg->handle);
+	void *dst = (void *)(uintptr_t)arg->data_ptr;
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	if (arg->offset > obj->size || arg->size > obj->size - arg->offset)
+		return -EINVAL;
+
+	object_wait(obj);
+
+	if (obj->userptr) {
+		memcpy(dst, (char *)obj->userptr + arg->offset, arg->size);
+		return 0;
+	}
+
+	if (pread(fake.fd, dst, arg->size,
+		  obj->file_offset + arg->offset) != (ssize_t)arg->size)
+		return -EFAULT;
+
+	return 0;
+}
+
+static int fake_mmap(struct local_i915_gem_mmap2 *arg, bool has_flags)
+{
+	struct fake_object *obj = lookup(arg->handle);
+	void *ptr;
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	if (obj->userptr)
+		return -EINVAL;
+
+	if (has_flags && arg->flags & ~LOCAL_I915_MMAP_WC)
+		return -EINVAL;
+
+	if (arg->offset > obj->size || arg->size > obj->size - arg->offset)
+		return -EINVAL;
+
+	ptr = mmap(0, arg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fake.fd, obj->file_offset + arg->offset);
+	if (ptr == MAP_FAILED)
+		return -ENOMEM;
+
+	arg->addr_ptr = (uintptr_t)ptr;
+	return 0;
+}
+
+static int fake_mmap_gtt(struct drm_i915_gem_mmap_gtt *arg)
+{
+	struct fake_object *obj = lookup(arg->handle);
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	if (obj->userptr)
+		return -EINVAL;
+
+	arg->offset = obj->file_offset;
+	return 0;
+}
+
+static uint32_t x_swizzle(void)
+{
+	return fake.config.swizzle;
+}
+
+static uint32_t y_swizzle(void)
+{
+	/* Y tiles span 128 bytes per row, so bit 9 is the only row bit */
+	switch (fake.config.swizzle) {
+	case I915_BIT_6_SWIZZLE_9_10: return I915_BIT_6_SWIZZLE_9;
+	case I915_BIT_6_SWIZZLE_9_10_11: return I915_BIT_6_SWIZZLE_9_11;
+	default: return fake.config.swizzle;
+	}
+}
+
+static uint32_t swizzle_for(uint32_t tiling)
+{
+	switch (tiling) {
+	case I915_TILING_X: return x_swizzle();
+	case I915_TILING_Y: return y_swizzle();
+	default: return I915_BIT_6_SWIZZLE_NONE;
+	}
+}
+
+static bool tiling_ok(uint32_t tiling, uint32_t stride)
+{
+	unsigned gen = fake.config.gen;
+	uint32_t tile_width, max_stride;
+
+	if (tiling == I915_TILING_NONE)
+		return true;
+
+	if (tiling != I915_TILING_X && tiling != I915_TILING_Y)
+		return false;
+
+	if (gen < 030)
+		tile_width = 128;
+	else if (tiling == I915_TILING_Y && gen >= 040)
+		tile_width = 128;
+	else
+		tile_width = 512;
+
+	if (gen >= 070)
+		max_stride = 256*1024;
+	else if (gen >= 040)
+		max_stride = 128*1024;
+	else
+		max_stride = 8*1024;
+
+	if (stride == 0 || stride > max_stride || stride & (tile_width - 1))
+		return false;
+
+	/* Pre-965 needs a power-of-two fence stride */
+	if (gen < 040 && stride & (stride - 1))
+		return false;
+
+	return true;
+}
+
+static int fake_set_tiling(struct drm_i915_gem_set_tiling *arg)
+{
+	struct fake_object *obj = lookup(arg->handle);
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	if (obj->userptr || !tiling_ok(arg->tiling_mode, arg->stride))
+		return -EINVAL;
+
+	obj->tiling = arg->tiling_mode;
+	obj->stride = obj->tiling ? arg->stride : 0;
+	arg->swizzle_mode = swizzle_for(obj->tiling);
+	return 0;
+}
+
+static int fake_get_tiling(struct local_i915_gem_get_tiling_v2 *arg, bool v2)
+{
+	struct fake_object *obj = lookup(arg->handle);
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	arg->tiling_mode = obj->tiling;
+	arg->swizzle_mode = swizzle_for(obj->tiling);
+	if (v2)
+		arg->phys_swizzle_mode = arg->swizzle_mode;
+	return 0;
+}
+
+static int fake_busy(struct drm_i915_gem_busy *arg)
+{
+	struct fake_object *obj = lookup(arg->handle);
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	arg->busy = object_busy(obj) ? obj->busy : 0;
+	return 0;
+}
+
+static int fake_wait(struct local_i915_gem_wait *arg)
+{
+	struct fake_object *obj = lookup(arg->handle);
+	uint64_t now;
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	if (!object_busy(obj))
+		return 0;
+
+	now = now_ns();
+	if (arg->timeout >= 0 &&
+	    obj->busy_until > now + (uint64_t)arg->timeout) {
+		if (arg->timeout) {
+			sleep_until(now + arg->timeout);
+			arg->timeout = 0;
+		}
+		return -ETIME;
+	}
+
+	object_wait(obj);
+	if (arg->timeout > 0)
+		arg->timeout = 0;
+	return 0;
+}
+
+static int fake_set_domain(struct drm_i915_gem_set_domain *arg)
+{
+	struct fake_object *obj = lookup(arg->handle);
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	object_wait(obj);
+	return 0;
+}
+
+static int fake_caching(struct local_i915_gem_caching *arg, bool set)
+{
+	struct fake_object *obj = lookup(arg->handle);
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	if (set) {
+		if (arg->caching > 2)
+			return -EINVAL;
+		obj->caching = arg->caching;
+	} else
+		arg->caching = obj->caching;
+	return 0;
+}
+
+static int fake_madvise(struct drm_i915_gem_madvise *arg)
+{
+	struct fake_object *obj = lookup(arg->handle);
+
+	if (obj == NULL)
+		return -ENOENT;
+
+	/* We never reap purgeable objects */
+	obj->madv = arg->madv;
+	arg->retained = 1;
+	return 0;
+}
+
+static int fake_getparam(drm_i915_getparam_t *arg)
+{
+	const struct kgem_fake_config *c = &fake.config;
+	int v;
+
+	switch (arg->param) {
+	case LOCAL_I915_PARAM_CHIPSET_ID: v = 0; break;
+	case LOCAL_I915_PARAM_HAS_GEM: v = 1; break;
+	case LOCAL_I915_PARAM_NUM_FENCES_AVAIL:
+		v = c->gen >= 070 ? 32 : c->gen >= 040 ? 16 : 8;
+		break;
+	case LOCAL_I915_PARAM_HAS_EXECBUF2: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_BLT: v = c->gen >= 060; break;
+	case LOCAL_I915_PARAM_HAS_RELAXED_FENCING: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_RELAXED_DELTA: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_LLC: v = c->has_llc; break;
+	case LOCAL_I915_PARAM_HAS_ALIASING_PPGTT: v = c->gen >= 0100 ? 2 : 1; break;
+	case LOCAL_I915_PARAM_HAS_WAIT_TIMEOUT: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_SEMAPHORES: v = 0; break;
+	case LOCAL_I915_PARAM_HAS_NO_RELOC: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_HANDLE_LUT: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_WT: v = 0; break;
+	case LOCAL_I915_PARAM_MMAP_VERSION: v = 1; break;
+	case LOCAL_I915_PARAM_HAS_EXEC_SOFTPIN: v = c->gen >= 0100; break;
+	default: return -EINVAL;
+	}
+
+	*arg->value = v;
+	return 0;
+}
+
+static int fake_context_getparam(struct local_i915_gem_context_param *arg)
+{
+	if (arg->param != LOCAL_CONTEXT_PARAM_GTT_SIZE)
+		return -EINVAL;
+
+	arg->value = fake.config.aperture_size;
+	return 0;
+}
+
+static int fake_get_aperture(struct drm_i915_gem_get_aperture *arg)
+{
+	arg->aper_size = fake.config.aperture_size;
+	arg->aper_available_size = fake.config.aperture_size;
+	return 0;
+}
+
+static void unbind_all(void)
+{
+	uint32_t n;
+
+	DBG(("%s: fake GTT full, rebinding\n", __FUNCTION__));
+	for (n = 1; n < fake.num_objects; n++)
+		if (fake.objects[n])
+			fake.objects[n]->offset = 0;
+
+	fake.gtt_next = PAGE_SIZE; /* keep 0 for unbound */
+	fake.stats.rebinds++;
+}
+
+static bool bind(struct fake_object *obj, uint64_t alignment)
+{
+	uint64_t offset;
+
+	if (alignment < PAGE_SIZE)
+		alignment = PAGE_SIZE;
+
+	offset = (fake.gtt_next + alignment - 1) & ~(alignment - 1);
+	if (offset + obj->size > fake.config.aperture_size)
+		return false;
+
+	obj->offset = offset;
+	fake.gtt_next = offset + obj->size;
+	return true;
+}
+
+static int fake_execbuffer2(struct drm_i915_gem_execbuffer2 *eb)
+{
+	struct drm_i915_gem_exec_object2 *exec =
+		(struct drm_i915_gem_exec_object2 *)(uintptr_t)eb->buffers_ptr;
+	const unsigned reloc_size = fake.config.gen >= 0100 ? 8 : 4;
+	const unsigned num_fences =
+		fake.config.gen >= 070 ? 32 : fake.config.gen >= 040 ? 16 : 8;
+	struct fake_object *obj, *batch;
+	uint64_t total = 0, busy_until;
+	unsigned fences = 0;
+	uint32_t busy;
+	unsigned i, j;
+	bool retried = false;
+
+	if (fake.fail_execbuffers) {
+		fake.fail_execbuffers--;
+		return -ENOSPC;
+	}
+
+	if (eb->buffer_count == 0)
+		return -EINVAL;
+
+	if (exec == NULL)
+		return -EFAULT;
+
+	for (i = 0; i < eb->buffer_count; i++) {
+		obj = lookup(exec[i].handle);
+		if (obj == NULL)
+			return -ENOENT;
+
+		for (j = 0; j < i; j++)
+			if (exec[j].handle == exec[i].handle)
+				return -EINVAL;
+
+		if (exec[i].flags & LOCAL_EXEC_OBJECT_NEEDS_FENCE && obj->tiling)
+			fences++;
+
+		total += obj->size;
+	}
+
+	if (total > fake.config.aperture_size || fences > num_fences)
+		return -ENOSPC;
+
+	batch = lookup(exec[eb->flags & LOCAL_I915_EXEC_BATCH_FIRST ? 0 : eb->buffer_count - 1].handle);
+	if ((uint64_t)eb->batch_start_offset + eb->batch_len > batch->size)
+		return -EINVAL;
+
+retry:
+	for (i = 0; i < eb->buffer_count; i++) {
+		obj = lookup(exec[i].handle);
+
+		if (exec[i].flags & LOCAL_EXEC_OBJECT_PINNED) {
+			if (exec[i].offset & (PAGE_SIZE - 1))
+				return -EINVAL;
+			obj->offset = exec[i].offset;
+			continue;
+		}
+
+		if (obj->offset &&
+		    (exec[i].alignment == 0 ||
+		     (obj->offset & (exec[i].alignment - 1)) == 0))
+			continue;
+
+		if (!bind(obj, exec[i].alignment)) {
+			if (retried)
+				return -ENOSPC;
+
+			unbind_all();
+			retried = true;
+			goto retry;
+		}
+	}
+
+	for (i = 0; i < eb->buffer_count; i++) {
+		const struct drm_i915_gem_relocation_entry *end;
+		struct drm_i915_gem_relocation_entry *r;
+
+		if (exec[i].relocation_count == 0)
+			continue;
+
+		obj = lookup(exec[i].handle);
+		r = (struct drm_i915_gem_relocation_entry *)(uintptr_t)exec[i].relocs_ptr;
+		if (r == NULL)
+			return -EFAULT;
+
+		end = r + exec[i].relocation_count;
+		for (; r < end; r++) {
+			struct fake_object *target;
+			uint64_t value;
+			char *ptr;
+
+			if (eb->flags & LOCAL_I915_EXEC_HANDLE_LUT) {
+				if (r->target_handle >= eb->buffer_count)
+					return -ENOENT;
+				target = lookup(exec[r->target_handle].handle);
+			} else
+				target = lookup(r->target_handle);
+			if (target == NULL)
+				return -ENOENT;
+
+			if (r->offset > obj->size - reloc_size)
+				return -EINVAL;
+
+			fake.stats.relocs++;
+			if (r->presumed_offset == target->offset)
+				continue;
+
+			ptr = object_ptr(obj);
+			if (ptr == NULL)
+				return -ENOMEM;
+
+			value = target->offset + (int32_t)r->delta;
+			memcpy(ptr + r->offset, &value, reloc_size);
+			r->presumed_offset = target->offset;
+			fake.stats.relocs_written++;
+		}
+	}
+
+	/* The low half is set if written, the high half holds the rings */
+	busy = (eb->flags & I915_EXEC_RING_MASK) == I915_EXEC_BLT ? 1 << 17 : 1 << 16;
+	busy_until = now_ns() + fake.config.latency_ns;
+	for (i = 0; i < eb->buffer_count; i++) {
+		obj = lookup(exec[i].handle);
+		exec[i].offset = obj->offset;
+
+		obj->busy_until = busy_until;
+		obj->busy = busy;
+		if (exec[i].flags & LOCAL_EXEC_OBJECT_WRITE)
+			obj->busy |= 1;
+	}
+
+	fake.stats.execbuffers++;
+	fake.stats.exec_objects += eb->buffer_count;
+	fake.stats.batch_bytes += eb->batch_len;
+	return 0;
+}
+
+static int fake_dispatch(unsigned long request, void *arg)
+{
+	unsigned nr = _IOC_NR(request);
+
+	fake.stats.ioctls++;
+
+	switch (nr) {
+	case 0x09: /* DRM_IOCTL_GEM_CLOSE */
+		return fake_close(arg);
+	}
+
+	if (nr < DRM_COMMAND_BASE)
+		return -ENOTTY;
+
+	switch (nr - DRM_COMMAND_BASE) {
+	case DRM_I915_GETPARAM:
+		return fake_getparam(arg);
+	case DRM_I915_GEM_CREATE:
+		return fake_create(arg);
+	case DRM_I915_GEM_PWRITE:
+		return fake_pwrite(arg);
+	case DRM_I915_GEM_PREAD:
+		return fake_pread(arg);
+	case DRM_I915_GEM_MMAP:
+		return fake_mmap(arg,
+				 _IOC_SIZE(request) == sizeof(struct local_i915_gem_mmap2));
+	case DRM_I915_GEM_MMAP_GTT:
+		return fake_mmap_gtt(arg);
+	case DRM_I915_GEM_SET_DOMAIN:
+		return fake_set_domain(arg);
+	case DRM_I915_GEM_SET_TILING:
+		return fake_set_tiling(arg);
+	case DRM_I915_GEM_GET_TILING:
+		return fake_get_tiling(arg,
+				       _IOC_SIZE(request) == sizeof(struct local_i915_gem_get_tiling_v2));
+	case DRM_I915_GEM_BUSY:
+		return fake_busy(arg);
+	case DRM_I915_GEM_THROTTLE:
+		return 0;
+	case DRM_I915_GEM_MADVISE:
+		return fake_madvise(arg);
+	case DRM_I915_GEM_EXECBUFFER2:
+		return fake_execbuffer2(arg);
+	case DRM_I915_GEM_GET_APERTURE:
+		return fake_get_aperture(arg);
+	case LOCAL_I915_GEM_WAIT:
+		return fake_wait(arg);
+	case LOCAL_I915_GEM_SET_CACHING:
+		return fake_caching(arg, true);
+	case LOCAL_I915_GEM_GET_CACHING:
+		return fake_caching(arg, false);
+	case LOCAL_I915_GEM_USERPTR:
+		return fake_userptr(arg);
+	case LOCAL_I915_GEM_CONTEXT_GETPARAM:
+		/* shares its number with the never-merged CREATE2 */
+		if (_IOC_SIZE(request) != sizeof(struct local_i915_gem_context_param))
+			return -ENOTTY;
+		return fake_context_getparam(arg);
+	default:
+		/* pinning, flink, prime and modesetting are not emulated */
+		return -ENODEV;
+	}
+}
+
+static int fake_ioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	if (fd != fake.fd) {
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&fake.lock);
+	ret = fake_dispatch(request, arg);
+	pthread_mutex_unlock(&fake.lock);
+
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct kgem_backend kgem_fake_backend = {
+	"fake",
+	fake_ioctl,
+};
+
+static int create_arena(void)
+{
+	int fd = -1;
+
+#if defined(__NR_memfd_create)
+	fd = syscall(__NR_memfd_create, "kgem-fake", 0);
+#endif
+	if (fd < 0) {
+		char name[] = "/tmp/kgem-fake-XXXXXX";
+
+		fd = mkstemp(name);
+		if (fd >= 0)
+			unlink(name);
+	}
+
+	return fd;
+}
+
+/* Returns an fd to pass to kgem_init() after selecting kgem_fake_backend
+ * with kgem_set_backend(). Only one fake device may be open at a time.
+ */
+int kgem_fake_open(const struct kgem_fake_config *config)
+{
+	int fd;
+
+	if (fake.fd != -1)
+		return -EBUSY;
+
+	fd = create_arena();
+	if (fd < 0)
+		return -errno;
+
+	memset(&fake.stats, 0, sizeof(fake.stats));
+	fake.config = *config;
+	if (fake.config.aperture_size == 0)
+		fake.config.aperture_size = 2ull << 30;
+	fake.arena_size = fake.arena_end = 0;
+	fake.gtt_next = PAGE_SIZE;
+	fake.fd = fd;
+
+	DBG(("%s: fd=%d, gen=%d, aperture=%lld, latency=%lldns\n",
+	     __FUNCTION__, fd, fake.config.gen,
+	     (long long)fake.config.aperture_size,
+	     (long long)fake.config.latency_ns));
+	return fd;
+}
+
+void kgem_fake_close(int fd)
+{
+	uint32_t n;
+
+	if (fd != fake.fd)
+		return;
+
+	for (n = 1; n < fake.num_objects; n++) {
+		struct fake_object *obj = fake.objects[n];
+
+		if (obj == NULL)
+			continue;
+
+		if (obj->ptr)
+			munmap(obj->ptr, obj->size);
+		free(obj);
+	}
+
+	free(fake.objects);
+	free(fake.free_handles);
+	fake.objects = NULL;
+	fake.free_handles = NULL;
+	fake.num_objects = fake.num_free = 0;
+
+	close(fake.fd);
+	fake.fd = -1;
+}
+
+void kgem_fake_fail_execbuffers(unsigned count)
+{
+	pthread_mutex_lock(&fake.lock);
+	fake.fail_execbuffers = count;
+	pthread_mutex_unlock(&fake.lock);
+}
+
+void kgem_fake_get_stats(struct kgem_fake_stats *stats)
+{
+	pthread_mutex_lock(&fake.lock);
+	*stats = fake.stats;
+	pthread_mutex_unlock(&fake.lock);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef KGEM_FAKE_H
+#define KGEM_FAKE_H
+
+#include "kgem_backend.h"
+
+/* A userspace emulation of i915 GEM: objects live in anonymous memory,
+ * execbuffers are relocated and complete after a fixed latency, and
+ * tiling strides, fence registers and the aperture size are checked as
+ * the kernel would. Nothing is executed, so the contents of the objects
+ * are never changed by a batch. Only linked into the tests, the driver
+ * always uses the real device.
+ */
+struct kgem_fake_config {
+	unsigned gen;		/* as kgem->gen, e.g. 0110 for Skylake */
+	uint64_t aperture_size;	/* defaults to 2GiB */
+	uint64_t latency_ns;	/* from execbuffer until the objects are idle */
+	int swizzle;		/* bit-6 swizzling reported for X tiling */
+	bool has_llc;
+};
+
+struct kgem_fake_stats {
+	uint64_t ioctls;
+	uint64_t objects, bytes;	/* currently allocated */
+	uint64_t execbuffers;
+	uint64_t exec_objects;
+	uint64_t batch_bytes;
+	uint64_t relocs;
+	uint64_t relocs_written;	/* presumed offset was stale */
+	uint64_t rebinds;		/* aperture exhausted, everything moved */
+	uint64_t waits;			/* blocking waits on a busy object */
+};
+
+extern const struct kgem_backend kgem_fake_backend;
+
+int kgem_fake_open(const struct kgem_fake_config *config);
+void kgem_fake_close(int fd);
+void kgem_fake_get_stats(struct kgem_fake_stats *stats);
+
+/* Fail the next count execbuffers with -ENOSPC */
+void kgem_fake_fail_execbuffers(unsigned count);
+
+#endif /* KGEM_FAKE_H */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef KGEM_TRACE_H
+#define KGEM_TRACE_H
+
+#include <stdint.h>
+
+/* With Option "TraceBatches", every batch submitted is recorded into a
+ * ring that is the shared mapping of a file, so that it can be read by
+ * tools/sna-batch-trace whilst the server runs without ever blocking the
+ * server.
+ *
+ * There is a single writer. An entry is invalidated (seqno = 0) before it
+ * is overwritten and its seqno written last, so a reader must copy an
+ * entry and then check that its seqno is still the one it expected.
+ * The retire time is filled in later, when the request is retired.
+ *
+ * The file is removed again when the screen is freed.
+ */
+
+enum kgem_flush_reason {
+	KGEM_FLUSH_OTHER = 0, /* explicit, ring switch or opportunistic */
+	KGEM_FLUSH_BATCH,
+	KGEM_FLUSH_RELOC,
+	KGEM_FLUSH_EXEC,
+	KGEM_FLUSH_APERTURE,
+	KGEM_FLUSH_FENCE,
+	KGEM_FLUSH_REASONS
+};
+
+#define KGEM_TRACE_MAGIC 0x4b475452 /* "KGTR" */
+#define KGEM_TRACE_VERSION 2
+#define KGEM_TRACE_SIZE 4096
+
+struct kgem_trace_batch {
+	uint64_t submit;	/* CLOCK_MONOTONIC ns, before the execbuffer */
+	uint64_t retire;	/* ns from submission until retired, 0 if busy */
+	uint32_t execbuf;	/* ns spent inside the execbuffer ioctl */
+	uint32_t aperture;	/* pages referenced by the batch */
+	uint16_t nbatch;	/* dwords */
+	uint16_t nreloc;
+	uint16_t nexec;
+	uint8_t ring;		/* KGEM_RENDER, KGEM_BSD or KGEM_BLT */
+	uint8_t reason;		/* enum kgem_flush_reason */
+	uint32_t seqno;		/* low 32 bits of the batch count, from 1 */
+};
+
+struct kgem_trace {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* entries in batch[], a power of two */
+	uint32_t pid;
+	uint64_t count;		/* batches recorded */
+	struct kgem_trace_batch batch[];
+};
+
+#endif /* KGEM_TRACE_H */
@@ -170,6 +170,8 @@ struct sna_glyph {
 	struct sna_coordinate coordinate;
 	uint16_t size, pos;
 	pixman_image_t *image;
+	uint8_t page; /* of the atlas */
+	uint8_t used; /* since the clock hand last passed */
 };
 
 static inline WindowPtr get_root_window(ScreenPtr screen)
@@ -1131,6 +1133,7 @@ void sna_composite_trapezoids(CARD8 op,
 			      INT16 xSrc, INT16 ySrc,
 			      int ntrap, xTrapezoid *traps);
 void sna_add_traps(PicturePtr picture, INT16 x, INT16 y, int n, xTrap *t);
+void sna_trapezoids_close(struct sna *sna);
 
 void sna_composite_triangles(CARD8 op,
 			     PicturePtr src,
@@ -1172,6 +1175,7 @@ void sna_glyphs__shared(CARD8 op,
 			INT16 src_x, INT16 src_y,
 			int nlist, GlyphListPtr list, GlyphPtr *glyphs);
 void sna_glyph_unrealize(ScreenPtr screen, GlyphPtr glyph);
+void sna_glyphs_dump(struct sna *sna);
 void sna_glyphs_close(struct sna *sna);
 
 void sna_read_boxes(struct sna *sna, PixmapPtr dst, struct kgem_bo *src_bo,
@@ -1225,6 +1229,7 @@ affine_blt(const void *src, void *dst, int bpp,
 	   uint16_t dst_width, uint16_t dst_height,
 	   int32_t dst_stride,
 	   const struct pixman_f_transform *t);
+void choose_affine_blt(unsigned cpu);
 
 void
 memmove_box(const void *src, void *dst,
@@ -1239,6 +1244,8 @@ memcpy_xor(const void *src, void *dst, int bpp,
 	   int16_t dst_x, int16_t dst_y,
 	   uint16_t width, uint16_t height,
 	   uint32_t and, uint32_t or);
+void choose_memcpy_xor(unsigned cpu);
+void choose_span_blt(unsigned cpu);
 
 #define SNA_CREATE_FB 0x10
 #define SNA_CREATE_SCRATCH 0x11
@@ -1321,12 +1328,25 @@ static inline void sna_acpi_wakeup(struct sna *sna, void *read_mask)
 }
 void sna_acpi_fini(struct sna *sna);
 
-void sna_threads_init(void);
-int sna_use_threads (int width, int height, int threshold);
+/* Classes of threaded operations, each with its own cost model */
+enum {
+	THREAD_COMPOSITE = 0,
+	THREAD_SPANS,
+	THREAD_MASK,
+	THREAD_INPLACE,
+	THREAD_COPY,
+	THREAD_NUM_OPS
+};
+
+void sna_threads_init(int max_threads, bool pin);
+int sna_threads_max(void);
+int sna_use_threads (int op, int width, int height, int threshold);
+int sna_threads_tasks(int num_threads, int height);
 void sna_threads_run(int id, void (*func)(void *arg), void *arg);
 void sna_threads_trap(int sig);
-void sna_threads_wait(void);
+bool sna_threads_wait(void);
 void sna_threads_kill(void);
+void sna_threads_dump(void);
 
 void sna_image_composite(pixman_op_t        op,
 			 pixman_image_t    *src,
@@ -1341,6 +1361,14 @@ void sna_image_composite(pixman_op_t        op,
 			 uint16_t           width,
 			 uint16_t           height);
 
+bool sna_memcpy_boxes__tiled(struct kgem *kgem, int tiling, bool upload,
+			     int tile_dy,
+			     const void *src, void *dst, int bpp,
+			     int32_t src_stride, int32_t dst_stride,
+			     int16_t src_dx, int16_t src_dy,
+			     int16_t dst_dx, int16_t dst_dy,
+			     const BoxRec *box, int n);
+
 extern jmp_buf sigjmp[4];
 extern volatile sig_atomic_t sigtrap;
 
@@ -17795,6 +17795,8 @@ static void sna_accel_expire(struct sna *sna)
 
 	if (!sna->kgem.need_expire)
 		sna_accel_disarm_timer(sna, EXPIRE_TIMER);
+	else if (sna->kgem.need_trim) /* continue trimming shortly */
+		sna->timer_expire[EXPIRE_TIMER] = TIME + 50;
 }
 
 #ifdef DEBUG_MEMORY
@@ -17818,6 +17820,11 @@ static void sna_accel_debug_memory(struct sna *sna)
 	       (unsigned long)sna->kgem.debug_memory.bo_bytes,
 	       sna->debug_memory.cpu_bo_allocs,
 	       (unsigned long)sna->debug_memory.cpu_bo_bytes);
+	sna_threads_dump();
+	sna_glyphs_dump(sna);
+	sna_render_state_dump(sna);
+	kgem_cache_dump(&sna->kgem);
+	kgem_flush_dump(&sna->kgem);
 
 #ifdef VALGRIND_DO_ADDED_LEAK_CHECK
 	VG(VALGRIND_DO_ADDED_LEAK_CHECK);
@@ -18304,6 +18311,7 @@ void sna_accel_close(struct sna *sna)
 	sna_composite_close(sna);
 	sna_gradients_close(sna);
 	sna_glyphs_close(sna);
+	sna_trapezoids_close(sna);
 
 	sna_pixmap_expire(sna);
 
@@ -31,6 +31,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "sna.h"
 #include "sna_damage.h"
 
+#define DBG_NO_DAMAGE_TILES 0
+
 /*
  * sna_damage is a batching layer on top of the regular pixman_region_t.
  * It is required as the ever-growing accumulation of invidual small
@@ -190,6 +192,8 @@ static struct sna_damage *_sna_damage_create(void)
 	}
 	reset_embedded_box(damage);
 	damage->mode = DAMAGE_ADD;
+	damage->tiles = NULL;
+	damage->churn = 0;
 	pixman_region_init(&damage->region);
 	reset_extents(damage);
 
@@ -210,6 +214,704 @@ static void free_list(struct list *head)
 	}
 }
 
+/*
+ * Tile mode.
+ *
+ * Once a large damage has been reduced often enough that the pixman
+ * region operations dominate (a terminal or spreadsheet adding and
+ * subtracting thousands of small boxes), we stop batching boxes and
+ * instead track the damage in a grid of 32x32 tiles. Each tile is either
+ * empty, full or a bitmap of one word per row, so that adding or
+ * subtracting a box only touches the tiles it covers and queries can
+ * answer from the grid without reducing. The region is then only rebuilt
+ * (already y-x banded, without sorting) when the boxes are requested.
+ *
+ * Whilst in tile mode, the grid is the damage: damage->region is just the
+ * last reduction and is stale whenever damage->dirty is set, and the mode
+ * is only ever DAMAGE_SUBTRACT whilst a subtraction is being applied.
+ */
+#define DAMAGE_TILE_SHIFT 5
+#define DAMAGE_TILE_SIZE (1 << DAMAGE_TILE_SHIFT)
+#define DAMAGE_TILE_FULL ((uint32_t *)1)
+#define DAMAGE_TILE_MAX (512*512)	/* 16384x16384 */
+#define DAMAGE_TILE_CHURN 4096		/* boxes reduced before switching */
+#define DAMAGE_TILE_AREA (512*512)
+#define DAMAGE_TILE_MIN_RECTS 8		/* switch back when this simple */
+
+struct sna_damage_tiles {
+	int x, y;		/* origin, aligned to the tile size */
+	int width, height;	/* in tiles */
+	int count;		/* tiles not known to be empty */
+	uint32_t *tile[];	/* NULL, DAMAGE_TILE_FULL or a row bitmap */
+};
+
+static uint32_t *__freed_tile;
+
+static uint32_t *tile_alloc(bool fill)
+{
+	uint32_t *rows;
+
+	if (__freed_tile) {
+		rows = __freed_tile;
+		__freed_tile = NULL;
+	} else {
+		rows = malloc(DAMAGE_TILE_SIZE * sizeof(uint32_t));
+		if (rows == NULL)
+			return NULL;
+	}
+
+	memset(rows, fill ? 0xff : 0, DAMAGE_TILE_SIZE * sizeof(uint32_t));
+	return rows;
+}
+
+static void tile_free(uint32_t *rows)
+{
+	if (rows == NULL || rows == DAMAGE_TILE_FULL)
+		return;
+
+	/* Keep just one for the next tile to be split, a grid being
+	 * destroyed can hand back thousands.
+	 */
+	if (__freed_tile == NULL)
+		__freed_tile = rows;
+	else
+		free(rows);
+}
+
+static inline uint32_t tile_row(const uint32_t *tile, int row)
+{
+	if (tile == NULL)
+		return 0;
+	if (tile == DAMAGE_TILE_FULL)
+		return ~0u;
+	return tile[row];
+}
+
+static inline uint32_t tile_mask(int x1, int x2)
+{
+	assert(0 <= x1 && x1 < x2 && x2 <= DAMAGE_TILE_SIZE);
+	return (x2 == DAMAGE_TILE_SIZE ? ~0u : (1u << x2) - 1) & ~((1u << x1) - 1);
+}
+
+static struct sna_damage_tiles *
+damage_tiles_create(int x1, int y1, int x2, int y2)
+{
+	struct sna_damage_tiles *t;
+	int width, height;
+
+	assert(x2 > x1 && y2 > y1);
+
+	x1 &= ~(DAMAGE_TILE_SIZE - 1);
+	y1 &= ~(DAMAGE_TILE_SIZE - 1);
+	width = (x2 - x1 + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT;
+	height = (y2 - y1 + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT;
+	if (width * height > DAMAGE_TILE_MAX)
+		return NULL;
+
+	DBG(("%s: (%d, %d) x %dx%d tiles\n", __FUNCTION__, x1, y1, width, height));
+
+	t = calloc(1, sizeof(*t) + width * height * sizeof(t->tile[0]));
+	if (t == NULL)
+		return NULL;
+
+	t->x = x1;
+	t->y = y1;
+	t->width = width;
+	t->height = height;
+	return t;
+}
+
+static void damage_tiles_destroy(struct sna_damage_tiles *t)
+{
+	int n;
+
+	for (n = 0; n < t->width * t->height; n++)
+		tile_free(t->tile[n]);
+	free(t);
+}
+
+static bool damage_tiles_cover(const struct sna_damage_tiles *t,
+			       const BoxRec *box)
+{
+	return (box->x1 >= t->x &&
+		box->y1 >= t->y &&
+		box->x2 <= t->x + (t->width << DAMAGE_TILE_SHIFT) &&
+		box->y2 <= t->y + (t->height << DAMAGE_TILE_SHIFT));
+}
+
+static bool damage_tiles_grow(struct sna_damage *damage, const BoxRec *box)
+{
+	struct sna_damage_tiles *old = damage->tiles, *t;
+	int dx, dy, y;
+
+	t = damage_tiles_create(min(box->x1, old->x),
+				min(box->y1, old->y),
+				max(box->x2, old->x + (old->width << DAMAGE_TILE_SHIFT)),
+				max(box->y2, old->y + (old->height << DAMAGE_TILE_SHIFT)));
+	if (t == NULL)
+		return false;
+
+	dx = (old->x - t->x) >> DAMAGE_TILE_SHIFT;
+	dy = (old->y - t->y) >> DAMAGE_TILE_SHIFT;
+	for (y = 0; y < old->height; y++)
+		memcpy(&t->tile[(y + dy) * t->width + dx],
+		       &old->tile[y * old->width],
+		       old->width * sizeof(t->tile[0]));
+	t->count = old->count;
+
+	free(old);
+	damage->tiles = t;
+	return true;
+}
+
+/* Sets or clears the box in every tile it covers. Returns false if we
+ * fail to allocate a bitmap, leaving the box only partially applied.
+ */
+static bool damage_tiles_fill(struct sna_damage_tiles *t,
+			      const BoxRec *box, bool set)
+{
+	int x1, y1, x2, y2, tx, ty;
+
+	x1 = max(box->x1 - t->x, 0);
+	y1 = max(box->y1 - t->y, 0);
+	x2 = min(box->x2 - t->x, t->width << DAMAGE_TILE_SHIFT);
+	y2 = min(box->y2 - t->y, t->height << DAMAGE_TILE_SHIFT);
+	if (x1 >= x2 || y1 >= y2)
+		return true;
+
+	for (ty = y1 >> DAMAGE_TILE_SHIFT; ty <= (y2 - 1) >> DAMAGE_TILE_SHIFT; ty++) {
+		int r1 = max(y1 - (ty << DAMAGE_TILE_SHIFT), 0);
+		int r2 = min(y2 - (ty << DAMAGE_TILE_SHIFT), DAMAGE_TILE_SIZE);
+
+		for (tx = x1 >> DAMAGE_TILE_SHIFT; tx <= (x2 - 1) >> DAMAGE_TILE_SHIFT; tx++) {
+			uint32_t **tile = &t->tile[ty * t->width + tx];
+			uint32_t mask = tile_mask(max(x1 - (tx << DAMAGE_TILE_SHIFT), 0),
+						  min(x2 - (tx << DAMAGE_TILE_SHIFT), DAMAGE_TILE_SIZE));
+			int r;
+
+			if (mask == ~0u && r1 == 0 && r2 == DAMAGE_TILE_SIZE) {
+				if (set) {
+					if (*tile == NULL)
+						t->count++;
+					tile_free(*tile);
+					*tile = DAMAGE_TILE_FULL;
+				} else {
+					if (*tile != NULL)
+						t->count--;
+					tile_free(*tile);
+					*tile = NULL;
+				}
+				continue;
+			}
+
+			if (*tile == (set ? DAMAGE_TILE_FULL : NULL))
+				continue;
+
+			if (*tile == (set ? NULL : DAMAGE_TILE_FULL)) {
+				uint32_t *rows = tile_alloc(!set);
+				if (rows == NULL)
+					return false;
+
+				if (set)
+					t->count++;
+				*tile = rows;
+			}
+
+			if (set) {
+				for (r = r1; r < r2; r++)
+					(*tile)[r] |= mask;
+			} else {
+				for (r = r1; r < r2; r++)
+					(*tile)[r] &= ~mask;
+			}
+		}
+	}
+
+	return true;
+}
+
+static int damage_tiles_contains_box(const struct sna_damage_tiles *t,
+				     const BoxRec *box)
+{
+	bool in = false, out;
+	int x1, y1, x2, y2, tx, ty;
+
+	x1 = max(box->x1 - t->x, 0);
+	y1 = max(box->y1 - t->y, 0);
+	x2 = min(box->x2 - t->x, t->width << DAMAGE_TILE_SHIFT);
+	y2 = min(box->y2 - t->y, t->height << DAMAGE_TILE_SHIFT);
+	if (x1 >= x2 || y1 >= y2)
+		return PIXMAN_REGION_OUT;
+
+	out = !damage_tiles_cover(t, box);
+	for (ty = y1 >> DAMAGE_TILE_SHIFT; ty <= (y2 - 1) >> DAMAGE_TILE_SHIFT; ty++) {
+		int r1 = max(y1 - (ty << DAMAGE_TILE_SHIFT), 0);
+		int r2 = min(y2 - (ty << DAMAGE_TILE_SHIFT), DAMAGE_TILE_SIZE);
+
+		for (tx = x1 >> DAMAGE_TILE_SHIFT; tx <= (x2 - 1) >> DAMAGE_TILE_SHIFT; tx++) {
+			const uint32_t *tile = t->tile[ty * t->width + tx];
+
+			if (tile == NULL) {
+				out = true;
+			} else if (tile == DAMAGE_TILE_FULL) {
+				in = true;
+			} else {
+				uint32_t mask = tile_mask(max(x1 - (tx << DAMAGE_TILE_SHIFT), 0),
+							  min(x2 - (tx << DAMAGE_TILE_SHIFT), DAMAGE_TILE_SIZE));
+				int r;
+
+				for (r = r1; r < r2; r++) {
+					uint32_t v = tile[r] & mask;
+					if (v)
+						in = true;
+					if (v != mask)
+						out = true;
+				}
+			}
+
+			if (in && out)
+				return PIXMAN_REGION_PART;
+		}
+	}
+
+	return in ? PIXMAN_REGION_IN : PIXMAN_REGION_OUT;
+}
+
+/* Collapse bitmaps that have become empty or full, and report whether
+ * every tile in the row is now empty or full.
+ */
+static bool damage_tiles_row_is_uniform(struct sna_damage_tiles *t, int ty)
+{
+	uint32_t **tile = &t->tile[ty * t->width];
+	bool uniform = true;
+	int tx, r;
+
+	for (tx = 0; tx < t->width; tx++) {
+		uint32_t any = 0, all = ~0u;
+
+		if (tile[tx] == NULL || tile[tx] == DAMAGE_TILE_FULL)
+			continue;
+
+		for (r = 0; r < DAMAGE_TILE_SIZE; r++) {
+			any |= tile[tx][r];
+			all &= tile[tx][r];
+		}
+
+		if (any == 0) {
+			tile_free(tile[tx]);
+			tile[tx] = NULL;
+			t->count--;
+		} else if (all == ~0u) {
+			tile_free(tile[tx]);
+			tile[tx] = DAMAGE_TILE_FULL;
+		} else
+			uniform = false;
+	}
+
+	return uniform;
+}
+
+/* Writes the start and end of each run of set pixels along the row */
+static int damage_tiles_row_spans(const struct sna_damage_tiles *t,
+				  int ty, int r, int *span)
+{
+	const uint32_t * const *tile = (const uint32_t * const *)&t->tile[ty * t->width];
+	bool open = false;
+	int tx, n = 0;
+
+	for (tx = 0; tx < t->width; tx++) {
+		uint32_t w = tile_row(tile[tx], r);
+		int x = t->x + (tx << DAMAGE_TILE_SHIFT);
+		int bit;
+
+		if (w == 0) {
+			if (open) {
+				span[n++] = x;
+				open = false;
+			}
+			continue;
+		}
+
+		if (w == ~0u) {
+			if (!open) {
+				span[n++] = x;
+				open = true;
+			}
+			continue;
+		}
+
+		bit = 0;
+		do {
+			uint64_t v = (uint64_t)w >> bit;
+			int run;
+
+			if (open) {
+				run = __builtin_ctzll(~v);
+				if (bit + run == DAMAGE_TILE_SIZE)
+					break;
+			} else {
+				if (v == 0)
+					break;
+				run = __builtin_ctzll(v);
+			}
+
+			bit += run;
+			span[n++] = x + bit;
+			open = !open;
+		} while (1);
+	}
+	if (open)
+		span[n++] = t->x + (t->width << DAMAGE_TILE_SHIFT);
+
+	return n;
+}
+
+/* Build the region directly in y-x banded form, coalescing identical
+ * rows into bands, so that it matches what pixman would have produced.
+ */
+static bool damage_tiles_to_region(struct sna_damage_tiles *t,
+				   pixman_region16_t *region)
+{
+	pixman_region16_data_t *data;
+	BoxRec *box;
+	int *span;
+	int size, n, band, nband, band_y2, ty, r, h, i;
+
+	span = malloc(sizeof(int) * ((t->width << DAMAGE_TILE_SHIFT) + 2));
+	if (span == NULL)
+		return false;
+
+	size = 64;
+	data = malloc(sizeof(*data) + size * sizeof(BoxRec));
+	if (data == NULL) {
+		free(span);
+		return false;
+	}
+	box = (BoxRec *)(data + 1);
+
+	n = band = nband = 0;
+	band_y2 = MINSHORT;
+	for (ty = 0; ty < t->height; ty++) {
+		h = damage_tiles_row_is_uniform(t, ty) ? DAMAGE_TILE_SIZE : 1;
+		for (r = 0; r < DAMAGE_TILE_SIZE; r += h) {
+			int y = t->y + (ty << DAMAGE_TILE_SHIFT) + r;
+			int count = damage_tiles_row_spans(t, ty, r, span);
+
+			if (count == 0)
+				continue;
+
+			assert((count & 1) == 0);
+			count /= 2;
+
+			if (band_y2 == y && nband == count) {
+				for (i = 0; i < count; i++) {
+					if (box[band + i].x1 != span[2*i] ||
+					    box[band + i].x2 != span[2*i+1])
+						break;
+				}
+				if (i == count) {
+					for (i = 0; i < count; i++)
+						box[band + i].y2 = y + h;
+					band_y2 = y + h;
+					continue;
+				}
+			}
+
+			if (n + count > size) {
+				pixman_region16_data_t *new_data;
+
+				while (n + count > size)
+					size *= 2;
+
+				new_data = realloc(data, sizeof(*data) + size * sizeof(BoxRec));
+				if (new_data == NULL) {
+					free(data);
+					free(span);
+					return false;
+				}
+				data = new_data;
+				box = (BoxRec *)(data + 1);
+			}
+
+			for (i = 0; i < count; i++) {
+				box[n + i].x1 = span[2*i];
+				box[n + i].x2 = span[2*i+1];
+				box[n + i].y1 = y;
+				box[n + i].y2 = y + h;
+			}
+			band = n;
+			nband = count;
+			band_y2 = y + h;
+			n += count;
+		}
+	}
+	free(span);
+
+	if (n <= 1) {
+		if (n)
+			pixman_region_init_rect(region,
+						box->x1, box->y1,
+						box->x2 - box->x1,
+						box->y2 - box->y1);
+		else
+			pixman_region_init(region);
+		free(data);
+		return true;
+	}
+
+	data->size = n;
+	data->numRects = n;
+	region->data = data;
+	region->extents.x1 = box[0].x1;
+	region->extents.x2 = box[0].x2;
+	region->extents.y1 = box[0].y1;
+	region->extents.y2 = box[n-1].y2;
+	for (i = 1; i < n; i++) {
+		if (box[i].x1 < region->extents.x1)
+			region->extents.x1 = box[i].x1;
+		if (box[i].x2 > region->extents.x2)
+			region->extents.x2 = box[i].x2;
+	}
+	assert(pixman_region_selfcheck(region));
+	return true;
+}
+
+static bool damage_tiles_fill_pending(struct sna_damage_tiles *t,
+				      struct sna_damage *damage,
+				      bool set)
+{
+	struct sna_damage_box *iter;
+	int n, count;
+
+	if (!damage->dirty)
+		return true;
+
+	count = damage->embedded_box.size;
+	if (list_is_empty(&damage->embedded_box.list))
+		count -= damage->remain;
+	for (n = 0; n < count; n++)
+		if (!damage_tiles_fill(t, &damage->embedded_box.box[n], set))
+			return false;
+
+	list_for_each_entry(iter, &damage->embedded_box.list, list) {
+		const BoxRec *b = (const BoxRec *)(iter + 1);
+
+		count = iter->size;
+		if (iter == last_box(damage))
+			count -= damage->remain;
+		for (n = 0; n < count; n++)
+			if (!damage_tiles_fill(t, &b[n], set))
+				return false;
+	}
+
+	return true;
+}
+
+static bool damage_is_empty(const struct sna_damage *damage)
+{
+	if (damage->tiles)
+		return damage->tiles->count == 0;
+
+	/* A new damage may only hold boxes still to be added */
+	if (damage->dirty && damage->mode == DAMAGE_ADD)
+		return false;
+
+	return RegionNil(&damage->region);
+}
+
+static bool damage_want_tiles(const struct sna_damage *damage)
+{
+	if (DBG_NO_DAMAGE_TILES)
+		return false;
+
+	if (damage->churn < DAMAGE_TILE_CHURN)
+		return false;
+
+	if (damage->extents.x2 <= damage->extents.x1 ||
+	    damage->extents.y2 <= damage->extents.y1)
+		return false;
+
+	return ((damage->extents.x2 - damage->extents.x1) *
+		(damage->extents.y2 - damage->extents.y1) >= DAMAGE_TILE_AREA);
+}
+
+/* Move the region and any pending boxes into a new grid */
+static bool __sna_damage_tile(struct sna_damage *damage, const BoxRec *bounds)
+{
+	struct sna_damage_tiles *t;
+	const BoxRec *b;
+	int n;
+
+	assert(damage->tiles == NULL);
+	assert(damage->mode != DAMAGE_ALL);
+
+	t = damage_tiles_create(bounds->x1, bounds->y1,
+				bounds->x2, bounds->y2);
+	if (t == NULL)
+		return false;
+
+	DBG(("%s: churn=%d, region.n=%d, pending=%d\n", __FUNCTION__,
+	     damage->churn, region_num_rects(&damage->region), damage->dirty));
+
+	b = region_rects(&damage->region);
+	for (n = region_num_rects(&damage->region); n--; b++) {
+		if (!damage_tiles_fill(t, b, true))
+			goto err;
+	}
+	if (!damage_tiles_fill_pending(t, damage, damage->mode == DAMAGE_ADD))
+		goto err;
+
+	/* The caller applies its boxes and then resets the mode */
+	free_list(&damage->embedded_box.list);
+	reset_embedded_box(damage);
+	damage->dirty = true;
+	damage->tiles = t;
+	return true;
+
+err:
+	damage_tiles_destroy(t);
+	return false;
+}
+
+/* Only once the region is up to date */
+static void __sna_damage_untile(struct sna_damage *damage)
+{
+	DBG(("%s: region.n=%d\n", __FUNCTION__, region_num_rects(&damage->region)));
+	assert(!damage->dirty);
+
+	damage_tiles_destroy(damage->tiles);
+	damage->tiles = NULL;
+	damage->churn = 0;
+}
+
+static void __sna_damage_tiles_reduce(struct sna_damage *damage)
+{
+	pixman_region16_t region;
+	bool keep = true;
+
+	assert(damage->tiles);
+	assert(damage->mode == DAMAGE_ADD);
+
+	if (damage->dirty) {
+		if (damage_tiles_to_region(damage->tiles, &region)) {
+			pixman_region_fini(&damage->region);
+			damage->region = region;
+		} else
+			keep = false;
+		damage->dirty = false;
+
+		if (pixman_region_not_empty(&damage->region))
+			damage->extents = damage->region.extents;
+		else
+			reset_extents(damage);
+	}
+
+	DBG(("    reduce: tiles=%d, region.n=%d\n",
+	     damage->tiles->count, region_num_rects(&damage->region)));
+
+	if (!keep || region_num_rects(&damage->region) <= DAMAGE_TILE_MIN_RECTS)
+		__sna_damage_untile(damage);
+}
+
+/* Make room in the grid for the boxes about to be added. If the grid
+ * cannot grow, fall back to the box list (with an up to date region).
+ */
+static bool damage_tiles_reserve(struct sna_damage *damage,
+				 const BoxRec *box)
+{
+	assert(damage->tiles);
+	assert(damage->mode == DAMAGE_ADD);
+
+	if (damage_tiles_cover(damage->tiles, box) ||
+	    damage_tiles_grow(damage, box))
+		return true;
+
+	__sna_damage_tiles_reduce(damage);
+	if (damage->tiles)
+		__sna_damage_untile(damage);
+	return false;
+}
+
+/* Decide whether the boxes about to be added to, or subtracted from,
+ * the damage should be applied to the grid rather than batched.
+ */
+static bool damage_use_tiles(struct sna_damage *damage)
+{
+	if (damage->tiles == NULL) {
+		if (!damage_want_tiles(damage))
+			return false;
+
+		if (!__sna_damage_tile(damage, &damage->extents)) {
+			damage->churn = 0;
+			return false;
+		}
+	}
+
+	assert(damage->mode == DAMAGE_SUBTRACT ||
+	       damage_tiles_cover(damage->tiles, &damage->extents));
+	return true;
+}
+
+/* Sets or clears the box in the grid. Should we fail to allocate a
+ * tile, the grid is converted back into the region and this and any
+ * further boxes are applied to the region directly instead.
+ */
+static void damage_tiles_apply(struct sna_damage *damage,
+			       const BoxRec *box, bool set)
+{
+	RegionRec r;
+
+	if (damage->tiles) {
+		if (damage_tiles_fill(damage->tiles, box, set))
+			return;
+
+		DBG(("%s: failed to allocate a tile, reverting to the region\n",
+		     __FUNCTION__));
+		damage->mode = DAMAGE_ADD;
+		damage->dirty = true;
+		__sna_damage_tiles_reduce(damage);
+		if (damage->tiles)
+			__sna_damage_untile(damage);
+	}
+
+	if (box->x2 <= box->x1 || box->y2 <= box->y1)
+		return;
+
+	r.extents = *box;
+	r.data = NULL;
+	if (set)
+		pixman_region_union(&damage->region, &damage->region, &r);
+	else
+		pixman_region_subtract(&damage->region, &damage->region, &r);
+}
+
+static struct sna_damage *
+damage_tiles_done(struct sna_damage *damage)
+{
+	damage->mode = DAMAGE_ADD;
+
+	if (damage->tiles == NULL) {
+		/* damage_tiles_apply() fell back to the region */
+		assert(!damage->dirty);
+		if (!pixman_region_not_empty(&damage->region)) {
+			__sna_damage_destroy(damage);
+			return NULL;
+		}
+
+		damage->extents = damage->region.extents;
+		return damage;
+	}
+
+	damage->dirty = true;
+
+	if (damage->tiles->count == 0) {
+		__sna_damage_destroy(damage);
+		return NULL;
+	}
+
+	return damage;
+}
+
 static void __sna_damage_reduce(struct sna_damage *damage)
 {
 	int n, nboxes;
@@ -217,6 +919,11 @@ static void __sna_damage_reduce(struct sna_damage *damage)
 	pixman_region16_t *region = &damage->region;
 	struct sna_damage_box *iter;
 
+	if (damage->tiles) {
+		__sna_damage_tiles_reduce(damage);
+		return;
+	}
+
 	assert(damage->mode != DAMAGE_ALL);
 	assert(damage->dirty);
 
@@ -246,6 +953,7 @@ static void __sna_damage_reduce(struct sna_damage *damage)
 
 	if (damage->mode == DAMAGE_ADD)
 		nboxes += region_num_rects(region);
+	damage->churn += nboxes;
 
 	iter = last_box(damage);
 	n = iter->size - damage->remain;
@@ -372,6 +1080,15 @@ _sna_damage_create_elt(struct sna_damage *damage,
 	     __FUNCTION__, damage->remain, count));
 	assert(count);
 
+	if (damage_use_tiles(damage)) {
+		bool set = damage->mode == DAMAGE_ADD;
+
+		for (n = 0; n < count; n++)
+			damage_tiles_apply(damage, &boxes[n], set);
+
+		return damage_tiles_done(damage);
+	}
+
 restart:
 	n = count;
 	if (n > damage->remain)
@@ -424,6 +1141,22 @@ _sna_damage_create_elt_from_boxes(struct sna_damage *damage,
 	DBG(("    %s: prev=(remain %d)\n", __FUNCTION__, damage->remain));
 	assert(count);
 
+	if (damage_use_tiles(damage)) {
+		bool set = damage->mode == DAMAGE_ADD;
+
+		for (i = 0; i < count; i++) {
+			BoxRec b;
+
+			b.x1 = boxes[i].x1 + dx;
+			b.x2 = boxes[i].x2 + dx;
+			b.y1 = boxes[i].y1 + dy;
+			b.y2 = boxes[i].y2 + dy;
+			damage_tiles_apply(damage, &b, set);
+		}
+
+		return damage_tiles_done(damage);
+	}
+
 restart:
 	n = count;
 	if (n > damage->remain)
@@ -487,6 +1220,22 @@ _sna_damage_create_elt_from_rectangles(struct sna_damage *damage,
 	     __FUNCTION__, damage->remain, count));
 	assert(count);
 
+	if (damage_use_tiles(damage)) {
+		bool set = damage->mode == DAMAGE_ADD;
+
+		for (i = 0; i < count; i++) {
+			BoxRec b;
+
+			b.x1 = r[i].x + dx;
+			b.x2 = b.x1 + r[i].width;
+			b.y1 = r[i].y + dy;
+			b.y2 = b.y1 + r[i].height;
+			damage_tiles_apply(damage, &b, set);
+		}
+
+		return damage_tiles_done(damage);
+	}
+
 restart:
 	n = count;
 	if (n > damage->remain)
@@ -550,6 +1299,22 @@ _sna_damage_create_elt_from_points(struct sna_damage *damage,
 	     __FUNCTION__, damage->remain, count));
 	assert(count);
 
+	if (damage_use_tiles(damage)) {
+		bool set = damage->mode == DAMAGE_ADD;
+
+		for (i = 0; i < count; i++) {
+			BoxRec b;
+
+			b.x1 = p[i].x + dx;
+			b.x2 = b.x1 + 1;
+			b.y1 = p[i].y + dy;
+			b.y2 = b.y1 + 1;
+			damage_tiles_apply(damage, &b, set);
+		}
+
+		return damage_tiles_done(damage);
+	}
+
 restart:
 	n = count;
 	if (n > damage->remain)
@@ -658,6 +1423,11 @@ static struct sna_damage *__sna_damage_add_box(struct sna_damage *damage,
 		break;
 	}
 
+	if (damage->tiles && damage_tiles_reserve(damage, box)) {
+		damage_union(damage, box);
+		return _sna_damage_create_elt(damage, box, 1);
+	}
+
 	if (region_is_singular_or_empty(&damage->region) ||
 	    box_contains_region(box, &damage->region)) {
 		_pixman_region_union_box(&damage->region, box);
@@ -696,6 +1466,13 @@ inline static struct sna_damage *__sna_damage_add(struct sna_damage *damage,
 	if (region_is_singular(region))
 		return __sna_damage_add_box(damage, &region->extents);
 
+	if (damage->tiles && damage_tiles_reserve(damage, &region->extents)) {
+		damage_union(damage, &region->extents);
+		return _sna_damage_create_elt(damage,
+					      region_rects(region),
+					      region_num_rects(region));
+	}
+
 	if (region_is_singular_or_empty(&damage->region)) {
 		pixman_region_union(&damage->region, &damage->region, region);
 		assert(damage->region.extents.x2 > damage->region.extents.x1);
@@ -729,9 +1506,9 @@ fastcall struct sna_damage *_sna_damage_add(struct sna_damage *damage,
 
 	DBG(("  = %s\n",
 	     _debug_describe_damage(damage_buf, sizeof(damage_buf), damage)));
-	assert(region_num_rects(&damage->region));
-	assert(damage->region.extents.x2 > damage->region.extents.x1);
-	assert(damage->region.extents.y2 > damage->region.extents.y1);
+	assert(damage->tiles || region_num_rects(&damage->region));
+	assert(damage->tiles || damage->region.extents.x2 > damage->region.extents.x1);
+	assert(damage->tiles || damage->region.extents.y2 > damage->region.extents.y1);
 
 	return damage;
 }
@@ -790,6 +1567,11 @@ __sna_damage_add_boxes(struct sna_damage *damage,
 	if (n == 1)
 		return __sna_damage_add_box(damage, &extents);
 
+	if (damage->tiles && damage_tiles_reserve(damage, &extents)) {
+		damage_union(damage, &extents);
+		return _sna_damage_create_elt_from_boxes(damage, box, n, dx, dy);
+	}
+
 	if (pixman_region_contains_rectangle(&damage->region,
 					     &extents) == PIXMAN_REGION_IN)
 		return damage;
@@ -879,6 +1661,11 @@ __sna_damage_add_rectangles(struct sna_damage *damage,
 		break;
 	}
 
+	if (damage->tiles && damage_tiles_reserve(damage, &extents)) {
+		damage_union(damage, &extents);
+		return _sna_damage_create_elt_from_rectangles(damage, r, n, dx, dy);
+	}
+
 	if (pixman_region_contains_rectangle(&damage->region,
 					     &extents) == PIXMAN_REGION_IN)
 		return damage;
@@ -963,6 +1750,11 @@ __sna_damage_add_points(struct sna_damage *damage,
 		break;
 	}
 
+	if (damage->tiles && damage_tiles_reserve(damage, &extents)) {
+		damage_union(damage, &extents);
+		return _sna_damage_create_elt_from_points(damage, p, n, dx, dy);
+	}
+
 	if (pixman_region_contains_rectangle(&damage->region,
 					     &extents) == PIXMAN_REGION_IN)
 		return damage;
@@ -1016,9 +1808,9 @@ fastcall struct sna_damage *_sna_damage_add_box(struct sna_damage *damage,
 
 	DBG(("  = %s\n",
 	     _debug_describe_damage(damage_buf, sizeof(damage_buf), damage)));
-	assert(region_num_rects(&damage->region));
-	assert(damage->region.extents.x2 > damage->region.extents.x1);
-	assert(damage->region.extents.y2 > damage->region.extents.y1);
+	assert(damage->tiles || region_num_rects(&damage->region));
+	assert(damage->tiles || damage->region.extents.x2 > damage->region.extents.x1);
+	assert(damage->tiles || damage->region.extents.y2 > damage->region.extents.y1);
 
 	return damage;
 }
@@ -1039,6 +1831,11 @@ struct sna_damage *__sna_damage_all(struct sna_damage *damage,
 		pixman_region_fini(&damage->region);
 		free_list(&damage->embedded_box.list);
 		reset_embedded_box(damage);
+		if (damage->tiles) {
+			damage_tiles_destroy(damage->tiles);
+			damage->tiles = NULL;
+		}
+		damage->churn = 0;
 	} else {
 		damage = _sna_damage_create();
 		if (damage == NULL)
@@ -1102,7 +1899,7 @@ static struct sna_damage *__sna_damage_subtract(struct sna_damage *damage,
 	if (damage == NULL)
 		return NULL;
 
-	if (RegionNil(&damage->region)) {
+	if (damage_is_empty(damage)) {
 no_damage:
 		__sna_damage_destroy(damage);
 		return NULL;
@@ -1130,6 +1927,13 @@ no_damage:
 		return damage;
 	}
 
+	if (damage->tiles) {
+		damage->mode = DAMAGE_SUBTRACT;
+		return _sna_damage_create_elt(damage,
+					      region_rects(region),
+					      region_num_rects(region));
+	}
+
 	if (damage->mode != DAMAGE_SUBTRACT) {
 		if (damage->dirty) {
 			__sna_damage_reduce(damage);
@@ -1195,7 +1999,7 @@ inline static struct sna_damage *__sna_damage_subtract_box(struct sna_damage *da
 	if (damage == NULL)
 		return NULL;
 
-	if (RegionNil(&damage->region)) {
+	if (damage_is_empty(damage)) {
 		__sna_damage_destroy(damage);
 		return NULL;
 	}
@@ -1208,6 +2012,11 @@ inline static struct sna_damage *__sna_damage_subtract_box(struct sna_damage *da
 		return NULL;
 	}
 
+	if (damage->tiles) {
+		damage->mode = DAMAGE_SUBTRACT;
+		return _sna_damage_create_elt(damage, box, 1);
+	}
+
 	if (damage->mode != DAMAGE_SUBTRACT) {
 		if (damage->dirty) {
 			__sna_damage_reduce(damage);
@@ -1267,7 +2076,7 @@ static struct sna_damage *__sna_damage_subtract_boxes(struct sna_damage *damage,
 	if (damage == NULL)
 		return NULL;
 
-	if (RegionNil(&damage->region)) {
+	if (damage_is_empty(damage)) {
 		__sna_damage_destroy(damage);
 		return NULL;
 	}
@@ -1301,6 +2110,11 @@ static struct sna_damage *__sna_damage_subtract_boxes(struct sna_damage *damage,
 	if (n == 1)
 		return __sna_damage_subtract_box(damage, &extents);
 
+	if (damage->tiles) {
+		damage->mode = DAMAGE_SUBTRACT;
+		return _sna_damage_create_elt_from_boxes(damage, box, n, dx, dy);
+	}
+
 	if (damage->mode != DAMAGE_SUBTRACT) {
 		if (damage->dirty) {
 			__sna_damage_reduce(damage);
@@ -1355,6 +2169,9 @@ static int __sna_damage_contains_box(struct sna_damage **_damage,
 	if (!sna_damage_overlaps_box(damage, box))
 		return PIXMAN_REGION_OUT;
 
+	if (damage->tiles)
+		return damage_tiles_contains_box(damage->tiles, box);
+
 	ret = pixman_region_contains_rectangle(&damage->region, (BoxPtr)box);
 	if (!damage->dirty)
 		return ret;
@@ -1441,6 +2258,9 @@ bool _sna_damage_contains_box__no_reduce(const struct sna_damage *damage,
 	if (!box_contains(&damage->extents, box))
 		return false;
 
+	if (damage->tiles)
+		return damage_tiles_contains_box(damage->tiles, box) == PIXMAN_REGION_IN;
+
 	n = pixman_region_contains_rectangle((pixman_region16_t *)&damage->region, (BoxPtr)box);
 	if (!damage->dirty)
 		return n == PIXMAN_REGION_IN;
@@ -1591,6 +2411,8 @@ struct sna_damage *_sna_damage_combine(struct sna_damage *l,
 {
 	if (r->dirty)
 		__sna_damage_reduce(r);
+	if (r->tiles)
+		__sna_damage_untile(r);
 
 	if (pixman_region_not_empty(&r->region)) {
 		pixman_region_translate(&r->region, dx, dy);
@@ -1603,6 +2425,8 @@ struct sna_damage *_sna_damage_combine(struct sna_damage *l,
 void __sna_damage_destroy(struct sna_damage *damage)
 {
 	free_list(&damage->embedded_box.list);
+	if (damage->tiles)
+		damage_tiles_destroy(damage->tiles);
 
 	pixman_region_fini(&damage->region);
 	*(void **)damage = __freed_damage;
@@ -1612,6 +2436,7 @@ void __sna_damage_destroy(struct sna_damage *damage)
 #if TEST_DAMAGE && HAS_DEBUG_FULL
 struct sna_damage_selftest{
 	int width, height;
+	enum { ST_BOXES, ST_TILES, ST_ADAPTIVE } mode;
 };
 
 static void st_damage_init_random_box(struct sna_damage_selftest *test,
@@ -1689,6 +2514,26 @@ static void st_damage_add_box(struct sna_damage_selftest *test,
 	pixman_region_union(region, region, &r);
 }
 
+static void st_damage_add_boxes(struct sna_damage_selftest *test,
+				struct sna_damage **damage,
+				pixman_region16_t *region)
+{
+	BoxRec box[16];
+	int n, count = 2 + rand() % (ARRAY_SIZE(box) - 1);
+
+	for (n = 0; n < count; n++) {
+		RegionRec r;
+
+		st_damage_init_random_box(test, &box[n]);
+		r.extents = box[n];
+		r.data = NULL;
+		pixman_region_union(region, region, &r);
+	}
+
+	if (!DAMAGE_IS_ALL(*damage))
+		sna_damage_add_boxes(damage, box, count, 0, 0);
+}
+
 static void st_damage_subtract(struct sna_damage_selftest *test,
 			       struct sna_damage **damage,
 			       pixman_region16_t *region)
@@ -1714,6 +2559,25 @@ static void st_damage_subtract_box(struct sna_damage_selftest *test,
 	pixman_region_subtract(region, region, &r);
 }
 
+static void st_damage_subtract_boxes(struct sna_damage_selftest *test,
+				     struct sna_damage **damage,
+				     pixman_region16_t *region)
+{
+	BoxRec box[16];
+	int n, count = 2 + rand() % (ARRAY_SIZE(box) - 1);
+
+	for (n = 0; n < count; n++) {
+		RegionRec r;
+
+		st_damage_init_random_box(test, &box[n]);
+		r.extents = box[n];
+		r.data = NULL;
+		pixman_region_subtract(region, region, &r);
+	}
+
+	sna_damage_subtract_boxes(damage, box, count, 0, 0);
+}
+
 static void st_damage_all(struct sna_damage_selftest *test,
 			  struct sna_damage **damage,
 			  pixman_region16_t *region)
@@ -1723,7 +2587,7 @@ static void st_damage_all(struct sna_damage_selftest *test,
 	pixman_region_init_rect(&tmp, 0, 0, test->width, test->height);
 
 	if (!DAMAGE_IS_ALL(*damage))
-		sna_damage_all(damage, test->width, test->height);
+		*damage = _sna_damage_all(*damage, test->width, test->height);
 	pixman_region_union(region, region, &tmp);
 }
 
@@ -1732,7 +2596,8 @@ static bool st_check_equal(struct sna_damage_selftest *test,
 			   pixman_region16_t *region)
 {
 	int d_num, r_num;
-	BoxPtr d_boxes, r_boxes;
+	const BoxRec *d_boxes;
+	BoxPtr r_boxes;
 
 	d_num = *damage ? sna_damage_get_boxes(*damage, &d_boxes) : 0;
 	r_boxes = pixman_region_rectangles(region, &r_num);
@@ -1752,6 +2617,37 @@ static bool st_check_equal(struct sna_damage_selftest *test,
 	return true;
 }
 
+static bool st_check_contains(struct sna_damage_selftest *test,
+			      struct sna_damage **damage,
+			      pixman_region16_t *region)
+{
+	int n;
+
+	for (n = 0; n < 16; n++) {
+		BoxRec box;
+		int expect;
+
+		st_damage_init_random_box(test, &box);
+		expect = pixman_region_contains_rectangle(region, &box);
+
+		if (*damage && !DAMAGE_IS_ALL(*damage) &&
+		    sna_damage_contains_box__no_reduce(*damage, &box) &&
+		    expect != PIXMAN_REGION_IN) {
+			ERR(("%s: damage contains (%d, %d), (%d, %d) without reduction, ref does not\n",
+			     __FUNCTION__, box.x1, box.y1, box.x2, box.y2));
+			return false;
+		}
+
+		if (sna_damage_contains_box(damage, &box) != expect) {
+			ERR(("%s: damage and ref disagree on (%d, %d), (%d, %d)\n",
+			     __FUNCTION__, box.x1, box.y1, box.x2, box.y2));
+			return false;
+		}
+	}
+
+	return st_check_equal(test, damage, region);
+}
+
 void sna_damage_selftest(void)
 {
 	void (*const op[])(struct sna_damage_selftest *test,
@@ -1759,15 +2655,17 @@ void sna_damage_selftest(void)
 			   pixman_region16_t *region) = {
 		st_damage_add,
 		st_damage_add_box,
+		st_damage_add_boxes,
 		st_damage_subtract,
 		st_damage_subtract_box,
+		st_damage_subtract_boxes,
 		st_damage_all
 	};
 	bool (*const check[])(struct sna_damage_selftest *test,
 			      struct sna_damage **damage,
 			      pixman_region16_t *region) = {
 		st_check_equal,
-		//st_check_contains,
+		st_check_contains,
 	};
 	char region_buf[120];
 	char damage_buf[1000];
@@ -1784,10 +2682,18 @@ void sna_damage_selftest(void)
 
 		test.width = 1 + rand() % 2048;
 		test.height = 1 + rand() % 2048;
+		test.mode = pass % 3;
 
 		damage = _sna_damage_create();
 		pixman_region_init(&ref);
 
+		/* Either start in tile mode, or switch on the first batch */
+		if (test.mode == ST_TILES) {
+			BoxRec bounds = { 0, 0, test.width, test.height };
+			__sna_damage_tile(damage, &bounds);
+		} else if (test.mode == ST_ADAPTIVE)
+			damage->churn = DAMAGE_TILE_CHURN;
+
 		for (i = 0; i < iter; i++) {
 			op[rand() % ARRAY_SIZE(op)](&test, &damage, &ref);
 		}
@@ -1810,8 +2716,18 @@ void _sna_damage_debug_get_region(struct sna_damage *damage, RegionRec *r)
 	BoxPtr boxes;
 	struct sna_damage_box *iter;
 
+	if (damage->tiles && damage->dirty) {
+		pixman_region16_t tmp;
+
+		if (damage_tiles_to_region(damage->tiles, &tmp)) {
+			RegionCopy(r, &tmp);
+			pixman_region_fini(&tmp);
+			return;
+		}
+	}
+
 	RegionCopy(r, &damage->region);
-	if (!damage->dirty)
+	if (!damage->dirty || damage->tiles)
 		return;
 
 	nboxes = damage->embedded_box.size;
@@ -5,6 +5,8 @@
 
 #include "compiler.h"
 
+struct sna_damage_tiles;
+
 struct sna_damage {
 	BoxRec extents;
 	pixman_region16_t region;
@@ -15,6 +17,8 @@ struct sna_damage {
 	} mode;
 	int remain, dirty;
 	BoxPtr box;
+	struct sna_damage_tiles *tiles;
+	int churn;
 	struct {
 		struct list list;
 		int size;
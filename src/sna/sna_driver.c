@@ -517,7 +517,7 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int probe)
 	rgb defaultWeight = { 0, 0, 0 };
 	EntityInfoPtr pEnt;
 	Gamma zeros = { 0.0, 0.0, 0.0 };
-	int fd;
+	int fd, threads, cache_size;
 
 	DBG(("%s flags=%x, numEntities=%d\n",
 	     __FUNCTION__, probe, scrn->numEntities));
@@ -556,6 +556,9 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int probe)
 		scrn->driverPrivate = sna;
 
 		sna->cpu_features = sna_cpu_detect();
+		choose_affine_blt(sna->cpu_features);
+		choose_memcpy_xor(sna->cpu_features);
+		choose_span_blt(sna->cpu_features);
 		sna->acpi.fd = sna_acpi_open();
 	}
 	sna = to_sna(scrn);
@@ -584,10 +587,6 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int probe)
 	}
 
 	intel_detect_chipset(scrn, sna->dev);
-	xf86DrvMsg(scrn->scrnIndex, X_PROBED,
-		   "CPU: %s; using a maximum of %d threads\n",
-		   sna_cpu_features_to_string(sna->cpu_features, buf),
-		   sna_use_threads(64*1024, 64*1024, 1));
 
 	if (!xf86SetDepthBpp(scrn, 24, 0, 0,
 			     Support32bppFb |
@@ -620,12 +619,77 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int probe)
 	if (sna->Options == NULL)
 		goto cleanup;
 
+	if (!xf86GetOptValInteger(sna->Options, OPTION_THREADS, &threads))
+		threads = -1;
+	sna_threads_init(threads,
+			 xf86ReturnOptValBool(sna->Options, OPTION_THREAD_AFFINITY, FALSE));
+	xf86DrvMsg(scrn->scrnIndex, X_PROBED,
+		   "CPU: %s; using a maximum of %d threads\n",
+		   sna_cpu_features_to_string(sna->cpu_features, buf),
+		   sna_threads_max());
+
 	sna_setup_capabilities(scrn, fd);
 
 	kgem_init(&sna->kgem, fd,
 		  xf86GetPciInfoForEntity(pEnt->index),
 		  sna->info->gen);
 
+	if (xf86GetOptValInteger(sna->Options, OPTION_CACHE_SIZE, &cache_size) &&
+	    cache_size >= 0) {
+		kgem_set_cache_limit(&sna->kgem, (uint64_t)cache_size << 20);
+		if (cache_size)
+			xf86DrvMsg(scrn->scrnIndex, X_CONFIG,
+				   "Buffer cache limited to %dMiB\n", cache_size);
+		else
+			xf86DrvMsg(scrn->scrnIndex, X_CONFIG,
+				   "Buffer cache size unlimited\n");
+	}
+
+	if (xf86ReturnOptValBool(sna->Options, OPTION_TRACE_BATCHES, FALSE)) {
+		const char *dir = getenv("XDG_RUNTIME_DIR");
+
+		if (dir == NULL) {
+			xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+				   "Unable to record batches, XDG_RUNTIME_DIR is not set\n");
+		} else {
+			snprintf(buf, sizeof(buf), "%s/sna-batches.%d",
+				 dir, (int)getpid());
+			if (kgem_trace_open(&sna->kgem, buf))
+				xf86DrvMsg(scrn->scrnIndex, X_CONFIG,
+					   "Recording batches into %s\n", buf);
+			else
+				xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+					   "Unable to record batches into %s\n", buf);
+		}
+	}
+
+	if (xf86ReturnOptValBool(sna->Options, OPTION_ASYNC_SUBMIT, FALSE)) {
+		if (kgem_enable_async_submit(&sna->kgem))
+			xf86DrvMsg(scrn->scrnIndex, X_CONFIG,
+				   "Submitting batches from a separate thread\n");
+		else
+			xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+				   "Unable to submit batches asynchronously\n");
+	}
+
+	if (xf86ReturnOptValBool(sna->Options, OPTION_CAPTURE_BATCHES, FALSE)) {
+		const char *dir = getenv("XDG_RUNTIME_DIR");
+
+		if (dir == NULL) {
+			xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+				   "Unable to capture batches, XDG_RUNTIME_DIR is not set\n");
+		} else {
+			snprintf(buf, sizeof(buf), "%s/sna-capture.%d",
+				 dir, (int)getpid());
+			if (kgem_capture_open(&sna->kgem, buf))
+				xf86DrvMsg(scrn->scrnIndex, X_CONFIG,
+					   "Capturing batches into %s\n", buf);
+			else
+				xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+					   "Unable to capture batches into %s\n", buf);
+		}
+	}
+
 	if (xf86ReturnOptValBool(sna->Options, OPTION_TILING_FB, FALSE))
 		sna->flags |= SNA_LINEAR_FB;
 	if (!sna->kgem.can_fence)
@@ -1262,6 +1326,10 @@ static void sna_free_screen(FREE_SCREEN_ARGS_DECL)
 
 	sna_mode_fini(sna);
 	sna_acpi_fini(sna);
+	kgem_disable_async_submit(&sna->kgem);
+	kgem_trace_close(&sna->kgem);
+	kgem_capture_close(&sna->kgem);
+	kgem_pressure_close(&sna->kgem);
 
 	intel_put_device(sna->dev);
 	free(sna);
@@ -1459,8 +1527,6 @@ Bool sna_init_scrn(ScrnInfoPtr scrn, int entity_num)
 	xf86SetEntityInstanceForScreen(scrn, entity_num,
 				       xf86GetNumEntityInstances(entity_num)-1);
 
-	sna_threads_init();
-
 	return TRUE;
 }
 
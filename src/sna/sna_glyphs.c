@@ -156,9 +156,11 @@ void sna_glyphs_close(struct sna *sna)
 
 	for (i = 0; i < ARRAY_SIZE(render->glyph); i++) {
 		struct sna_glyph_cache *cache = &render->glyph[i];
+		unsigned int n;
 
-		if (cache->picture)
-			FreePicture(cache->picture, 0);
+		for (n = 0; n < ARRAY_SIZE(cache->picture); n++)
+			if (cache->picture[n])
+				FreePicture(cache->picture[n], 0);
 
 		free(cache->glyphs);
 	}
@@ -174,13 +176,56 @@ void sna_glyphs_close(struct sna *sna)
 	}
 }
 
+static PicturePtr
+glyph_cache_create_page(ScreenPtr screen, PictFormatPtr format)
+{
+	struct sna_pixmap *priv;
+	PixmapPtr pixmap;
+	PicturePtr picture = NULL;
+	CARD32 component_alpha;
+	int error;
+
+	/* Now allocate the pixmap and picture */
+	pixmap = screen->CreatePixmap(screen,
+				      CACHE_PICTURE_SIZE,
+				      CACHE_PICTURE_SIZE,
+				      format->depth,
+				      SNA_CREATE_SCRATCH);
+	if (!pixmap) {
+		DBG(("%s: failed to allocate pixmap for Glyph cache\n",
+		     __FUNCTION__));
+		return NULL;
+	}
+
+	priv = sna_pixmap(pixmap);
+	if (priv != NULL) {
+		/* Prevent the cache from ever being paged out */
+		assert(priv->gpu_bo);
+		priv->pinned = PIN_SCANOUT;
+
+		component_alpha = NeedsComponent(format->format);
+		picture = CreatePicture(0, &pixmap->drawable, format,
+					CPComponentAlpha, &component_alpha,
+					serverClient, &error);
+	}
+
+	screen->DestroyPixmap(pixmap);
+	if (!picture)
+		return NULL;
+
+	ValidatePicture(picture);
+	assert(picture->pDrawable == &pixmap->drawable);
+	return picture;
+}
+
 /* All caches for a single format share a single pixmap for glyph storage,
  * allowing mixing glyphs of different sizes without paying a penalty
  * for switching between source pixmaps. (Note that for a size of font
  * right at the border between two sizes, we might be switching for almost
- * every glyph.)
+ * every glyph.) Once that pixmap is full, further pages may be added
+ * (see glyph_cache_grow()) before we start evicting.
  *
- * This function allocates the storage pixmap, and then fills in the
+ * This function allocates the first storage pixmap, and then fills in the
  * rest of the allocated structures for all caches with the given format.
  */
 bool sna_glyphs_create(struct sna *sna)
@@ -222,56 +267,25 @@ bool sna_glyphs_create(struct sna *sna)
 
 	for (i = 0; i < ARRAY_SIZE(formats); i++) {
 		struct sna_glyph_cache *cache = &sna->render.glyph[i];
-		struct sna_pixmap *priv;
-		PixmapPtr pixmap;
-		PicturePtr picture = NULL;
+		PicturePtr picture;
 		PictFormatPtr pPictFormat;
-		CARD32 component_alpha;
 		int depth = PIXMAN_FORMAT_DEPTH(formats[i]);
 
 		pPictFormat = PictureMatchFormat(screen, depth, formats[i]);
 		if (!pPictFormat)
 			goto bail;
 
-		/* Now allocate the pixmap and picture */
-		pixmap = screen->CreatePixmap(screen,
-					      CACHE_PICTURE_SIZE,
-					      CACHE_PICTURE_SIZE,
-					      depth,
-					      SNA_CREATE_SCRATCH);
-		if (!pixmap) {
-			DBG(("%s: failed to allocate pixmap for Glyph cache\n",
-			     __FUNCTION__));
-			goto bail;
-		}
-
-		priv = sna_pixmap(pixmap);
-		if (priv != NULL) {
-			/* Prevent the cache from ever being paged out */
-			assert(priv->gpu_bo);
-			priv->pinned = PIN_SCANOUT;
-
-			component_alpha = NeedsComponent(pPictFormat->format);
-			picture = CreatePicture(0, &pixmap->drawable, pPictFormat,
-						CPComponentAlpha, &component_alpha,
-						serverClient, &error);
-		}
-
-		screen->DestroyPixmap(pixmap);
+		picture = glyph_cache_create_page(screen, pPictFormat);
 		if (!picture)
 			goto bail;
 
-		ValidatePicture(picture);
-		assert(picture->pDrawable == &pixmap->drawable);
-
 		cache->count = cache->evict = 0;
-		cache->picture = picture;
+		cache->picture[0] = picture;
+		cache->npages = 1;
 		cache->glyphs = calloc(sizeof(struct sna_glyph *),
 				       GLYPH_CACHE_SIZE);
 		if (!cache->glyphs)
 			goto bail;
-
-		cache->evict = rand() % GLYPH_CACHE_SIZE;
 	}
 
 	sna->render.white_picture =
@@ -287,7 +301,7 @@ bail:
 }
 
 static void
-glyph_cache_upload(struct sna_glyph_cache *cache,
+glyph_cache_upload(PicturePtr atlas,
 		   GlyphPtr glyph, PicturePtr glyph_picture,
 		   int16_t x, int16_t y)
 {
@@ -297,7 +311,7 @@ glyph_cache_upload(struct sna_glyph_cache *cache,
 	     glyph_picture->pDrawable->width,
 	     glyph_picture->pDrawable->height));
 	sna_composite(PictOpSrc,
-		      glyph_picture, 0, cache->picture,
+		      glyph_picture, 0, atlas,
 		      0, 0,
 		      0, 0,
 		      x, y,
@@ -387,6 +401,154 @@ glyph_size_to_mask(int size)
 	return glyph_count_to_mask(glyph_size_to_count(size));
 }
 
+static inline void
+glyph_used(struct sna_render *render, struct sna_glyph *p)
+{
+	p->used = 1;
+	render->glyph_lookups++;
+}
+
+static inline int
+glyph_page_size(const struct sna_glyph_cache *cache)
+{
+	return CACHE_PICTURE_SIZE * CACHE_PICTURE_SIZE *
+		PIXMAN_FORMAT_BPP(cache->picture[0]->format) / 8;
+}
+
+/* Add another page to the atlas, so long as all the glyph caches together
+ * remain a small fraction of the aperture.
+ */
+static bool
+glyph_cache_grow(ScreenPtr screen,
+		 struct sna_render *render,
+		 struct sna_glyph_cache *cache)
+{
+	struct sna *sna = to_sna_from_screen(screen);
+	struct sna_glyph **glyphs;
+	PicturePtr picture;
+	unsigned long bytes;
+	unsigned int i;
+
+	if (cache->npages == ARRAY_SIZE(cache->picture))
+		return false;
+
+	bytes = glyph_page_size(cache);
+	for (i = 0; i < ARRAY_SIZE(render->glyph); i++) {
+		if (render->glyph[i].npages)
+			bytes += render->glyph[i].npages * glyph_page_size(&render->glyph[i]);
+	}
+	DBG(("%s: adding page %d, total %ld bytes, limit %d\n",
+	     __FUNCTION__, cache->npages, bytes, sna->kgem.aperture_low / 32));
+	if (bytes > sna->kgem.aperture_low / 32)
+		return false;
+
+	glyphs = realloc(cache->glyphs,
+			 (cache->npages + 1) * GLYPH_CACHE_SIZE * sizeof(*glyphs));
+	if (glyphs == NULL)
+		return false;
+
+	memset(glyphs + cache->npages * GLYPH_CACHE_SIZE, 0,
+	       GLYPH_CACHE_SIZE * sizeof(*glyphs));
+	cache->glyphs = glyphs;
+
+	picture = glyph_cache_create_page(screen, cache->picture[0]->pFormat);
+	if (picture == NULL)
+		return false;
+
+	cache->picture[cache->npages++] = picture;
+	cache->count = 0;
+	return true;
+}
+
+/* Find the glyph, if any, occupying all of the size-aligned block at pos */
+static struct sna_glyph *
+glyph_cache_container(struct sna_glyph_cache *cache, int pos, int size)
+{
+	int s;
+
+	for (s = size; s <= GLYPH_MAX_SIZE; s *= 2) {
+		struct sna_glyph *p = cache->glyphs[pos & glyph_size_to_mask(s)];
+		if (p != NULL)
+			return p->size >= s ? p : NULL;
+	}
+
+	return NULL;
+}
+
+/* Report whether any glyph in the block has been used since the clock
+ * hand last passed over it, and clear their bits for the next pass.
+ */
+static bool
+glyph_cache_referenced(struct sna_glyph_cache *cache, int pos, int size)
+{
+	struct sna_glyph *p;
+	bool used = false;
+	int count, i;
+
+	p = glyph_cache_container(cache, pos, size);
+	if (p != NULL) {
+		used = p->used;
+		p->used = 0;
+		return used;
+	}
+
+	count = glyph_size_to_count(size);
+	for (i = 0; i < count; i++) {
+		p = cache->glyphs[pos + i];
+		if (p != NULL && p->used) {
+			p->used = 0;
+			used = true;
+		}
+	}
+
+	return used;
+}
+
+static void
+glyph_cache_remove(struct sna_glyph_cache *cache, int pos)
+{
+	struct sna_glyph *p = cache->glyphs[pos];
+
+	DBG(("%s: evicting glyph of size %d from page %d, pos %d\n",
+	     __FUNCTION__, p->size, p->page, p->pos >> 1));
+	assert(p->page * GLYPH_CACHE_SIZE + (p->pos >> 1) == pos);
+
+	cache->glyphs[pos] = NULL;
+	p->atlas = NULL;
+	cache->evictions++;
+}
+
+/* Second-chance (clock) replacement: the hand sweeps over all pages in
+ * steps of the glyph size, sparing once any block with a glyph that has
+ * been used since the previous sweep, and evicts the first cold block.
+ */
+static int
+glyph_cache_evict(struct sna_glyph_cache *cache, int size)
+{
+	const int count = glyph_size_to_count(size);
+	const uint32_t total = cache->npages * GLYPH_CACHE_SIZE;
+	struct sna_glyph *p;
+	int pos, i;
+
+	do {
+		pos = cache->evict & glyph_count_to_mask(count);
+		cache->evict = pos + count;
+		if (cache->evict >= total)
+			cache->evict = 0;
+	} while (glyph_cache_referenced(cache, pos, size));
+
+	p = glyph_cache_container(cache, pos, size);
+	if (p != NULL) {
+		glyph_cache_remove(cache, pos & glyph_size_to_mask(p->size));
+	} else {
+		for (i = 0; i < count; i++)
+			if (cache->glyphs[pos + i])
+				glyph_cache_remove(cache, pos + i);
+	}
+
+	return pos;
+}
+
 static int
 glyph_cache(ScreenPtr screen,
 	    struct sna_render *render,
@@ -427,51 +589,31 @@ glyph_cache(ScreenPtr screen,
 			break;
 
 	cache = &render->glyph[PICT_FORMAT_RGB(glyph_picture->format) != 0];
+	cache->misses++;
+
 	s = glyph_size_to_count(size);
 	mask = glyph_count_to_mask(s);
 	pos = (cache->count + s - 1) & mask;
+	if (pos >= GLYPH_CACHE_SIZE && glyph_cache_grow(screen, render, cache))
+		pos = 0;
 	if (pos < GLYPH_CACHE_SIZE) {
 		cache->count = pos + s;
-	} else {
-		p = NULL;
-		for (s = size; s <= GLYPH_MAX_SIZE; s *= 2) {
-			int i = cache->evict & glyph_size_to_mask(s);
-			p = cache->glyphs[i];
-			if (p == NULL)
-				continue;
-
-			if (p->size >= s) {
-				cache->glyphs[i] = NULL;
-				p->atlas = NULL;
-				pos = i;
-			} else
-				p = NULL;
-			break;
-		}
-		if (p == NULL) {
-			int count = glyph_size_to_count(size);
-			pos = cache->evict & glyph_count_to_mask(count);
-			for (s = 0; s < count; s++) {
-				p = cache->glyphs[pos + s];
-				if (p != NULL) {
-					p->atlas =NULL;
-					cache->glyphs[pos + s] = NULL;
-				}
-			}
-		}
-
-		/* And pick a new eviction position */
-		cache->evict = rand() % GLYPH_CACHE_SIZE;
-	}
+		pos += (cache->npages - 1) * GLYPH_CACHE_SIZE;
+	} else
+		pos = glyph_cache_evict(cache, size);
 	assert(cache->glyphs[pos] == NULL);
 
 	p = sna_glyph(glyph);
-	DBG(("%s(%d): adding glyph to cache %d, pos %d\n",
+	DBG(("%s(%d): adding glyph to cache %d, page %d, pos %d\n",
 	     __FUNCTION__, screen->myNum,
-	     PICT_FORMAT_RGB(glyph_picture->format) != 0, pos));
+	     PICT_FORMAT_RGB(glyph_picture->format) != 0,
+	     pos / GLYPH_CACHE_SIZE, pos % GLYPH_CACHE_SIZE));
 	cache->glyphs[pos] = p;
-	p->atlas = cache->picture;
+	p->atlas = cache->picture[pos / GLYPH_CACHE_SIZE];
+	p->page = pos / GLYPH_CACHE_SIZE;
+	p->used = 1;
 	p->size = size;
+	pos %= GLYPH_CACHE_SIZE;
 	p->pos = pos << 1 | (PICT_FORMAT_RGB(glyph_picture->format) != 0);
 	s = pos / ((GLYPH_MAX_SIZE / GLYPH_MIN_SIZE) * (GLYPH_MAX_SIZE / GLYPH_MIN_SIZE));
 	p->coordinate.x = s % (CACHE_PICTURE_SIZE / GLYPH_MAX_SIZE) * GLYPH_MAX_SIZE;
@@ -484,7 +626,7 @@ glyph_cache(ScreenPtr screen,
 		pos >>= 2;
 	}
 
-	glyph_cache_upload(cache, glyph, glyph_picture,
+	glyph_cache_upload(p->atlas, glyph, glyph_picture,
 			   p->coordinate.x, p->coordinate.y);
 
 	return true;
@@ -648,6 +790,7 @@ glyphs_to_dst(struct sna *sna,
 
 				glyph_atlas = p->atlas;
 			}
+			glyph_used(&sna->render, p);
 
 			if (nrect) {
 				int xi = x - glyph->info.x;
@@ -798,6 +941,7 @@ glyphs0_to_dst(struct sna *sna,
 
 					glyph_atlas = p->atlas;
 				}
+				glyph_used(&sna->render, p);
 
 				xi = x - glyph->info.x;
 				yi = y - glyph->info.y;
@@ -890,6 +1034,7 @@ next_glyph_N:
 
 				glyph_atlas = p->atlas;
 			}
+			glyph_used(&sna->render, p);
 
 			r.dst.x = x - glyph->info.x;
 			r.dst.y = y - glyph->info.y;
@@ -970,6 +1115,7 @@ glyphs_slow(struct sna *sna,
 				if (!glyph_cache(screen, &sna->render, glyph))
 					goto next_glyph;
 			}
+			glyph_used(&sna->render, p);
 
 			DBG(("%s: glyph=(%d, %d)x(%d, %d), src=(%d, %d), mask=(%d, %d)\n",
 			     __FUNCTION__,
@@ -1408,6 +1554,7 @@ next_image:
 
 					glyph_atlas = p->atlas;
 				}
+				glyph_used(&sna->render, p);
 
 				DBG(("%s: blt glyph origin (%d, %d), offset (%d, %d), src (%d, %d), size (%d, %d)\n",
 				     __FUNCTION__,
@@ -2387,10 +2534,11 @@ sna_glyph_unrealize(ScreenPtr screen, GlyphPtr glyph)
 	if (p->atlas && p->atlas != GetGlyphPicture(glyph, screen)) {
 		struct sna *sna = to_sna_from_screen(screen);
 		struct sna_glyph_cache *cache = &sna->render.glyph[p->pos&1];
-		DBG(("%s: releasing glyph pos %d from cache %d\n",
-		     __FUNCTION__, p->pos >> 1, p->pos & 1));
-		assert(cache->glyphs[p->pos >> 1] == p);
-		cache->glyphs[p->pos >> 1] = NULL;
+		int pos = p->page * GLYPH_CACHE_SIZE + (p->pos >> 1);
+		DBG(("%s: releasing glyph page %d, pos %d from cache %d\n",
+		     __FUNCTION__, p->page, p->pos >> 1, p->pos & 1));
+		assert(cache->glyphs[pos] == p);
+		cache->glyphs[pos] = NULL;
 		p->atlas = NULL;
 	}
 
@@ -2399,3 +2547,27 @@ sna_glyph_unrealize(ScreenPtr screen, GlyphPtr glyph)
 	       pixman_glyph_cache_lookup(__global_glyph_cache, glyph, NULL) == NULL);
 #endif
 }
+
+void sna_glyphs_dump(struct sna *sna)
+{
+	struct sna_render *render = &sna->render;
+	unsigned long misses = 0;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(render->glyph); i++)
+		misses += render->glyph[i].misses;
+
+	ErrorF("Glyph cache: %lu lookups, %lu hits\n",
+	       render->glyph_lookups,
+	       render->glyph_lookups > misses ? render->glyph_lookups - misses : 0);
+	for (i = 0; i < ARRAY_SIZE(render->glyph); i++) {
+		const struct sna_glyph_cache *cache = &render->glyph[i];
+
+		if (cache->npages == 0)
+			continue;
+
+		ErrorF("  %s: %d pages, %lu misses, %lu evictions\n",
+		       i ? "argb" : "a8", cache->npages,
+		       cache->misses, cache->evictions);
+	}
+}
@@ -63,6 +63,11 @@ static bool download_inplace__cpu(struct kgem *kgem,
 	case I915_TILING_X:
 		if (!kgem->memcpy_from_tiled_x)
 			return false;
+		break;
+	case I915_TILING_Y:
+		if (!kgem->memcpy_from_tiled_y)
+			return false;
+		break;
 	case I915_TILING_NONE:
 		break;
 	default:
@@ -105,9 +110,6 @@ read_boxes_inplace__cpu(struct kgem *kgem,
 	if (!download_inplace__cpu(kgem, dst, bo, box, n))
 		return false;
 
-	if (bo->tiling == I915_TILING_Y)
-		return false;
-
 	assert(kgem_bo_can_map__cpu(kgem, bo, false));
 
 	src = kgem_bo_map__cpu(kgem, bo);
@@ -121,14 +123,14 @@ read_boxes_inplace__cpu(struct kgem *kgem,
 
 	DBG(("%s x %d\n", __FUNCTION__, n));
 
-	if (bo->tiling == I915_TILING_X) {
-		do {
-			memcpy_from_tiled_x(kgem, src, dst, bpp, src_pitch, dst_pitch,
-					    box->x1, box->y1,
-					    box->x1, box->y1,
-					    box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
+	if (bo->tiling == I915_TILING_X || bo->tiling == I915_TILING_Y) {
+		if (!sna_memcpy_boxes__tiled(kgem, bo->tiling, false, 0,
+					     src, dst, bpp, src_pitch, dst_pitch,
+					     0, 0, 0, 0,
+					     box, n)) {
+			sigtrap_put();
+			return false;
+		}
 	} else {
 		do {
 			memcpy_blt(src, dst, bpp, src_pitch, dst_pitch,
@@ -652,7 +654,9 @@ static bool upload_inplace__tiled(struct kgem *kgem, struct kgem_bo *bo)
 	DBG(("%s: tiling=%d\n", __FUNCTION__, bo->tiling));
 	switch (bo->tiling) {
 	case I915_TILING_Y:
-		return false;
+		if (!kgem->memcpy_to_tiled_y)
+			return false;
+		break;
 	case I915_TILING_X:
 		if (!kgem->memcpy_to_tiled_x)
 			return false;
@@ -666,44 +670,52 @@ static bool upload_inplace__tiled(struct kgem *kgem, struct kgem_bo *bo)
 	return kgem_bo_can_map__cpu(kgem, bo, true);
 }
 
-static bool
-write_boxes_inplace__tiled(struct kgem *kgem,
-                           const uint8_t *src, int stride, int bpp, int16_t src_dx, int16_t src_dy,
-                           struct kgem_bo *bo, int16_t dst_dx, int16_t dst_dy,
-                           const BoxRec *box, int n)
+static void *map_inplace__tiled(struct kgem *kgem, struct kgem_bo *bo)
 {
-	uint8_t *dst;
-
-	if (bo->tiling == I915_TILING_Y)
-		return false;
+	void *dst;
 
 	assert(kgem->has_wc_mmap || kgem_bo_can_map__cpu(kgem, bo, true));
 
 	if (kgem_bo_can_map__cpu(kgem, bo, true)) {
 		dst = kgem_bo_map__cpu(kgem, bo);
 		if (dst == NULL)
-			return false;
+			return NULL;
 
 		kgem_bo_sync__cpu(kgem, bo);
 	} else {
 		dst = kgem_bo_map__wc(kgem, bo);
 		if (dst == NULL)
-			return false;
+			return NULL;
 
 		kgem_bo_sync__gtt(kgem, bo);
 	}
 
+	return dst;
+}
+
+static bool
+write_boxes_inplace__tiled(struct kgem *kgem,
+                           const uint8_t *src, int stride, int bpp, int16_t src_dx, int16_t src_dy,
+                           struct kgem_bo *bo, int16_t dst_dx, int16_t dst_dy,
+                           const BoxRec *box, int n)
+{
+	uint8_t *dst;
+
+	dst = map_inplace__tiled(kgem, bo);
+	if (dst == NULL)
+		return false;
+
 	if (sigtrap_get())
 		return false;
 
-	if (bo->tiling) {
-		do {
-			memcpy_to_tiled_x(kgem, src, dst, bpp, stride, bo->pitch,
-					  box->x1 + src_dx, box->y1 + src_dy,
-					  box->x1 + dst_dx, box->y1 + dst_dy,
-					  box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
+	if (bo->tiling == I915_TILING_X || bo->tiling == I915_TILING_Y) {
+		if (!sna_memcpy_boxes__tiled(kgem, bo->tiling, true, dst_dy,
+					     src, dst, bpp, stride, bo->pitch,
+					     src_dx, src_dy, dst_dx, dst_dy,
+					     box, n)) {
+			sigtrap_put();
+			return false;
+		}
 	} else {
 		do {
 			memcpy_blt(src, dst, bpp, stride, bo->pitch,
@@ -1264,6 +1276,60 @@ fallback:
 				   box, nbox);
 }
 
+static bool upload_inplace__tiled__xor(struct kgem *kgem,
+				       struct kgem_bo *bo, int bpp)
+{
+	DBG(("%s: tiling=%d, bpp=%d\n", __FUNCTION__, bo->tiling, bpp));
+	if (bo->tiling != I915_TILING_X || bpp != 32)
+		return false;
+
+	if (!kgem->memcpy_xor_to_tiled_x)
+		return false;
+
+	if (kgem->has_wc_mmap)
+		return true;
+
+	return kgem_bo_can_map__cpu(kgem, bo, true);
+}
+
+static bool
+write_boxes_inplace__tiled__xor(struct kgem *kgem,
+				const uint8_t *src, int stride, int bpp, int16_t src_dx, int16_t src_dy,
+				struct kgem_bo *bo, int16_t dst_dx, int16_t dst_dy,
+				const BoxRec *box, int n,
+				uint32_t and, uint32_t or)
+{
+	uint8_t *dst;
+
+	assert(bo->tiling == I915_TILING_X);
+	assert(kgem->memcpy_xor_to_tiled_x);
+
+	dst = map_inplace__tiled(kgem, bo);
+	if (dst == NULL)
+		return false;
+
+	if (sigtrap_get())
+		return false;
+
+	do {
+		DBG(("%s: (%d, %d) -> (%d, %d) x (%d, %d) [bpp=%d, src_pitch=%d, dst_pitch=%d]\n", __FUNCTION__,
+		     box->x1 + src_dx, box->y1 + src_dy,
+		     box->x1 + dst_dx, box->y1 + dst_dy,
+		     box->x2 - box->x1, box->y2 - box->y1,
+		     bpp, stride, bo->pitch));
+
+		kgem->memcpy_xor_to_tiled_x(src, dst, bpp, stride, bo->pitch,
+					    box->x1 + src_dx, box->y1 + src_dy,
+					    box->x1 + dst_dx, box->y1 + dst_dy,
+					    box->x2 - box->x1, box->y2 - box->y1,
+					    and, or);
+		box++;
+	} while (--n);
+
+	sigtrap_put();
+	return true;
+}
+
 static bool
 write_boxes_inplace__xor(struct kgem *kgem,
 			 const void *src, int stride, int bpp, int16_t src_dx, int16_t src_dy,
@@ -1275,6 +1341,12 @@ write_boxes_inplace__xor(struct kgem *kgem,
 
 	DBG(("%s x %d, tiling=%d\n", __FUNCTION__, n, bo->tiling));
 
+	if (upload_inplace__tiled__xor(kgem, bo, bpp) &&
+	    write_boxes_inplace__tiled__xor(kgem, src, stride, bpp, src_dx, src_dy,
+					    bo, dst_dx, dst_dy, box, n,
+					    and, or))
+		return true;
+
 	if (!kgem_bo_can_map(kgem, bo))
 		return false;
 
@@ -1327,7 +1399,8 @@ static bool upload_inplace__xor(struct kgem *kgem,
 	if (unlikely(kgem->wedged))
 		return true;
 
-	if (!kgem_bo_can_map(kgem, bo))
+	if (!kgem_bo_can_map(kgem, bo) &&
+	    !upload_inplace__tiled__xor(kgem, bo, bpp))
 		return false;
 
 	return __upload_inplace(kgem, bo, box, n, bpp);
@@ -1961,6 +2034,21 @@ sna_replace__xor(struct sna *sna, PixmapPtr pixmap,
 			bo = new_bo;
 	}
 
+	if (upload_inplace__tiled__xor(&sna->kgem, bo,
+				       pixmap->drawable.bitsPerPixel)) {
+		BoxRec box;
+
+		box.x1 = box.y1 = 0;
+		box.x2 = pixmap->drawable.width;
+		box.y2 = pixmap->drawable.height;
+
+		if (write_boxes_inplace__tiled__xor(&sna->kgem, src,
+						    stride, pixmap->drawable.bitsPerPixel, 0, 0,
+						    bo, 0, 0, &box, 1,
+						    and, or))
+			goto done;
+	}
+
 	if (kgem_bo_can_map(&sna->kgem, bo) &&
 	    (dst = kgem_bo_map(&sna->kgem, bo)) != NULL &&
 	    sigtrap_get() == 0) {
@@ -1992,6 +2080,7 @@ sna_replace__xor(struct sna *sna, PixmapPtr pixmap,
 			return false;
 	}
 
+done:
 	if (bo != priv->gpu_bo) {
 		sna_pixmap_unmap(pixmap, priv);
 		kgem_bo_destroy(&sna->kgem, priv->gpu_bo);
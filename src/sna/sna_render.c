@@ -2412,3 +2412,20 @@ sna_render_mark_wedged(struct sna *sna)
 	sna->render.copy_boxes = memcpy_copy_boxes;
 	sna->render.prefer_gpu = 0;
 }
+
+void
+sna_render_state_dump(struct sna *sna)
+{
+	static const char * const name[SNA_STATE_COUNT] = {
+		[SNA_STATE_DRAWRECT] = "drawrect",
+		[SNA_STATE_BLEND] = "blend",
+		[SNA_STATE_SAMPLER] = "sampler",
+	};
+	const struct sna_state_shadow *shadow = &sna->render.shadow;
+	unsigned int i;
+
+	ErrorF("Render state packets:\n");
+	for (i = 0; i < SNA_STATE_COUNT; i++)
+		ErrorF("  %s: %lu emitted, %lu elided\n",
+		       name[i], shadow->emitted[i], shadow->elided[i]);
+}
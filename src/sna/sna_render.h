@@ -221,6 +221,27 @@ struct sna_copy_op {
 	void (*done)(struct sna *sna, const struct sna_copy_op *op);
 };
 
+/* State packets whose last payload within the batch is shadowed, so that
+ * an identical packet need not be emitted again (see sna_state_emit()).
+ */
+enum sna_state_packet {
+	SNA_STATE_DRAWRECT,
+	SNA_STATE_BLEND,
+	SNA_STATE_SAMPLER,
+	SNA_STATE_COUNT
+};
+#define SNA_STATE_MAX_DWORDS 8
+
+struct sna_state_shadow {
+	struct {
+		uint32_t hash;
+		uint32_t len; /* 0 if unknown, e.g. at the start of a batch */
+		uint32_t dw[SNA_STATE_MAX_DWORDS];
+	} packet[SNA_STATE_COUNT];
+	unsigned long emitted[SNA_STATE_COUNT];
+	unsigned long elided[SNA_STATE_COUNT];
+};
+
 struct sna_render {
 	pthread_mutex_t lock;
 	pthread_cond_t wait;
@@ -327,11 +348,16 @@ struct sna_render {
 	} gradient_cache;
 
 	struct sna_glyph_cache{
-		PicturePtr picture;
+		PicturePtr picture[4];
 		struct sna_glyph **glyphs;
+		uint16_t npages;
 		uint16_t count;
-		uint16_t evict;
+		uint32_t evict;
+		unsigned long misses;
+		unsigned long evictions;
 	} glyph[2];
+	unsigned long glyph_lookups;
+	struct sna_state_shadow shadow;
 	pixman_image_t *white_image;
 	PicturePtr white_picture;
 
@@ -390,8 +416,6 @@ struct gen4_render_state {
 	uint32_t cc;
 
 	int ve_id;
-	uint32_t drawrect_offset;
-	uint32_t drawrect_limit;
 	uint32_t last_pipelined_pointers;
 	uint16_t last_primitive;
 	int16_t floats_per_vertex;
@@ -410,8 +434,6 @@ struct gen5_render_state {
 	uint32_t cc;
 
 	int ve_id;
-	uint32_t drawrect_offset;
-	uint32_t drawrect_limit;
 	uint32_t last_pipelined_pointers;
 	uint16_t last_primitive;
 	int16_t floats_per_vertex;
@@ -454,10 +476,7 @@ struct gen6_render_state {
 
 	uint32_t cc_blend;
 
-	uint32_t drawrect_offset;
-	uint32_t drawrect_limit;
 	uint32_t blend;
-	uint32_t samplers;
 	uint32_t kernel;
 
 	uint16_t num_sf_outputs;
@@ -505,10 +524,6 @@ struct gen7_render_state {
 
 	uint32_t cc_blend;
 
-	uint32_t drawrect_offset;
-	uint32_t drawrect_limit;
-	uint32_t blend;
-	uint32_t samplers;
 	uint32_t kernel;
 
 	uint16_t num_sf_outputs;
@@ -558,10 +573,6 @@ struct gen8_render_state {
 
 	uint32_t cc_blend;
 
-	uint32_t drawrect_offset;
-	uint32_t drawrect_limit;
-	uint32_t blend;
-	uint32_t samplers;
 	uint32_t kernel;
 
 	uint16_t num_sf_outputs;
@@ -609,10 +620,6 @@ struct gen9_render_state {
 
 	uint32_t cc_blend;
 
-	uint32_t drawrect_offset;
-	uint32_t drawrect_limit;
-	uint32_t blend;
-	uint32_t samplers;
 	uint32_t kernel;
 
 	uint16_t num_sf_outputs;
@@ -683,6 +690,7 @@ const char *gen8_render_init(struct sna *sna, const char *backend);
 const char *gen9_render_init(struct sna *sna, const char *backend);
 
 void sna_render_mark_wedged(struct sna *sna);
+void sna_render_state_dump(struct sna *sna);
 
 bool sna_tiling_composite(uint32_t op,
 			  PicturePtr src,
@@ -393,4 +393,78 @@ static inline long get_picture_id(PicturePtr picture)
 	return picture && picture->pDrawable ? get_drawable_pixmap(picture->pDrawable)->drawable.serialNumber : 0;
 }
 
+static inline uint32_t sna_state_hash(const uint32_t *dw, int len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--)
+		hash = (hash ^ *dw++) * 16777619u;
+
+	return hash;
+}
+
+/* Compare the packet against the last one emitted for the same state in
+ * this batch, and if it differs remember it as the new one. The hash
+ * rejects most changes without looking at the payload, but only an exact
+ * match of every dword lets the packet be dropped.
+ */
+static inline bool
+sna_state_changed(struct sna *sna, enum sna_state_packet id,
+		  const uint32_t *dw, int len)
+{
+	struct sna_state_shadow *shadow = &sna->render.shadow;
+	uint32_t hash = sna_state_hash(dw, len);
+
+	assert(id < SNA_STATE_COUNT);
+	assert(len > 0 && len <= SNA_STATE_MAX_DWORDS);
+
+	if (shadow->packet[id].len == len &&
+	    shadow->packet[id].hash == hash &&
+	    memcmp(shadow->packet[id].dw, dw, len * sizeof(uint32_t)) == 0) {
+		shadow->elided[id]++;
+		return false;
+	}
+
+	shadow->packet[id].hash = hash;
+	shadow->packet[id].len = len;
+	memcpy(shadow->packet[id].dw, dw, len * sizeof(uint32_t));
+	shadow->emitted[id]++;
+	return true;
+}
+
+static inline void
+sna_state_out(struct sna *sna, const uint32_t *dw, int len)
+{
+	assert(sna->kgem.nbatch + len <= sna->kgem.surface);
+	memcpy(sna->kgem.batch + sna->kgem.nbatch, dw, len * sizeof(uint32_t));
+	sna->kgem.nbatch += len;
+}
+
+/* Returns true if the packet was written into the batch */
+static inline bool
+sna_state_emit(struct sna *sna, enum sna_state_packet id,
+	       const uint32_t *dw, int len)
+{
+	if (!sna_state_changed(sna, id, dw, len))
+		return false;
+
+	sna_state_out(sna, dw, len);
+	return true;
+}
+
+static inline void
+sna_state_invalidate(struct sna *sna, enum sna_state_packet id)
+{
+	sna->render.shadow.packet[id].len = 0;
+}
+
+/* Nothing is known about the hardware state at the start of a batch */
+static inline void sna_state_reset(struct sna *sna)
+{
+	int i;
+
+	for (i = 0; i < SNA_STATE_COUNT; i++)
+		sna_state_invalidate(sna, i);
+}
+
 #endif /* SNA_RENDER_INLINE_H */
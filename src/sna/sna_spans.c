@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* CPU kernels for compositing a span of constant coverage into the
+ * destination, used by the inplace trapezoid rasterisers. Each SIMD
+ * kernel computes exactly the same bytes as mul_8_8() and lerp8x4():
+ * per channel, (x*a + 0x7f + ((x*a + 0x7f) >> 8)) >> 8 fits in 16 bits,
+ * and the saturating adds are those of add8x2_8x2().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+#include "sna_render.h"
+#include "sna_trapezoids.h"
+
+static void
+in_a8__generic(uint8_t *dst, int32_t stride,
+	       int width, int height, uint8_t a)
+{
+	do {
+		int i;
+
+		for (i = 0; i < width; i++)
+			dst[i] = mul_8_8(dst[i], a);
+		dst += stride;
+	} while (--height);
+}
+
+static void
+add_a8__generic(uint8_t *dst, int32_t stride,
+		int width, int height, uint8_t a)
+{
+	do {
+		int i;
+
+		for (i = 0; i < width; i++) {
+			int v = a + dst[i];
+			dst[i] = v >= 255 ? 255 : v;
+		}
+		dst += stride;
+	} while (--height);
+}
+
+static void
+lerp_x8r8g8b8__generic(uint32_t *dst, int32_t stride,
+		       int width, int height,
+		       uint32_t color, uint8_t a)
+{
+	do {
+		int i;
+
+		for (i = 0; i < width; i++)
+			dst[i] = lerp8x4(color, a, dst[i]);
+		dst = (uint32_t *)((uint8_t *)dst + stride);
+	} while (--height);
+}
+
+#if defined(sse2)
+#pragma GCC push_options
+#pragma GCC target("sse2,fpmath=sse")
+#pragma GCC optimize("Ofast")
+#include <emmintrin.h>
+
+/* mul_8_8() of eight 16-bit lanes */
+static force_inline __m128i
+xmm_mul_8_8(__m128i x, __m128i a)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(x, a),
+				  _mm_set1_epi16(0x7f));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static force_inline __m128i
+xmm_mul_8x16_8(__m128i v, __m128i a)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	return _mm_packus_epi16(xmm_mul_8_8(_mm_unpacklo_epi8(v, zero), a),
+				xmm_mul_8_8(_mm_unpackhi_epi8(v, zero), a));
+}
+
+static void
+in_a8__sse2(uint8_t *dst, int32_t stride,
+	    int width, int height, uint8_t a)
+{
+	const __m128i va = _mm_set1_epi16(a);
+
+	do {
+		int i = 0;
+
+		for (; i + 16 <= width; i += 16) {
+			__m128i *d = (__m128i *)(dst + i);
+			_mm_storeu_si128(d, xmm_mul_8x16_8(_mm_loadu_si128(d), va));
+		}
+		for (; i < width; i++)
+			dst[i] = mul_8_8(dst[i], a);
+		dst += stride;
+	} while (--height);
+}
+
+static void
+add_a8__sse2(uint8_t *dst, int32_t stride,
+	     int width, int height, uint8_t a)
+{
+	const __m128i va = _mm_set1_epi8(a);
+
+	do {
+		int i = 0;
+
+		for (; i + 16 <= width; i += 16) {
+			__m128i *d = (__m128i *)(dst + i);
+			_mm_storeu_si128(d, _mm_adds_epu8(_mm_loadu_si128(d), va));
+		}
+		for (; i < width; i++) {
+			int v = a + dst[i];
+			dst[i] = v >= 255 ? 255 : v;
+		}
+		dst += stride;
+	} while (--height);
+}
+
+static void
+lerp_x8r8g8b8__sse2(uint32_t *dst, int32_t stride,
+		    int width, int height,
+		    uint32_t color, uint8_t a)
+{
+	/* The source term, mul8x2_8(color, a), is the same for every pixel */
+	const __m128i src = _mm_set1_epi32(mul_4x8_8(color, a));
+	const __m128i ia = _mm_set1_epi16((uint8_t)~a);
+
+	do {
+		int i = 0;
+
+		for (; i + 4 <= width; i += 4) {
+			__m128i *d = (__m128i *)(dst + i);
+			_mm_storeu_si128(d,
+					 _mm_adds_epu8(src,
+						       xmm_mul_8x16_8(_mm_loadu_si128(d), ia)));
+		}
+		for (; i < width; i++)
+			dst[i] = lerp8x4(color, a, dst[i]);
+		dst = (uint32_t *)((uint8_t *)dst + stride);
+	} while (--height);
+}
+
+#pragma GCC pop_options
+#endif
+
+#if defined(avx2)
+#pragma GCC push_options
+#pragma GCC target("avx2,avx,sse4.2,sse4.1,sse2,fpmath=sse")
+#pragma GCC optimize("Ofast")
+#include <immintrin.h>
+
+static force_inline __m256i
+ymm_mul_8_8(__m256i x, __m256i a)
+{
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(x, a),
+				     _mm256_set1_epi16(0x7f));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+/* The unpacks and the pack both work within each 128-bit lane,
+ * so the bytes come back out in their original order.
+ */
+static force_inline __m256i
+ymm_mul_8x32_8(__m256i v, __m256i a)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	return _mm256_packus_epi16(ymm_mul_8_8(_mm256_unpacklo_epi8(v, zero), a),
+				   ymm_mul_8_8(_mm256_unpackhi_epi8(v, zero), a));
+}
+
+static void
+in_a8__avx2(uint8_t *dst, int32_t stride,
+	    int width, int height, uint8_t a)
+{
+	const __m256i va = _mm256_set1_epi16(a);
+
+	do {
+		int i = 0;
+
+		for (; i + 32 <= width; i += 32) {
+			__m256i *d = (__m256i *)(dst + i);
+			_mm256_storeu_si256(d, ymm_mul_8x32_8(_mm256_loadu_si256(d), va));
+		}
+		for (; i < width; i++)
+			dst[i] = mul_8_8(dst[i], a);
+		dst += stride;
+	} while (--height);
+}
+
+static void
+add_a8__avx2(uint8_t *dst, int32_t stride,
+	     int width, int height, uint8_t a)
+{
+	const __m256i va = _mm256_set1_epi8(a);
+
+	do {
+		int i = 0;
+
+		for (; i + 32 <= width; i += 32) {
+			__m256i *d = (__m256i *)(dst + i);
+			_mm256_storeu_si256(d, _mm256_adds_epu8(_mm256_loadu_si256(d), va));
+		}
+		for (; i < width; i++) {
+			int v = a + dst[i];
+			dst[i] = v >= 255 ? 255 : v;
+		}
+		dst += stride;
+	} while (--height);
+}
+
+static void
+lerp_x8r8g8b8__avx2(uint32_t *dst, int32_t stride,
+		    int width, int height,
+		    uint32_t color, uint8_t a)
+{
+	const __m256i src = _mm256_set1_epi32(mul_4x8_8(color, a));
+	const __m256i ia = _mm256_set1_epi16((uint8_t)~a);
+
+	do {
+		int i = 0;
+
+		for (; i + 8 <= width; i += 8) {
+			__m256i *d = (__m256i *)(dst + i);
+			_mm256_storeu_si256(d,
+					    _mm256_adds_epu8(src,
+							     ymm_mul_8x32_8(_mm256_loadu_si256(d), ia)));
+		}
+		for (; i < width; i++)
+			dst[i] = lerp8x4(color, a, dst[i]);
+		dst = (uint32_t *)((uint8_t *)dst + stride);
+	} while (--height);
+}
+
+#pragma GCC pop_options
+#endif
+
+typedef void (*span_a8_func)(uint8_t *dst, int32_t stride,
+			     int width, int height, uint8_t a);
+typedef void (*span_x8r8g8b8_func)(uint32_t *dst, int32_t stride,
+				   int width, int height,
+				   uint32_t color, uint8_t a);
+
+static struct {
+	span_a8_func in_a8;
+	span_a8_func add_a8;
+	span_x8r8g8b8_func lerp_x8r8g8b8;
+} span_funcs = {
+#if defined(sse2) && __x86_64__
+	in_a8__sse2,
+	add_a8__sse2,
+	lerp_x8r8g8b8__sse2,
+#else
+	in_a8__generic,
+	add_a8__generic,
+	lerp_x8r8g8b8__generic,
+#endif
+};
+
+void choose_span_blt(unsigned cpu)
+{
+#if defined(avx2)
+	if (cpu & AVX2) {
+		span_funcs.in_a8 = in_a8__avx2;
+		span_funcs.add_a8 = add_a8__avx2;
+		span_funcs.lerp_x8r8g8b8 = lerp_x8r8g8b8__avx2;
+	} else
+#endif
+#if defined(sse2)
+	if (cpu & SSE2) {
+		span_funcs.in_a8 = in_a8__sse2;
+		span_funcs.add_a8 = add_a8__sse2;
+		span_funcs.lerp_x8r8g8b8 = lerp_x8r8g8b8__sse2;
+	} else
+#endif
+	{
+		span_funcs.in_a8 = in_a8__generic;
+		span_funcs.add_a8 = add_a8__generic;
+		span_funcs.lerp_x8r8g8b8 = lerp_x8r8g8b8__generic;
+	}
+}
+
+void span_in_a8(uint8_t *dst, int32_t stride,
+		int width, int height, uint8_t a)
+{
+	assert(width > 0 && height > 0);
+	span_funcs.in_a8(dst, stride, width, height, a);
+}
+
+void span_add_a8(uint8_t *dst, int32_t stride,
+		 int width, int height, uint8_t a)
+{
+	assert(width > 0 && height > 0);
+	span_funcs.add_a8(dst, stride, width, height, a);
+}
+
+void span_lerp_x8r8g8b8(uint32_t *dst, int32_t stride,
+			int width, int height,
+			uint32_t color, uint8_t a)
+{
+	assert(width > 0 && height > 0);
+	span_funcs.lerp_x8r8g8b8(dst, stride, width, height, color, a);
+}
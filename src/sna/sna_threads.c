@@ -25,6 +25,10 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for sched_getaffinity() and friends */
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -34,6 +38,10 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sched.h>
+#include <dirent.h>
+#include <time.h>
+#include <math.h>
 
 #ifdef HAVE_VALGRIND
 #include <valgrind.h>
@@ -44,122 +52,649 @@ static inline bool valgrind_active(void) { return false; }
 
 static int max_threads = -1;
 
-static struct thread {
-    pthread_t thread;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+/* A physical core available to us, described by its first usable
+ * logical cpu. SMT siblings are folded into the same core.
+ */
+struct core {
+	int cpu;
+	int package, id;
+	int node;
+};
 
-    void (*func)(void *arg);
-    void *arg;
-} *threads;
+static struct core *cores;
+static int num_cores;
+static bool pin_threads;
 
-static void *__run__(void *arg)
+static int sysfs_read_int(const char *fmt, int cpu)
 {
-	struct thread *t = arg;
-	sigset_t signals;
+	char path[128];
+	FILE *file;
+	int val = -1;
 
-	/* Disable all signals in the slave threads as X uses them for IO */
-	sigfillset(&signals);
-	sigdelset(&signals, SIGBUS);
-	sigdelset(&signals, SIGSEGV);
-	pthread_sigmask(SIG_SETMASK, &signals, NULL);
-
-	pthread_mutex_lock(&t->mutex);
-	while (1) {
-		while (t->func == NULL)
-			pthread_cond_wait(&t->cond, &t->mutex);
-		pthread_mutex_unlock(&t->mutex);
+	snprintf(path, sizeof(path), fmt, cpu);
+	file = fopen(path, "r");
+	if (file) {
+		if (fscanf(file, "%d", &val) != 1)
+			val = -1;
+		fclose(file);
+	}
 
-		assert(t->func);
-		t->func(t->arg);
+	return val;
+}
 
-		pthread_mutex_lock(&t->mutex);
-		t->arg = NULL;
-		t->func = NULL;
-		pthread_cond_signal(&t->cond);
+static int sysfs_cpu_node(int cpu)
+{
+	char path[128];
+	struct dirent *de;
+	DIR *dir;
+	int node = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+
+	while ((de = readdir(dir))) {
+		if (sscanf(de->d_name, "node%d", &node) == 1)
+			break;
 	}
-	pthread_mutex_unlock(&t->mutex);
+	closedir(dir);
 
-	return NULL;
+	return node;
 }
 
-#if defined(__GNUC__)
-#define popcount(x) __builtin_popcount(x)
-#else
-static int popcount(unsigned int x)
+static bool add_core(int cpu, int package, int id, int node)
 {
-	int count = 0;
+	int n;
 
-	while (x) {
-		count += x&1;
-		x >>= 1;
+	for (n = 0; n < num_cores; n++) {
+		if (cores[n].package == package && cores[n].id == id)
+			return true;
 	}
 
-	return count;
+	if ((num_cores & (num_cores - 1)) == 0) {
+		struct core *new_cores;
+
+		new_cores = realloc(cores, sizeof(*cores)*2*(num_cores + 1));
+		if (new_cores == NULL)
+			return false;
+
+		cores = new_cores;
+	}
+
+	cores[num_cores].cpu = cpu;
+	cores[num_cores].package = package;
+	cores[num_cores].id = id;
+	cores[num_cores].node = node;
+	num_cores++;
+	return true;
 }
+
+static bool cpu_allowed(int cpu)
+{
+#ifdef HAVE_SCHED_GETAFFINITY
+	static cpu_set_t allowed;
+	static int valid = -1;
+
+	/* Respect the cpuset we have been confined to */
+	if (valid == -1)
+		valid = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+	if (valid && cpu < CPU_SETSIZE)
+		return CPU_ISSET(cpu, &allowed);
 #endif
+	return true;
+}
 
-static int
-num_cores(void)
+static void sysfs_topology(void)
+{
+	int cpu, max;
+
+	max = sysconf(_SC_NPROCESSORS_CONF);
+	for (cpu = 0; cpu < max; cpu++) {
+		int package, id;
+
+		if (!cpu_allowed(cpu))
+			continue;
+
+		package = sysfs_read_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		id = sysfs_read_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+		if (package < 0 || id < 0)
+			continue;
+
+		if (!add_core(cpu, package, id, sysfs_cpu_node(cpu)))
+			break;
+	}
+}
+
+static void cpuinfo_topology(void)
 {
 	FILE *file = fopen("/proc/cpuinfo", "r");
-	int count = 0;
 	if (file) {
 		size_t len = 0;
 		char *line = NULL;
-		uint32_t processors = 0, cores = 0;
+		int cpu = -1, package = -1;
+
 		while (getline(&line, &len, file) != -1) {
 			int id;
-			if (sscanf(line, "physical id : %d", &id) == 1) {
-				if (id >= 32)
-					continue;
-				processors |= 1 << id;
+			if (sscanf(line, "processor : %d", &id) == 1) {
+				cpu = id;
+				package = -1;
+			} else if (sscanf(line, "physical id : %d", &id) == 1) {
+				package = id;
 			} else if (sscanf(line, "core id : %d", &id) == 1) {
-				if (id >= 32)
+				if (cpu < 0 || package < 0 || !cpu_allowed(cpu))
 					continue;
-				cores |= 1 << id;
+				if (!add_core(cpu, package, id, 0))
+					break;
 			}
 		}
 		free(line);
 		fclose(file);
+	}
+}
+
+static int cgroup_read_quota(const char *quota, const char *period)
+{
+	long q = -1, p = -1;
+	FILE *file;
+
+	file = fopen(quota, "r");
+	if (file == NULL)
+		return 0;
+
+	if (period == NULL) {
+		/* cgroup v2: "max 100000" or "$quota $period" */
+		if (fscanf(file, "%ld %ld", &q, &p) != 2)
+			q = -1;
+		fclose(file);
+	} else {
+		if (fscanf(file, "%ld", &q) != 1)
+			q = -1;
+		fclose(file);
+
+		file = fopen(period, "r");
+		if (file == NULL)
+			return 0;
+		if (fscanf(file, "%ld", &p) != 1)
+			p = -1;
+		fclose(file);
+	}
 
-		DBG(("%s: processors=0x%08x, cores=0x%08x\n",
-		     __FUNCTION__, processors, cores));
+	if (q <= 0 || p <= 0)
+		return 0;
 
-		count = popcount(processors) * popcount(cores);
+	return (q + p - 1) / p;
+}
+
+/* Look for the whole name, as "cpu" is also the start of "cpuset" */
+static bool has_controller(const char *list, const char *sep, const char *name)
+{
+	size_t len = strlen(name);
+
+	while (*list) {
+		size_t n = strcspn(list, sep);
+		if (n == len && memcmp(list, name, len) == 0)
+			return true;
+		list += n;
+		list += strspn(list, sep);
 	}
+
+	return false;
+}
+
+/* cgroup v2 only provides cpu.max where the cpu controller is enabled */
+static bool cgroup2_has_cpu(const char *path)
+{
+	char buf[1024];
+	bool found = false;
+	FILE *file;
+
+	snprintf(buf, sizeof(buf), "/sys/fs/cgroup%s/cgroup.controllers", path);
+	file = fopen(buf, "r");
+	if (file == NULL)
+		return false;
+
+	if (fgets(buf, sizeof(buf), file))
+		found = has_controller(buf, " \n", "cpu");
+	fclose(file);
+
+	return found;
+}
+
+static int
+cgroup_cpu_quota(void)
+{
+	FILE *file = fopen("/proc/self/cgroup", "r");
+	int quota = 0;
+	if (file) {
+		size_t len = 0;
+		char *line = NULL;
+
+		while (quota == 0 && getline(&line, &len, file) != -1) {
+			char quota_path[1024], period_path[1024];
+			char *controllers, *path;
+
+			line[strcspn(line, "\n")] = '\0';
+
+			controllers = strchr(line, ':');
+			if (controllers == NULL)
+				continue;
+			path = strchr(++controllers, ':');
+			if (path == NULL)
+				continue;
+			*path++ = '\0';
+
+			if (*controllers == '\0') {
+				if (!cgroup2_has_cpu(path))
+					continue;
+
+				snprintf(quota_path, sizeof(quota_path),
+					 "/sys/fs/cgroup%s/cpu.max", path);
+				quota = cgroup_read_quota(quota_path, NULL);
+			} else if (has_controller(controllers, ",", "cpu")) {
+				snprintf(quota_path, sizeof(quota_path),
+					 "/sys/fs/cgroup/%s%s/cpu.cfs_quota_us",
+					 controllers, path);
+				snprintf(period_path, sizeof(period_path),
+					 "/sys/fs/cgroup/%s%s/cpu.cfs_period_us",
+					 controllers, path);
+				quota = cgroup_read_quota(quota_path, period_path);
+			}
+		}
+		free(line);
+		fclose(file);
+	}
+
+	DBG(("%s: quota=%d cpus\n", __FUNCTION__, quota));
+	return quota;
+}
+
+static int local_node(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+	int cpu = sched_getcpu();
+	if (cpu >= 0)
+		return sysfs_cpu_node(cpu);
+#endif
+	return 0;
+}
+
+static void sort_cores(void)
+{
+	int node = local_node();
+	int n, m;
+
+	/* Fill up the cores on our own node first so that the workers
+	 * share the memory the X server is touching.
+	 */
+	for (n = m = 0; n < num_cores; n++) {
+		if (cores[n].node == node) {
+			struct core tmp = cores[m];
+			cores[m++] = cores[n];
+			cores[n] = tmp;
+		}
+	}
+}
+
+static int
+detect_cores(void)
+{
+	int count, quota;
+
+	sysfs_topology();
+	if (num_cores == 0)
+		cpuinfo_topology();
+	if (num_cores)
+		sort_cores();
+
+	count = num_cores;
+	quota = cgroup_cpu_quota();
+	if (quota && (count == 0 || quota < count))
+		count = quota;
+
+	DBG(("%s: cores=%d, quota=%d\n", __FUNCTION__, num_cores, quota));
 	return count;
 }
 
-void sna_threads_init(void)
+static void pin_thread(int id)
+{
+#ifdef HAVE_SCHED_GETAFFINITY
+	const struct core *c;
+	cpu_set_t allowed, mask;
+	int cpu;
+
+	if (!pin_threads || num_cores == 0)
+		return;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return;
+
+	/* Bind to every usable cpu on the node of our assigned core,
+	 * SMT siblings included; the scheduler is still free to balance
+	 * within the node, but our stack and scratch allocations stay
+	 * local.
+	 */
+	c = &cores[id % num_cores];
+	CPU_ZERO(&mask);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) &&
+		    sysfs_cpu_node(cpu) == c->node)
+			CPU_SET(cpu, &mask);
+	}
+	if (CPU_COUNT(&mask) == 0)
+		return;
+
+	if (sched_setaffinity(0, sizeof(mask), &mask))
+		DBG(("%s: failed to pin thread[%d] to node %d\n",
+		     __FUNCTION__, id, c->node));
+#else
+	(void)id;
+#endif
+}
+
+/* Each thread owns a small ring of tasks. Only the main thread ever
+ * queues work (sna_threads_run() is restricted to the X thread), so the
+ * rings are single-producer/multi-consumer: the owner takes tasks from
+ * its own ring and, once that is empty, steals from the others. The
+ * main thread joins in from sna_threads_wait(), so nobody sits idle
+ * waiting on the slowest band whilst there is still work queued.
+ */
+#define THREAD_QUEUE_SIZE 64 /* power-of-two */
+
+struct task {
+	void (*func)(void *arg);
+	void *arg;
+};
+
+static struct thread {
+	pthread_t thread;
+	atomic_t head, tail;
+
+	/* Only updated by the owner, sampled by sna_threads_wait() */
+	uint64_t busy;
+	unsigned tasks;
+
+	struct task queue[THREAD_QUEUE_SIZE];
+} *threads;
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t work;
+	pthread_cond_t done;
+
+	atomic_t pending;
+	atomic_t sleeping;
+	unsigned generation;
+	int count;
+	int failed;
+	unsigned queued;
+} pool;
+
+/* The cost model: for each class of threaded operation we keep a
+ * running estimate of the time spent per pixel by a single thread, and
+ * of the overhead added by each extra thread (waking it, stealing the
+ * task, the cache misses on the shared data and the final join). The
+ * wall time using n threads is then predicted to be
+ *
+ *	T(n) = ns_per_pixel * pixels / n + ns_per_thread * n
+ *
+ * which we minimise to choose the number of threads. Until we have
+ * enough samples for a class we use the static thresholds, and we
+ * periodically fall back to them so that the model is refreshed.
+ */
+#define COST_MIN_SAMPLES 8
+#define COST_EXPLORE_INTERVAL 64
+#define COST_WEIGHT (1/8.f)
+
+static struct cost {
+	float ns_per_pixel;
+	float ns_per_thread;
+	unsigned samples;
+	unsigned calls;
+} cost[THREAD_NUM_OPS];
+
+static struct {
+	int op;
+	int num_threads;
+	float pixels;
+	uint64_t start;
+	uint64_t busy;
+	unsigned tasks;
+} measure = { -1 };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_task(struct thread *t, const struct task *task)
+{
+	uint64_t start = now_ns();
+
+	task->func(task->arg);
+
+	t->busy += now_ns() - start;
+	t->tasks++;
+}
+
+static void sample_busy(uint64_t *busy, unsigned *tasks)
+{
+	int n;
+
+	*busy = 0;
+	*tasks = 0;
+	for (n = 0; n < pool.count; n++) {
+		*busy += threads[n].busy;
+		*tasks += threads[n].tasks;
+	}
+}
+
+static void measure_begin(int op, int num_threads, float pixels)
+{
+	measure.op = op;
+	measure.num_threads = num_threads;
+	measure.pixels = pixels;
+	sample_busy(&measure.busy, &measure.tasks);
+	pool.queued = 0;
+	measure.start = now_ns();
+}
+
+static void measure_end(void)
+{
+	struct cost *c;
+	uint64_t busy, elapsed;
+	unsigned tasks;
+	float per_pixel, per_thread;
+
+	if (measure.op < 0)
+		return;
+
+	elapsed = now_ns() - measure.start;
+	sample_busy(&busy, &tasks);
+	busy -= measure.busy;
+	tasks -= measure.tasks;
+
+	c = &cost[measure.op];
+	measure.op = -1;
+	if (tasks == 0 || measure.pixels <= 0)
+		return;
+
+	/* We only time the tasks run through the queues; the caller
+	 * renders one band itself, of the same size as the others.
+	 */
+	per_pixel = (float)busy / tasks * (pool.queued + 1) / measure.pixels;
+	per_thread = (elapsed - per_pixel * measure.pixels / measure.num_threads) / measure.num_threads;
+	if (per_thread < 0)
+		per_thread = 0;
+
+	if (c->samples++ == 0) {
+		c->ns_per_pixel = per_pixel;
+		c->ns_per_thread = per_thread;
+	} else {
+		c->ns_per_pixel += COST_WEIGHT * (per_pixel - c->ns_per_pixel);
+		c->ns_per_thread += COST_WEIGHT * (per_thread - c->ns_per_thread);
+	}
+
+	DBG(("%s: op=%d, threads=%d, tasks=%d, elapsed=%lldns, busy=%lldns -> %.3fns/pixel, %.0fns/thread\n",
+	     __FUNCTION__, (int)(c - cost), measure.num_threads, pool.queued + 1,
+	     (long long)elapsed, (long long)busy,
+	     c->ns_per_pixel, c->ns_per_thread));
+}
+
+static bool queue_push(struct thread *t, void (*func)(void *arg), void *arg)
+{
+	unsigned tail = atomic_read(&t->tail);
+
+	if (tail - (unsigned)atomic_read(&t->head) == THREAD_QUEUE_SIZE)
+		return false;
+
+	t->queue[tail & (THREAD_QUEUE_SIZE - 1)].func = func;
+	t->queue[tail & (THREAD_QUEUE_SIZE - 1)].arg = arg;
+	atomic_inc(&t->tail); /* full barrier, publishes the task */
+	return true;
+}
+
+static bool queue_pop(struct thread *t, struct task *task)
+{
+	unsigned head;
+
+	do {
+		head = atomic_read(&t->head);
+		if (head == (unsigned)atomic_read(&t->tail))
+			return false;
+
+		/* The slot cannot be reused until head advances */
+		*task = t->queue[head & (THREAD_QUEUE_SIZE - 1)];
+	} while ((unsigned)atomic_cmpxchg(&t->head, head, head + 1) != head);
+
+	return true;
+}
+
+static bool steal_task(int self, struct task *task)
 {
 	int n;
 
+	if (queue_pop(&threads[self], task))
+		return true;
+
+	for (n = 1; n < pool.count; n++) {
+		if (queue_pop(&threads[(self + n) % pool.count], task))
+			return true;
+	}
+
+	return false;
+}
+
+static void task_done(void)
+{
+	if (atomic_dec_and_test(&pool.pending)) {
+		pthread_mutex_lock(&pool.mutex);
+		pthread_cond_signal(&pool.done);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+}
+
+static void __unlock__(void *arg)
+{
+	pthread_mutex_unlock(arg);
+}
+
+static void *__run__(void *arg)
+{
+	struct thread *t = arg;
+	int self = t - threads;
+	sigset_t signals;
+
+	/* Disable all signals in the slave threads as X uses them for IO */
+	sigfillset(&signals);
+	sigdelset(&signals, SIGBUS);
+	sigdelset(&signals, SIGSEGV);
+	pthread_sigmask(SIG_SETMASK, &signals, NULL);
+
+	pin_thread(self);
+
+	while (1) {
+		struct task task;
+		unsigned generation;
+
+		if (steal_task(self, &task)) {
+			run_task(t, &task);
+			task_done();
+			continue;
+		}
+
+		/* Advertise that we are about to sleep before checking the
+		 * queues one last time, so that a concurrent
+		 * sna_threads_run() either sees us asleep and wakes us,
+		 * or we see its task.
+		 */
+		pthread_mutex_lock(&pool.mutex);
+		atomic_inc(&pool.sleeping);
+		generation = pool.generation;
+		pthread_mutex_unlock(&pool.mutex);
+
+		if (steal_task(self, &task)) {
+			atomic_dec(&pool.sleeping, 1);
+			run_task(t, &task);
+			task_done();
+			continue;
+		}
+
+		pthread_mutex_lock(&pool.mutex);
+		pthread_cleanup_push(__unlock__, &pool.mutex);
+		while (generation == pool.generation)
+			pthread_cond_wait(&pool.work, &pool.mutex);
+		pthread_cleanup_pop(0);
+		atomic_dec(&pool.sleeping, 1);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+
+	return NULL;
+}
+
+/* The pool is shared by every screen, so only the options of the first
+ * screen to be initialised are used.
+ */
+void sna_threads_init(int threads_option, bool pin)
+{
+	int n, online;
+
 	if (max_threads != -1)
 		return;
 
 	if (valgrind_active())
 		goto bail;
 
-	max_threads = num_cores();
+	pin_threads = pin;
+	max_threads = detect_cores();
 	if (max_threads == 0)
 		max_threads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+	if (threads_option >= 0)
+		max_threads = threads_option;
+
+	/* More threads than cpus only adds contention */
+	online = sysconf(_SC_NPROCESSORS_ONLN);
+	if (online > 0 && max_threads > online)
+		max_threads = online;
 	if (max_threads <= 1)
 		goto bail;
 
 	DBG(("%s: creating a thread pool of %d threads\n",
 	     __func__, max_threads));
 
-	threads = malloc (sizeof(threads[0])*max_threads);
+	threads = calloc(max_threads, sizeof(threads[0]));
 	if (threads == NULL)
 		goto bail;
 
-	for (n = 1; n < max_threads; n++) {
-		pthread_mutex_init(&threads[n].mutex, NULL);
-		pthread_cond_init(&threads[n].cond, NULL);
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	pool.count = max_threads;
 
-		threads[n].func = NULL;
-		threads[n].arg = NULL;
+	for (n = 1; n < max_threads; n++) {
 		if (pthread_create(&threads[n].thread, NULL,
 				   __run__, &threads[n]))
 			goto bail;
@@ -176,15 +711,24 @@ void sna_threads_run(int id, void (*func)(void *arg), void *arg)
 {
 	assert(max_threads > 0);
 	assert(pthread_self() == threads[0].thread);
-	assert(id > 0 && id < max_threads);
-
-	assert(threads[id].func == NULL);
+	assert(id >= 0);
+
+	/* The id is only a hint as to which queue to start from,
+	 * idle threads will steal the task if its owner is busy.
+	 */
+	pool.queued++;
+	if (!queue_push(&threads[id % max_threads], func, arg)) {
+		run_task(&threads[0], &(struct task){ func, arg });
+		return;
+	}
+	atomic_inc(&pool.pending);
 
-	pthread_mutex_lock(&threads[id].mutex);
-	threads[id].func = func;
-	threads[id].arg = arg;
-	pthread_cond_signal(&threads[id].cond);
-	pthread_mutex_unlock(&threads[id].mutex);
+	if (atomic_read(&pool.sleeping)) {
+		pthread_mutex_lock(&pool.mutex);
+		pool.generation++;
+		pthread_cond_broadcast(&pool.work);
+		pthread_mutex_unlock(&pool.mutex);
+	}
 }
 
 void sna_threads_trap(int sig)
@@ -203,36 +747,44 @@ void sna_threads_trap(int sig)
 
 	ERR(("%s: thread[%d] caught signal %d\n", __func__, n, sig));
 
-	pthread_mutex_lock(&threads[n].mutex);
-	threads[n].arg = (void *)(intptr_t)sig;
-	threads[n].func = NULL;
-	pthread_cond_signal(&threads[n].cond);
-	pthread_mutex_unlock(&threads[n].mutex);
+	/* Report the failure and abandon the task we were running */
+	pthread_mutex_lock(&pool.mutex);
+	pool.failed++;
+	pthread_cond_signal(&pool.done);
+	pthread_mutex_unlock(&pool.mutex);
+	task_done();
 
 	pthread_exit(&sig);
 }
 
-void sna_threads_wait(void)
+bool sna_threads_wait(void)
 {
-	int n;
+	struct task task;
 
 	assert(max_threads > 0);
 	assert(pthread_self() == threads[0].thread);
 
-	for (n = 1; n < max_threads; n++) {
-		if (threads[n].func != NULL) {
-			pthread_mutex_lock(&threads[n].mutex);
-			while (threads[n].func)
-				pthread_cond_wait(&threads[n].cond, &threads[n].mutex);
-			pthread_mutex_unlock(&threads[n].mutex);
-		}
+	/* Help drain the queues before sleeping on the stragglers */
+	while (steal_task(0, &task)) {
+		run_task(&threads[0], &task);
+		atomic_dec(&pool.pending, 1);
+	}
 
-		if (threads[n].arg != NULL) {
-			DBG(("%s: thread[%d] died from signal %d\n", __func__, n, (int)(intptr_t)threads[n].arg));
-			sna_threads_kill();
-			return;
-		}
+	if (atomic_read(&pool.pending)) {
+		pthread_mutex_lock(&pool.mutex);
+		while (atomic_read(&pool.pending) && !pool.failed)
+			pthread_cond_wait(&pool.done, &pool.mutex);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+
+	if (pool.failed) {
+		DBG(("%s: %d threads died\n", __func__, pool.failed));
+		sna_threads_kill();
+		return false;
 	}
+
+	measure_end();
+	return true;
 }
 
 void sna_threads_kill(void)
@@ -252,15 +804,37 @@ void sna_threads_kill(void)
 	max_threads = 0;
 }
 
-int sna_use_threads(int width, int height, int threshold)
+/* Split a band of height rows into tasks for num_threads. We
+ * oversubscribe each thread so that whoever finishes first can steal
+ * the remaining bands from those that fall behind, whilst keeping each
+ * band tall enough to amortise the per-task setup.
+ */
+#define TASKS_PER_THREAD 4
+#define TASK_MIN_HEIGHT 16
+
+int sna_threads_tasks(int num_threads, int height)
 {
-	int num_threads;
+	int num_tasks, h;
 
-	if (max_threads <= 0)
+	if (num_threads <= 1 || height <= 1)
 		return 1;
 
-	if (height <= 1)
-		return 1;
+	num_tasks = num_threads * TASKS_PER_THREAD;
+	if (num_tasks > height / TASK_MIN_HEIGHT)
+		num_tasks = height / TASK_MIN_HEIGHT;
+	if (num_tasks < num_threads)
+		num_tasks = num_threads;
+	if (num_tasks > height)
+		num_tasks = height;
+
+	/* Trim so that every band, bar the last, is of equal height */
+	h = (height + num_tasks - 1) / num_tasks;
+	return (height + h - 1) / h;
+}
+
+static int static_threads(int width, int height, int threshold)
+{
+	int num_threads;
 
 	if (width < 128)
 		height /= 128/width;
@@ -271,12 +845,93 @@ int sna_use_threads(int width, int height, int threshold)
 
 	if (num_threads > max_threads)
 		num_threads = max_threads;
+
+	return num_threads;
+}
+
+/* Returns 0 if the model is degenerate and should not be trusted */
+static int modelled_threads(const struct cost *c, float pixels)
+{
+	float work = c->ns_per_pixel * pixels;
+	int num_threads;
+
+	/* A noisy sample can clamp either cost to nothing, which would
+	 * send every tiny operation to all the threads.
+	 */
+	if (c->ns_per_thread < 1 || !(c->ns_per_pixel > 0))
+		return 0;
+
+	num_threads = sqrtf(work / c->ns_per_thread) + .5f;
+	if (num_threads > max_threads)
+		num_threads = max_threads;
+	if (num_threads > 1 &&
+	    work / num_threads + c->ns_per_thread * num_threads >= work)
+		num_threads = 1;
+
+	return num_threads;
+}
+
+int sna_threads_max(void)
+{
+	return max_threads > 0 ? max_threads : 1;
+}
+
+int sna_use_threads(int op, int width, int height, int threshold)
+{
+	struct cost *c;
+	int num_threads;
+
+	assert(op >= 0 && op < THREAD_NUM_OPS);
+	measure.op = -1;
+
+	if (max_threads <= 0)
+		return 1;
+
+	if (height <= 1)
+		return 1;
+
+	c = &cost[op];
+	num_threads = 0;
+	if (c->samples >= COST_MIN_SAMPLES &&
+	    ++c->calls % COST_EXPLORE_INTERVAL)
+		num_threads = modelled_threads(c, (float)width * height);
+	if (num_threads == 0)
+		num_threads = static_threads(width, height, threshold);
+
 	if (num_threads > height)
 		num_threads = height;
+	if (num_threads > 1)
+		measure_begin(op, num_threads, (float)width * height);
 
 	return num_threads;
 }
 
+void sna_threads_dump(void)
+{
+	static const char *names[THREAD_NUM_OPS] = {
+		[THREAD_COMPOSITE] = "composite",
+		[THREAD_SPANS] = "spans",
+		[THREAD_MASK] = "mask",
+		[THREAD_INPLACE] = "inplace",
+		[THREAD_COPY] = "copy",
+	};
+	int op;
+
+	ErrorF("Thread pool: %d threads\n", max_threads);
+	for (op = 0; op < THREAD_NUM_OPS; op++) {
+		const struct cost *c = &cost[op];
+		float crossover = 0;
+
+		/* T(2) < T(1) when pixels > 4 * ns_per_thread / ns_per_pixel */
+		if (c->ns_per_pixel > 0)
+			crossover = 4 * c->ns_per_thread / c->ns_per_pixel;
+
+		ErrorF("  %s: %u samples, %.3f ns/pixel, %.0f ns/thread, threading from %.0f pixels\n",
+		       names[op], c->samples,
+		       c->ns_per_pixel, c->ns_per_thread, crossover);
+	}
+}
+
 struct thread_composite {
 	pixman_image_t *src, *mask, *dst;
 	pixman_op_t op;
@@ -311,7 +966,7 @@ void sna_image_composite(pixman_op_t        op,
 {
 	int num_threads;
 
-	num_threads = sna_use_threads(width, height, 32);
+	num_threads = sna_use_threads(THREAD_COMPOSITE, width, height, 32);
 	if (num_threads <= 1) {
 		if (sigtrap_get() == 0) {
 			pixman_image_composite(op, src, mask, dst,
@@ -322,15 +977,15 @@ void sna_image_composite(pixman_op_t        op,
 			sigtrap_put();
 		}
 	} else {
-		struct thread_composite data[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, height);
+		struct thread_composite data[num_tasks];
 		int y, dy, n;
 
-		DBG(("%s: using %d threads for compositing %dx%d\n",
-		     __FUNCTION__, num_threads, width, height));
+		DBG(("%s: using %d threads (%d tasks) for compositing %dx%d\n",
+		     __FUNCTION__, num_threads, num_tasks, width, height));
 
 		y = dst_y;
-		dy = (height + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * dy >= height;
+		dy = (height + num_tasks - 1) / num_tasks;
 
 		data[0].op = op;
 		data[0].src = src;
@@ -346,7 +1001,7 @@ void sna_image_composite(pixman_op_t        op,
 		data[0].height = dy;
 
 		if (sigtrap_get() == 0) {
-			for (n = 1; n < num_threads; n++) {
+			for (n = 1; n < num_tasks; n++) {
 				data[n] = data[0];
 				data[n].src_y += y - dst_y;
 				data[n].mask_y += y - dst_y;
@@ -373,3 +1028,181 @@ void sna_image_composite(pixman_op_t        op,
 			sna_threads_kill();
 	}
 }
+
+struct thread_memcpy_boxes {
+	struct kgem *kgem;
+	int tiling;
+	bool upload;
+	const void *src;
+	void *dst;
+	int bpp;
+	int32_t src_stride, dst_stride;
+	int16_t src_dx, src_dy;
+	int16_t dst_dx, dst_dy;
+	const BoxRec *box;
+	int n;
+	int y1, y2;
+};
+
+static void thread_memcpy_boxes(void *arg)
+{
+	const struct thread_memcpy_boxes *t = arg;
+	const BoxRec *box = t->box;
+	int n = t->n;
+
+	do {
+		int y1 = box->y1 > t->y1 ? box->y1 : t->y1;
+		int y2 = box->y2 < t->y2 ? box->y2 : t->y2;
+		if (y2 <= y1)
+			goto next;
+
+		if (t->tiling == I915_TILING_X) {
+			if (t->upload)
+				memcpy_to_tiled_x(t->kgem, t->src, t->dst, t->bpp,
+						  t->src_stride, t->dst_stride,
+						  box->x1 + t->src_dx, y1 + t->src_dy,
+						  box->x1 + t->dst_dx, y1 + t->dst_dy,
+						  box->x2 - box->x1, y2 - y1);
+			else
+				memcpy_from_tiled_x(t->kgem, t->src, t->dst, t->bpp,
+						    t->src_stride, t->dst_stride,
+						    box->x1 + t->src_dx, y1 + t->src_dy,
+						    box->x1 + t->dst_dx, y1 + t->dst_dy,
+						    box->x2 - box->x1, y2 - y1);
+		} else {
+			if (t->upload)
+				memcpy_to_tiled_y(t->kgem, t->src, t->dst, t->bpp,
+						  t->src_stride, t->dst_stride,
+						  box->x1 + t->src_dx, y1 + t->src_dy,
+						  box->x1 + t->dst_dx, y1 + t->dst_dy,
+						  box->x2 - box->x1, y2 - y1);
+			else
+				memcpy_from_tiled_y(t->kgem, t->src, t->dst, t->bpp,
+						    t->src_stride, t->dst_stride,
+						    box->x1 + t->src_dx, y1 + t->src_dy,
+						    box->x1 + t->dst_dx, y1 + t->dst_dy,
+						    box->x2 - box->x1, y2 - y1);
+		}
+next:
+		box++;
+	} while (--n);
+}
+
+/* Copy the boxes to or from a tiled surface, splitting the work into
+ * bands of whole tile rows. Each task then owns a disjoint set of
+ * tiles (and so pages) and streams through consecutive rows of the
+ * linear side, rather than threads interleaving within a tile.
+ * tile_dy converts a box row into a row of the tiled surface.
+ *
+ * The caller must hold a sigtrap around the copy; if one of the tasks
+ * faults, the tasks are killed and false is returned so that the
+ * caller can fall back, as a fault in the single-threaded path would
+ * unwind to the caller's own trap.
+ */
+bool sna_memcpy_boxes__tiled(struct kgem *kgem, int tiling, bool upload,
+			     int tile_dy,
+			     const void *src, void *dst, int bpp,
+			     int32_t src_stride, int32_t dst_stride,
+			     int16_t src_dx, int16_t src_dy,
+			     int16_t dst_dx, int16_t dst_dy,
+			     const BoxRec *box, int n)
+{
+	struct thread_memcpy_boxes data;
+	int x1, x2, y1, y2, i;
+	int num_threads, tile_height;
+
+	assert(n > 0);
+	assert(tiling == I915_TILING_X || tiling == I915_TILING_Y);
+	sigtrap_assert_active();
+
+	if (tiling == I915_TILING_X)
+		tile_height = kgem->gen < 030 ? 16 : 8;
+	else
+		tile_height = 32;
+
+	data.kgem = kgem;
+	data.tiling = tiling;
+	data.upload = upload;
+	data.src = src;
+	data.dst = dst;
+	data.bpp = bpp;
+	data.src_stride = src_stride;
+	data.dst_stride = dst_stride;
+	data.src_dx = src_dx;
+	data.src_dy = src_dy;
+	data.dst_dx = dst_dx;
+	data.dst_dy = dst_dy;
+	data.box = box;
+	data.n = n;
+
+	x1 = box[0].x1;
+	x2 = box[0].x2;
+	y1 = box[0].y1;
+	y2 = box[0].y2;
+	for (i = 1; i < n; i++) {
+		if (box[i].x1 < x1)
+			x1 = box[i].x1;
+		if (box[i].x2 > x2)
+			x2 = box[i].x2;
+		if (box[i].y1 < y1)
+			y1 = box[i].y1;
+		if (box[i].y2 > y2)
+			y2 = box[i].y2;
+	}
+	data.y1 = y1;
+	data.y2 = y2;
+
+	num_threads = sna_use_threads(THREAD_COPY,
+				      (x2 - x1) * bpp / 32, y2 - y1,
+				      128);
+	if (num_threads > 1) {
+		/* Band boundaries fall on tile rows of the tiled surface */
+		int first = (y1 + tile_dy) & -tile_height;
+		int rows = (y2 + tile_dy - first + tile_height - 1) / tile_height;
+		int num_tasks, dy;
+
+		num_tasks = sna_threads_tasks(num_threads, rows);
+		if (num_tasks > 1) {
+			struct thread_memcpy_boxes threads[num_tasks];
+			int y;
+
+			DBG(("%s: using %d threads (%d tasks) for %d tile rows\n",
+			     __FUNCTION__, num_threads, num_tasks, rows));
+
+			dy = (rows + num_tasks - 1) / num_tasks * tile_height;
+			y = first - tile_dy;
+
+			if (sigtrap_get()) {
+				sna_threads_kill();
+				return false;
+			}
+
+			for (i = 1; i < num_tasks; i++) {
+				threads[i] = data;
+				threads[i].y1 = y;
+				threads[i].y2 = y + dy;
+				y += dy;
+
+				sna_threads_run(i, thread_memcpy_boxes, &threads[i]);
+			}
+
+			threads[0] = data;
+			threads[0].y1 = y;
+			thread_memcpy_boxes(&threads[0]);
+
+			/* If a worker died its bands were never copied, so
+			 * let the caller redo the whole upload another way.
+			 */
+			if (!sna_threads_wait()) {
+				sigtrap_put();
+				return false;
+			}
+
+			sigtrap_put();
+			return true;
+		}
+	}
+
+	thread_memcpy_boxes(&data);
+	return true;
+}
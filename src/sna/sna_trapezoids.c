@@ -140,6 +140,127 @@ bool trapezoids_bounds(int n, const xTrapezoid *t, BoxPtr box)
 	return box->x2 > box->x1 && box->y2 > box->y1;
 }
 
+bool trapezoid_bands_init(struct trapezoid_bands *bands,
+			  int count, int y1, int y2)
+{
+	assert(count > 0);
+	assert(y2 > y1);
+
+	bands->y1 = y1;
+	bands->y2 = y2;
+	bands->count = count;
+	bands->num_bands = 0;
+	bands->y = NULL;
+	bands->index = NULL;
+
+	bands->rows = malloc(2*count*sizeof(int16_t) +
+			     (y2 - y1 + 1)*sizeof(int));
+	if (bands->rows == NULL)
+		return false;
+
+	bands->cost = (int *)(bands->rows + 2*count);
+	memset(bands->cost, 0, (y2 - y1 + 1)*sizeof(int));
+	return true;
+}
+
+/* Cut the rows where the running cost passes each multiple of
+ * total/num_bands, so a dense stretch of the shape is shared between
+ * several bands. Then bucket the primitives by the bands they cross,
+ * so that each band only visits its own.
+ */
+bool trapezoid_bands_split(struct trapezoid_bands *bands, int num_bands)
+{
+	const int height = bands->y2 - bands->y1;
+	int *cost = bands->cost;
+	int64_t total, sum;
+	int i, n, y, active;
+
+	assert(num_bands > 0);
+
+	total = 0;
+	active = 0;
+	for (y = 0; y < height; y++) {
+		active += cost[y];
+		assert(active >= 0);
+		cost[y] = 1 + active;
+		total += cost[y];
+	}
+
+	bands->y = malloc(2*(num_bands + 1)*sizeof(int));
+	if (bands->y == NULL)
+		return false;
+	bands->first = bands->y + num_bands + 1;
+
+	/* From here on, cost[] maps each row to its band */
+	bands->y[0] = bands->y1;
+	sum = 0;
+	n = 0;
+	for (y = 0; y < height; y++) {
+		sum += cost[y];
+		cost[y] = n;
+		if (n + 1 < num_bands && y + 1 < height &&
+		    sum * num_bands >= total * (n + 1))
+			bands->y[++n] = bands->y1 + y + 1;
+	}
+	bands->y[++n] = bands->y2;
+	bands->num_bands = n;
+
+	memset(bands->first, 0, (n + 1)*sizeof(int));
+	for (i = 0; i < bands->count; i++) {
+		int top = bands->rows[2*i + 0] - bands->y1;
+		int bottom = bands->rows[2*i + 1] - bands->y1;
+		int b;
+
+		if (top == bottom)
+			continue;
+
+		for (b = cost[top]; b <= cost[bottom - 1]; b++)
+			bands->first[b + 1]++;
+	}
+	for (n = 0; n < bands->num_bands; n++)
+		bands->first[n + 1] += bands->first[n];
+
+	DBG(("%s: %d rows, cost=%lld, %d bands, %d primitives -> %d\n",
+	     __FUNCTION__, height, (long long)total, bands->num_bands,
+	     bands->count, bands->first[bands->num_bands]));
+
+	if (bands->first[bands->num_bands] == 0)
+		return true;
+
+	bands->index = malloc(bands->first[bands->num_bands]*sizeof(int));
+	if (bands->index == NULL) {
+		bands->num_bands = 0;
+		return false;
+	}
+
+	/* Fill each band in order, advancing first[] to the end of the
+	 * band, and then shift it back down to the start.
+	 */
+	for (i = 0; i < bands->count; i++) {
+		int top = bands->rows[2*i + 0] - bands->y1;
+		int bottom = bands->rows[2*i + 1] - bands->y1;
+		int b;
+
+		if (top == bottom)
+			continue;
+
+		for (b = cost[top]; b <= cost[bottom - 1]; b++)
+			bands->index[bands->first[b]++] = i;
+	}
+	for (n = bands->num_bands; n > 0; n--)
+		bands->first[n] = bands->first[n - 1];
+	bands->first[0] = 0;
+
+	return true;
+}
+
+void trapezoid_bands_fini(struct trapezoid_bands *bands)
+{
+	free(bands->index);
+	free(bands->y);
+	free(bands->rows);
+}
+
 static bool
 trapezoids_inplace_fallback(struct sna *sna,
 			    CARD8 op,
@@ -335,7 +456,7 @@ trapezoids_fallback(struct sna *sna,
 			if (!scratch)
 				return;
 
-			num_threads = sna_use_threads(width, height, 8);
+			num_threads = sna_use_threads(THREAD_MASK, width, height, 8);
 			if (num_threads == 1) {
 				if (depth < 8) {
 					image = pixman_image_create_bits(format, width, height,
@@ -379,7 +500,8 @@ trapezoids_fallback(struct sna *sna,
 					return;
 				}
 			} else {
-				struct rasterize_traps_thread threads[num_threads];
+				int num_tasks = sna_threads_tasks(num_threads, bounds.y2 - bounds.y1);
+				struct rasterize_traps_thread threads[num_tasks];
 				int y, dy, n;
 
 				threads[0].ptr = scratch->devPrivate.ptr;
@@ -390,11 +512,10 @@ trapezoids_fallback(struct sna *sna,
 				threads[0].format = format;
 
 				y = bounds.y1;
-				dy = (height + num_threads - 1) / num_threads;
-				num_threads -= (num_threads-1) * dy >= bounds.y2 - bounds.y1;
+				dy = (height + num_tasks - 1) / num_tasks;
 
 				if (sigtrap_get() == 0) {
-					for (n = 1; n < num_threads; n++) {
+					for (n = 1; n < num_tasks; n++) {
 						threads[n] = threads[0];
 						threads[n].ptr += (y - bounds.y1) * threads[n].stride;
 						threads[n].bounds.y1 = y;
@@ -857,6 +978,14 @@ sna_add_traps(PicturePtr picture, INT16 x, INT16 y, int n, xTrap *t)
 	}
 }
 
+void sna_trapezoids_close(struct sna *sna)
+{
+	DBG(("%s\n", __FUNCTION__));
+	(void)sna;
+
+	precise_trapezoid_cache_fini();
+}
+
 #if HAS_PIXMAN_TRIANGLES
 static void
 triangles_fallback(CARD8 op,
@@ -215,6 +215,8 @@ precise_trap_span_converter(struct sna *sna,
 			    INT16 src_x, INT16 src_y,
 			    int ntrap, xTrap *trap);
 
+void precise_trapezoid_cache_fini(void);
+
 bool
 imprecise_trap_span_converter(struct sna *sna,
 			      PicturePtr dst,
@@ -393,6 +395,66 @@ static inline int pixman_fixed_to_fast(pixman_fixed_t v)
 
 bool trapezoids_bounds(int n, const xTrapezoid *t, BoxPtr box);
 
+/* Rows [y1, y2) split into bands of similar cost for the threaded
+ * rasterisers, along with the primitives (trapezoids or lines) that
+ * cross each band. A row costs one plus the number of edges crossing it.
+ */
+struct trapezoid_bands {
+	int y1, y2;
+	int count;
+	int16_t *rows;	/* [top, bottom) of each primitive, clipped */
+	int *cost;	/* per row; becomes the band of each row */
+
+	int num_bands;
+	int *y;		/* num_bands + 1 band boundaries */
+	int *first;	/* num_bands + 1 offsets into index[] */
+	int *index;	/* the primitives crossing each band, in order */
+};
+
+bool trapezoid_bands_init(struct trapezoid_bands *bands,
+			  int count, int y1, int y2);
+bool trapezoid_bands_split(struct trapezoid_bands *bands, int num_bands);
+void trapezoid_bands_fini(struct trapezoid_bands *bands);
+
+/* Record that primitive i, with the given number of edges, covers rows
+ * [top, bottom). Every primitive must be added before splitting.
+ */
+static inline void
+trapezoid_bands_add(struct trapezoid_bands *bands,
+		    int i, int top, int bottom, int edges)
+{
+	assert(i >= 0 && i < bands->count);
+
+	if (top < bands->y1)
+		top = bands->y1;
+	if (bottom > bands->y2)
+		bottom = bands->y2;
+	if (top >= bottom) {
+		bands->rows[2*i + 0] = bands->rows[2*i + 1] = bands->y1;
+		return;
+	}
+
+	bands->rows[2*i + 0] = top;
+	bands->rows[2*i + 1] = bottom;
+	bands->cost[top - bands->y1] += edges;
+	bands->cost[bottom - bands->y1] -= edges;
+}
+
+static inline int
+trapezoid_bands_count(const struct trapezoid_bands *bands, int n)
+{
+	return bands->first[n + 1] - bands->first[n];
+}
+
+/* Composite a constant coverage over a span of the destination (sna_spans.c) */
+void span_in_a8(uint8_t *dst, int32_t stride,
+		int width, int height, uint8_t alpha);
+void span_add_a8(uint8_t *dst, int32_t stride,
+		 int width, int height, uint8_t alpha);
+void span_lerp_x8r8g8b8(uint32_t *dst, int32_t stride,
+			int width, int height,
+			uint32_t color, uint8_t alpha);
+
 #define TOR_INPLACE_SIZE 128
 
 #endif /* SNA_TRAPEZOIDS_H */
@@ -1131,7 +1131,7 @@ composite_unaligned_boxes_inplace(struct sna *sna,
 			}
 		}
 
-		num_threads = sna_use_threads(clip.extents.x2 - clip.extents.x1,
+		num_threads = sna_use_threads(THREAD_INPLACE, clip.extents.x2 - clip.extents.x1,
 					      clip.extents.y2 - clip.extents.y1,
 					      32);
 		if (num_threads == 1) {
@@ -1186,10 +1186,10 @@ composite_unaligned_boxes_inplace(struct sna *sna,
 			pixman_image_unref(pi.source);
 			pixman_image_unref(pi.mask);
 		} else {
-			struct rectilinear_inplace_thread thread[num_threads];
+			int num_tasks = sna_threads_tasks(num_threads, clip.extents.y2 - clip.extents.y1);
+			struct rectilinear_inplace_thread thread[num_tasks];
 			int i, y, dy;
 
-
 			thread[0].trap = t;
 			thread[0].dst = image_from_pict(dst, false, &thread[0].dx, &thread[0].dy);
 			thread[0].src = image_from_pict(src, false, &thread[0].sx, &thread[0].sy);
@@ -1200,11 +1200,10 @@ composite_unaligned_boxes_inplace(struct sna *sna,
 			thread[0].op = op;
 
 			y = clip.extents.y1;
-			dy = (clip.extents.y2 - clip.extents.y1 + num_threads - 1) / num_threads;
-			num_threads = (clip.extents.y2 - clip.extents.y1 + dy - 1) / dy;
+			dy = (clip.extents.y2 - clip.extents.y1 + num_tasks - 1) / num_tasks;
 
 			if (sigtrap_get() == 0) {
-				for (i = 1; i < num_threads; i++) {
+				for (i = 1; i < num_tasks; i++) {
 					thread[i] = thread[0];
 					thread[i].y1 = y;
 					thread[i].y2 = y += dy;
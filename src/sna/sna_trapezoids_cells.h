@@ -0,0 +1,373 @@
+#ifndef SNA_TRAPEZOIDS_CELLS_H
+#define SNA_TRAPEZOIDS_CELLS_H
+
+/* Coverage accumulation for the precise scan converter.
+ *
+ * Requires sna.h, sna_render.h and sna_trapezoids.h to be included first.
+ */
+
+#include <string.h>
+#include <limits.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define _GRID_TO_INT_FRAC(t, i, f, m) do {      \
+	(i) = (t) / (m);                   \
+	(f) = (t) % (m);                   \
+	if ((f) < 0) {                     \
+		--(i);                     \
+		(f) += (m);                \
+	}                                  \
+} while (0)
+
+#define SAMPLES_X_TO_INT_FRAC(x, i, f) \
+	_GRID_TO_INT_FRAC(x, i, f, SAMPLES_X)
+
+typedef void (*span_func_t)(struct sna *sna,
+			    struct sna_composite_spans_op *op,
+			    pixman_region16_t *clip,
+			    const BoxRec *box,
+			    int coverage);
+
+/* A cell records the effect on pixel coverage of polygon edges
+ * passing through a pixel.  It contains two accumulators of pixel
+ * coverage.
+ *
+ * Consider the effects of a polygon edge on the coverage of a pixel
+ * it intersects and that of the following one.  The coverage of the
+ * following pixel is the height of the edge multiplied by the width
+ * of the pixel, and the coverage of the pixel itself is the area of
+ * the trapezoid formed by the edge and the right side of the pixel.
+ *
+ * +-----------------------+-----------------------+
+ * |                       |                       |
+ * |                       |                       |
+ * |_______________________|_______________________|
+ * |   \...................|.......................|\
+ * |    \..................|.......................| |
+ * |     \.................|.......................| |
+ * |      \....covered.....|.......................| |
+ * |       \....area.......|.......................| } covered height
+ * |        \..............|.......................| |
+ * |uncovered\.............|.......................| |
+ * |  area    \............|.......................| |
+ * |___________\...........|.......................|/
+ * |                       |                       |
+ * |                       |                       |
+ * |                       |                       |
+ * +-----------------------+-----------------------+
+ *
+ * Since the coverage of the following pixel will always be a multiple
+ * of the width of the pixel, we can store the height of the covered
+ * area instead.  The coverage of the pixel itself is the total
+ * coverage minus the area of the uncovered area to the left of the
+ * edge.  As it's faster to compute the uncovered area we only store
+ * that and subtract it from the total coverage later when forming
+ * spans to blit.
+ *
+ * The heights and areas are signed, with left edges of the polygon
+ * having positive sign and right edges having negative sign.  When
+ * two edges intersect they swap their left/rightness so their
+ * contribution above and below the intersection point must be
+ * computed separately. */
+struct cell {
+	int16_t uncovered_area;
+	int16_t covered_height;
+};
+
+/* A cell list holds a cell for every pixel of the scan line, so an
+ * edge crossing is accumulated without searching for its cell.
+ * cells[0] collects the crossings left of x1 (only its height is used),
+ * cells[1 + x - x1] the pixels from x1 to x2, and cells[x2 - x1 + 1]
+ * swallows those right of x2. The range of cells touched since the
+ * last reset is tracked so that forming the spans and clearing the row
+ * only visits that range.
+ */
+#define CELL_LIST_PAD 4 /* zeroed cells for reading a vector past the end */
+struct cell_list {
+	int16_t x1, x2;
+	int min, max;
+	struct cell *cells;
+	struct cell embedded[256];
+};
+
+static inline int cell_list_size(int x1, int x2)
+{
+	return x2 - x1 + 2 + CELL_LIST_PAD;
+}
+
+/* Use storage, of at least cell_list_size() cells, owned by the caller */
+static void
+cell_list_init_storage(struct cell_list *cells, int x1, int x2,
+		       struct cell *storage)
+{
+	cells->x1 = x1;
+	cells->x2 = x2;
+	cells->min = INT_MAX;
+	cells->max = INT_MIN;
+	cells->cells = storage;
+	memset(cells->cells, 0, cell_list_size(x1, x2) * sizeof(struct cell));
+}
+
+static bool
+cell_list_init(struct cell_list *cells, int x1, int x2)
+{
+	int size = cell_list_size(x1, x2);
+	struct cell *storage = cells->embedded;
+
+	if (size > (int)ARRAY_SIZE(cells->embedded)) {
+		storage = malloc(size * sizeof(struct cell));
+		if (storage == NULL)
+			return false;
+	}
+
+	cell_list_init_storage(cells, x1, x2, storage);
+	return true;
+}
+
+static void
+cell_list_fini(struct cell_list *cells)
+{
+	if (cells->cells != cells->embedded)
+		free(cells->cells);
+}
+
+inline static void
+cell_list_reset(struct cell_list *cells)
+{
+	if (cells->min <= cells->max)
+		memset(cells->cells + cells->min, 0,
+		       (cells->max - cells->min + 1) * sizeof(struct cell));
+	cells->min = INT_MAX;
+	cells->max = INT_MIN;
+}
+
+/* Returns the cell accumulating the pixel at x */
+inline static struct cell *
+cell_list_at(struct cell_list *cells, int x)
+{
+	int i;
+
+	if (x < cells->x1)
+		i = 0;
+	else if (x >= cells->x2)
+		i = cells->x2 - cells->x1 + 1;
+	else
+		i = x - cells->x1 + 1;
+
+	if (i < cells->min)
+		cells->min = i;
+	if (i > cells->max)
+		cells->max = i;
+
+	return &cells->cells[i];
+}
+
+/* Add a subpixel span covering [x1, x2) to the coverage cells. */
+inline static void
+cell_list_add_subspan(struct cell_list *cells, int x1, int x2)
+{
+	struct cell *cell;
+	int ix1, fx1;
+	int ix2, fx2;
+
+	if (x1 == x2)
+		return;
+
+	SAMPLES_X_TO_INT_FRAC(x1, ix1, fx1);
+	SAMPLES_X_TO_INT_FRAC(x2, ix2, fx2);
+
+	__DBG(("%s: x1=%d (%d+%d), x2=%d (%d+%d)\n", __FUNCTION__,
+	       x1, ix1, fx1, x2, ix2, fx2));
+
+	cell = cell_list_at(cells, ix1);
+	if (ix1 != ix2) {
+		cell->uncovered_area += 2*fx1;
+		++cell->covered_height;
+
+		cell = cell_list_at(cells, ix2);
+		cell->uncovered_area -= 2*fx2;
+		--cell->covered_height;
+	} else
+		cell->uncovered_area += 2*(fx1-fx2);
+}
+
+inline static void
+cell_list_add_span(struct cell_list *cells, int x1, int x2)
+{
+	struct cell *cell;
+	int ix1, fx1;
+	int ix2, fx2;
+
+	SAMPLES_X_TO_INT_FRAC(x1, ix1, fx1);
+	SAMPLES_X_TO_INT_FRAC(x2, ix2, fx2);
+
+	__DBG(("%s: x1=%d (%d+%d), x2=%d (%d+%d)\n", __FUNCTION__,
+	       x1, ix1, fx1, x2, ix2, fx2));
+
+	cell = cell_list_at(cells, ix1);
+	if (ix1 != ix2) {
+		cell->uncovered_area += 2*fx1*SAMPLES_Y;
+		cell->covered_height += SAMPLES_Y;
+
+		cell = cell_list_at(cells, ix2);
+		cell->uncovered_area -= 2*fx2*SAMPLES_Y;
+		cell->covered_height -= SAMPLES_Y;
+	} else
+		cell->uncovered_area += 2*(fx1-fx2)*SAMPLES_Y;
+}
+
+/* Returns the first non-empty cell from i, or an index beyond end */
+inline static int
+cell_list_next(const struct cell *cells, int i, int end)
+{
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+
+	while (i <= end) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&cells[i]);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(v, zero));
+		if (mask != 0xffff)
+			return i + (__builtin_ctz(~mask) >> 2);
+		i += 4;
+	}
+#else
+	while (i <= end &&
+	       (cells[i].covered_height | cells[i].uncovered_area) == 0)
+		i++;
+#endif
+	return i;
+}
+
+/* Form the spans for the rows [y, y + height) from the coverages and areas */
+static void
+cell_list_blt(struct cell_list *cells,
+	      struct sna *sna,
+	      struct sna_composite_spans_op *op,
+	      pixman_region16_t *clip,
+	      span_func_t span,
+	      int y, int height,
+	      int unbounded)
+{
+	const struct cell *cell = cells->cells;
+	int i, end;
+	BoxRec box;
+	int cover;
+
+	box.y1 = y;
+	box.y2 = y + height;
+	box.x1 = cells->x1;
+
+	cover = cell[0].covered_height*SAMPLES_X*2;
+	assert(cover >= 0);
+
+	end = MIN(cells->max, cells->x2 - cells->x1);
+	for (i = cell_list_next(cell, MAX(cells->min, 1), end);
+	     i <= end;
+	     i = cell_list_next(cell, i + 1, end)) {
+		int x = cells->x1 + i - 1;
+
+		__DBG(("%s: cell=(%d, %d, %d), cover=%d\n", __FUNCTION__,
+		       x, cell[i].covered_height, cell[i].uncovered_area,
+		       cover));
+
+		box.x2 = x;
+		if (box.x2 > box.x1 && (unbounded || cover)) {
+			__DBG(("%s: end span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
+			       box.x1, box.y1,
+			       box.x2 - box.x1,
+			       box.y2 - box.y1,
+			       cover));
+			span(sna, op, clip, &box, cover);
+		}
+		box.x1 = box.x2;
+		cover += cell[i].covered_height*SAMPLES_X*2;
+
+		if (cell[i].uncovered_area) {
+			int area = cover - cell[i].uncovered_area;
+			box.x2 = x + 1;
+			if (unbounded || area) {
+				__DBG(("%s: new span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
+				       box.x1, box.y1,
+				       box.x2 - box.x1,
+				       box.y2 - box.y1,
+				       area));
+				span(sna, op, clip, &box, area);
+			}
+			box.x1 = box.x2;
+		}
+	}
+
+	box.x2 = cells->x2;
+	if (box.x2 > box.x1 && (unbounded || cover)) {
+		__DBG(("%s: span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
+		       box.x1, box.y1,
+		       box.x2 - box.x1,
+		       box.y2 - box.y1,
+		       cover));
+		span(sna, op, clip, &box, cover);
+	}
+}
+
+/* The inplace converter writes the a8 coverage of a row directly.
+ * Rather than adding each span's coverage to every pixel it covers, the
+ * span adds the differences between neighbouring pixels into a row of
+ * deltas, width + 2 bytes long, which are then summed across the row.
+ * As the sums are taken modulo 256, the result is exactly that of
+ * adding the coverage bytes together.
+ */
+inline static void
+inplace_deltas_add(uint8_t *d, int lix, int lfx, int rix, int rfx, int weight)
+{
+	assert(lix <= rix);
+	if (lix == rix) {
+		d[lix] += (rfx - lfx) * weight;
+		d[lix + 1] -= (rfx - lfx) * weight;
+	} else {
+		d[lix] += (SAMPLES_X - lfx) * weight;
+		d[lix + 1] += lfx * weight;
+		d[rix] -= (SAMPLES_X - rfx) * weight;
+		d[rix + 1] -= rfx * weight;
+	}
+}
+
+/* Sum the deltas into the coverage row, leaving the deltas cleared */
+inline static void
+inplace_deltas_sum(uint8_t *d, uint8_t *row, int width)
+{
+	uint8_t sum = 0;
+	int x = 0;
+
+#if defined(__SSE2__)
+	__m128i carry = _mm_setzero_si128();
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *)(d + x));
+		_mm_storeu_si128((__m128i *)(d + x), _mm_setzero_si128());
+
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi8(v, carry);
+		_mm_storeu_si128((__m128i *)(row + x), v);
+
+		/* broadcast the last byte as the carry into the next block */
+		v = _mm_unpackhi_epi8(v, v);
+		v = _mm_shufflehi_epi16(v, 0xff);
+		carry = _mm_shuffle_epi32(v, 0xff);
+	}
+	sum = _mm_cvtsi128_si32(carry);
+#endif
+
+	for (; x < width; x++) {
+		sum += d[x];
+		d[x] = 0;
+		row[x] = sum;
+	}
+	d[width] = d[width + 1] = 0;
+}
+
+#endif /* SNA_TRAPEZOIDS_CELLS_H */
@@ -1961,7 +1961,7 @@ imprecise_trapezoid_span_converter(struct sna *sna,
 	    (flags & COMPOSITE_SPANS_RECTILINEAR) == 0 &&
 	    tmp.thread_boxes &&
 	    thread_choose_span(&tmp, dst, maskFormat, &clip))
-		num_threads = sna_use_threads(clip.extents.x2-clip.extents.x1,
+		num_threads = sna_use_threads(THREAD_SPANS, clip.extents.x2-clip.extents.x1,
 					      clip.extents.y2-clip.extents.y1,
 					      16);
 	DBG(("%s: using %d threads\n", __FUNCTION__, num_threads));
@@ -1985,7 +1985,8 @@ imprecise_trapezoid_span_converter(struct sna *sna,
 
 		tor_fini(&tor);
 	} else {
-		struct span_thread threads[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, clip.extents.y2 - clip.extents.y1);
+		struct span_thread threads[num_tasks];
 		int y, h;
 
 		DBG(("%s: using %d threads for span compositing %dx%d\n",
@@ -2007,10 +2008,9 @@ imprecise_trapezoid_span_converter(struct sna *sna,
 
 		y = clip.extents.y1;
 		h = clip.extents.y2 - clip.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= clip.extents.y2 - clip.extents.y1;
+		h = (h + num_tasks - 1) / num_tasks;
 
-		for (n = 1; n < num_threads; n++) {
+		for (n = 1; n < num_tasks; n++) {
 			threads[n] = threads[0];
 			threads[n].extents.y1 = y;
 			threads[n].extents.y2 = y += h;
@@ -2294,7 +2294,6 @@ tor_blt_in(struct sna *sna,
 {
 	struct inplace *in = (struct inplace *)op;
 	uint8_t *ptr = in->ptr;
-	int h, w, i;
 
 	if (coverage == 0) {
 		_tor_blt_src(in, box, 0);
@@ -2306,14 +2305,9 @@ tor_blt_in(struct sna *sna,
 		return;
 
 	ptr += box->y1 * in->stride + box->x1;
-
-	h = box->y2 - box->y1;
-	w = box->x2 - box->x1;
-	do {
-		for (i = 0; i < w; i++)
-			ptr[i] = mul_8_8(ptr[i], coverage);
-		ptr += in->stride;
-	} while (--h);
+	span_in_a8(ptr, in->stride,
+		   box->x2 - box->x1, box->y2 - box->y1,
+		   coverage);
 }
 
 static void
@@ -2325,7 +2319,7 @@ tor_blt_add(struct sna *sna,
 {
 	struct inplace *in = (struct inplace *)op;
 	uint8_t *ptr = in->ptr;
-	int h, w, v, i;
+	int h, w, v;
 
 	if (coverage == 0)
 		return;
@@ -2343,15 +2337,8 @@ tor_blt_add(struct sna *sna,
 	if ((w | h) == 1) {
 		v = coverage + *ptr;
 		*ptr = v >= 255 ? 255 : v;
-	} else {
-		do {
-			for (i = 0; i < w; i++) {
-				v = coverage + ptr[i];
-				ptr[i] = v >= 255 ? 255 : v;
-			}
-			ptr += in->stride;
-		} while (--h);
-	}
+	} else
+		span_add_a8(ptr, in->stride, w, h, coverage);
 }
 
 static void
@@ -2400,13 +2387,9 @@ tor_blt_lerp32(struct sna *sna,
 				*ptr = lerp8x4(in->color, coverage, *ptr);
 				ptr += stride;
 			} while (--h);
-		} else{
-			do {
-				for (i = 0; i < w; i++)
-					ptr[i] = lerp8x4(in->color, coverage, ptr[i]);
-				ptr += stride;
-			} while (--h);
-		}
+		} else
+			span_lerp_x8r8g8b8(ptr, in->stride, w, h,
+					   in->color, coverage);
 	}
 }
 
@@ -2655,7 +2638,7 @@ trapezoid_span_inplace__x8r8g8b8(CARD8 op,
 	dx = dst->pDrawable->x * FAST_SAMPLES_X;
 	dy = dst->pDrawable->y * FAST_SAMPLES_Y;
 
-	num_threads = sna_use_threads(4*(region.extents.x2 - region.extents.x1),
+	num_threads = sna_use_threads(THREAD_INPLACE, 4*(region.extents.x2 - region.extents.x1),
 				      region.extents.y2 - region.extents.y1,
 				      16);
 
@@ -2759,7 +2742,8 @@ trapezoid_span_inplace__x8r8g8b8(CARD8 op,
 
 		tor_fini(&tor);
 	} else {
-		struct inplace_x8r8g8b8_thread threads[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, region.extents.y2 - region.extents.y1);
+		struct inplace_x8r8g8b8_thread threads[num_tasks];
 		int y, h;
 
 		DBG(("%s: using %d threads for inplace compositing %dx%d\n",
@@ -2783,11 +2767,10 @@ trapezoid_span_inplace__x8r8g8b8(CARD8 op,
 
 		y = region.extents.y1;
 		h = region.extents.y2 - region.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= region.extents.y2 - region.extents.y1;
+		h = (h + num_tasks - 1) / num_tasks;
 
 		if (sigtrap_get() == 0) {
-			for (n = 1; n < num_threads; n++) {
+			for (n = 1; n < num_tasks; n++) {
 				threads[n] = threads[0];
 				threads[n].extents.y1 = y;
 				threads[n].extents.y2 = y += h;
@@ -2997,7 +2980,7 @@ imprecise_trapezoid_span_inplace(struct sna *sna,
 
 	num_threads = 1;
 	if ((flags & COMPOSITE_SPANS_RECTILINEAR) == 0)
-		num_threads = sna_use_threads(region.extents.x2 - region.extents.x1,
+		num_threads = sna_use_threads(THREAD_INPLACE, region.extents.x2 - region.extents.x1,
 					      region.extents.y2 - region.extents.y1,
 					      16);
 	if (num_threads == 1) {
@@ -3023,7 +3006,8 @@ imprecise_trapezoid_span_inplace(struct sna *sna,
 
 		tor_fini(&tor);
 	} else {
-		struct inplace_thread threads[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, region.extents.y2 - region.extents.y1);
+		struct inplace_thread threads[num_tasks];
 		int y, h;
 
 		DBG(("%s: using %d threads for inplace compositing %dx%d\n",
@@ -3045,11 +3029,10 @@ imprecise_trapezoid_span_inplace(struct sna *sna,
 
 		y = region.extents.y1;
 		h = region.extents.y2 - region.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= region.extents.y2 - region.extents.y1;
+		h = (h + num_tasks - 1) / num_tasks;
 
 		if (sigtrap_get() == 0) {
-			for (n = 1; n < num_threads; n++) {
+			for (n = 1; n < num_tasks; n++) {
 				threads[n] = threads[0];
 				threads[n].extents.y1 = y;
 				threads[n].extents.y2 = y += h;
@@ -3801,7 +3784,7 @@ imprecise_tristrip_span_converter(struct sna *sna,
 	if (!NO_GPU_THREADS &&
 	    tmp.thread_boxes &&
 	    thread_choose_span(&tmp, dst, maskFormat, &clip))
-		num_threads = sna_use_threads(extents.x2 - extents.x1,
+		num_threads = sna_use_threads(THREAD_SPANS, extents.x2 - extents.x1,
 					      extents.y2 - extents.y1,
 					      16);
 	if (num_threads == 1) {
@@ -3842,7 +3825,8 @@ imprecise_tristrip_span_converter(struct sna *sna,
 
 		tor_fini(&tor);
 	} else {
-		struct tristrip_thread threads[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, clip.extents.y2 - clip.extents.y1);
+		struct tristrip_thread threads[num_tasks];
 		int y, h, n;
 
 		DBG(("%s: using %d threads for tristrip compositing %dx%d\n",
@@ -3864,10 +3848,9 @@ imprecise_tristrip_span_converter(struct sna *sna,
 
 		y = clip.extents.y1;
 		h = clip.extents.y2 - clip.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= clip.extents.y2 - clip.extents.y1;
+		h = (h + num_tasks - 1) / num_tasks;
 
-		for (n = 1; n < num_threads; n++) {
+		for (n = 1; n < num_tasks; n++) {
 			threads[n] = threads[0];
 			threads[n].extents.y1 = y;
 			threads[n].extents.y2 = y += h;
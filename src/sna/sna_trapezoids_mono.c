@@ -886,11 +886,12 @@ mono_trapezoids_span_converter(struct sna *sna,
 	    mono.op.thread_boxes &&
 	    mono.op.damage == NULL &&
 	    !unbounded)
-		num_threads = sna_use_threads(mono.clip.extents.x2 - mono.clip.extents.x1,
+		num_threads = sna_use_threads(THREAD_SPANS, mono.clip.extents.x2 - mono.clip.extents.x1,
 					      mono.clip.extents.y2 - mono.clip.extents.y1,
 					      32);
 	if (num_threads > 1) {
-		struct mono_span_thread threads[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, extents.y2 - extents.y1);
+		struct mono_span_thread threads[num_tasks];
 		int y, h;
 
 		DBG(("%s: using %d threads for mono span compositing %dx%d\n",
@@ -909,10 +910,9 @@ mono_trapezoids_span_converter(struct sna *sna,
 
 		y = extents.y1;
 		h = extents.y2 - extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= extents.y2 - extents.y1;
+		h = (h + num_tasks - 1) / num_tasks;
 
-		for (n = 1; n < num_threads; n++) {
+		for (n = 1; n < num_tasks; n++) {
 			threads[n] = threads[0];
 			threads[n].extents.y1 = y;
 			threads[n].extents.y2 = y += h;
@@ -35,6 +35,7 @@
 #include "sna_render.h"
 #include "sna_render_inline.h"
 #include "sna_trapezoids.h"
+#include "sna_trapezoids_cells.h"
 #include "fb/fbpict.h"
 
 #include <mipict.h>
@@ -52,15 +53,6 @@
 #define MIN(x,y) ((x) <= (y) ? (x) : (y))
 #endif
 
-#define _GRID_TO_INT_FRAC(t, i, f, m) do {      \
-	(i) = (t) / (m);                   \
-	(f) = (t) % (m);                   \
-	if ((f) < 0) {                     \
-		--(i);                     \
-		(f) += (m);                \
-	}                                  \
-} while (0)
-
 #define GRID_AREA (2*SAMPLES_X*SAMPLES_Y)
 
 static inline int pixman_fixed_to_grid_x(pixman_fixed_t v)
@@ -73,12 +65,6 @@ static inline int pixman_fixed_to_grid_y(pixman_fixed_t v)
 	return ((int64_t)v * SAMPLES_Y + (1<<15)) >> 16;
 }
 
-typedef void (*span_func_t)(struct sna *sna,
-			    struct sna_composite_spans_op *op,
-			    pixman_region16_t *clip,
-			    const BoxRec *box,
-			    int coverage);
-
 #if HAS_DEBUG_FULL
 static void _assert_pixmap_contains_box(PixmapPtr pixmap, BoxPtr box, const char *function)
 {
@@ -134,9 +120,6 @@ inline static void apply_damage_box(struct sna_composite_op *op, const BoxRec *b
 		_apply_damage_box(op, box);
 }
 
-#define SAMPLES_X_TO_INT_FRAC(x, i, f) \
-	_GRID_TO_INT_FRAC(x, i, f, SAMPLES_X)
-
 #define AREA_TO_FLOAT(c)  ((c) / (float)GRID_AREA)
 #define TO_ALPHA(c) (((c)+1) >> 1)
 
@@ -187,69 +170,6 @@ struct polygon {
 	int num_edges;
 };
 
-/* A cell records the effect on pixel coverage of polygon edges
- * passing through a pixel.  It contains two accumulators of pixel
- * coverage.
- *
- * Consider the effects of a polygon edge on the coverage of a pixel
- * it intersects and that of the following one.  The coverage of the
- * following pixel is the height of the edge multiplied by the width
- * of the pixel, and the coverage of the pixel itself is the area of
- * the trapezoid formed by the edge and the right side of the pixel.
- *
- * +-----------------------+-----------------------+
- * |                       |                       |
- * |                       |                       |
- * |_______________________|_______________________|
- * |   \...................|.......................|\
- * |    \..................|.......................| |
- * |     \.................|.......................| |
- * |      \....covered.....|.......................| |
- * |       \....area.......|.......................| } covered height
- * |        \..............|.......................| |
- * |uncovered\.............|.......................| |
- * |  area    \............|.......................| |
- * |___________\...........|.......................|/
- * |                       |                       |
- * |                       |                       |
- * |                       |                       |
- * +-----------------------+-----------------------+
- *
- * Since the coverage of the following pixel will always be a multiple
- * of the width of the pixel, we can store the height of the covered
- * area instead.  The coverage of the pixel itself is the total
- * coverage minus the area of the uncovered area to the left of the
- * edge.  As it's faster to compute the uncovered area we only store
- * that and subtract it from the total coverage later when forming
- * spans to blit.
- *
- * The heights and areas are signed, with left edges of the polygon
- * having positive sign and right edges having negative sign.  When
- * two edges intersect they swap their left/rightness so their
- * contribution above and below the intersection point must be
- * computed separately. */
-struct cell {
-	struct cell *next;
-	int x;
-	int16_t uncovered_area;
-	int16_t covered_height;
-};
-
-/* A cell list represents the scan line sparsely as cells ordered by
- * ascending x.  It is geared towards scanning the cells in order
- * using an internal cursor. */
-struct cell_list {
-	struct cell *cursor;
-
-	/* Points to the left-most cell in the scan line. */
-	struct cell head, tail;
-
-	int16_t x1, x2;
-	int16_t count, size;
-	struct cell *cells;
-	struct cell embedded[256];
-};
-
 /* The active list contains edges in the current scan line ordered by
  * the x-coordinate of the intercept of the edge and the scan line. */
 struct active_list {
@@ -263,207 +183,78 @@ struct tor {
     struct cell_list	coverages[1];
 
     BoxRec extents;
+    bool cached;
 };
 
-/* Rewinds the cell list's cursor to the beginning.  After rewinding
- * we're good to cell_list_find() the cell any x coordinate. */
-inline static void
-cell_list_rewind(struct cell_list *cells)
-{
-	cells->cursor = &cells->head;
-}
-
-static bool
-cell_list_init(struct cell_list *cells, int x1, int x2)
-{
-	cells->tail.next = NULL;
-	cells->tail.x = INT_MAX;
-	cells->head.x = INT_MIN;
-	cells->head.next = &cells->tail;
-	cells->head.covered_height = 0;
-	cell_list_rewind(cells);
-	cells->count = 0;
-	cells->x1 = x1;
-	cells->x2 = x2;
-	cells->size = x2 - x1 + 1;
-	cells->cells = cells->embedded;
-	if (cells->size > ARRAY_SIZE(cells->embedded))
-		cells->cells = malloc(cells->size * sizeof(struct cell));
-	return cells->cells != NULL;
-}
+/* The threaded converters keep the storage for the edges and cells of
+ * each task between calls, instead of allocating it for every band.
+ * The array is only resized by the main thread, before the tasks are
+ * started; each task then grows (frees and mallocs) only its own entry,
+ * so no two threads ever touch the same one. Up to TOR_CACHE_MAX is kept
+ * per task until precise_trapezoid_cache_fini().
+ */
+#define TOR_CACHE_MAX (1 << 20)
+struct tor_cache {
+	void *ptr;
+	size_t size;
+};
+static struct tor_cache *tor_cache;
+static int tor_cache_count;
 
 static void
-cell_list_fini(struct cell_list *cells)
-{
-	if (cells->cells != cells->embedded)
-		free(cells->cells);
-}
-
-inline static void
-cell_list_reset(struct cell_list *cells)
-{
-	cell_list_rewind(cells);
-	cells->head.next = &cells->tail;
-	cells->head.covered_height = 0;
-	cells->count = 0;
-}
-
-inline static struct cell *
-cell_list_alloc(struct cell_list *cells,
-		struct cell *tail,
-		int x)
-{
-	struct cell *cell;
-
-	assert(cells->count < cells->size);
-	cell = cells->cells + cells->count++;
-	cell->next = tail->next;
-	tail->next = cell;
-
-	cell->x = x;
-	cell->covered_height = 0;
-	cell->uncovered_area = 0;
-	return cell;
-}
-
-/* Find a cell at the given x-coordinate.  Returns %NULL if a new cell
- * needed to be allocated but couldn't be.  Cells must be found with
- * non-decreasing x-coordinate until the cell list is rewound using
- * cell_list_rewind(). Ownership of the returned cell is retained by
- * the cell list. */
-inline static struct cell *
-cell_list_find(struct cell_list *cells, int x)
-{
-	struct cell *tail;
-
-	if (x >= cells->x2)
-		return &cells->tail;
-
-	if (x < cells->x1)
-		return &cells->head;
-
-	tail = cells->cursor;
-	if (tail->x == x)
-		return tail;
-
-	do {
-		if (tail->next->x > x)
-			break;
-
-		tail = tail->next;
-		if (tail->next->x > x)
-			break;
-
-		tail = tail->next;
-		if (tail->next->x > x)
-			break;
-
-		tail = tail->next;
-	} while (1);
-
-	if (tail->x != x)
-		tail = cell_list_alloc(cells, tail, x);
-
-	return cells->cursor = tail;
-}
-
-/* Add a subpixel span covering [x1, x2) to the coverage cells. */
-inline static void
-cell_list_add_subspan(struct cell_list *cells, int x1, int x2)
+polygon_fini(struct polygon *polygon)
 {
-	struct cell *cell;
-	int ix1, fx1;
-	int ix2, fx2;
-
-	if (x1 == x2)
-		return;
-
-	SAMPLES_X_TO_INT_FRAC(x1, ix1, fx1);
-	SAMPLES_X_TO_INT_FRAC(x2, ix2, fx2);
-
-	__DBG(("%s: x1=%d (%d+%d), x2=%d (%d+%d)\n", __FUNCTION__,
-	       x1, ix1, fx1, x2, ix2, fx2));
-
-	cell = cell_list_find(cells, ix1);
-	if (ix1 != ix2) {
-		cell->uncovered_area += 2*fx1;
-		++cell->covered_height;
+	if (polygon->y_buckets != polygon->y_buckets_embedded)
+		free(polygon->y_buckets);
 
-		cell = cell_list_find(cells, ix2);
-		cell->uncovered_area -= 2*fx2;
-		--cell->covered_height;
-	} else
-		cell->uncovered_area += 2*(fx1-fx2);
+	if (polygon->edges != polygon->edges_embedded)
+		free(polygon->edges);
 }
 
-inline static void
-cell_list_add_span(struct cell_list *cells, int x1, int x2)
+static void
+polygon_init_storage(struct polygon *polygon, int ymin, int ymax,
+		     struct edge *edges, struct edge **y_buckets)
 {
-	struct cell *cell;
-	int ix1, fx1;
-	int ix2, fx2;
-
-	SAMPLES_X_TO_INT_FRAC(x1, ix1, fx1);
-	SAMPLES_X_TO_INT_FRAC(x2, ix2, fx2);
-
-	__DBG(("%s: x1=%d (%d+%d), x2=%d (%d+%d)\n", __FUNCTION__,
-	       x1, ix1, fx1, x2, ix2, fx2));
-
-	cell = cell_list_find(cells, ix1);
-	if (ix1 != ix2) {
-		cell->uncovered_area += 2*fx1*SAMPLES_Y;
-		cell->covered_height += SAMPLES_Y;
+	unsigned num_buckets = EDGE_Y_BUCKET_INDEX(ymax-1, ymin) + 1;
 
-		cell = cell_list_find(cells, ix2);
-		cell->uncovered_area -= 2*fx2*SAMPLES_Y;
-		cell->covered_height -= SAMPLES_Y;
-	} else
-		cell->uncovered_area += 2*(fx1-fx2)*SAMPLES_Y;
-}
+	polygon->edges = edges;
+	polygon->y_buckets = y_buckets;
+	polygon->num_edges = 0;
 
-static void
-polygon_fini(struct polygon *polygon)
-{
-	if (polygon->y_buckets != polygon->y_buckets_embedded)
-		free(polygon->y_buckets);
+	memset(polygon->y_buckets, 0, num_buckets * sizeof(struct edge *));
+	polygon->y_buckets[num_buckets] = (void *)-1;
 
-	if (polygon->edges != polygon->edges_embedded)
-		free(polygon->edges);
+	polygon->ymin = ymin;
+	polygon->ymax = ymax;
 }
 
 static bool
 polygon_init(struct polygon *polygon, int num_edges, int ymin, int ymax)
 {
 	unsigned num_buckets = EDGE_Y_BUCKET_INDEX(ymax-1, ymin) + 1;
+	struct edge **y_buckets = polygon->y_buckets_embedded;
+	struct edge *edges = polygon->edges_embedded;
 
 	if (unlikely(ymax - ymin > 0x7FFFFFFFU - EDGE_Y_BUCKET_HEIGHT))
 		return false;
 
-	polygon->edges = polygon->edges_embedded;
-	polygon->y_buckets = polygon->y_buckets_embedded;
-
-	polygon->num_edges = 0;
 	if (num_edges > (int)ARRAY_SIZE(polygon->edges_embedded)) {
-		polygon->edges = malloc(sizeof(struct edge)*num_edges);
-		if (unlikely(NULL == polygon->edges))
-			goto bail_no_mem;
+		edges = malloc(sizeof(struct edge)*num_edges);
+		if (unlikely(NULL == edges))
+			return false;
 	}
 
 	if (num_buckets >= ARRAY_SIZE(polygon->y_buckets_embedded)) {
-		polygon->y_buckets = malloc((1+num_buckets)*sizeof(struct edge *));
-		if (unlikely(NULL == polygon->y_buckets))
-			goto bail_no_mem;
+		y_buckets = malloc((1+num_buckets)*sizeof(struct edge *));
+		if (unlikely(NULL == y_buckets)) {
+			if (edges != polygon->edges_embedded)
+				free(edges);
+			return false;
+		}
 	}
-	memset(polygon->y_buckets, 0, num_buckets * sizeof(struct edge *));
-	polygon->y_buckets[num_buckets] = (void *)-1;
 
-	polygon->ymin = ymin;
-	polygon->ymax = ymax;
+	polygon_init_storage(polygon, ymin, ymax, edges, y_buckets);
 	return true;
-
-bail_no_mem:
-	polygon_fini(polygon);
-	return false;
 }
 
 static void
@@ -914,8 +705,6 @@ nonzero_subrow(struct active_list *active, struct cell_list *coverages)
 	int prev_x = INT_MIN;
 	int winding = 0, xstart = edge->cell;
 
-	cell_list_rewind(coverages);
-
 	while (&active->tail != edge) {
 		struct edge *next = edge->next;
 
@@ -992,6 +781,9 @@ nonzero_row(struct active_list *active, struct cell_list *coverages)
 static void
 tor_fini(struct tor *converter)
 {
+	if (converter->cached)
+		return;
+
 	polygon_fini(converter->polygon);
 	cell_list_fini(converter->coverages);
 }
@@ -1006,6 +798,7 @@ tor_init(struct tor *converter, const BoxRec *box, int num_edges)
 	       num_edges));
 
 	converter->extents = *box;
+	converter->cached = false;
 
 	if (!cell_list_init(converter->coverages, box->x1, box->x2))
 		return false;
@@ -1020,6 +813,82 @@ tor_init(struct tor *converter, const BoxRec *box, int num_edges)
 	return true;
 }
 
+/* As tor_init(), but carving the edges, buckets and cells from the
+ * task's cache rather than allocating them afresh.
+ */
+static bool
+tor_init_cached(struct tor *converter, const BoxRec *box, int num_edges,
+		struct tor_cache *cache)
+{
+	int ymin = (int)box->y1 * SAMPLES_Y;
+	int ymax = (int)box->y2 * SAMPLES_Y;
+	unsigned num_buckets = EDGE_Y_BUCKET_INDEX(ymax-1, ymin) + 1;
+	size_t edges, buckets, size;
+
+	edges = num_edges * sizeof(struct edge);
+	buckets = (1 + num_buckets) * sizeof(struct edge *);
+	size = edges + buckets +
+		cell_list_size(box->x1, box->x2) * sizeof(struct cell);
+	if (cache == NULL || size > TOR_CACHE_MAX)
+		return tor_init(converter, box, num_edges);
+
+	if (size > cache->size) {
+		DBG(("%s: growing cache from %zd to %zd bytes\n",
+		     __FUNCTION__, cache->size, size));
+		free(cache->ptr);
+		cache->ptr = malloc(size);
+		if (cache->ptr == NULL) {
+			cache->size = 0;
+			return tor_init(converter, box, num_edges);
+		}
+		cache->size = size;
+	}
+
+	converter->extents = *box;
+	converter->cached = true;
+
+	cell_list_init_storage(converter->coverages, box->x1, box->x2,
+			       (struct cell *)((char *)cache->ptr + edges + buckets));
+	active_list_reset(converter->active);
+	polygon_init_storage(converter->polygon, ymin, ymax,
+			     cache->ptr,
+			     (struct edge **)((char *)cache->ptr + edges));
+	return true;
+}
+
+/* Returns a cache entry for each of num_tasks, or NULL */
+static struct tor_cache *
+tor_cache_get(int num_tasks)
+{
+	if (num_tasks > tor_cache_count) {
+		struct tor_cache *cache;
+
+		cache = realloc(tor_cache, num_tasks * sizeof(*cache));
+		if (cache == NULL)
+			return NULL;
+
+		memset(cache + tor_cache_count, 0,
+		       (num_tasks - tor_cache_count) * sizeof(*cache));
+		tor_cache = cache;
+		tor_cache_count = num_tasks;
+	}
+
+	return tor_cache;
+}
+
+void precise_trapezoid_cache_fini(void)
+{
+	int n;
+
+	DBG(("%s: releasing %d task caches\n", __FUNCTION__, tor_cache_count));
+	for (n = 0; n < tor_cache_count; n++)
+		free(tor_cache[n].ptr);
+	free(tor_cache);
+
+	tor_cache = NULL;
+	tor_cache_count = 0;
+}
+
 static void
 tor_add_trapezoid(struct tor *tor, const xTrapezoid *t, int dx, int dy)
 {
@@ -1108,74 +977,13 @@ tor_blt(struct sna *sna,
 	struct tor *converter,
 	struct sna_composite_spans_op *op,
 	pixman_region16_t *clip,
-	void (*span)(struct sna *sna,
-		     struct sna_composite_spans_op *op,
-		     pixman_region16_t *clip,
-		     const BoxRec *box,
-		     int coverage),
+	span_func_t span,
 	int y, int height,
 	int unbounded)
 {
-	struct cell_list *cells = converter->coverages;
-	struct cell *cell;
-	BoxRec box;
-	int cover;
-
-	box.y1 = y + converter->extents.y1;
-	box.y2 = box.y1 + height;
-	assert(box.y2 <= converter->extents.y2);
-	box.x1 = converter->extents.x1;
-
-	/* Form the spans from the coverages and areas. */
-	cover = cells->head.covered_height*SAMPLES_X*2;
-	assert(cover >= 0);
-	for (cell = cells->head.next; cell != &cells->tail; cell = cell->next) {
-		int x = cell->x;
-
-		assert(x >= converter->extents.x1);
-		assert(x < converter->extents.x2);
-		__DBG(("%s: cell=(%d, %d, %d), cover=%d\n", __FUNCTION__,
-		       cell->x, cell->covered_height, cell->uncovered_area,
-		       cover));
-
-		if (cell->covered_height || cell->uncovered_area) {
-			box.x2 = x;
-			if (box.x2 > box.x1 && (unbounded || cover)) {
-				__DBG(("%s: end span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
-				       box.x1, box.y1,
-				       box.x2 - box.x1,
-				       box.y2 - box.y1,
-				       cover));
-				span(sna, op, clip, &box, cover);
-			}
-			box.x1 = box.x2;
-			cover += cell->covered_height*SAMPLES_X*2;
-		}
-
-		if (cell->uncovered_area) {
-			int area = cover - cell->uncovered_area;
-			box.x2 = x + 1;
-			if (unbounded || area) {
-				__DBG(("%s: new span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
-				       box.x1, box.y1,
-				       box.x2 - box.x1,
-				       box.y2 - box.y1,
-				       area));
-				span(sna, op, clip, &box, area);
-			}
-			box.x1 = box.x2;
-		}
-	}
-
-	box.x2 = converter->extents.x2;
-	if (box.x2 > box.x1 && (unbounded || cover)) {
-		__DBG(("%s: span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
-		       box.x1, box.y1,
-		       box.x2 - box.x1,
-		       box.y2 - box.y1,
-		       cover));
-		span(sna, op, clip, &box, cover);
-	}
+	assert(converter->extents.y1 + y + height <= converter->extents.y2);
+	cell_list_blt(converter->coverages, sna, op, clip, span,
+		      converter->extents.y1 + y, height, unbounded);
 }
 
 flatten static void
@@ -1269,7 +1077,7 @@ tor_render(struct sna *sna,
 }
 
 static void
-inplace_row(struct active_list *active, uint8_t *row, int width)
+inplace_row(struct active_list *active, uint8_t *deltas, int width)
 {
 	struct edge *left = active->head.next;
 
@@ -1317,72 +1125,16 @@ inplace_row(struct active_list *active, uint8_t *row, int width)
 			rfx = 0;
 		} else
 			SAMPLES_X_TO_INT_FRAC(right->cell, rix, rfx);
-		if (lix == rix) {
-			if (rfx != lfx) {
-				assert(lix < width);
-				row[lix] += (rfx-lfx) * SAMPLES_Y;
-			}
-		} else {
-			assert(lix < width);
-			if (lfx == 0)
-				row[lix] = 0xff;
-			else
-				row[lix] += 255 - lfx * SAMPLES_Y;
-
-			assert(rix <= width);
-			if (rfx) {
-				assert(rix < width);
-				row[rix] += rfx * SAMPLES_Y;
-			}
-
-			if (rix > ++lix) {
-				uint8_t *r = row + lix;
-				rix -= lix;
-#if 0
-				if (rix == 1)
-					*row = 0xff;
-				else
-					memset(row, 0xff, rix);
-#else
-				if ((uintptr_t)r & 1 && rix) {
-					*r++ = 0xff;
-					rix--;
-				}
-				if ((uintptr_t)r & 2 && rix >= 2) {
-					*(uint16_t *)r = 0xffff;
-					r += 2;
-					rix -= 2;
-				}
-				if ((uintptr_t)r & 4 && rix >= 4) {
-					*(uint32_t *)r = 0xffffffff;
-					r += 4;
-					rix -= 4;
-				}
-				while (rix >= 8) {
-					*(uint64_t *)r = 0xffffffffffffffff;
-					r += 8;
-					rix -= 8;
-				}
-				if (rix & 4) {
-					*(uint32_t *)r = 0xffffffff;
-					r += 4;
-				}
-				if (rix & 2) {
-					*(uint16_t *)r = 0xffff;
-					r += 2;
-				}
-				if (rix & 1)
-					*r = 0xff;
-#endif
-			}
-		}
+		assert(lix < width || lix == rix);
+		assert(rix <= width);
+		inplace_deltas_add(deltas, lix, lfx, rix, rfx, SAMPLES_Y);
 
 		left = right->next;
 	}
 }
 
 inline static void
-inplace_subrow(struct active_list *active, int8_t *row, int width)
+inplace_subrow(struct active_list *active, uint8_t *deltas, int width)
 {
 	struct edge *edge = active->head.next;
 	int prev_x = INT_MIN;
@@ -1492,24 +1244,9 @@ inplace_subrow(struct active_list *active, int8_t *row, int width)
 
 		__DBG(("%s: left=%d.%d, right=%d.%d\n", __FUNCTION__,
 		       lix, lfx, rix, rfx));
-		if (lix == rix) {
-			if (rfx != lfx) {
-				assert(lix < width);
-				row[lix] += (rfx-lfx);
-			}
-		} else {
-			assert(lix < width);
-			row[lix] += SAMPLES_X - lfx;
-
-			assert(rix <= width);
-			if (rfx) {
-				assert(rix < width);
-				row[rix] += rfx;
-			}
-
-			while (++lix < rix)
-				row[lix] += SAMPLES_X;
-		}
+		assert(lix < width || lix == rix);
+		assert(rix <= width);
+		inplace_deltas_add(deltas, lix, lfx, rix, rfx, 1);
 	}
 }
 
@@ -1517,6 +1254,7 @@ flatten static void
 tor_inplace(struct tor *converter, PixmapPtr scratch)
 {
 	uint8_t buf[TOR_INPLACE_SIZE];
+	uint8_t deltas[TOR_INPLACE_SIZE + 2];
 	int i, j, h = converter->extents.y2 - converter->extents.y1;
 	struct polygon *polygon = converter->polygon;
 	struct active_list *active = converter->active;
@@ -1528,8 +1266,10 @@ tor_inplace(struct tor *converter, PixmapPtr scratch)
 	__DBG(("%s: buf?=%d\n", __FUNCTION__, buf != NULL));
 	assert(converter->extents.x1 == 0);
 	assert(scratch->drawable.depth == 8);
+	assert(width <= TOR_INPLACE_SIZE);
 
 	row += converter->extents.y1 * stride;
+	memset(deltas, 0, width + 2);
 
 	/* Render each pixel row. */
 	for (i = 0; i < h; i = j) {
@@ -1559,8 +1299,8 @@ tor_inplace(struct tor *converter, PixmapPtr scratch)
 		       __FUNCTION__, i, do_full_step,
 		       polygon->y_buckets[i] != NULL));
 		if (do_full_step) {
-			memset(ptr, 0, width);
-			inplace_row(active, ptr, width);
+			inplace_row(active, deltas, width);
+			inplace_deltas_sum(deltas, ptr, width);
 			if (row != ptr)
 				memcpy(row, ptr, width);
 
@@ -1582,15 +1322,15 @@ tor_inplace(struct tor *converter, PixmapPtr scratch)
 			fill_buckets(active, polygon->y_buckets[i], (i+converter->extents.y1)*SAMPLES_Y, buckets);
 
 			/* Subsample this row. */
-			memset(ptr, 0, width);
 			for (suby = 0; suby < SAMPLES_Y; suby++) {
 				if (buckets[suby]) {
 					merge_edges(active, buckets[suby]);
 					buckets[suby] = NULL;
 				}
 
-				inplace_subrow(active, ptr, width);
+				inplace_subrow(active, deltas, width);
 			}
+			inplace_deltas_sum(deltas, ptr, width);
 			if (row != ptr)
 				memcpy(row, ptr, width);
 		}
@@ -1634,6 +1374,8 @@ struct span_thread {
 	struct sna *sna;
 	const struct sna_composite_spans_op *op;
 	const xTrapezoid *traps;
+	const int *index; /* traps[index[0..ntrap]], or all of traps if NULL */
+	struct tor_cache *cache;
 	RegionPtr clip;
 	span_func_t span;
 	BoxRec extents;
@@ -1766,17 +1508,20 @@ span_thread(void *arg)
 	struct span_thread *thread = arg;
 	struct span_thread_boxes boxes;
 	struct tor tor;
-	const xTrapezoid *t;
 	int n, y1, y2;
 
-	if (!tor_init(&tor, &thread->extents, 2*thread->ntrap))
+	if (!tor_init_cached(&tor, &thread->extents, 2*thread->ntrap,
+			     thread->cache))
 		return;
 
 	span_thread_boxes_init(&boxes, thread->op, thread->clip);
 
 	y1 = thread->extents.y1 - thread->draw_y;
 	y2 = thread->extents.y2 - thread->draw_y;
-	for (n = thread->ntrap, t = thread->traps; n--; t++) {
+	for (n = 0; n < thread->ntrap; n++) {
+		const xTrapezoid *t =
+			&thread->traps[thread->index ? thread->index[n] : n];
+
 		if (pixman_fixed_integer_floor(t->top) >= y2 ||
 		    pixman_fixed_integer_ceil(t->bottom) <= y1)
 			continue;
@@ -1906,7 +1651,7 @@ precise_trapezoid_span_converter(struct sna *sna,
 	    (flags & COMPOSITE_SPANS_RECTILINEAR) == 0 &&
 	    tmp.thread_boxes &&
 	    thread_choose_span(&tmp, dst, maskFormat, &clip))
-		num_threads = sna_use_threads(clip.extents.x2-clip.extents.x1,
+		num_threads = sna_use_threads(THREAD_SPANS, clip.extents.x2-clip.extents.x1,
 					      clip.extents.y2-clip.extents.y1,
 					      8);
 	DBG(("%s: using %d threads\n", __FUNCTION__, num_threads));
@@ -1930,17 +1675,33 @@ precise_trapezoid_span_converter(struct sna *sna,
 
 		tor_fini(&tor);
 	} else {
-		struct span_thread threads[num_threads];
-		int y, h;
+		int num_tasks = sna_threads_tasks(num_threads, clip.extents.y2 - clip.extents.y1);
+		struct span_thread threads[num_tasks];
+		struct trapezoid_bands bands;
+		struct tor_cache *cache;
 
 		DBG(("%s: using %d threads for span compositing %dx%d\n",
 		     __FUNCTION__, num_threads,
 		     clip.extents.x2 - clip.extents.x1,
 		     clip.extents.y2 - clip.extents.y1));
 
+		/* Balance the bands by the edges crossing them, not by height */
+		if (trapezoid_bands_init(&bands, ntrap,
+					 clip.extents.y1, clip.extents.y2)) {
+			for (n = 0; n < ntrap; n++)
+				trapezoid_bands_add(&bands, n,
+						    pixman_fixed_integer_floor(traps[n].top) + dst->pDrawable->y,
+						    pixman_fixed_integer_ceil(traps[n].bottom) + dst->pDrawable->y,
+						    2);
+			trapezoid_bands_split(&bands, num_tasks);
+		}
+		cache = tor_cache_get(bands.num_bands);
+
 		threads[0].sna = sna;
 		threads[0].op = &tmp;
 		threads[0].traps = traps;
+		threads[0].index = NULL;
+		threads[0].cache = NULL;
 		threads[0].ntrap = ntrap;
 		threads[0].extents = clip.extents;
 		threads[0].clip = &clip;
@@ -1950,24 +1711,23 @@ precise_trapezoid_span_converter(struct sna *sna,
 		threads[0].unbounded = !was_clear && maskFormat && !operator_is_bounded(op);
 		threads[0].span = thread_choose_span(&tmp, dst, maskFormat, &clip);
 
-		y = clip.extents.y1;
-		h = clip.extents.y2 - clip.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= clip.extents.y2 - clip.extents.y1;
-
-		for (n = 1; n < num_threads; n++) {
+		/* Without the bands, the main thread does all the work */
+		for (n = bands.num_bands; n--; ) {
 			threads[n] = threads[0];
-			threads[n].extents.y1 = y;
-			threads[n].extents.y2 = y += h;
-
-			sna_threads_run(n, span_thread, &threads[n]);
+			threads[n].extents.y1 = bands.y[n];
+			threads[n].extents.y2 = bands.y[n + 1];
+			threads[n].index = bands.index + bands.first[n];
+			threads[n].ntrap = trapezoid_bands_count(&bands, n);
+			threads[n].cache = cache ? &cache[n] : NULL;
+
+			if (n)
+				sna_threads_run(n, span_thread, &threads[n]);
 		}
 
-		assert(y < threads[0].extents.y2);
-		threads[0].extents.y1 = y;
 		span_thread(&threads[0]);
 
 		sna_threads_wait();
+		trapezoid_bands_fini(&bands);
 	}
 skip:
 	tmp.done(sna, &tmp);
@@ -2119,7 +1879,7 @@ precise_trapezoid_mask_converter(CARD8 op, PicturePtr src, PicturePtr dst,
 	num_threads = 1;
 	if (!NO_GPU_THREADS &&
 	    (flags & COMPOSITE_SPANS_RECTILINEAR) == 0)
-		num_threads = sna_use_threads(extents.x2 - extents.x1,
+		num_threads = sna_use_threads(THREAD_MASK, extents.x2 - extents.x1,
 					      extents.y2 - extents.y1,
 					      4);
 	if (num_threads == 1) {
@@ -2149,7 +1909,8 @@ precise_trapezoid_mask_converter(CARD8 op, PicturePtr src, PicturePtr dst,
 		}
 		tor_fini(&tor);
 	} else {
-		struct mask_thread threads[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, extents.y2 - extents.y1);
+		struct mask_thread threads[num_tasks];
 		int y, h;
 
 		DBG(("%s: using %d threads for mask compositing %dx%d\n",
@@ -2167,10 +1928,9 @@ precise_trapezoid_mask_converter(CARD8 op, PicturePtr src, PicturePtr dst,
 
 		y = extents.y1;
 		h = extents.y2 - extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= extents.y2 - extents.y1;
+		h = (h + num_tasks - 1) / num_tasks;
 
-		for (n = 1; n < num_threads; n++) {
+		for (n = 1; n < num_tasks; n++) {
 			threads[n] = threads[0];
 			threads[n].extents.y1 = y;
 			threads[n].extents.y2 = y += h;
@@ -2310,7 +2070,6 @@ tor_blt_in(struct sna *sna,
 {
 	struct inplace *in = (struct inplace *)op;
 	uint8_t *ptr = in->ptr;
-	int h, w, i;
 
 	if (coverage == 0 || in->opacity == 0) {
 		_tor_blt_src(in, box, 0);
@@ -2322,14 +2081,9 @@ tor_blt_in(struct sna *sna,
 		return;
 
 	ptr += box->y1 * in->stride + box->x1;
-
-	h = box->y2 - box->y1;
-	w = box->x2 - box->x1;
-	do {
-		for (i = 0; i < w; i++)
-			ptr[i] = mul_8_8(ptr[i], coverage);
-		ptr += in->stride;
-	} while (--h);
+	span_in_a8(ptr, in->stride,
+		   box->x2 - box->x1, box->y2 - box->y1,
+		   coverage);
 }
 
 static void
@@ -2341,7 +2095,7 @@ tor_blt_add(struct sna *sna,
 {
 	struct inplace *in = (struct inplace *)op;
 	uint8_t *ptr = in->ptr;
-	int h, w, v, i;
+	int h, w, v;
 
 	if (coverage == 0)
 		return;
@@ -2359,15 +2113,8 @@ tor_blt_add(struct sna *sna,
 	if ((w | h) == 1) {
 		v = coverage + *ptr;
 		*ptr = v >= 255 ? 255 : v;
-	} else {
-		do {
-			for (i = 0; i < w; i++) {
-				v = coverage + ptr[i];
-				ptr[i] = v >= 255 ? 255 : v;
-			}
-			ptr += in->stride;
-		} while (--h);
-	}
+	} else
+		span_add_a8(ptr, in->stride, w, h, coverage);
 }
 
 static void
@@ -2414,13 +2161,9 @@ tor_blt_lerp32(struct sna *sna,
 				*ptr = lerp8x4(in->color, coverage, *ptr);
 				ptr += stride;
 			} while (--h);
-		} else{
-			do {
-				for (i = 0; i < w; i++)
-					ptr[i] = lerp8x4(in->color, coverage, ptr[i]);
-				ptr += stride;
-			} while (--h);
-		}
+		} else
+			span_lerp_x8r8g8b8(ptr, in->stride, w, h,
+					   in->color, coverage);
 	}
 }
 
@@ -2668,7 +2411,7 @@ trapezoid_span_inplace__x8r8g8b8(CARD8 op,
 	if (!NO_GPU_THREADS &&
 	    (flags & COMPOSITE_SPANS_RECTILINEAR) == 0 &&
 	    (lerp || is_solid))
-		num_threads = sna_use_threads(4*(region.extents.x2 - region.extents.x1),
+		num_threads = sna_use_threads(THREAD_INPLACE, 4*(region.extents.x2 - region.extents.x1),
 					      region.extents.y2 - region.extents.y1,
 					      4);
 
@@ -2769,7 +2512,8 @@ trapezoid_span_inplace__x8r8g8b8(CARD8 op,
 
 		tor_fini(&tor);
 	} else {
-		struct inplace_x8r8g8b8_thread threads[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, region.extents.y2 - region.extents.y1);
+		struct inplace_x8r8g8b8_thread threads[num_tasks];
 		int y, h;
 
 		DBG(("%s: using %d threads for inplace compositing %dx%d\n",
@@ -2793,11 +2537,10 @@ trapezoid_span_inplace__x8r8g8b8(CARD8 op,
 
 		y = region.extents.y1;
 		h = region.extents.y2 - region.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= region.extents.y2 - region.extents.y1;
+		h = (h + num_tasks - 1) / num_tasks;
 
 		if (sigtrap_get() == 0) {
-			for (n = 1; n < num_threads; n++) {
+			for (n = 1; n < num_tasks; n++) {
 				threads[n] = threads[0];
 				threads[n].extents.y1 = y;
 				threads[n].extents.y2 = y += h;
@@ -3009,7 +2752,7 @@ precise_trapezoid_span_inplace(struct sna *sna,
 	num_threads = 1;
 	if (!NO_GPU_THREADS &&
 	    (flags & COMPOSITE_SPANS_RECTILINEAR) == 0)
-		num_threads = sna_use_threads(region.extents.x2 - region.extents.x1,
+		num_threads = sna_use_threads(THREAD_INPLACE, region.extents.x2 - region.extents.x1,
 					      region.extents.y2 - region.extents.y1,
 					      4);
 	if (num_threads == 1) {
@@ -3036,7 +2779,8 @@ precise_trapezoid_span_inplace(struct sna *sna,
 
 		tor_fini(&tor);
 	} else {
-		struct inplace_thread threads[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, region.extents.y2 - region.extents.y1);
+		struct inplace_thread threads[num_tasks];
 		int y, h;
 
 		DBG(("%s: using %d threads for inplace compositing %dx%d\n",
@@ -3058,11 +2802,10 @@ precise_trapezoid_span_inplace(struct sna *sna,
 
 		y = region.extents.y1;
 		h = region.extents.y2 - region.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= region.extents.y2 - region.extents.y1;
+		h = (h + num_tasks - 1) / num_tasks;
 
 		if (sigtrap_get() == 0) {
-			for (n = 1; n < num_threads; n++) {
+			for (n = 1; n < num_tasks; n++) {
 				threads[n] = threads[0];
 				threads[n].extents.y1 = y;
 				threads[n].extents.y2 = y += h;
@@ -3153,7 +2896,7 @@ precise_trapezoid_span_fallback(CARD8 op, PicturePtr src, PicturePtr dst,
 	num_threads = 1;
 	if (!NO_GPU_THREADS &&
 	    (flags & COMPOSITE_SPANS_RECTILINEAR) == 0)
-		num_threads = sna_use_threads(extents.x2 - extents.x1,
+		num_threads = sna_use_threads(THREAD_MASK, extents.x2 - extents.x1,
 					      extents.y2 - extents.y1,
 					      4);
 	if (num_threads == 1) {
@@ -3183,7 +2926,8 @@ precise_trapezoid_span_fallback(CARD8 op, PicturePtr src, PicturePtr dst,
 		}
 		tor_fini(&tor);
 	} else {
-		struct mask_thread threads[num_threads];
+		int num_tasks = sna_threads_tasks(num_threads, extents.y2 - extents.y1);
+		struct mask_thread threads[num_tasks];
 		int y, h;
 
 		DBG(("%s: using %d threads for mask compositing %dx%d\n",
@@ -3201,10 +2945,9 @@ precise_trapezoid_span_fallback(CARD8 op, PicturePtr src, PicturePtr dst,
 
 		y = extents.y1;
 		h = extents.y2 - extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= extents.y2 - extents.y1;
+		h = (h + num_tasks - 1) / num_tasks;
 
-		for (n = 1; n < num_threads; n++) {
+		for (n = 1; n < num_tasks; n++) {
 			threads[n] = threads[0];
 			threads[n].extents.y1 = y;
 			threads[n].extents.y2 = y += h;
@@ -3252,51 +2995,69 @@ struct tristrip_thread {
 	struct sna *sna;
 	const struct sna_composite_spans_op *op;
 	const xPointFixed *points;
+	const int *index; /* lines[index[0..nline]], or all lines if NULL */
+	struct tor_cache *cache;
 	RegionPtr clip;
 	span_func_t span;
 	BoxRec extents;
 	int dx, dy, draw_y;
-	int count;
+	int count, nline;
 	bool unbounded;
 };
 
+/* The strip is outlined by count lines, added in this order: from the
+ * second point to the first, then along each side in turn as every
+ * point is reached, and finally across the two last points.
+ */
+static void
+tristrip_line(const xPointFixed *points, int count, int line,
+	      const xPointFixed **p1, const xPointFixed **p2)
+{
+	int last = count - 1;
+
+	assert(line >= 0 && line < count);
+	if (line == 0) {
+		*p1 = &points[1];
+		*p2 = &points[0];
+	} else if (line < last) {
+		int n = line + 1;
+
+		if (n & 1) {
+			*p1 = &points[n];
+			*p2 = &points[n - 2];
+		} else {
+			*p1 = &points[n - 2];
+			*p2 = &points[n];
+		}
+	} else {
+		*p1 = &points[last & 1 ? last - 1 : last];
+		*p2 = &points[last & 1 ? last : last - 1];
+	}
+}
+
 static void
 tristrip_thread(void *arg)
 {
 	struct tristrip_thread *thread = arg;
 	struct span_thread_boxes boxes;
 	struct tor tor;
-	int n, cw, ccw;
+	int n;
 
-	if (!tor_init(&tor, &thread->extents, 2*thread->count))
+	if (!tor_init_cached(&tor, &thread->extents, thread->nline,
+			     thread->cache))
 		return;
 
 	span_thread_boxes_init(&boxes, thread->op, thread->clip);
 
-	cw = 0; ccw = 1;
-	polygon_add_line(tor.polygon,
-			 &thread->points[ccw], &thread->points[cw],
-			 thread->dx, thread->dy);
-	n = 2;
-	do {
-		polygon_add_line(tor.polygon,
-				 &thread->points[cw], &thread->points[n],
-				 thread->dx, thread->dy);
-		cw = n;
-		if (++n == thread->count)
-			break;
+	for (n = 0; n < thread->nline; n++) {
+		const xPointFixed *p1, *p2;
 
-		polygon_add_line(tor.polygon,
-				 &thread->points[n], &thread->points[ccw],
-				 thread->dx, thread->dy);
-		ccw = n;
-		if (++n == thread->count)
-			break;
-	} while (1);
-	polygon_add_line(tor.polygon,
-			 &thread->points[cw], &thread->points[ccw],
-			 thread->dx, thread->dy);
-	assert(tor.polygon->num_edges <= 2*thread->count);
+		tristrip_line(thread->points, thread->count,
+			      thread->index ? thread->index[n] : n,
+			      &p1, &p2);
+		polygon_add_line(tor.polygon, p1, p2, thread->dx, thread->dy);
+	}
+	assert(tor.polygon->num_edges <= thread->nline);
 
 	tor_render(thread->sna, &tor,
 		   (struct sna_composite_spans_op *)&boxes, thread->clip,
@@ -3406,7 +3167,7 @@ precise_tristrip_span_converter(struct sna *sna,
 	if (!NO_GPU_THREADS &&
 	    tmp.thread_boxes &&
 	    thread_choose_span(&tmp, dst, maskFormat, &clip))
-		num_threads = sna_use_threads(extents.x2 - extents.x1,
+		num_threads = sna_use_threads(THREAD_SPANS, extents.x2 - extents.x1,
 					      extents.y2 - extents.y1,
 					      16);
 	if (num_threads == 1) {
@@ -3447,18 +3208,39 @@ precise_tristrip_span_converter(struct sna *sna,
 
 		tor_fini(&tor);
 	} else {
-		struct tristrip_thread threads[num_threads];
-		int y, h, n;
+		int num_tasks = sna_threads_tasks(num_threads, extents.y2 - extents.y1);
+		struct tristrip_thread threads[num_tasks];
+		struct trapezoid_bands bands;
+		struct tor_cache *cache;
+		int n;
 
 		DBG(("%s: using %d threads for tristrip compositing %dx%d\n",
 		     __FUNCTION__, num_threads,
 		     clip.extents.x2 - clip.extents.x1,
 		     clip.extents.y2 - clip.extents.y1));
 
+		if (trapezoid_bands_init(&bands, count,
+					 clip.extents.y1, clip.extents.y2)) {
+			for (n = 0; n < count; n++) {
+				const xPointFixed *p1, *p2;
+
+				tristrip_line(points, count, n, &p1, &p2);
+				trapezoid_bands_add(&bands, n,
+						    pixman_fixed_integer_floor(MIN(p1->y, p2->y)) + dst->pDrawable->y,
+						    pixman_fixed_integer_ceil(MAX(p1->y, p2->y)) + dst->pDrawable->y,
+						    1);
+			}
+			trapezoid_bands_split(&bands, num_tasks);
+		}
+		cache = tor_cache_get(bands.num_bands);
+
 		threads[0].sna = sna;
 		threads[0].op = &tmp;
 		threads[0].points = points;
 		threads[0].count = count;
+		threads[0].index = NULL;
+		threads[0].cache = NULL;
+		threads[0].nline = count;
 		threads[0].extents = clip.extents;
 		threads[0].clip = &clip;
 		threads[0].dx = dx;
@@ -3467,24 +3249,22 @@ precise_tristrip_span_converter(struct sna *sna,
 		threads[0].unbounded = !was_clear && maskFormat && !operator_is_bounded(op);
 		threads[0].span = thread_choose_span(&tmp, dst, maskFormat, &clip);
 
-		y = clip.extents.y1;
-		h = clip.extents.y2 - clip.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= clip.extents.y2 - clip.extents.y1;
-
-		for (n = 1; n < num_threads; n++) {
+		for (n = bands.num_bands; n--; ) {
 			threads[n] = threads[0];
-			threads[n].extents.y1 = y;
-			threads[n].extents.y2 = y += h;
-
-			sna_threads_run(n, tristrip_thread, &threads[n]);
+			threads[n].extents.y1 = bands.y[n];
+			threads[n].extents.y2 = bands.y[n + 1];
+			threads[n].index = bands.index + bands.first[n];
+			threads[n].nline = trapezoid_bands_count(&bands, n);
+			threads[n].cache = cache ? &cache[n] : NULL;
+
+			if (n)
+				sna_threads_run(n, tristrip_thread, &threads[n]);
 		}
 
-		assert(y < threads[0].extents.y2);
-		threads[0].extents.y1 = y;
 		tristrip_thread(&threads[0]);
 
 		sna_threads_wait();
+		trapezoid_bands_fini(&bands);
 	}
 skip:
 	tmp.done(sna, &tmp);
@@ -0,0 +1,708 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Microbenchmark for the CPU kernels in blt.c: memcpy_blt, memmove_box,
+ * memcpy_xor, affine_blt and the tiled X/Y converters. Every kernel is
+ * swept over bpp, width and alignment, and the tiled converters,
+ * memcpy_xor and affine_blt over each swizzle mode and every CPU feature
+ * level supported by the host. Output of each accelerated kernel is checked against the
+ * generic C version and the exit status is non-zero on any mismatch.
+ *
+ * Runs without a display or GPU. The sizes, iteration counts and buffer
+ * contents depend only on the command line, and each result is the best
+ * of several repetitions on a pinned cpu, so that runs are comparable
+ * between builds. Bytes per cycle are against the TSC (reference cycles).
+ * Use -c for CSV output.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for sched_getcpu() */
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna-bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static const struct level {
+	unsigned cpu;
+	const char *name;
+} levels[] = {
+	{ 0, "generic" },
+	{ SSE2, "sse2" },
+	{ SSE2 | SSE4_1, "sse4.1" },
+	{ SSE2 | SSE4_1 | AVX2, "avx2" },
+};
+
+static const int all_bpp[] = { 8, 16, 32 };
+static const int all_widths[] = { 8, 31, 128, 1024, 3840 };
+static const int all_aligns[] = { 0, 1, 3 };
+
+static struct options {
+	const char *kernel;
+	const char *level;
+	int bpp, width, align;
+	int reps;
+	uint64_t min_bytes;
+	bool csv;
+	unsigned cpu;
+	int failures;
+} options = {
+	.bpp = -1, .width = -1, .align = -1,
+	.reps = 3,
+	.min_bytes = 4 << 20,
+};
+
+struct op {
+	const char *kernel;
+	const char *level;
+	const char *swizzle;
+	void (*run)(const struct op *op);
+
+	int bpp, width, height, align;
+	int src_width, src_height;
+	const uint8_t *src;
+	uint8_t *dst;
+	int32_t src_stride, dst_stride;
+	memcpy_box_func func;
+	memcpy_xor_box_func xor_func;
+	struct pixman_f_transform t;
+
+	uint64_t bytes; /* written per run */
+};
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static bool selected(const char *kernel, const char *level)
+{
+	if (options.kernel && strstr(kernel, options.kernel) == NULL)
+		return false;
+	if (options.level && strcmp(level, options.level))
+		return false;
+	return true;
+}
+
+static int height_for(int width, int bpp)
+{
+	/* keep each pass around 1MiB, enough to leave the L1/L2 */
+	int height = (1 << 20) / (width * bpp / 8);
+	if (height > 1024)
+		height = 1024;
+	if (height < 8)
+		height = 8;
+	return height;
+}
+
+static void measure(const struct op *op)
+{
+	uint64_t loops, best_ns = -1, best_cycles = -1;
+	double gbps, bpc;
+	int rep, n;
+
+	loops = (options.min_bytes + op->bytes - 1) / op->bytes;
+
+	op->run(op); /* fault in the pages */
+
+	for (rep = 0; rep < options.reps; rep++) {
+		uint64_t t0, c0, t, c;
+
+		t0 = now();
+		c0 = cycles();
+		for (n = 0; n < loops; n++)
+			op->run(op);
+		c = cycles() - c0;
+		t = now() - t0;
+
+		if (t < best_ns)
+			best_ns = t;
+		if (c < best_cycles)
+			best_cycles = c;
+	}
+
+	gbps = (double)op->bytes * loops / best_ns;
+	bpc = best_cycles ? (double)op->bytes * loops / best_cycles : 0;
+
+	if (options.csv)
+		printf("%s,%s,%s,%d,%d,%d,%d,%llu,%llu,%llu,%llu,%.3f,%.4f\n",
+		       op->kernel, op->level, op->swizzle,
+		       op->bpp, op->width, op->height, op->align,
+		       (unsigned long long)op->bytes,
+		       (unsigned long long)loops,
+		       (unsigned long long)best_ns,
+		       (unsigned long long)best_cycles,
+		       gbps, bpc);
+	else
+		printf("%-16s %-8s %-8s %2dbpp %4dx%-4d +%d: %7.2f GB/s, %6.3f bytes/cycle\n",
+		       op->kernel, op->level, op->swizzle,
+		       op->bpp, op->width, op->height, op->align,
+		       gbps, bpc);
+	fflush(stdout);
+}
+
+static void run_memcpy_blt(const struct op *op)
+{
+	memcpy_blt(op->src, op->dst, op->bpp,
+		   op->src_stride, op->dst_stride,
+		   op->align, 0, op->align, 0,
+		   op->width, op->height);
+}
+
+static void run_memmove_box(const struct op *op)
+{
+	BoxRec box;
+
+	/* scroll up by a couple of rows within the same pixmap */
+	box.x1 = op->align;
+	box.y1 = 0;
+	box.x2 = op->align + op->width;
+	box.y2 = op->height;
+
+	memmove_box(op->dst + 2*op->dst_stride, op->dst, op->bpp,
+		    op->dst_stride, &box, 0, 2);
+}
+
+static void run_memcpy_xor(const struct op *op)
+{
+	memcpy_xor(op->src, op->dst, op->bpp,
+		   op->src_stride, op->dst_stride,
+		   op->align, 0, op->align, 0,
+		   op->width, op->height,
+		   0xffffffff, op->bpp == 32 ? 0xff000000 : 0);
+}
+
+static void run_xor_to_tiled_x(const struct op *op)
+{
+	op->xor_func(op->src, op->dst, op->bpp,
+		     op->src_stride, op->dst_stride,
+		     op->align, 0, op->align, 0,
+		     op->width, op->height,
+		     0xffffffff, 0xff000000);
+}
+
+static void run_affine_blt(const struct op *op)
+{
+	affine_blt(op->src, op->dst, op->bpp,
+		   0, 0, op->src_width, op->src_height, op->src_stride,
+		   op->align, 0, op->width, op->height, op->dst_stride,
+		   &op->t);
+}
+
+static void run_tiled(const struct op *op)
+{
+	op->func(op->src, op->dst, op->bpp,
+		 op->src_stride, op->dst_stride,
+		 op->align, 0, op->align, 0,
+		 op->width, op->height);
+}
+
+static void bench_linear(int bpp, int width, int align)
+{
+	struct op op;
+	size_t len;
+
+	memset(&op, 0, sizeof(op));
+	op.level = "-";
+	op.swizzle = "-";
+	op.bpp = bpp;
+	op.width = width;
+	op.height = height_for(width, bpp);
+	op.align = align;
+	op.src_stride = op.dst_stride = ALIGN((width + align) * bpp / 8, 64);
+	op.bytes = (uint64_t)width * bpp / 8 * op.height;
+
+	len = op.dst_stride * (op.height + 2);
+	op.src = alloc(len, 1);
+	op.dst = alloc(len, 2);
+
+	op.kernel = "memcpy_blt";
+	op.run = run_memcpy_blt;
+	if (selected(op.kernel, op.level))
+		measure(&op);
+
+	op.kernel = "memmove_box";
+	op.run = run_memmove_box;
+	if (selected(op.kernel, op.level))
+		measure(&op);
+
+	free((void *)op.src);
+	free(op.dst);
+}
+
+static void compare(const struct op *op, const uint8_t *expected, size_t len)
+{
+	if (memcmp(expected, op->dst, len)) {
+		fprintf(stderr, "FAIL: %s %s swizzle %s, %dbpp %dx%d +%d does not match the generic kernel\n",
+			op->kernel, op->level, op->swizzle,
+			op->bpp, op->width, op->height, op->align);
+		options.failures++;
+	}
+}
+
+static void bench_xor(const struct level *l, int bpp, int width, int align)
+{
+	struct op op;
+	size_t len;
+
+	/* there are only generic, SSE2 and AVX2 kernels */
+	if (l->cpu & SSE4_1 && (l->cpu & AVX2) == 0)
+		return;
+
+	memset(&op, 0, sizeof(op));
+	op.kernel = "memcpy_xor";
+	op.level = l->name;
+	op.swizzle = "-";
+	if (!selected(op.kernel, op.level))
+		return;
+
+	op.run = run_memcpy_xor;
+	op.bpp = bpp;
+	op.width = width;
+	op.height = height_for(width, bpp);
+	op.align = align;
+	op.src_stride = op.dst_stride = ALIGN((width + align) * bpp / 8, 64);
+	op.bytes = (uint64_t)width * bpp / 8 * op.height;
+
+	len = op.dst_stride * op.height;
+	op.src = alloc(len, 1);
+	op.dst = alloc(len, 2);
+
+	choose_memcpy_xor(l->cpu);
+	measure(&op);
+
+	if (l->cpu) {
+		struct op ref = op;
+
+		ref.dst = alloc(len, 2);
+		choose_memcpy_xor(0);
+		run_memcpy_xor(&ref);
+		compare(&op, ref.dst, len);
+		free(ref.dst);
+	}
+
+	free((void *)op.src);
+	free(op.dst);
+}
+
+static void bench_xor_tiled(const struct swizzle *s, const struct level *l,
+			    int width, int align)
+{
+	struct kgem kgem;
+	struct op op;
+	size_t len;
+
+	if (l->cpu & SSE4_1 && (l->cpu & AVX2) == 0)
+		return;
+
+	memset(&op, 0, sizeof(op));
+	op.kernel = "xor_to_tiled_x";
+	op.level = l->name;
+	op.swizzle = s->name;
+	if (!selected(op.kernel, op.level))
+		return;
+
+	memset(&kgem, 0, sizeof(kgem));
+	kgem.gen = 0100;
+	choose_memcpy_tiled_x(&kgem, s->mode, l->cpu);
+	op.xor_func = kgem.memcpy_xor_to_tiled_x;
+	if (op.xor_func == NULL)
+		return;
+
+	op.run = run_xor_to_tiled_x;
+	op.bpp = 32;
+	op.width = width;
+	op.height = height_for(width, 32);
+	op.align = align;
+	op.bytes = (uint64_t)width * 4 * op.height;
+	op.src_stride = ALIGN((width + align) * 4, 64);
+	op.dst_stride = ALIGN((width + align) * 4, 512);
+
+	len = op.dst_stride * ALIGN(op.height, 8);
+	op.src = alloc(op.src_stride * op.height, 1);
+	op.dst = alloc(len, 2);
+
+	choose_memcpy_xor(l->cpu);
+	measure(&op);
+
+	if (l->cpu) {
+		struct op ref = op;
+
+		ref.dst = alloc(len, 2);
+		choose_memcpy_xor(0);
+		run_xor_to_tiled_x(&ref);
+		compare(&op, ref.dst, len);
+		free(ref.dst);
+	}
+
+	free((void *)op.src);
+	free(op.dst);
+}
+
+static void bench_affine(bool rotate, const struct level *l, int width, int align)
+{
+	struct op op;
+	uint8_t *expected;
+	size_t len;
+
+	/* there is only a generic and an AVX2 kernel */
+	if (l->cpu && (l->cpu & AVX2) == 0)
+		return;
+
+	memset(&op, 0, sizeof(op));
+	op.kernel = rotate ? "affine_rotate" : "affine_scale";
+	op.level = l->name;
+	op.swizzle = "-";
+	if (!selected(op.kernel, op.level))
+		return;
+
+	op.run = run_affine_blt;
+	op.bpp = 32;
+	op.width = width;
+	op.height = height_for(width, 32);
+	op.align = align;
+	op.bytes = (uint64_t)width * 4 * op.height;
+
+	op.t.m[2][2] = 1.;
+	if (rotate) {
+		/* 30 degrees about the centre, a quarter of the samples fall outside */
+		op.src_width = width;
+		op.src_height = op.height;
+		op.t.m[0][0] = op.t.m[1][1] = cos(M_PI/6);
+		op.t.m[0][1] = -sin(M_PI/6);
+		op.t.m[1][0] = sin(M_PI/6);
+		op.t.m[0][2] = width/2. - op.t.m[0][0]*width/2. - op.t.m[0][1]*op.height/2.;
+		op.t.m[1][2] = op.height/2. - op.t.m[1][0]*width/2. - op.t.m[1][1]*op.height/2.;
+	} else {
+		/* 3:2 downscale, as for a video thumbnail */
+		op.src_width = width * 3 / 2 + 1;
+		op.src_height = op.height * 3 / 2 + 1;
+		op.t.m[0][0] = op.t.m[1][1] = 1.5;
+	}
+
+	op.src_stride = ALIGN(op.src_width * 4, 64);
+	op.dst_stride = ALIGN((width + align) * 4, 64);
+	op.src = alloc(op.src_stride * op.src_height, 1);
+
+	len = op.dst_stride * op.height;
+	op.dst = alloc(len, 2);
+
+	choose_affine_blt(l->cpu);
+	measure(&op);
+
+	if (l->cpu) {
+		struct op ref = op;
+
+		expected = alloc(len, 2);
+		ref.dst = expected;
+		choose_affine_blt(0);
+		run_affine_blt(&ref);
+
+		if (memcmp(expected, op.dst, len)) {
+			fprintf(stderr, "FAIL: %s %s, %dx%d +%d does not match the generic kernel\n",
+				op.kernel, op.level, op.width, op.height, op.align);
+			options.failures++;
+		}
+		free(expected);
+	}
+
+	free((void *)op.src);
+	free(op.dst);
+}
+
+enum dir { TO, FROM, BETWEEN };
+
+static memcpy_box_func choose(int tiling, enum dir dir,
+			      const struct swizzle *s, const struct level *l)
+{
+	struct kgem kgem;
+
+	memset(&kgem, 0, sizeof(kgem));
+	kgem.gen = 0100;
+
+	if (tiling == I915_TILING_X) {
+		choose_memcpy_tiled_x(&kgem, s->mode, l->cpu);
+		switch (dir) {
+		case TO: return kgem.memcpy_to_tiled_x;
+		case FROM: return kgem.memcpy_from_tiled_x;
+		case BETWEEN: return kgem.memcpy_between_tiled_x;
+		}
+	} else {
+		choose_memcpy_tiled_y(&kgem, s->mode, l->cpu);
+		switch (dir) {
+		case TO: return kgem.memcpy_to_tiled_y;
+		case FROM: return kgem.memcpy_from_tiled_y;
+		case BETWEEN: return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static void check(const struct op *op, memcpy_box_func ref,
+		  const uint8_t *expected_init, size_t len)
+{
+	uint8_t *expected;
+	struct op tmp;
+
+	expected = alloc(len, 0);
+	memcpy(expected, expected_init, len);
+
+	tmp = *op;
+	tmp.func = ref;
+	tmp.dst = expected;
+	run_tiled(&tmp);
+
+	compare(op, expected, len);
+
+	free(expected);
+}
+
+static void bench_tiled(int tiling, enum dir dir,
+			const struct swizzle *s, const struct level *l,
+			int bpp, int width, int align)
+{
+	static const char *names[2][3] = {
+		{ "to_tiled_x", "from_tiled_x", "between_tiled_x" },
+		{ "to_tiled_y", "from_tiled_y", NULL },
+	};
+	const int tile_height = tiling == I915_TILING_X ? 8 : 32;
+	int32_t linear_stride, tiled_stride;
+	size_t src_len, dst_len;
+	uint8_t *initial;
+	struct op op;
+
+	memset(&op, 0, sizeof(op));
+	op.kernel = names[tiling == I915_TILING_Y][dir];
+	if (op.kernel == NULL)
+		return;
+
+	op.level = l->name;
+	op.swizzle = s->name;
+	if (!selected(op.kernel, op.level))
+		return;
+
+	op.func = choose(tiling, dir, s, l);
+	if (op.func == NULL)
+		return;
+
+	op.run = run_tiled;
+	op.bpp = bpp;
+	op.width = width;
+	op.height = height_for(width, bpp);
+	op.align = align;
+	op.bytes = (uint64_t)width * bpp / 8 * op.height;
+
+	linear_stride = ALIGN((width + align) * bpp / 8, 64);
+	tiled_stride = ALIGN((width + align) * bpp / 8, 512);
+	op.src_stride = dir == TO ? linear_stride : tiled_stride;
+	op.dst_stride = dir == FROM ? linear_stride : tiled_stride;
+
+	src_len = op.src_stride * ALIGN(op.height, tile_height);
+	dst_len = op.dst_stride * ALIGN(op.height, tile_height);
+	op.src = alloc(src_len, 1);
+	op.dst = alloc(dst_len, 2);
+	initial = alloc(dst_len, 2);
+
+	measure(&op);
+	if (l->cpu)
+		check(&op, choose(tiling, dir, s, &levels[0]), initial, dst_len);
+
+	free(initial);
+	free((void *)op.src);
+	free(op.dst);
+}
+
+struct sweep {
+	const int *values;
+	unsigned count;
+};
+
+static void sweep_init(struct sweep *sw, const int *option,
+		       const int *values, unsigned count)
+{
+	if (*option != -1) {
+		sw->values = option;
+		sw->count = 1;
+	} else {
+		sw->values = values;
+		sw->count = count;
+	}
+}
+
+static void run(void)
+{
+	static const int tilings[] = { I915_TILING_X, I915_TILING_Y };
+	struct sweep bpp, width, align;
+	unsigned b, w, a, t, s, l;
+	int d;
+
+	sweep_init(&bpp, &options.bpp, all_bpp, ARRAY_SIZE(all_bpp));
+	sweep_init(&width, &options.width, all_widths, ARRAY_SIZE(all_widths));
+	sweep_init(&align, &options.align, all_aligns, ARRAY_SIZE(all_aligns));
+
+	for (b = 0; b < bpp.count; b++)
+		for (w = 0; w < width.count; w++)
+			for (a = 0; a < align.count; a++)
+				bench_linear(bpp.values[b], width.values[w], align.values[a]);
+
+	for (l = 0; l < ARRAY_SIZE(levels); l++) {
+		if ((levels[l].cpu & options.cpu) != levels[l].cpu)
+			continue;
+
+		for (b = 0; b < bpp.count; b++)
+			for (w = 0; w < width.count; w++)
+				for (a = 0; a < align.count; a++)
+					bench_xor(&levels[l], bpp.values[b],
+						  width.values[w], align.values[a]);
+	}
+
+	/* affine_blt() only handles 32bpp */
+	if (options.bpp == -1 || options.bpp == 32)
+		for (d = 0; d < 2; d++)
+			for (l = 0; l < ARRAY_SIZE(levels); l++) {
+				if ((levels[l].cpu & options.cpu) != levels[l].cpu)
+					continue;
+
+				for (w = 0; w < width.count; w++)
+					for (a = 0; a < align.count; a++)
+						bench_affine(d, &levels[l],
+							     width.values[w], align.values[a]);
+			}
+
+	for (t = 0; t < ARRAY_SIZE(tilings); t++)
+		for (d = TO; d <= BETWEEN; d++)
+			for (s = 0; s < ARRAY_SIZE(swizzles); s++)
+				for (l = 0; l < ARRAY_SIZE(levels); l++) {
+					if ((levels[l].cpu & options.cpu) != levels[l].cpu)
+						continue;
+
+					for (b = 0; b < bpp.count; b++)
+						for (w = 0; w < width.count; w++)
+							for (a = 0; a < align.count; a++)
+								bench_tiled(tilings[t], d,
+									    &swizzles[s], &levels[l],
+									    bpp.values[b], width.values[w], align.values[a]);
+				}
+
+	/* memcpy_xor_to_tiled_x() only handles 32bpp */
+	if (options.bpp == -1 || options.bpp == 32)
+		for (s = 0; s < ARRAY_SIZE(swizzles); s++)
+			for (l = 0; l < ARRAY_SIZE(levels); l++) {
+				if ((levels[l].cpu & options.cpu) != levels[l].cpu)
+					continue;
+
+				for (w = 0; w < width.count; w++)
+					for (a = 0; a < align.count; a++)
+						bench_xor_tiled(&swizzles[s], &levels[l],
+								width.values[w], align.values[a]);
+			}
+}
+
+static void pin(void)
+{
+#ifdef CPU_SET
+	cpu_set_t set;
+	int cpu;
+
+	/* stay on whichever cpu we started on to avoid migrations */
+	cpu = sched_getcpu();
+	if (cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-c] [-k kernel] [-L level] [-b bpp] [-w width] [-a align] [-r repetitions] [-m min-KiB]\n"
+		"  -c  print CSV\n"
+		"  -k  only run kernels whose name contains this string\n"
+		"  -L  only run this CPU level (generic, sse2, sse4.1, avx2)\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char buf[1024];
+	int c;
+
+	while ((c = getopt(argc, argv, "ck:L:b:w:a:r:m:")) != -1) {
+		switch (c) {
+		case 'c': options.csv = true; break;
+		case 'k': options.kernel = optarg; break;
+		case 'L': options.level = optarg; break;
+		case 'b': options.bpp = atoi(optarg); break;
+		case 'w': options.width = atoi(optarg); break;
+		case 'a': options.align = atoi(optarg); break;
+		case 'r': options.reps = atoi(optarg); break;
+		case 'm': options.min_bytes = (uint64_t)atoi(optarg) << 10; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (options.reps <= 0 || options.min_bytes == 0 ||
+	    (options.bpp != -1 && options.bpp != 8 && options.bpp != 16 && options.bpp != 32) ||
+	    (options.width != -1 && options.width <= 0) ||
+	    options.align < -1)
+		usage(argv[0]);
+
+	options.cpu = sna_cpu_detect();
+	pin();
+
+	if (options.csv)
+		printf("kernel,level,swizzle,bpp,width,height,align,bytes,loops,ns,cycles,gbps,bytes_per_cycle\n");
+	else
+		printf("cpu: %s\n", sna_cpu_features_to_string(options.cpu, buf));
+
+	run();
+
+	if (options.failures)
+		fprintf(stderr, "%d kernels did not match the generic version\n",
+			options.failures);
+	return options.failures != 0;
+}
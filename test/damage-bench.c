@@ -0,0 +1,713 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Replay a trace of damage operations against sna_damage and report the
+ * time and the number of allocations per operation, or fuzz sna_damage
+ * against a reference pixman region. Runs without a display or GPU: only
+ * sna_damage.c and pixman are linked in, but it is built against the
+ * server, libdrm and udev headers pulled in by sna.h, as is the driver.
+ *
+ * A trace is a text file with one operation per line:
+ *
+ *   p <width> <height>              start again with an empty damage
+ *   a <x1> <y1> <x2> <y2>           sna_damage_add_box()
+ *   b <n> <x1> <y1> <x2> <y2> ...   sna_damage_add_boxes()
+ *   s <x1> <y1> <x2> <y2>           sna_damage_subtract_box()
+ *   c <x1> <y1> <x2> <y2>           sna_damage_contains_box()
+ *   g                               sna_damage_get_boxes()
+ *   r                               sna_damage_reduce()
+ *
+ * Lines starting with '#' are ignored. The built-in workloads can be
+ * written out as traces with -o, as can the operations leading up to a
+ * failure whilst fuzzing.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+#include "sna_damage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+/* Normally provided by the server */
+void ErrorF(const char *f, ...)
+{
+	va_list ap;
+
+	va_start(ap, f);
+	vfprintf(stderr, f, ap);
+	va_end(ap);
+}
+
+/* Count every allocation, including those made by pixman, by
+ * interposing on the C library.
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long alloc_count;
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#define HAVE_ALLOC_COUNT 1
+#else
+static const unsigned long alloc_count;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+enum op_type {
+	OP_PIXMAP,
+	OP_ADD,
+	OP_ADD_BOXES,
+	OP_SUBTRACT,
+	OP_CONTAINS,
+	OP_GET_BOXES,
+	OP_REDUCE,
+	OP_COUNT
+};
+
+static const char op_code[] = "pabscgr";
+static const char * const op_name[OP_COUNT] = {
+	[OP_PIXMAP] = "pixmap",
+	[OP_ADD] = "add_box",
+	[OP_ADD_BOXES] = "add_boxes",
+	[OP_SUBTRACT] = "subtract_box",
+	[OP_CONTAINS] = "contains_box",
+	[OP_GET_BOXES] = "get_boxes",
+	[OP_REDUCE] = "reduce",
+};
+
+struct op {
+	enum op_type type;
+	int first, count;	/* boxes used by the operation */
+};
+
+struct trace {
+	struct op *op;
+	int nop, op_size;
+	BoxRec *box;
+	int nbox, box_size;
+};
+
+static void trace_fini(struct trace *t)
+{
+	free(t->op);
+	free(t->box);
+	memset(t, 0, sizeof(*t));
+}
+
+static BoxRec *trace_add(struct trace *t, enum op_type type, int count)
+{
+	struct op *op;
+
+	if (t->nop == t->op_size) {
+		t->op_size = t->op_size ? 2 * t->op_size : 1024;
+		t->op = realloc(t->op, t->op_size * sizeof(*t->op));
+		if (t->op == NULL)
+			abort();
+	}
+	if (t->nbox + count > t->box_size) {
+		while (t->nbox + count > t->box_size)
+			t->box_size = t->box_size ? 2 * t->box_size : 1024;
+		t->box = realloc(t->box, t->box_size * sizeof(*t->box));
+		if (t->box == NULL)
+			abort();
+	}
+
+	op = &t->op[t->nop++];
+	op->type = type;
+	op->first = t->nbox;
+	op->count = count;
+	t->nbox += count;
+
+	return &t->box[op->first];
+}
+
+static void trace_box(struct trace *t, enum op_type type,
+		      int x1, int y1, int x2, int y2)
+{
+	BoxRec *box = trace_add(t, type, 1);
+
+	box->x1 = x1;
+	box->y1 = y1;
+	box->x2 = x2;
+	box->y2 = y2;
+}
+
+static bool trace_read(struct trace *t, const char *filename)
+{
+	char line[4096];
+	FILE *file;
+	int lineno = 0;
+
+	file = fopen(filename, "r");
+	if (file == NULL) {
+		perror(filename);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		const char *code;
+		int x1, y1, x2, y2, n, i, len;
+		char *s = line;
+
+		lineno++;
+		while (*s == ' ' || *s == '\t')
+			s++;
+		if (*s == '#' || *s == '\n' || *s == '\0')
+			continue;
+
+		code = strchr(op_code, *s++);
+		if (code == NULL)
+			goto bad;
+
+		switch (code - op_code) {
+		case OP_PIXMAP:
+			if (sscanf(s, "%d %d", &x2, &y2) != 2 ||
+			    x2 <= 0 || y2 <= 0)
+				goto bad;
+			trace_box(t, OP_PIXMAP, 0, 0, x2, y2);
+			break;
+
+		case OP_ADD_BOXES:
+			if (sscanf(s, "%d%n", &n, &len) != 1 || n <= 0)
+				goto bad;
+			s += len;
+			trace_add(t, OP_ADD_BOXES, n);
+			for (i = 0; i < n; i++) {
+				BoxRec *box = &t->box[t->nbox - n + i];
+
+				if (sscanf(s, "%d %d %d %d%n",
+					   &x1, &y1, &x2, &y2, &len) != 4 ||
+				    x2 <= x1 || y2 <= y1)
+					goto bad;
+				s += len;
+
+				box->x1 = x1;
+				box->y1 = y1;
+				box->x2 = x2;
+				box->y2 = y2;
+			}
+			break;
+
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_CONTAINS:
+			if (sscanf(s, "%d %d %d %d", &x1, &y1, &x2, &y2) != 4 ||
+			    x2 <= x1 || y2 <= y1)
+				goto bad;
+			trace_box(t, code - op_code, x1, y1, x2, y2);
+			break;
+
+		default:
+			trace_add(t, code - op_code, 0);
+			break;
+		}
+	}
+
+	fclose(file);
+	return true;
+
+bad:
+	fprintf(stderr, "%s:%d: invalid operation\n", filename, lineno);
+	fclose(file);
+	return false;
+}
+
+static bool trace_write(const struct trace *t, const char *filename)
+{
+	FILE *file;
+	int n, i;
+
+	file = fopen(filename, "w");
+	if (file == NULL) {
+		perror(filename);
+		return false;
+	}
+
+	for (n = 0; n < t->nop; n++) {
+		const struct op *op = &t->op[n];
+		const BoxRec *box = &t->box[op->first];
+
+		fputc(op_code[op->type], file);
+		switch (op->type) {
+		case OP_PIXMAP:
+			fprintf(file, " %d %d", box->x2, box->y2);
+			break;
+		case OP_ADD_BOXES:
+			fprintf(file, " %d", op->count);
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_CONTAINS:
+			for (i = 0; i < op->count; i++)
+				fprintf(file, " %d %d %d %d",
+					box[i].x1, box[i].y1,
+					box[i].x2, box[i].y2);
+			break;
+		default:
+			break;
+		}
+		fputc('\n', file);
+	}
+
+	return fclose(file) == 0;
+}
+
+static void random_box(BoxRec *box, int width, int height, int max)
+{
+	int w = 1 + rand() % min(width, max);
+	int h = 1 + rand() % min(height, max);
+
+	box->x1 = rand() % (width - w + 1);
+	box->y1 = rand() % (height - h + 1);
+	box->x2 = box->x1 + w;
+	box->y2 = box->y1 + h;
+}
+
+/* Glyph runs drawn into a terminal, with the occasional scroll and
+ * readback of a line.
+ */
+static void workload_terminal(struct trace *t, int frames)
+{
+	const int width = 1920, height = 1080, cw = 8, ch = 16;
+	int frame, n;
+
+	trace_box(t, OP_PIXMAP, 0, 0, width, height);
+	for (frame = 0; frame < frames; frame++) {
+		for (n = 0; n < 64; n++) {
+			int row = rand() % (height / ch);
+			int col = rand() % (width / cw);
+			int len = 1 + rand() % min(16, width / cw - col);
+
+			trace_box(t, OP_ADD,
+				  col * cw, row * ch,
+				  (col + len) * cw, (row + 1) * ch);
+		}
+
+		if (frame % 16 == 0)
+			trace_box(t, OP_ADD, 0, 0, width, height - ch);
+
+		for (n = 0; n < 8; n++) {
+			int row = rand() % (height / ch);
+			int col = rand() % (width / cw);
+
+			trace_box(t, OP_CONTAINS,
+				  col * cw, row * ch,
+				  (col + 1) * cw, (row + 1) * ch);
+		}
+
+		n = rand() % (height / ch);
+		trace_box(t, OP_SUBTRACT, 0, n * ch, width, (n + 1) * ch);
+
+		if (frame % 4 == 0)
+			trace_add(t, OP_GET_BOXES, 0);
+	}
+}
+
+/* Cell updates in a grid, each redrawing its contents and borders */
+static void workload_spreadsheet(struct trace *t, int frames)
+{
+	const int width = 2560, height = 1440, cw = 64, ch = 20;
+	int frame, n;
+
+	trace_box(t, OP_PIXMAP, 0, 0, width, height);
+	for (frame = 0; frame < frames; frame++) {
+		for (n = 0; n < 16; n++) {
+			int x = (rand() % (width / cw)) * cw;
+			int y = (rand() % (height / ch)) * ch;
+			BoxRec *box = trace_add(t, OP_ADD_BOXES, 5);
+
+			box[0].x1 = x + 1; box[0].y1 = y + 1;
+			box[0].x2 = x + cw - 1; box[0].y2 = y + ch - 1;
+			box[1].x1 = x; box[1].y1 = y;
+			box[1].x2 = x + cw; box[1].y2 = y + 1;
+			box[2].x1 = x; box[2].y1 = y + ch - 1;
+			box[2].x2 = x + cw; box[2].y2 = y + ch;
+			box[3].x1 = x; box[3].y1 = y;
+			box[3].x2 = x + 1; box[3].y2 = y + ch;
+			box[4].x1 = x + cw - 1; box[4].y1 = y;
+			box[4].x2 = x + cw; box[4].y2 = y + ch;
+		}
+
+		for (n = 0; n < 4; n++) {
+			int x = (rand() % (width / cw)) * cw;
+			int y = (rand() % (height / ch)) * ch;
+
+			trace_box(t, OP_CONTAINS, x, y, x + cw, y + ch);
+			trace_box(t, OP_SUBTRACT, x + 1, y + 1, x + cw - 1, y + ch - 1);
+		}
+
+		if (frame % 8 == 0)
+			trace_add(t, OP_GET_BOXES, 0);
+	}
+}
+
+static void workload_random(struct trace *t, int frames)
+{
+	const int width = 1024, height = 768;
+	int frame;
+
+	trace_box(t, OP_PIXMAP, 0, 0, width, height);
+	for (frame = 0; frame < frames; frame++) {
+		BoxRec *box;
+
+		switch (rand() % 8) {
+		case 0:
+		case 1:
+		case 2:
+			box = trace_add(t, OP_ADD, 1);
+			random_box(box, width, height, 128);
+			break;
+		case 3:
+			box = trace_add(t, OP_ADD_BOXES, 8);
+			for (int i = 0; i < 8; i++)
+				random_box(&box[i], width, height, 32);
+			break;
+		case 4:
+		case 5:
+			box = trace_add(t, OP_SUBTRACT, 1);
+			random_box(box, width, height, 128);
+			break;
+		case 6:
+			box = trace_add(t, OP_CONTAINS, 1);
+			random_box(box, width, height, 64);
+			break;
+		case 7:
+			trace_add(t, rand() & 1 ? OP_GET_BOXES : OP_REDUCE, 0);
+			break;
+		}
+	}
+}
+
+static const struct workload {
+	const char *name;
+	void (*func)(struct trace *t, int frames);
+} workloads[] = {
+	{ "terminal", workload_terminal },
+	{ "spreadsheet", workload_spreadsheet },
+	{ "random", workload_random },
+};
+
+static uint64_t elapsed(const struct timespec *start,
+			const struct timespec *end)
+{
+	return 1000000000ull*(end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec);
+}
+
+static void replay(const char *name, const struct trace *t, int loops)
+{
+	struct {
+		uint64_t ns;
+		unsigned long count;
+		unsigned long allocs;
+	} stat[OP_COUNT];
+	unsigned long tiled = 0, total = 0, sum = 0;
+	int loop, n;
+
+	memset(stat, 0, sizeof(stat));
+	for (loop = 0; loop < loops; loop++) {
+		struct sna_damage *damage = NULL;
+
+		for (n = 0; n < t->nop; n++) {
+			const struct op *op = &t->op[n];
+			const BoxRec *box = &t->box[op->first];
+			struct timespec start, end;
+			unsigned long allocs;
+
+			allocs = alloc_count;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			switch (op->type) {
+			case OP_PIXMAP:
+				sna_damage_destroy(&damage);
+				break;
+			case OP_ADD:
+				sna_damage_add_box(&damage, box);
+				break;
+			case OP_ADD_BOXES:
+				sna_damage_add_boxes(&damage, box, op->count, 0, 0);
+				break;
+			case OP_SUBTRACT:
+				sna_damage_subtract_box(&damage, box);
+				break;
+			case OP_CONTAINS:
+				sum += sna_damage_contains_box(&damage, box);
+				break;
+			case OP_GET_BOXES:
+				if (damage) {
+					const BoxRec *boxes;
+					sum += sna_damage_get_boxes(damage, &boxes);
+				}
+				break;
+			case OP_REDUCE:
+				sna_damage_reduce(&damage);
+				break;
+			case OP_COUNT:
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			stat[op->type].ns += elapsed(&start, &end);
+			stat[op->type].count++;
+			stat[op->type].allocs += alloc_count - allocs;
+
+			if (damage && DAMAGE_PTR(damage)->tiles)
+				tiled++;
+			total++;
+		}
+
+		sna_damage_destroy(&damage);
+	}
+
+	printf("%s: %d operations x %d loops, %lu%% in tile mode (%lx)\n",
+	       name, t->nop, loops, total ? 100 * tiled / total : 0, sum & 0xf);
+	for (n = 0; n < OP_COUNT; n++) {
+		if (stat[n].count == 0)
+			continue;
+
+		printf("  %-14s %9lu ops %10.1f ns/op",
+		       op_name[n], stat[n].count,
+		       (double)stat[n].ns / stat[n].count);
+		if (HAVE_ALLOC_COUNT)
+			printf(" %8.3f allocs/op",
+			       (double)stat[n].allocs / stat[n].count);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+static bool fuzz_check(struct sna_damage **damage, pixman_region16_t *ref,
+		       const char **what)
+{
+	const BoxRec *boxes = NULL;
+	BoxPtr ref_boxes;
+	int n, ref_n;
+
+	n = *damage ? sna_damage_get_boxes(*damage, &boxes) : 0;
+	ref_boxes = pixman_region_rectangles(ref, &ref_n);
+	if (n != ref_n || memcmp(boxes, ref_boxes, n * sizeof(BoxRec))) {
+		*what = "get_boxes";
+		return false;
+	}
+
+	return true;
+}
+
+/* Apply random operations to both the damage and a reference region,
+ * checking that they agree after each query. Returns the number of
+ * operations run, stopping at the first disagreement.
+ */
+static int fuzz(unsigned seed, int count, struct trace *t)
+{
+	struct sna_damage *damage = NULL;
+	pixman_region16_t ref;
+	int width = 0, height = 0, n;
+	const char *what = NULL;
+
+	srand(seed);
+	pixman_region_init(&ref);
+
+	for (n = 0; n < count && what == NULL; n++) {
+		pixman_region16_t r;
+		BoxRec *box;
+		int i;
+
+		if (n % 1000 == 0) {
+			width = 1 + rand() % 2048;
+			height = 1 + rand() % 2048;
+			trace_box(t, OP_PIXMAP, 0, 0, width, height);
+
+			sna_damage_destroy(&damage);
+			pixman_region_fini(&ref);
+			pixman_region_init(&ref);
+			continue;
+		}
+
+		switch (rand() % 8) {
+		case 0:
+		case 1:
+			box = trace_add(t, OP_ADD, 1);
+			random_box(box, width, height, 256);
+			sna_damage_add_box(&damage, box);
+			pixman_region_init_with_extents(&r, box);
+			pixman_region_union(&ref, &ref, &r);
+			pixman_region_fini(&r);
+			break;
+
+		case 2:
+			i = 2 + rand() % 15;
+			box = trace_add(t, OP_ADD_BOXES, i);
+			while (i--) {
+				random_box(&box[i], width, height, 64);
+				pixman_region_init_with_extents(&r, &box[i]);
+				pixman_region_union(&ref, &ref, &r);
+				pixman_region_fini(&r);
+			}
+			sna_damage_add_boxes(&damage, box, t->op[t->nop-1].count, 0, 0);
+			break;
+
+		case 3:
+		case 4:
+			box = trace_add(t, OP_SUBTRACT, 1);
+			random_box(box, width, height, 256);
+			sna_damage_subtract_box(&damage, box);
+			pixman_region_init_with_extents(&r, box);
+			pixman_region_subtract(&ref, &ref, &r);
+			pixman_region_fini(&r);
+			break;
+
+		case 5:
+		case 6:
+			box = trace_add(t, OP_CONTAINS, 1);
+			random_box(box, width, height, 64);
+			if (sna_damage_contains_box(&damage, box) !=
+			    pixman_region_contains_rectangle(&ref, box))
+				what = "contains_box";
+			break;
+
+		case 7:
+			trace_add(t, OP_GET_BOXES, 0);
+			fuzz_check(&damage, &ref, &what);
+			break;
+		}
+	}
+
+	if (what == NULL) {
+		trace_add(t, OP_GET_BOXES, 0);
+		fuzz_check(&damage, &ref, &what);
+	}
+	if (what)
+		fprintf(stderr, "seed %u: %s disagrees with the reference region after %d operations\n",
+			seed, what, t->nop);
+
+	sna_damage_destroy(&damage);
+	pixman_region_fini(&ref);
+
+	return what ? -1 : n;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-t trace] [-w workload] [-n frames] [-l loops] [-f ops] [-s seed] [-o trace]\n"
+		"  -t  replay the trace file\n"
+		"  -w  replay a built-in workload: terminal, spreadsheet or random\n"
+		"  -f  fuzz the given number of operations against pixman\n"
+		"  -o  write the workload, or the operations up to a fuzz failure, as a trace\n"
+		"With no -t, -w or -f every built-in workload is replayed.\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *trace_file = NULL, *workload = NULL, *output = NULL;
+	int frames = 1000, loops = 10, fuzz_ops = 0;
+	unsigned seed = 0;
+	struct trace t;
+	unsigned n;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "t:w:n:l:f:s:o:")) != -1) {
+		switch (c) {
+		case 't': trace_file = optarg; break;
+		case 'w': workload = optarg; break;
+		case 'n': frames = atoi(optarg); break;
+		case 'l': loops = atoi(optarg); break;
+		case 'f': fuzz_ops = atoi(optarg); break;
+		case 's': seed = strtoul(optarg, NULL, 0); break;
+		case 'o': output = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (optind != argc || frames <= 0 || loops <= 0 || fuzz_ops < 0)
+		usage(argv[0]);
+
+	memset(&t, 0, sizeof(t));
+
+	if (fuzz_ops) {
+		if (fuzz(seed, fuzz_ops, &t) < 0) {
+			if (output)
+				trace_write(&t, output);
+			ret = 1;
+		} else
+			printf("fuzz: %d operations from seed %u agree with pixman\n",
+			       fuzz_ops, seed);
+		trace_fini(&t);
+	}
+
+	if (trace_file) {
+		if (!trace_read(&t, trace_file))
+			return 1;
+
+		replay(trace_file, &t, loops);
+		trace_fini(&t);
+	}
+
+	for (n = 0; n < ARRAY_SIZE(workloads); n++) {
+		if (workload ? strcmp(workload, workloads[n].name) :
+		    trace_file || fuzz_ops)
+			continue;
+
+		srand(seed);
+		workloads[n].func(&t, frames);
+		if (output && workload)
+			ret |= !trace_write(&t, output);
+		replay(workloads[n].name, &t, loops);
+		trace_fini(&t);
+	}
+
+	return ret;
+}
@@ -0,0 +1,768 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Exercise the userspace GEM emulation (kgem_fake.c), first through the
+ * same ioctls that kgem issues, checking the results against what the
+ * kernel would report, and then by running a real struct kgem on top of
+ * it: kgem_init(), building and submitting a batch, and the bo cache.
+ * Runs without a display or GPU.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna.h"
+#include "sna_reg.h"
+#include "kgem_fake.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+static int fd;
+static int failures;
+
+/* Normally provided by the server and the rest of the driver */
+jmp_buf sigjmp[4];
+volatile sig_atomic_t sigtrap;
+
+void ErrorF(const char *f, ...)
+{
+	va_list ap;
+
+	va_start(ap, f);
+	vfprintf(stderr, f, ap);
+	va_end(ap);
+}
+
+void FatalError(const char *f, ...)
+{
+	va_list ap;
+
+	va_start(ap, f);
+	vfprintf(stderr, f, ap);
+	va_end(ap);
+	abort();
+}
+
+void xf86DrvMsg(int scrnIndex, MessageType type, const char *f, ...)
+{
+	va_list ap;
+
+	(void)scrnIndex;
+	(void)type;
+
+	va_start(ap, f);
+	vfprintf(stderr, f, ap);
+	va_end(ap);
+}
+
+void xorg_backtrace(void)
+{
+}
+
+void sna_render_mark_wedged(struct sna *sna)
+{
+	(void)sna;
+}
+
+void sna_render_flush_solid(struct sna *sna)
+{
+	(void)sna;
+}
+
+bool sna_mode_disable(struct sna *sna)
+{
+	(void)sna;
+	return false;
+}
+
+void sna_mode_enable(struct sna *sna)
+{
+	(void)sna;
+}
+
+#if HAS_DEBUG_FULL
+void __kgem_batch_debug(struct kgem *kgem, uint32_t nbatch)
+{
+	(void)kgem;
+	(void)nbatch;
+}
+#endif
+
+#define check(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+			__FILE__, __LINE__, #expr); \
+		failures++; \
+	} \
+} while (0)
+
+static int do_ioctl(unsigned long req, void *arg)
+{
+	if (kgem_fake_backend.ioctl(fd, req, arg))
+		return -errno;
+
+	return 0;
+}
+
+static uint32_t create(uint64_t size)
+{
+	struct drm_i915_gem_create create;
+
+	memset(&create, 0, sizeof(create));
+	create.size = size;
+	if (do_ioctl(DRM_IOCTL_I915_GEM_CREATE, &create))
+		return 0;
+
+	return create.handle;
+}
+
+static void gem_close(uint32_t handle)
+{
+	struct drm_gem_close close;
+
+	memset(&close, 0, sizeof(close));
+	close.handle = handle;
+	check(do_ioctl(DRM_IOCTL_GEM_CLOSE, &close) == 0);
+}
+
+static void *map(uint32_t handle, uint64_t size)
+{
+	struct drm_i915_gem_mmap_gtt gtt;
+	void *ptr;
+
+	memset(&gtt, 0, sizeof(gtt));
+	gtt.handle = handle;
+	if (do_ioctl(DRM_IOCTL_I915_GEM_MMAP_GTT, &gtt))
+		return NULL;
+
+	/* exactly as kgem maps through the GTT */
+	ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, gtt.offset);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static int set_tiling(uint32_t handle, uint32_t tiling, uint32_t stride)
+{
+	struct drm_i915_gem_set_tiling set;
+
+	memset(&set, 0, sizeof(set));
+	set.handle = handle;
+	set.tiling_mode = tiling;
+	set.stride = stride;
+	return do_ioctl(DRM_IOCTL_I915_GEM_SET_TILING, &set);
+}
+
+static int busy(uint32_t handle)
+{
+	struct drm_i915_gem_busy busy;
+
+	memset(&busy, 0, sizeof(busy));
+	busy.handle = handle;
+	check(do_ioctl(DRM_IOCTL_I915_GEM_BUSY, &busy) == 0);
+	return busy.busy;
+}
+
+static int execbuf(struct drm_i915_gem_exec_object2 *exec, int count,
+		   uint32_t batch_len, uint64_t flags)
+{
+	struct drm_i915_gem_execbuffer2 eb;
+
+	memset(&eb, 0, sizeof(eb));
+	eb.buffers_ptr = (uintptr_t)exec;
+	eb.buffer_count = count;
+	eb.batch_len = batch_len;
+	eb.flags = flags;
+	return do_ioctl(DRM_IOCTL_I915_GEM_EXECBUFFER2, &eb);
+}
+
+static void test_params(void)
+{
+	struct drm_i915_gem_get_aperture aperture;
+	drm_i915_getparam_t gp;
+	int v;
+
+	memset(&gp, 0, sizeof(gp));
+	gp.param = I915_PARAM_HAS_EXECBUF2;
+	gp.value = &v;
+	check(do_ioctl(DRM_IOCTL_I915_GETPARAM, &gp) == 0 && v == 1);
+
+	gp.param = I915_PARAM_HAS_LLC;
+	check(do_ioctl(DRM_IOCTL_I915_GETPARAM, &gp) == 0 && v == 1);
+
+	/* full-ppgtt, so that kgem may softpin */
+	gp.param = I915_PARAM_HAS_ALIASING_PPGTT;
+	check(do_ioctl(DRM_IOCTL_I915_GETPARAM, &gp) == 0 && v == 2);
+
+	gp.param = 0xdead;
+	check(do_ioctl(DRM_IOCTL_I915_GETPARAM, &gp) == -EINVAL);
+
+	memset(&aperture, 0, sizeof(aperture));
+	check(do_ioctl(DRM_IOCTL_I915_GEM_GET_APERTURE, &aperture) == 0);
+	check(aperture.aper_size == 64 << 20);
+}
+
+static void test_objects(void)
+{
+	struct drm_i915_gem_pwrite pwrite;
+	struct drm_i915_gem_pread pread;
+	uint32_t handle, data[4] = { 1, 2, 3, 4 }, out[4];
+	uint32_t *ptr;
+
+	handle = create(1);
+	check(handle);
+
+	ptr = map(handle, 4096);
+	check(ptr);
+	if (ptr == NULL)
+		return;
+
+	memset(&pwrite, 0, sizeof(pwrite));
+	pwrite.handle = handle;
+	pwrite.offset = 64;
+	pwrite.size = sizeof(data);
+	pwrite.data_ptr = (uintptr_t)data;
+	check(do_ioctl(DRM_IOCTL_I915_GEM_PWRITE, &pwrite) == 0);
+	check(memcmp(ptr + 16, data, sizeof(data)) == 0);
+
+	ptr[17] = 0xc0ffee;
+	memset(&pread, 0, sizeof(pread));
+	pread.handle = handle;
+	pread.offset = 64;
+	pread.size = sizeof(out);
+	pread.data_ptr = (uintptr_t)out;
+	check(do_ioctl(DRM_IOCTL_I915_GEM_PREAD, &pread) == 0);
+	check(out[0] == 1 && out[1] == 0xc0ffee);
+
+	/* past the end of the (page-rounded) object */
+	pwrite.offset = 4096 - 8;
+	check(do_ioctl(DRM_IOCTL_I915_GEM_PWRITE, &pwrite) == -EINVAL);
+
+	munmap(ptr, 4096);
+	gem_close(handle);
+
+	/* handles are recycled */
+	check(create(4096) == handle);
+	gem_close(handle);
+}
+
+static void test_tiling(void)
+{
+	uint32_t handle = create(1 << 20);
+	struct drm_i915_gem_get_tiling get;
+
+	check(set_tiling(handle, I915_TILING_X, 512*4) == 0);
+	check(set_tiling(handle, I915_TILING_X, 100) == -EINVAL);
+	check(set_tiling(handle, I915_TILING_Y, 128*3) == 0);
+	check(set_tiling(handle, I915_TILING_X, 512*1024) == -EINVAL);
+
+	memset(&get, 0, sizeof(get));
+	get.handle = handle;
+	check(do_ioctl(DRM_IOCTL_I915_GEM_GET_TILING, &get) == 0);
+	check(get.tiling_mode == I915_TILING_Y);
+	check(get.swizzle_mode == I915_BIT_6_SWIZZLE_9);
+
+	gem_close(handle);
+}
+
+static void test_relocs(void)
+{
+	struct drm_i915_gem_exec_object2 exec[2];
+	struct drm_i915_gem_relocation_entry reloc;
+	uint32_t target = create(8192), batch = create(4096);
+	uint64_t *ptr;
+
+	memset(&reloc, 0, sizeof(reloc));
+	reloc.offset = 8;
+	reloc.delta = 256;
+	reloc.target_handle = 0; /* index into exec[] */
+	reloc.presumed_offset = -1;
+
+	memset(exec, 0, sizeof(exec));
+	exec[0].handle = target;
+	exec[0].flags = EXEC_OBJECT_WRITE;
+	exec[1].handle = batch;
+	exec[1].relocation_count = 1;
+	exec[1].relocs_ptr = (uintptr_t)&reloc;
+
+	check(execbuf(exec, 2, 16, I915_EXEC_BLT | I915_EXEC_HANDLE_LUT) == 0);
+	check(exec[0].offset && exec[1].offset);
+	check(exec[0].offset != exec[1].offset);
+	check(reloc.presumed_offset == exec[0].offset);
+
+	ptr = map(batch, 4096);
+	check(ptr && ptr[1] == exec[0].offset + 256);
+
+	/* busy on the blitter, and written */
+	check(busy(target) & 0xffff);
+	check(busy(target) & ~0x1ffff);
+	check(!(busy(batch) & 0xffff));
+
+	{
+		struct drm_i915_gem_set_domain domain;
+
+		memset(&domain, 0, sizeof(domain));
+		domain.handle = target;
+		domain.read_domains = I915_GEM_DOMAIN_GTT;
+		check(do_ioctl(DRM_IOCTL_I915_GEM_SET_DOMAIN, &domain) == 0);
+		check(busy(target) == 0);
+	}
+
+	if (ptr)
+		munmap(ptr, 4096);
+	gem_close(target);
+	gem_close(batch);
+}
+
+static void test_aperture(void)
+{
+	struct drm_i915_gem_exec_object2 exec[3];
+	uint32_t a = create(32 << 20), b = create(32 << 20), batch = create(4096);
+	struct kgem_fake_stats stats;
+
+	memset(exec, 0, sizeof(exec));
+	exec[0].handle = a;
+	exec[1].handle = b;
+	exec[2].handle = batch;
+	check(execbuf(exec, 3, 8, 0) == -ENOSPC);
+
+	/* each half fits, but only by moving everything */
+	check(execbuf(exec + 1, 2, 8, 0) == 0);
+	exec[1] = exec[2];
+	check(execbuf(exec, 2, 8, 0) == 0);
+	kgem_fake_get_stats(&stats);
+	check(stats.rebinds == 1);
+
+	check(execbuf(NULL, 1, 8, 0) == -EFAULT);
+
+	gem_close(a);
+	gem_close(b);
+	gem_close(batch);
+}
+
+static void test_latency(void)
+{
+	struct drm_i915_gem_exec_object2 exec;
+	struct timespec start, end;
+	struct {
+		uint32_t handle;
+		uint32_t flags;
+		int64_t timeout;
+	} wait;
+
+	memset(&exec, 0, sizeof(exec));
+	exec.handle = create(4096);
+	check(execbuf(&exec, 1, 8, 0) == 0);
+	check(busy(exec.handle));
+
+	memset(&wait, 0, sizeof(wait));
+	wait.handle = exec.handle;
+	check(do_ioctl(DRM_IOW(DRM_COMMAND_BASE + 0x2c, typeof(wait)), &wait) == -ETIME);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wait.timeout = -1;
+	check(do_ioctl(DRM_IOW(DRM_COMMAND_BASE + 0x2c, typeof(wait)), &wait) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	check(busy(exec.handle) == 0);
+	check((end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec > 1000000);
+
+	gem_close(exec.handle);
+}
+
+/* kgem reaches the screen and the render state through the struct sna
+ * it is embedded within, so the rest of sna is left zeroed.
+ */
+static struct sna sna;
+static ScrnInfoRec scrn;
+
+static void render_noop(struct sna *sna)
+{
+	(void)sna;
+}
+
+static struct kgem *kgem_open(const struct kgem_fake_config *config)
+{
+	memset(&sna, 0, sizeof(sna));
+	memset(&scrn, 0, sizeof(scrn));
+	sna.scrn = &scrn;
+	sna.render.reset = render_noop;
+	sna.render.flush = render_noop;
+
+	fd = kgem_fake_open(config);
+	if (fd < 0)
+		return NULL;
+
+	kgem_set_backend(&kgem_fake_backend);
+	kgem_init(&sna.kgem, fd, NULL, config->gen);
+	kgem_reset(&sna.kgem); /* as sna_accel_init() */
+	return &sna.kgem;
+}
+
+static void kgem_close(struct kgem *kgem)
+{
+	kgem_cleanup_cache(kgem);
+	kgem_fake_close(fd);
+	kgem_set_backend(NULL);
+}
+
+static void test_kgem_init(struct kgem *kgem,
+			   const struct kgem_fake_config *config)
+{
+	check(!kgem->wedged);
+	check(kgem->gen == config->gen);
+	check(kgem->has_blt);
+	check(kgem->has_llc == config->has_llc);
+	check(kgem->has_handle_lut);
+	check(kgem->has_no_reloc);
+	check(kgem->aperture_total == config->aperture_size / PAGE_SIZE);
+	check(kgem->batch != NULL);
+	check(kgem->nbatch == 0 && kgem->nexec == 0 && kgem->nreloc == 0);
+}
+
+/* As sna_blt_fill_box() */
+static void fill(struct kgem *kgem, struct kgem_bo *bo,
+		 const BoxRec *box, uint32_t color)
+{
+	uint32_t cmd, br13, *b;
+
+	cmd = XY_COLOR_BLT | BLT_WRITE_ALPHA | BLT_WRITE_RGB;
+	cmd |= kgem->gen >= 0100 ? 5 : 4;
+	br13 = bo->pitch;
+	if (kgem->gen >= 040 && bo->tiling) {
+		cmd |= BLT_DST_TILED;
+		br13 >>= 2;
+	}
+	br13 |= 0xf0 << 16 | 1 << 25 | 1 << 24;
+
+	kgem_set_mode(kgem, KGEM_BLT, bo);
+	if (!kgem_check_batch(kgem, 7) ||
+	    !kgem_check_reloc(kgem, 1) ||
+	    !kgem_check_bo_fenced(kgem, bo)) {
+		kgem_submit(kgem);
+		check(kgem_check_bo_fenced(kgem, bo));
+		_kgem_set_mode(kgem, KGEM_BLT);
+	}
+	kgem_bcs_set_tiling(kgem, NULL, bo);
+
+	b = kgem->batch + kgem->nbatch;
+	b[0] = cmd;
+	b[1] = br13;
+	b[2] = box->y1 << 16 | box->x1;
+	b[3] = box->y2 << 16 | box->x2;
+	if (kgem->gen >= 0100) {
+		*(uint64_t *)(b+4) =
+			kgem_add_reloc64(kgem, kgem->nbatch + 4, bo,
+					 I915_GEM_DOMAIN_RENDER << 16 |
+					 I915_GEM_DOMAIN_RENDER |
+					 KGEM_RELOC_FENCED,
+					 0);
+		b[6] = color;
+		kgem->nbatch += 7;
+	} else {
+		b[4] = kgem_add_reloc(kgem, kgem->nbatch + 4, bo,
+				      I915_GEM_DOMAIN_RENDER << 16 |
+				      I915_GEM_DOMAIN_RENDER |
+				      KGEM_RELOC_FENCED,
+				      0);
+		b[5] = color;
+		kgem->nbatch += 6;
+	}
+}
+
+static void test_kgem_batch(struct kgem *kgem)
+{
+	struct kgem_fake_stats before, after;
+	struct kgem_bo *bo, *batch;
+	BoxRec box;
+	int n;
+
+	bo = kgem_create_2d(kgem, 256, 256, 32, I915_TILING_X, 0);
+	check(bo);
+	if (bo == NULL)
+		return;
+
+	check(bo->tiling == I915_TILING_X);
+	check(bo->pitch >= 256*4 && bo->pitch % 512 == 0);
+
+	kgem_fake_get_stats(&before);
+
+	box.x1 = box.y1 = 0;
+	box.x2 = box.y2 = 64;
+	for (n = 0; n < 4; n++) {
+		fill(kgem, bo, &box, 0xff00ff00 + n);
+		box.x1 += 64;
+		box.x2 += 64;
+	}
+	check(kgem->mode == KGEM_BLT);
+	/* softpinned targets are written directly, not relocated */
+	check(kgem->nreloc == (bo->softpin ? 0 : 4));
+	check(bo->exec != NULL);
+	check(kgem_bo_is_busy(bo));
+
+	/* the batch is written straight into a bo of the ring */
+	batch = NULL;
+	if (kgem->batch_ring.count)
+		batch = kgem->batch_ring.bo[kgem->batch_ring.current];
+
+	kgem_submit(kgem);
+	kgem_fake_get_stats(&after);
+	if (batch) {
+		check(batch->rq != NULL);
+		check(kgem->batch_ring.bo[kgem->batch_ring.current] != batch);
+	}
+	check(after.execbuffers == before.execbuffers + 1);
+	check(after.exec_objects >= before.exec_objects + 2);
+	check(kgem->nbatch == 0 && kgem->nreloc == 0 && kgem->nexec == 0);
+	check(kgem->mode == KGEM_NONE);
+	check(bo->exec == NULL && bo->rq != NULL);
+	check(bo->presumed_offset != 0);
+
+	/* still executing until the fake latency has passed */
+	check(__kgem_bo_is_busy(kgem, bo));
+	kgem_bo_sync__gtt(kgem, bo);
+	check(!__kgem_bo_is_busy(kgem, bo));
+	check(bo->rq == NULL);
+
+	/* a second batch finds the bo where it was left */
+	fill(kgem, bo, &box, 0);
+	_kgem_submit(kgem);
+	kgem_fake_get_stats(&before);
+	check(before.execbuffers == after.execbuffers + 1);
+	check(before.rebinds == after.rebinds);
+
+	kgem_bo_destroy(kgem, bo);
+	kgem_retire(kgem);
+}
+
+static void test_kgem_softpin(struct kgem *kgem)
+{
+	struct kgem_bo *bo[8];
+	BoxRec box;
+	int n, m;
+
+	if (!kgem->has_softpin)
+		return;
+
+	/* one bo of each size up to 8 pages, a row per page */
+	box.x1 = box.y1 = 0;
+	box.x2 = box.y2 = 1;
+	for (n = 0; n < ARRAY_SIZE(bo); n++) {
+		bo[n] = kgem_create_2d(kgem, PAGE_SIZE / 4, n + 1, 32,
+				       I915_TILING_NONE, 0);
+		check(bo[n]);
+		if (bo[n] == NULL)
+			return;
+		fill(kgem, bo[n], &box, n);
+	}
+	_kgem_submit(kgem);
+
+	/* every bo is followed by a guard page that no other bo uses */
+	for (n = 0; n < ARRAY_SIZE(bo); n++) {
+		uint64_t start = bo[n]->presumed_offset;
+		uint64_t end = start + (bo[n]->size.pages.count + 1) * PAGE_SIZE;
+
+		check(bo[n]->softpin);
+		for (m = 0; m < ARRAY_SIZE(bo); m++) {
+			uint64_t other = bo[m]->presumed_offset;
+
+			if (m == n)
+				continue;
+
+			check(other >= end ||
+			      other + bo[m]->size.pages.count * PAGE_SIZE <= start);
+		}
+	}
+
+	for (n = 0; n < ARRAY_SIZE(bo); n++)
+		kgem_bo_destroy(kgem, bo[n]);
+	kgem_retire(kgem);
+}
+
+static void test_kgem_cache(struct kgem *kgem)
+{
+	struct kgem_fake_stats before, stats;
+	struct kgem_bo *bo;
+	uint32_t handle;
+	int pitch;
+
+	kgem_cleanup_cache(kgem);
+	kgem_fake_get_stats(&before);
+
+	/* an idle bo goes back into the cache and is handed out again */
+	bo = kgem_create_linear(kgem, 256 << 10, 0);
+	check(bo);
+	if (bo == NULL)
+		return;
+	handle = bo->handle;
+	kgem_bo_destroy(kgem, bo);
+
+	bo = kgem_create_linear(kgem, 256 << 10, 0);
+	check(bo && bo->handle == handle);
+	kgem_bo_destroy(kgem, bo);
+
+	bo = kgem_create_2d(kgem, 512, 512, 32, I915_TILING_X, 0);
+	check(bo);
+	if (bo == NULL)
+		return;
+	handle = bo->handle;
+	pitch = bo->pitch;
+	kgem_bo_destroy(kgem, bo);
+
+	bo = kgem_create_2d(kgem, 512, 512, 32, I915_TILING_X, 0);
+	check(bo && bo->handle == handle);
+	check(bo && bo->tiling == I915_TILING_X && bo->pitch == pitch);
+	kgem_bo_destroy(kgem, bo);
+
+	kgem_fake_get_stats(&stats);
+	check(stats.objects == before.objects + 2);
+
+	/* and dropping the cache releases them back to the "kernel" */
+	kgem_cleanup_cache(kgem);
+	kgem_fake_get_stats(&stats);
+	check(stats.objects == before.objects);
+	check(stats.bytes == before.bytes);
+}
+
+static void test_kgem_async(struct kgem *kgem)
+{
+	struct kgem_fake_stats before, after;
+	struct kgem_bo *bo;
+	BoxRec box;
+
+	check(kgem_enable_async_submit(kgem));
+	if (kgem->async == NULL)
+		return;
+
+	bo = kgem_create_2d(kgem, 256, 256, 32, I915_TILING_X, 0);
+	check(bo);
+	if (bo == NULL)
+		goto out;
+
+	kgem_fake_get_stats(&before);
+
+	box.x1 = box.y1 = 0;
+	box.x2 = box.y2 = 64;
+	fill(kgem, bo, &box, 0xff0000ff);
+	kgem_submit(kgem);
+	check(kgem->nbatch == 0);
+	check(bo->rq != NULL);
+
+	/* waiting upon the bo first hands the batch to the kernel */
+	kgem_bo_sync__gtt(kgem, bo);
+	kgem_fake_get_stats(&after);
+	check(after.execbuffers == before.execbuffers + 1);
+	check(!__kgem_bo_is_busy(kgem, bo));
+
+	/* a batch rejected by the kernel is retried, not dropped */
+	kgem_fake_fail_execbuffers(1);
+	fill(kgem, bo, &box, 0xff00ff00);
+	kgem_submit(kgem);
+	kgem_bo_sync__gtt(kgem, bo);
+	kgem_fake_get_stats(&before);
+	check(!kgem->wedged);
+	check(before.execbuffers == after.execbuffers + 1);
+	check(!__kgem_bo_is_busy(kgem, bo));
+
+	kgem_bo_destroy(kgem, bo);
+	kgem_retire(kgem);
+out:
+	kgem_disable_async_submit(kgem);
+	check(kgem->async == NULL);
+
+	/* and the thread may be started again */
+	check(kgem_enable_async_submit(kgem));
+	kgem_disable_async_submit(kgem);
+}
+
+int main(void)
+{
+	struct kgem_fake_config config;
+	struct kgem_fake_stats stats;
+	struct kgem *kgem;
+
+	memset(&config, 0, sizeof(config));
+	config.gen = 0110;
+	config.aperture_size = 64 << 20;
+	config.latency_ns = 5000000;
+	config.swizzle = I915_BIT_6_SWIZZLE_9_10;
+	config.has_llc = true;
+
+	fd = kgem_fake_open(&config);
+	if (fd < 0) {
+		fprintf(stderr, "unable to create fake device: %s\n",
+			strerror(-fd));
+		return 1;
+	}
+
+	test_params();
+	test_objects();
+	test_tiling();
+	test_relocs();
+	test_aperture();
+	test_latency();
+
+	kgem_fake_get_stats(&stats);
+	check(stats.objects == 0 && stats.bytes == 0);
+	printf("%llu ioctls, %llu execbuffers, %llu/%llu relocations written, %llu waits\n",
+	       (unsigned long long)stats.ioctls,
+	       (unsigned long long)stats.execbuffers,
+	       (unsigned long long)stats.relocs_written,
+	       (unsigned long long)stats.relocs,
+	       (unsigned long long)stats.waits);
+
+	kgem_fake_close(fd);
+
+	/* and now run kgem itself on top of the emulation */
+	config.aperture_size = 256 << 20;
+	config.latency_ns = 1000000;
+	kgem = kgem_open(&config);
+	if (kgem == NULL) {
+		fprintf(stderr, "unable to create fake device\n");
+		return 1;
+	}
+
+	test_kgem_init(kgem, &config);
+	test_kgem_batch(kgem);
+	test_kgem_softpin(kgem);
+	test_kgem_cache(kgem);
+	test_kgem_async(kgem);
+
+	kgem_fake_get_stats(&stats);
+	printf("kgem: %llu ioctls, %llu execbuffers, %llu/%llu relocations written\n",
+	       (unsigned long long)stats.ioctls,
+	       (unsigned long long)stats.execbuffers,
+	       (unsigned long long)stats.relocs_written,
+	       (unsigned long long)stats.relocs);
+
+	kgem_close(kgem);
+
+	if (failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+	return failures != 0;
+}
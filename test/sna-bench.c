@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna-bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+
+/* Normally provided by sna_accel.c and the server */
+jmp_buf sigjmp[4];
+volatile sig_atomic_t sigtrap;
+
+void ErrorF(const char *f, ...)
+{
+	va_list ap;
+
+	va_start(ap, f);
+	vfprintf(stderr, f, ap);
+	va_end(ap);
+}
+
+const struct swizzle swizzles[5] = {
+	{ I915_BIT_6_SWIZZLE_NONE, "none" },
+	{ I915_BIT_6_SWIZZLE_9, "9" },
+	{ I915_BIT_6_SWIZZLE_9_10, "9_10" },
+	{ I915_BIT_6_SWIZZLE_9_11, "9_11" },
+	{ I915_BIT_6_SWIZZLE_9_10_11, "9_10_11" },
+};
+
+uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fill(uint8_t *ptr, size_t len, uint32_t seed)
+{
+	while (len--) {
+		seed = seed * 1103515245 + 12345;
+		*ptr++ = seed >> 16;
+	}
+}
+
+void *alloc(size_t len, uint32_t seed)
+{
+	void *ptr;
+
+	if (posix_memalign(&ptr, 4096, len)) {
+		fprintf(stderr, "failed to allocate %zu bytes\n", len);
+		exit(1);
+	}
+
+	fill(ptr, len, seed);
+	return ptr;
+}
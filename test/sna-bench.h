@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef SNA_BENCH_H
+#define SNA_BENCH_H
+
+/* Shared by the standalone benchmarks that link the SNA CPU paths
+ * (blt.c, sna_threads.c) without the server: the stubs for what
+ * sna_accel.c and the server would otherwise provide, and the timing
+ * and buffer helpers.
+ */
+
+#include "sna.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct swizzle {
+	int mode;
+	const char *name;
+};
+
+/* Every bit-6 swizzle mode that choose_memcpy_tiled_x() handles */
+extern const struct swizzle swizzles[5];
+
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t now(void);
+
+/* A page-aligned buffer filled with a repeatable pattern for the seed;
+ * exits on failure.
+ */
+void *alloc(size_t len, uint32_t seed);
+
+#endif /* SNA_BENCH_H */
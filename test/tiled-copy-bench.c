@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Measure the CPU tiling and detiling used for inplace PutImage and
+ * GetImage (sna_memcpy_boxes__tiled) for every swizzle mode against the
+ * size of the thread pool. Runs without a display or GPU, the bo is
+ * simply a page-aligned allocation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sna-bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+static void copy(struct kgem *kgem, int tiling, bool upload,
+		 const void *src, void *dst, int bpp,
+		 int32_t src_stride, int32_t dst_stride,
+		 const BoxRec *box)
+{
+	/* The driver always holds a trap around the inplace copies */
+	if (sigtrap_get())
+		return;
+
+	if (sna_memcpy_boxes__tiled(kgem, tiling, upload, 0,
+				    src, dst, bpp, src_stride, dst_stride,
+				    0, 0, 0, 0, box, 1))
+		sigtrap_put();
+}
+
+static void bench(struct kgem *kgem, int tiling, const struct swizzle *s,
+		  int threads, int width, int height, int bpp, int loops)
+{
+	const int tile_height = tiling == I915_TILING_X ? 8 : 32;
+	const int stride = width * bpp / 8;
+	const int pitch = ALIGN(stride, 512);
+	uint64_t start;
+	uint8_t *linear, *tiled;
+	BoxRec box;
+	double up, down;
+	int n;
+
+	memset(kgem, 0, sizeof(*kgem));
+	kgem->gen = 0100;
+	if (tiling == I915_TILING_X) {
+		choose_memcpy_tiled_x(kgem, s->mode, sna_cpu_detect());
+		if (kgem->memcpy_to_tiled_x == NULL ||
+		    kgem->memcpy_from_tiled_x == NULL)
+			return;
+	} else {
+		choose_memcpy_tiled_y(kgem, s->mode, sna_cpu_detect());
+		if (kgem->memcpy_to_tiled_y == NULL ||
+		    kgem->memcpy_from_tiled_y == NULL)
+			return;
+	}
+
+	linear = alloc(stride * height, 1);
+	tiled = alloc(pitch * ALIGN(height, tile_height), 2);
+
+	box.x1 = box.y1 = 0;
+	box.x2 = width;
+	box.y2 = height;
+
+	/* warm up the pages and the cost model */
+	for (n = 0; n < 2; n++)
+		copy(kgem, tiling, true, linear, tiled, bpp, stride, pitch, &box);
+
+	start = now();
+	for (n = 0; n < loops; n++)
+		copy(kgem, tiling, true, linear, tiled, bpp, stride, pitch, &box);
+	up = (double)stride * height * loops / (now() - start);
+
+	start = now();
+	for (n = 0; n < loops; n++)
+		copy(kgem, tiling, false, tiled, linear, bpp, pitch, stride, &box);
+	down = (double)stride * height * loops / (now() - start);
+
+	printf("%c-tiled, swizzle %-8s %2d threads, %dx%d@%d: upload %6.2f GB/s, download %6.2f GB/s\n",
+	       tiling == I915_TILING_X ? 'X' : 'Y', s->name, threads,
+	       width, height, bpp, up, down);
+	fflush(stdout);
+
+	free(tiled);
+	free(linear);
+}
+
+static void run(int threads, int width, int height, int bpp, int loops)
+{
+	static struct kgem kgem;
+	unsigned n;
+
+	/* The pool can only be created once per process */
+	sna_threads_init(threads, false);
+
+	for (n = 0; n < sizeof(swizzles)/sizeof(swizzles[0]); n++)
+		bench(&kgem, I915_TILING_X, &swizzles[n],
+		      threads, width, height, bpp, loops);
+	for (n = 0; n < sizeof(swizzles)/sizeof(swizzles[0]); n++)
+		bench(&kgem, I915_TILING_Y, &swizzles[n],
+		      threads, width, height, bpp, loops);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-w width] [-h height] [-b bpp] [-t max-threads] [-l loops]\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int width = 3840, height = 2160, bpp = 32, loops = 20;
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads, c;
+
+	while ((c = getopt(argc, argv, "w:h:b:t:l:")) != -1) {
+		switch (c) {
+		case 'w': width = atoi(optarg); break;
+		case 'h': height = atoi(optarg); break;
+		case 'b': bpp = atoi(optarg); break;
+		case 't': max_threads = atoi(optarg); break;
+		case 'l': loops = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (width <= 0 || height <= 0 || loops <= 0 ||
+	    (bpp != 8 && bpp != 16 && bpp != 32))
+		usage(argv[0]);
+
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			run(threads, width, height, bpp, loops);
+			exit(0);
+		}
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Check the dense coverage cells of the precise trapezoid rasteriser
+ * (sna_trapezoids_cells.h) against the sorted cell list they replaced,
+ * feeding both the same rows of edge crossings as the scan converter
+ * would. The spans emitted for tor_blt must be identical, as must the
+ * a8 rows written by tor_inplace. Runs without a display or GPU.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sna.h"
+#include "sna_render.h"
+#include "sna_trapezoids.h"
+#include "sna_trapezoids_cells.h"
+
+static int failures;
+
+#define check(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+			__FILE__, __LINE__, #expr); \
+		failures++; \
+	} \
+} while (0)
+
+/* The previous implementation, kept as the reference */
+
+struct ref_cell {
+	struct ref_cell *next;
+	int x;
+	int16_t uncovered_area;
+	int16_t covered_height;
+};
+
+struct ref_cell_list {
+	struct ref_cell *cursor;
+	struct ref_cell head, tail;
+	int16_t x1, x2;
+	int count, size;
+	struct ref_cell *cells;
+};
+
+static void ref_cell_list_init(struct ref_cell_list *cells, int x1, int x2)
+{
+	cells->tail.next = NULL;
+	cells->tail.x = INT_MAX;
+	cells->head.x = INT_MIN;
+	cells->head.next = &cells->tail;
+	cells->head.covered_height = 0;
+	cells->cursor = &cells->head;
+	cells->count = 0;
+	cells->x1 = x1;
+	cells->x2 = x2;
+	cells->size = x2 - x1 + 1;
+	cells->cells = malloc(cells->size * sizeof(struct ref_cell));
+}
+
+static void ref_cell_list_reset(struct ref_cell_list *cells)
+{
+	cells->cursor = &cells->head;
+	cells->head.next = &cells->tail;
+	cells->head.covered_height = 0;
+	cells->count = 0;
+}
+
+static struct ref_cell *
+ref_cell_list_find(struct ref_cell_list *cells, int x)
+{
+	struct ref_cell *tail, *cell;
+
+	if (x >= cells->x2)
+		return &cells->tail;
+
+	if (x < cells->x1)
+		return &cells->head;
+
+	tail = cells->cursor;
+	if (tail->x == x)
+		return tail;
+
+	while (tail->next->x <= x)
+		tail = tail->next;
+
+	if (tail->x != x) {
+		assert(cells->count < cells->size);
+		cell = cells->cells + cells->count++;
+		cell->next = tail->next;
+		tail->next = cell;
+		cell->x = x;
+		cell->covered_height = 0;
+		cell->uncovered_area = 0;
+		tail = cell;
+	}
+
+	return cells->cursor = tail;
+}
+
+static void
+ref_cell_list_add_span(struct ref_cell_list *cells, int x1, int x2, int h)
+{
+	struct ref_cell *cell;
+	int ix1, fx1;
+	int ix2, fx2;
+
+	if (h == 1 && x1 == x2)
+		return;
+
+	SAMPLES_X_TO_INT_FRAC(x1, ix1, fx1);
+	SAMPLES_X_TO_INT_FRAC(x2, ix2, fx2);
+
+	cell = ref_cell_list_find(cells, ix1);
+	if (ix1 != ix2) {
+		cell->uncovered_area += 2*fx1*h;
+		cell->covered_height += h;
+
+		cell = ref_cell_list_find(cells, ix2);
+		cell->uncovered_area -= 2*fx2*h;
+		cell->covered_height -= h;
+	} else
+		cell->uncovered_area += 2*(fx1-fx2)*h;
+}
+
+static void
+ref_tor_blt(struct ref_cell_list *cells,
+	    struct sna_composite_spans_op *op,
+	    span_func_t span,
+	    int y, int height,
+	    int unbounded)
+{
+	struct ref_cell *cell;
+	BoxRec box;
+	int cover;
+
+	box.y1 = y;
+	box.y2 = y + height;
+	box.x1 = cells->x1;
+
+	cover = cells->head.covered_height*SAMPLES_X*2;
+	for (cell = cells->head.next; cell != &cells->tail; cell = cell->next) {
+		int x = cell->x;
+
+		if (cell->covered_height || cell->uncovered_area) {
+			box.x2 = x;
+			if (box.x2 > box.x1 && (unbounded || cover))
+				span(NULL, op, NULL, &box, cover);
+			box.x1 = box.x2;
+			cover += cell->covered_height*SAMPLES_X*2;
+		}
+
+		if (cell->uncovered_area) {
+			int area = cover - cell->uncovered_area;
+			box.x2 = x + 1;
+			if (unbounded || area)
+				span(NULL, op, NULL, &box, area);
+			box.x1 = box.x2;
+		}
+	}
+
+	box.x2 = cells->x2;
+	if (box.x2 > box.x1 && (unbounded || cover))
+		span(NULL, op, NULL, &box, cover);
+}
+
+/* The byte writes of inplace_row() and inplace_subrow() */
+static void
+ref_inplace_span(uint8_t *row, int lix, int lfx, int rix, int rfx, bool full)
+{
+	if (full) {
+		if (lix == rix) {
+			if (rfx != lfx)
+				row[lix] += (rfx-lfx) * SAMPLES_Y;
+		} else {
+			if (lfx == 0)
+				row[lix] = 0xff;
+			else
+				row[lix] += 255 - lfx * SAMPLES_Y;
+
+			if (rfx)
+				row[rix] += rfx * SAMPLES_Y;
+
+			if (rix > ++lix)
+				memset(row + lix, 0xff, rix - lix);
+		}
+	} else {
+		if (lix == rix) {
+			if (rfx != lfx)
+				row[lix] += (rfx-lfx);
+		} else {
+			row[lix] += SAMPLES_X - lfx;
+
+			if (rfx)
+				row[rix] += rfx;
+
+			while (++lix < rix)
+				row[lix] += SAMPLES_X;
+		}
+	}
+}
+
+/* Recording span callback, passed the log through the op pointer */
+struct span_log {
+	struct span {
+		BoxRec box;
+		int coverage;
+	} *span;
+	int count, size;
+};
+
+static void
+record_span(struct sna *sna,
+	    struct sna_composite_spans_op *op,
+	    pixman_region16_t *clip,
+	    const BoxRec *box,
+	    int coverage)
+{
+	struct span_log *log = (struct span_log *)op;
+
+	if (log->count == log->size) {
+		log->size = log->size ? 2 * log->size : 256;
+		log->span = realloc(log->span, log->size * sizeof(*log->span));
+		if (log->span == NULL)
+			abort();
+	}
+
+	log->span[log->count].box = *box;
+	log->span[log->count].coverage = coverage;
+	log->count++;
+}
+
+/* The crossings of the active edges on a subsample row, in ascending
+ * order and possibly beyond either side of the extents.
+ */
+static int random_crossings(int *x, int max, int x1, int x2)
+{
+	int n = rand() % (max + 1);
+	int lo = (x1 - 3) * SAMPLES_X;
+	int range = (x2 - x1 + 6) * SAMPLES_X;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		switch (rand() % 4) {
+		case 0: /* shared with the previous crossing */
+			x[i] = i ? x[i-1] : lo;
+			break;
+		case 1: /* within the same pixel */
+			x[i] = (i ? x[i-1] : lo) + rand() % SAMPLES_X;
+			break;
+		default:
+			x[i] = lo + rand() % range;
+			break;
+		}
+	}
+
+	/* sort */
+	for (i = 1; i < n; i++) {
+		int v = x[i], j = i;
+		while (j && x[j-1] > v) {
+			x[j] = x[j-1];
+			j--;
+		}
+		x[j] = v;
+	}
+
+	return n & ~1;
+}
+
+static void test_spans(int x1, int x2, int rows)
+{
+	struct ref_cell_list ref;
+	struct cell_list cells;
+	struct span_log a, b;
+	int x[64];
+	int y;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+
+	ref_cell_list_init(&ref, x1, x2);
+	check(cell_list_init(&cells, x1, x2));
+
+	for (y = 0; y < rows; y++) {
+		bool full = rand() % 4 == 0;
+		int unbounded = rand() & 1;
+		int height = full ? 1 + rand() % 4 : 1;
+		int sub, n, i;
+
+		for (sub = 0; sub < (full ? 1 : SAMPLES_Y); sub++) {
+			n = random_crossings(x, ARRAY_SIZE(x), x1, x2);
+			for (i = 0; i < n; i += 2) {
+				if (full) {
+					ref_cell_list_add_span(&ref, x[i], x[i+1], SAMPLES_Y);
+					cell_list_add_span(&cells, x[i], x[i+1]);
+				} else {
+					ref_cell_list_add_span(&ref, x[i], x[i+1], 1);
+					cell_list_add_subspan(&cells, x[i], x[i+1]);
+				}
+			}
+			ref.cursor = &ref.head;
+		}
+
+		a.count = b.count = 0;
+		ref_tor_blt(&ref, (void *)&a, record_span, y, height, unbounded);
+		cell_list_blt(&cells, NULL, (void *)&b, NULL, record_span,
+			      y, height, unbounded);
+
+		check(a.count == b.count);
+		if (a.count == b.count &&
+		    memcmp(a.span, b.span, a.count * sizeof(*a.span))) {
+			fprintf(stderr, "extents [%d, %d), row %d: spans differ\n",
+				x1, x2, y);
+			failures++;
+		}
+
+		ref_cell_list_reset(&ref);
+		cell_list_reset(&cells);
+	}
+
+	cell_list_fini(&cells);
+	free(ref.cells);
+	free(a.span);
+	free(b.span);
+}
+
+static void clamp(int x, int width, int *ix, int *fx)
+{
+	if (x < 0) {
+		*ix = *fx = 0;
+	} else if (x >= width * SAMPLES_X) {
+		*ix = width;
+		*fx = 0;
+	} else
+		SAMPLES_X_TO_INT_FRAC(x, *ix, *fx);
+}
+
+static void test_inplace(int width, int rows)
+{
+	uint8_t ref[TOR_INPLACE_SIZE], row[TOR_INPLACE_SIZE];
+	uint8_t deltas[TOR_INPLACE_SIZE + 2];
+	int x[64];
+	int y, i;
+
+	memset(deltas, 0, sizeof(deltas));
+	for (y = 0; y < rows; y++) {
+		bool full = rand() % 4 == 0;
+		int sub, n;
+
+		memset(ref, 0, width);
+		memset(row, 0xcc, width);
+		for (sub = 0; sub < (full ? 1 : SAMPLES_Y); sub++) {
+			n = random_crossings(x, ARRAY_SIZE(x), 0, width);
+			for (i = 0; i < n; i += 2) {
+				int lix, lfx, rix, rfx;
+
+				/* spans on a row never share a crossing */
+				if (i && x[i] == x[i-1])
+					continue;
+
+				clamp(x[i], width, &lix, &lfx);
+				clamp(x[i+1], width, &rix, &rfx);
+
+				ref_inplace_span(ref, lix, lfx, rix, rfx, full);
+				inplace_deltas_add(deltas, lix, lfx, rix, rfx,
+						   full ? SAMPLES_Y : 1);
+			}
+		}
+
+		inplace_deltas_sum(deltas, row, width);
+		if (memcmp(ref, row, width)) {
+			fprintf(stderr, "width %d, row %d: coverage differs\n",
+				width, y);
+			failures++;
+		}
+	}
+
+	for (i = 0; i < width + 2; i++)
+		check(deltas[i] == 0);
+}
+
+int main(int argc, char **argv)
+{
+	static const int extents[][2] = {
+		{ 0, 1 }, { 0, 7 }, { 0, 64 }, { 3, 130 },
+		{ -20, 20 }, { 0, 253 }, { 100, 1124 }, { 0, 4096 },
+	};
+	unsigned seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+	unsigned n;
+	int w;
+
+	srand(seed);
+
+	for (n = 0; n < ARRAY_SIZE(extents); n++)
+		test_spans(extents[n][0], extents[n][1], 2000);
+
+	for (w = 1; w <= TOR_INPLACE_SIZE; w++)
+		test_inplace(w, 200);
+
+	if (failures)
+		fprintf(stderr, "%d checks failed (seed %u)\n", failures, seed);
+	else
+		printf("dense cells match the cell list (seed %u)\n", seed);
+	return failures != 0;
+}
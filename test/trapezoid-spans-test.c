@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Check the span compositing kernels of sna_spans.c, used by the inplace
+ * trapezoid rasterisers, against the scalar formulae they replaced. Each
+ * CPU feature level supported by the host is forced in turn and every
+ * alpha is run over a sweep of widths and misalignments, with guard bytes
+ * either side of each row; the results must be bit-exact. With -b, also
+ * reports the time per megapixel of each kernel. Runs without a display
+ * or GPU.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sna.h"
+#include "sna_render.h"
+#include "sna_trapezoids.h"
+
+static int failures;
+
+#define check(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+			__FILE__, __LINE__, #expr); \
+		failures++; \
+	} \
+} while (0)
+
+static const struct level {
+	unsigned cpu;
+	const char *name;
+} levels[] = {
+	{ 0, "generic" },
+	{ SSE2, "sse2" },
+	{ SSE2 | AVX2, "avx2" },
+};
+
+#define GUARD 32
+#define MAX_WIDTH 80
+#define HEIGHT 3
+#define STRIDE (GUARD + MAX_WIDTH + GUARD)
+
+static uint32_t seed = 0x12345678;
+
+static uint32_t rand32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void fill(uint8_t *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		/* bias towards the saturating extremes */
+		switch (rand32() & 7) {
+		case 0: buf[i] = 0; break;
+		case 1: buf[i] = 0xff; break;
+		default: buf[i] = rand32(); break;
+		}
+	}
+}
+
+enum { IN, ADD, LERP };
+static const char *op_name[] = { "in_a8", "add_a8", "lerp_x8r8g8b8" };
+
+static void reference(int op, uint8_t *buf, int x, int w, uint32_t color, uint8_t a)
+{
+	int y, i;
+
+	for (y = 0; y < HEIGHT; y++) {
+		uint8_t *row = buf + y * STRIDE * 4;
+
+		for (i = 0; i < w; i++) {
+			switch (op) {
+			case IN:
+				row[x + i] = mul_8_8(row[x + i], a);
+				break;
+			case ADD: {
+				int v = a + row[x + i];
+				row[x + i] = v >= 255 ? 255 : v;
+				break;
+			}
+			case LERP: {
+				uint32_t *p = (uint32_t *)row + x + i;
+				*p = lerp8x4(color, a, *p);
+				break;
+			}
+			}
+		}
+	}
+}
+
+static void run(int op, uint8_t *buf, int x, int w, uint32_t color, uint8_t a)
+{
+	switch (op) {
+	case IN:
+		span_in_a8(buf + x, STRIDE * 4, w, HEIGHT, a);
+		break;
+	case ADD:
+		span_add_a8(buf + x, STRIDE * 4, w, HEIGHT, a);
+		break;
+	case LERP:
+		span_lerp_x8r8g8b8((uint32_t *)buf + x, STRIDE * 4, w, HEIGHT,
+				   color, a);
+		break;
+	}
+}
+
+static void test_level(const struct level *l)
+{
+	static uint32_t src[STRIDE * HEIGHT], ref[STRIDE * HEIGHT], dst[STRIDE * HEIGHT];
+	int op, a, w, x;
+
+	choose_span_blt(l->cpu);
+
+	for (op = IN; op <= LERP; op++) {
+		int before = failures;
+
+		for (a = 0; a < 256; a++) {
+			uint32_t color = rand32();
+
+			for (w = 1; w <= MAX_WIDTH; w++) {
+				x = GUARD + (rand32() & 15);
+
+				fill((uint8_t *)src, sizeof(src));
+				memcpy(ref, src, sizeof(src));
+				memcpy(dst, src, sizeof(src));
+
+				reference(op, (uint8_t *)ref, x, w, color, a);
+				run(op, (uint8_t *)dst, x, w, color, a);
+
+				if (memcmp(ref, dst, sizeof(dst))) {
+					fprintf(stderr, "%s %s: mismatch alpha=%d, width=%d, x=%d\n",
+						l->name, op_name[op], a, w, x);
+					check(memcmp(ref, dst, sizeof(dst)) == 0);
+					break;
+				}
+			}
+		}
+
+		printf("%s %s: %s\n", l->name, op_name[op],
+		       failures == before ? "ok" : "FAILED");
+	}
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + 1e-9 * (now.tv_nsec - start->tv_nsec);
+}
+
+static void bench_level(const struct level *l)
+{
+	enum { W = 1024, H = 256, N = 64 };
+	uint32_t *buf = malloc(W * H * 4);
+	int op, n;
+
+	choose_span_blt(l->cpu);
+	fill((uint8_t *)buf, W * H * 4);
+
+	for (op = IN; op <= LERP; op++) {
+		struct timespec start;
+		double t;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0; n < N; n++) {
+			uint8_t a = 1 + n * 3;
+
+			switch (op) {
+			case IN:
+				span_in_a8((uint8_t *)buf, 4 * W, 4 * W, H, a | 0x80);
+				break;
+			case ADD:
+				span_add_a8((uint8_t *)buf, 4 * W, 4 * W, H, a & 7);
+				break;
+			case LERP:
+				span_lerp_x8r8g8b8(buf, 4 * W, W, H, 0xff336699, a);
+				break;
+			}
+		}
+		t = elapsed(&start);
+
+		printf("%s %s: %.3f ms/Mpixel\n", l->name, op_name[op],
+		       1e3 * t / (N * (op == LERP ? 1. : 4.) * W * H / (1 << 20)));
+	}
+
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned cpu = sna_cpu_detect();
+	int bench = argc > 1 && strcmp(argv[1], "-b") == 0;
+	unsigned l;
+
+	for (l = 0; l < ARRAY_SIZE(levels); l++) {
+		if ((levels[l].cpu & cpu) != levels[l].cpu) {
+			printf("%s: not supported, skipped\n", levels[l].name);
+			continue;
+		}
+
+		test_level(&levels[l]);
+		if (bench)
+			bench_level(&levels[l]);
+	}
+
+	if (failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
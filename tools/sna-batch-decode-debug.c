@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Feeds a captured batch to the kgem_debug decoders, which expect to find
+ * it inside a struct kgem during submission. The batch is target 0 of its
+ * relocations and every other buffer is named by its index in the exec
+ * list plus one, so that both conventions used by the decoders, handles
+ * and target handles, resolve to the same buffer.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "sna.h"
+#include "sna-batch-decode.h"
+
+static void **contents;
+static struct kgem_bo *bos;
+
+void ErrorF(const char *f, ...)
+{
+	va_list args;
+
+	va_start(args, f);
+	vprintf(f, args);
+	va_end(args);
+}
+
+void *kgem_bo_map__debug(struct kgem *kgem, struct kgem_bo *bo)
+{
+	(void)kgem;
+	return contents[bo - bos];
+}
+
+void decode_batch(int gen, const struct capture_batch *b)
+{
+	const struct kgem_capture_batch *h = b->header;
+	struct kgem_request rq;
+	struct kgem kgem;
+	uint32_t batch = h->nexec - 1;
+	uint32_t n;
+
+	memset(&kgem, 0, sizeof(kgem));
+	memset(&rq, 0, sizeof(rq));
+	list_init(&rq.buffers);
+
+	kgem.gen = gen;
+	kgem.batch = b->batch;
+	kgem.nbatch = h->nbatch;
+	kgem.nexec = h->nexec;
+	kgem.nreloc = h->nreloc;
+	kgem.next_request = &rq;
+
+	kgem.exec = calloc(h->nexec, sizeof(*kgem.exec));
+	kgem.reloc = calloc(h->nreloc + 1, sizeof(*kgem.reloc));
+	bos = calloc(h->nexec, sizeof(*bos));
+	if (kgem.exec == NULL || kgem.reloc == NULL || bos == NULL)
+		goto out;
+
+	for (n = 0; n < h->nexec; n++) {
+		kgem.exec[n].handle = n == batch ? 0 : n + 1;
+		kgem.exec[n].flags = b->exec[n].flags;
+		kgem.exec[n].offset = b->exec[n].offset;
+		if (n == batch)
+			continue;
+
+		bos[n].refcnt = 1;
+		bos[n].handle = bos[n].target_handle = n + 1;
+		bos[n].tiling = b->exec[n].tiling;
+		bos[n].size.pages.count = b->exec[n].size / 4096;
+		bos[n].exec = &kgem.exec[n];
+		list_add_tail(&bos[n].request, &rq.buffers);
+	}
+
+	for (n = 0; n < h->nreloc; n++) {
+		uint32_t target = b->reloc[n].target;
+
+		if (target >= h->nexec)
+			goto out;
+
+		kgem.reloc[n].offset = b->reloc[n].offset;
+		kgem.reloc[n].target_handle = target == batch ? 0 : target + 1;
+		kgem.reloc[n].delta = b->reloc[n].delta;
+		kgem.reloc[n].read_domains = b->reloc[n].read_domains;
+		kgem.reloc[n].write_domain = b->reloc[n].write_domain;
+		kgem.reloc[n].presumed_offset = b->exec[target].offset;
+	}
+
+	contents = b->data;
+
+	printf("batch %u:\n", h->seqno);
+	__kgem_batch_debug(&kgem, h->nbatch);
+	printf("\n");
+
+out:
+	free(bos);
+	free(kgem.reloc);
+	free(kgem.exec);
+}
@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Decodes the batches recorded by the SNA backend with Option
+ * "CaptureBatches" and reports for each the state emitted, how much of it
+ * repeated the previous value, the pipeline flushes with no rendering
+ * since the last, and the primitives and vertex data drawn. Commands are
+ * walked for every generation, but 3D state is only understood on gen4+.
+ *
+ * When built with --enable-debug=full, -d prints every command through
+ * the same decoders used by the X driver.
+ *
+ * To compile standalone: gcc -I../src/sna -o sna-batch-decode sna-batch-decode.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sna-batch-decode.h"
+
+#define MI_FLUSH	0x04
+#define MI_BATCH_BUFFER_END 0x0a
+#define MI_LOAD_REGISTER_IMM 0x22
+#define MI_FLUSH_DW	0x26
+
+#define OP_3DPRIMITIVE	0x7b00
+#define OP_PIPE_CONTROL	0x7a00
+#define OP_VERTEX_BUFFERS 0x7808
+
+struct stats {
+	unsigned long batches;
+	unsigned long dwords;
+	unsigned long state, redundant_state;
+	unsigned long flushes, redundant_flushes;
+	unsigned long primitives, blits;
+	unsigned long long vertices, vertex_bytes;
+	unsigned long unparsed;
+};
+
+/* The last instance of each command within the current batch */
+static struct last {
+	uint32_t batch;
+	uint32_t offset;
+	unsigned long count, redundant;
+} last[1 << 16];
+
+static const char *ring_name(uint32_t flags)
+{
+	static const char * const name[] = { "default", "render", "bsd", "blt" };
+	flags &= 7;
+	return flags < sizeof(name)/sizeof(name[0]) ? name[flags] : "unknown";
+}
+
+static const char *op_name(uint32_t op)
+{
+	static const struct {
+		uint32_t op;
+		const char *name;
+	} names[] = {
+		{ 0x0110, "MI_LOAD_REGISTER_IMM" },
+		{ 0x6101, "STATE_BASE_ADDRESS" },
+		{ 0x6904, "PIPELINE_SELECT" },
+		{ 0x7800, "3DSTATE_PIPELINED_POINTERS" },
+		{ 0x7801, "3DSTATE_BINDING_TABLE_POINTERS" },
+		{ 0x7802, "3DSTATE_SAMPLER_STATE_POINTERS" },
+		{ 0x7805, "3DSTATE_DEPTH_BUFFER" },
+		{ 0x7808, "3DSTATE_VERTEX_BUFFERS" },
+		{ 0x7809, "3DSTATE_VERTEX_ELEMENTS" },
+		{ 0x780b, "3DSTATE_VF_STATISTICS" },
+		{ 0x780d, "3DSTATE_MULTISAMPLE" },
+		{ 0x780e, "3DSTATE_CC_STATE_POINTERS" },
+		{ 0x7810, "3DSTATE_VS" },
+		{ 0x7811, "3DSTATE_GS" },
+		{ 0x7812, "3DSTATE_CLIP" },
+		{ 0x7813, "3DSTATE_SF" },
+		{ 0x7814, "3DSTATE_WM" },
+		{ 0x7815, "3DSTATE_CONSTANT_VS" },
+		{ 0x7816, "3DSTATE_CONSTANT_GS" },
+		{ 0x7817, "3DSTATE_CONSTANT_PS" },
+		{ 0x7818, "3DSTATE_SAMPLE_MASK" },
+		{ 0x781f, "3DSTATE_SBE" },
+		{ 0x7820, "3DSTATE_PS" },
+		{ 0x7824, "3DSTATE_BLEND_STATE_POINTERS" },
+		{ 0x7825, "3DSTATE_DEPTH_STENCIL_STATE_POINTERS" },
+		{ 0x782a, "3DSTATE_BINDING_TABLE_POINTERS_PS" },
+		{ 0x782f, "3DSTATE_SAMPLER_STATE_POINTERS_PS" },
+		{ 0x784b, "3DSTATE_VF_TOPOLOGY" },
+		{ 0x784d, "3DSTATE_PS_BLEND" },
+		{ 0x784f, "3DSTATE_PS_EXTRA" },
+		{ 0x7850, "3DSTATE_RASTER" },
+		{ 0x7900, "3DSTATE_DRAWING_RECTANGLE" },
+		{ 0x7a00, "PIPE_CONTROL" },
+		{ 0x7b00, "3DPRIMITIVE" },
+	};
+	unsigned n;
+
+	for (n = 0; n < sizeof(names)/sizeof(names[0]); n++)
+		if (names[n].op == op)
+			return names[n].name;
+
+	return "";
+}
+
+static int length_mi(uint32_t cmd)
+{
+	uint32_t op = (cmd >> 23) & 0x3f;
+	return op < 0x10 ? 1 : (cmd & 0xff) + 2;
+}
+
+static int length_3d(int gen, uint32_t cmd)
+{
+	switch (cmd >> 16) {
+	case 0x6904: /* PIPELINE_SELECT */
+	case 0x680b: /* VF_STATISTICS */
+		return 1;
+	}
+	(void)gen;
+	return (cmd & 0xff) + 2;
+}
+
+/* Identical to the last instance of the same command in this batch? */
+static int repeated(const uint32_t *batch, uint32_t seqno,
+		    uint32_t op, uint32_t offset, int len)
+{
+	struct last *l = &last[op];
+	int ret;
+
+	ret = l->batch == seqno &&
+		memcmp(batch + l->offset, batch + offset, len * 4) == 0;
+
+	l->batch = seqno;
+	l->offset = offset;
+	l->count++;
+	l->redundant += ret;
+	return ret;
+}
+
+static void walk_batch(int gen, const struct capture_batch *b,
+		       struct stats *s)
+{
+	const uint32_t *batch = b->batch;
+	uint32_t seqno = b->header->seqno;
+	uint32_t nbatch = b->header->nbatch;
+	uint32_t offset = 0;
+	unsigned pitch[33] = {};
+	int drawn = 1;
+
+	while (offset < nbatch) {
+		uint32_t cmd = batch[offset];
+		uint32_t op;
+		int len;
+
+		switch (cmd >> 29) {
+		case 0: /* MI */
+			op = (cmd >> 23) & 0x3f;
+			len = length_mi(cmd);
+			if (op == MI_BATCH_BUFFER_END)
+				return;
+			if (op == MI_FLUSH || op == MI_FLUSH_DW) {
+				s->flushes++;
+				s->redundant_flushes += !drawn;
+				drawn = 0;
+			} else if (op == MI_LOAD_REGISTER_IMM) {
+				s->state++;
+				s->redundant_state +=
+					repeated(batch, seqno, 0x0110, offset, len);
+			}
+			break;
+
+		case 2: /* 2D */
+			op = (cmd >> 22) & 0x7f;
+			len = (cmd & 0xff) + 2;
+			switch (op) {
+			case 0x01: /* XY_SETUP_BLT */
+			case 0x03: /* XY_SETUP_CLIP_BLT */
+			case 0x11: /* XY_SETUP_MONO_PATTERN_SL_BLT */
+				s->state++;
+				s->redundant_state +=
+					repeated(batch, seqno, 0x4000 | op, offset, len);
+				break;
+			default:
+				s->blits++;
+				drawn = 1;
+				break;
+			}
+			break;
+
+		case 3: /* 3D */
+			if (gen < 040) {
+				/* Lengths differ per command before gen4 */
+				s->unparsed += nbatch - offset;
+				return;
+			}
+
+			op = cmd >> 16;
+			len = length_3d(gen, cmd);
+			if (op == OP_3DPRIMITIVE) {
+				uint32_t count = gen >= 070 ? batch[offset + 2] : batch[offset + 1];
+
+				s->primitives++;
+				s->vertices += count;
+				s->vertex_bytes += (unsigned long long)count * pitch[0];
+				drawn = 1;
+			} else if (op == OP_PIPE_CONTROL) {
+				s->flushes++;
+				s->redundant_flushes += !drawn;
+				drawn = 0;
+			} else {
+				if (op == OP_VERTEX_BUFFERS) {
+					int i;
+
+					for (i = 1; i + 3 < len; i += 4) {
+						uint32_t dw = batch[offset + i];
+						int id = dw >> (gen >= 060 ? 26 : 27);
+						pitch[id & 31] = dw & (gen >= 070 ? 0xfff : 0x7ff);
+					}
+				}
+				s->state++;
+				s->redundant_state +=
+					repeated(batch, seqno, op, offset, len);
+			}
+			break;
+
+		default:
+			len = 1;
+			break;
+		}
+
+		offset += len;
+	}
+}
+
+static int parse_batch(const char *ptr, size_t remain,
+		       struct capture_batch *b)
+{
+	const struct kgem_capture_batch *h = (const void *)ptr;
+	const char *end;
+	uint32_t n;
+
+	if (remain < sizeof(*h) || h->length < sizeof(*h) || h->length > remain)
+		return 0;
+	end = ptr + h->length;
+
+	b->header = h;
+	ptr += sizeof(*h);
+
+	if (h->nexec == 0 ||
+	    (size_t)(end - ptr) < h->nexec * sizeof(*b->exec) + h->nreloc * sizeof(*b->reloc))
+		return 0;
+
+	b->exec = (const void *)ptr;
+	ptr += h->nexec * sizeof(*b->exec);
+	b->reloc = (const void *)ptr;
+	ptr += h->nreloc * sizeof(*b->reloc);
+
+	b->data = calloc(h->nexec, sizeof(void *));
+	if (b->data == NULL)
+		return 0;
+
+	for (n = 0; n < h->nbo; n++) {
+		const struct kgem_capture_bo *bo = (const void *)ptr;
+
+		if ((size_t)(end - ptr) < sizeof(*bo) ||
+		    bo->index >= h->nexec ||
+		    (size_t)(end - ptr) - sizeof(*bo) < bo->size)
+			goto err;
+
+		b->data[bo->index] = (void *)(bo + 1);
+		ptr += sizeof(*bo) + ((bo->size + 7) & ~7);
+	}
+
+	b->batch = b->data[h->nexec - 1];
+	if (b->batch == NULL ||
+	    h->nbatch * sizeof(uint32_t) > b->exec[h->nexec - 1].size)
+		goto err;
+
+	return 1;
+
+err:
+	free(b->data);
+	return 0;
+}
+
+static void print_batch(const struct capture_batch *b, const struct stats *s)
+{
+	const struct kgem_capture_batch *h = b->header;
+
+	printf("%8u %-7s %6u %6u %5u %6lu %9lu %6lu %9lu %5lu %5lu %8llu %10llu\n",
+	       h->seqno, ring_name(h->flags),
+	       h->nbatch, h->nreloc, h->nexec,
+	       s->state, s->redundant_state,
+	       s->flushes, s->redundant_flushes,
+	       s->primitives, s->blits,
+	       s->vertices, s->vertex_bytes);
+}
+
+static int percent(unsigned long x, unsigned long y)
+{
+	return y ? (int)(100 * x / y) : 0;
+}
+
+static void print_summary(const struct stats *t)
+{
+	unsigned op;
+
+	printf("\n%lu batches, %lu dwords\n", t->batches, t->dwords);
+	printf("  state commands: %lu, redundant %lu (%d%%)\n",
+	       t->state, t->redundant_state,
+	       percent(t->redundant_state, t->state));
+	printf("  flushes: %lu, redundant %lu (%d%%)\n",
+	       t->flushes, t->redundant_flushes,
+	       percent(t->redundant_flushes, t->flushes));
+	printf("  primitives: %lu, blits: %lu\n", t->primitives, t->blits);
+	printf("  vertices: %llu, %llu bytes\n", t->vertices, t->vertex_bytes);
+	if (t->unparsed)
+		printf("  dwords of 3D commands not parsed: %lu\n", t->unparsed);
+
+	printf("\nredundant state by command:\n");
+	for (op = 0; op < sizeof(last)/sizeof(last[0]); op++) {
+		if (last[op].redundant == 0)
+			continue;
+
+		printf("  %04x %-40s %8lu of %8lu (%d%%)\n",
+		       op, op_name(op),
+		       last[op].redundant, last[op].count,
+		       percent(last[op].redundant, last[op].count));
+	}
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s] [-b seqno] [-d] <capture file>\n", argv0);
+	fprintf(stderr, "  -s  only print the summary\n");
+	fprintf(stderr, "  -b  only report the batch with this seqno\n");
+#if HAVE_KGEM_DEBUG
+	fprintf(stderr, "  -d  print every command of each batch\n");
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	const struct kgem_capture *capture;
+	struct stats total = {};
+	const char *ptr, *end;
+	struct stat st;
+	unsigned long only = 0, seen = 0;
+	int summary = 0, decode = 0;
+	int fd, c;
+
+	while ((c = getopt(argc, argv, "sb:dh")) != -1) {
+		switch (c) {
+		case 's':
+			summary = 1;
+			break;
+		case 'b':
+			only = strtoul(optarg, NULL, 0);
+			break;
+#if HAVE_KGEM_DEBUG
+		case 'd':
+			decode = 1;
+			break;
+#endif
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(*capture)) {
+		fprintf(stderr, "%s: too short for a batch capture\n", argv[optind]);
+		return 1;
+	}
+
+	/* Private and writable, as the decoders take the batch as mutable */
+	capture = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (capture == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (capture->magic != KGEM_CAPTURE_MAGIC ||
+	    capture->version != KGEM_CAPTURE_VERSION) {
+		fprintf(stderr, "%s: not a batch capture (version %d)\n",
+			argv[optind], KGEM_CAPTURE_VERSION);
+		return 1;
+	}
+
+	if (!summary)
+		printf("%8s %-7s %6s %6s %5s %6s %9s %6s %9s %5s %5s %8s %10s\n",
+		       "seqno", "ring", "dwords", "relocs", "exec",
+		       "state", "redundant", "flush", "redundant",
+		       "prims", "blits", "vertices", "vbytes");
+
+	ptr = (const char *)(capture + 1);
+	end = (const char *)capture + st.st_size;
+	while (ptr < end) {
+		struct capture_batch b;
+		struct stats s = {};
+
+		if (!parse_batch(ptr, end - ptr, &b)) {
+			fprintf(stderr, "%s: truncated or corrupt after %lu batches\n",
+				argv[optind], seen);
+			break;
+		}
+		ptr += b.header->length;
+		seen++;
+
+		if (only && b.header->seqno != only) {
+			free(b.data);
+			continue;
+		}
+
+		walk_batch(capture->gen, &b, &s);
+		if (!summary)
+			print_batch(&b, &s);
+#if HAVE_KGEM_DEBUG
+		if (decode)
+			decode_batch(capture->gen, &b);
+#endif
+
+		total.batches++;
+		total.dwords += b.header->nbatch;
+		total.state += s.state;
+		total.redundant_state += s.redundant_state;
+		total.flushes += s.flushes;
+		total.redundant_flushes += s.redundant_flushes;
+		total.primitives += s.primitives;
+		total.blits += s.blits;
+		total.vertices += s.vertices;
+		total.vertex_bytes += s.vertex_bytes;
+		total.unparsed += s.unparsed;
+
+		free(b.data);
+	}
+
+	print_summary(&total);
+	(void)decode;
+	return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Prints the batches recorded by the SNA backend with Option "TraceBatches",
+ * or with -j converts them into the JSON trace event format understood by
+ * chrome://tracing and Perfetto.
+ *
+ * To compile standalone: gcc -I../src/sna -o sna-batch-trace sna-batch-trace.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "kgem_trace.h"
+
+static const char *ring_name(unsigned ring)
+{
+	static const char * const name[] = { "none", "render", "bsd", "blt" };
+	return ring < sizeof(name)/sizeof(name[0]) ? name[ring] : "unknown";
+}
+
+static const char *reason_name(unsigned reason)
+{
+	static const char * const name[KGEM_FLUSH_REASONS] = {
+		[KGEM_FLUSH_OTHER] = "other",
+		[KGEM_FLUSH_BATCH] = "batch",
+		[KGEM_FLUSH_RELOC] = "reloc",
+		[KGEM_FLUSH_EXEC] = "exec",
+		[KGEM_FLUSH_APERTURE] = "aperture",
+		[KGEM_FLUSH_FENCE] = "fence",
+	};
+	return reason < KGEM_FLUSH_REASONS ? name[reason] : "unknown";
+}
+
+/* Copy out the entries still in the ring, skipping any being rewritten */
+static int snapshot(const struct kgem_trace *trace,
+		    struct kgem_trace_batch *out)
+{
+	uint64_t count, n;
+	int len = 0;
+
+	count = trace->count;
+	__sync_synchronize();
+
+	n = count > trace->size ? count - trace->size : 0;
+	for (; n < count; n++) {
+		const struct kgem_trace_batch *b =
+			&trace->batch[n & (trace->size - 1)];
+
+		out[len] = *b;
+		__sync_synchronize();
+		if (out[len].seqno == (uint32_t)(n + 1) &&
+		    b->seqno == (uint32_t)(n + 1))
+			len++;
+	}
+
+	return len;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_text(const struct kgem_trace_batch *b, int count)
+{
+	unsigned long reasons[KGEM_FLUSH_REASONS] = {};
+	uint64_t execbuf = 0, retire = 0;
+	uint64_t *latency;
+	int i, retired = 0;
+
+	latency = malloc(count * sizeof(*latency));
+
+	printf("%10s %10s %-6s %6s %6s %5s %9s %-8s %9s %9s\n",
+	       "seqno", "time/ms", "ring", "dwords", "relocs", "exec",
+	       "aperture", "reason", "ioctl/us", "retire/us");
+	for (i = 0; i < count; i++) {
+		printf("%10u %10.3f %-6s %6u %6u %5u %8uK %-8s %9.1f ",
+		       b[i].seqno,
+		       (b[i].submit - b[0].submit) / 1e6,
+		       ring_name(b[i].ring),
+		       b[i].nbatch, b[i].nreloc, b[i].nexec,
+		       b[i].aperture * 4,
+		       reason_name(b[i].reason),
+		       b[i].execbuf / 1e3);
+		if (b[i].retire)
+			printf("%9.1f\n", b[i].retire / 1e3);
+		else
+			printf("%9s\n", "busy");
+
+		if (b[i].reason < KGEM_FLUSH_REASONS)
+			reasons[b[i].reason]++;
+		execbuf += b[i].execbuf;
+		if (b[i].retire) {
+			retire += b[i].retire;
+			if (latency)
+				latency[retired] = b[i].retire;
+			retired++;
+		}
+	}
+
+	if (count == 0)
+		return;
+
+	printf("\n%d batches over %.3fms, execbuffer %.1fus on average\n",
+	       count, (b[count-1].submit - b[0].submit) / 1e6,
+	       execbuf / 1e3 / count);
+	for (i = 0; i < KGEM_FLUSH_REASONS; i++) {
+		if (reasons[i])
+			printf("  flushed for %s: %lu (%d%%)\n",
+			       reason_name(i), reasons[i],
+			       (int)(100 * reasons[i] / count));
+	}
+	if (retired && latency) {
+		qsort(latency, retired, sizeof(*latency), cmp_u64);
+		printf("retire latency: mean %.1fus, median %.1fus, 99%% %.1fus, max %.1fus\n",
+		       retire / 1e3 / retired,
+		       latency[retired / 2] / 1e3,
+		       latency[(retired * 99) / 100] / 1e3,
+		       latency[retired - 1] / 1e3);
+	}
+
+	free(latency);
+}
+
+/* One track for the time spent in the ioctl, and one per ring for the
+ * time from submission until the request was retired.
+ */
+static void print_json(const struct kgem_trace *trace,
+		       const struct kgem_trace_batch *b, int count)
+{
+	const char *sep = "";
+	int i;
+
+	printf("{\"traceEvents\":[\n");
+	printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"execbuffer\"}}",
+	       trace->pid);
+	for (i = 1; i < 4; i++)
+		printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		       trace->pid, i, ring_name(i));
+	sep = ",\n";
+
+	for (i = 0; i < count; i++) {
+		printf("%s{\"name\":\"execbuffer\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f,"
+		       "\"args\":{\"seqno\":%u,\"dwords\":%u,\"relocs\":%u,\"exec\":%u,\"aperture\":%u}}",
+		       sep, reason_name(b[i].reason), trace->pid,
+		       b[i].submit / 1e3, b[i].execbuf / 1e3,
+		       b[i].seqno, b[i].nbatch, b[i].nreloc, b[i].nexec,
+		       b[i].aperture * 4096);
+		if (b[i].retire)
+			printf("%s{\"name\":\"batch %u\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			       sep, b[i].seqno, reason_name(b[i].reason),
+			       trace->pid, b[i].ring,
+			       b[i].submit / 1e3, b[i].retire / 1e3);
+	}
+	printf("\n]}\n");
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-j] <trace file>\n", argv0);
+	fprintf(stderr, "  -j  output JSON trace events for chrome://tracing or Perfetto\n");
+}
+
+int main(int argc, char **argv)
+{
+	const struct kgem_trace *trace;
+	struct kgem_trace_batch *batch;
+	struct stat st;
+	int fd, count, json = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "jh")) != -1) {
+		switch (c) {
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(*trace)) {
+		fprintf(stderr, "%s: too short for a batch trace\n", argv[optind]);
+		return 1;
+	}
+
+	trace = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (trace->magic != KGEM_TRACE_MAGIC ||
+	    trace->version != KGEM_TRACE_VERSION ||
+	    trace->size == 0 || trace->size & (trace->size - 1) ||
+	    sizeof(*trace) + trace->size * sizeof(trace->batch[0]) > (size_t)st.st_size) {
+		fprintf(stderr, "%s: not a batch trace (version %d)\n",
+			argv[optind], KGEM_TRACE_VERSION);
+		return 1;
+	}
+
+	batch = malloc(trace->size * sizeof(*batch));
+	if (batch == NULL)
+		return 1;
+
+	count = snapshot(trace, batch);
+	if (json)
+		print_json(trace, batch, count);
+	else
+		print_text(batch, count);
+
+	free(batch);
+	return 0;
+}